@@ -39,6 +39,9 @@
 /* Define to 1 if you have the <limits.h> header file. */
 #define HAVE_LIMITS_H 1
 
+/* Define to 1 if you have the <linux/io_uring.h> header file. */
+/* #undef HAVE_LINUX_IO_URING_H */
+
 /* Define to 1 if you have the <linux/serial.h> header file. */
 /* #undef HAVE_LINUX_SERIAL_H */
 
@@ -81,6 +84,9 @@
 /* Define to 1 if you have the `strlcpy' function. */
 /* #undef HAVE_STRLCPY */
 
+/* Define to 1 if you have the <sys/epoll.h> header file. */
+/* #undef HAVE_SYS_EPOLL_H */
+
 /* Define to 1 if you have the <sys/ioctl.h> header file. */
 /* #undef HAVE_SYS_IOCTL_H */
 
@@ -0,0 +1,654 @@
+/*
+ * Copyright © 2001-2013 Stéphane Raimbault <stephane.raimbault@gmail.com>
+ *
+ * SPDX-License-Identifier: LGPL-2.1+
+ */
+
+#ifndef MODBUS_CORO_HPP
+#define MODBUS_CORO_HPP
+
+/*
+ C++20协程客户端，头文件实现。
+ reactor在一个线程中用poll()等待所有客户端的套接字/串口及截止时间，
+ client包装一个modbus_t（TCP或RTU），每个操作为可co_await的task：
+     auto rc = co_await client.read_holding(addr, regs);
+ - 沿用modbus_t的配置：从站地址、应答超时（每个操作的默认截止时间）、错误恢复
+   （协议层：下一个请求前清空接收；链路层：连接断开后重新连接）
+ - 每个操作可指定超时和std::stop_token取消，取消需在run()的线程中请求
+ - 同一client的操作按顺序执行，不同client并发；一个线程可驱动大量设备
+ - Windows下串口不支持（需可poll的句柄）
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <coroutine>
+#include <deque>
+#include <exception>
+#include <optional>
+#include <stop_token>
+#include <utility>
+#include <vector>
+
+#if defined(_WIN32)
+#  include <winsock2.h>
+#else
+#  include <poll.h>
+#endif
+
+#include "modbus.hpp"
+
+namespace modbus {
+namespace coro {
+
+using clock = std::chrono::steady_clock;
+
+/* Tasks */
+
+template <class T>
+class task;
+
+namespace detail {
+
+struct promise_base {
+    std::coroutine_handle<> continuation;
+
+    struct final_awaiter {
+        bool await_ready() const noexcept { return false; }
+        template <class P>
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<P> h) noexcept
+        {
+            std::coroutine_handle<> next = h.promise().continuation;
+            return next ? next : std::noop_coroutine();
+        }
+        void await_resume() const noexcept {}
+    };
+
+    std::suspend_always initial_suspend() const noexcept { return {}; }
+    final_awaiter final_suspend() const noexcept { return {}; }
+    void unhandled_exception() const noexcept { std::terminate(); }
+};
+
+template <class T>
+struct promise : promise_base {
+    std::optional<T> value;
+
+    task<T> get_return_object() noexcept;
+    void return_value(T v) noexcept { value.emplace(std::move(v)); }
+    T take() noexcept { return std::move(*value); }
+};
+
+template <>
+struct promise<void> : promise_base {
+    task<void> get_return_object() noexcept;
+    void return_void() const noexcept {}
+    void take() const noexcept {}
+};
+
+} // namespace detail
+
+/* Lazy coroutine, starts when awaited or spawned */
+template <class T>
+class task {
+public:
+    using promise_type = detail::promise<T>;
+
+    explicit task(std::coroutine_handle<promise_type> h) noexcept : h_(h) {}
+    task(task &&other) noexcept : h_(std::exchange(other.h_, nullptr)) {}
+    task &operator=(task &&other) noexcept
+    {
+        if (this != &other) {
+            if (h_)
+                h_.destroy();
+            h_ = std::exchange(other.h_, nullptr);
+        }
+        return *this;
+    }
+    task(const task &) = delete;
+    task &operator=(const task &) = delete;
+    ~task()
+    {
+        if (h_)
+            h_.destroy();
+    }
+
+    bool await_ready() const noexcept { return !h_ || h_.done(); }
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> caller) noexcept
+    {
+        h_.promise().continuation = caller;
+        return h_;
+    }
+    T await_resume() noexcept { return h_.promise().take(); }
+
+private:
+    std::coroutine_handle<promise_type> h_;
+};
+
+namespace detail {
+
+template <class T>
+inline task<T> promise<T>::get_return_object() noexcept
+{
+    return task<T>(std::coroutine_handle<promise<T>>::from_promise(*this));
+}
+
+inline task<void> promise<void>::get_return_object() noexcept
+{
+    return task<void>(std::coroutine_handle<promise<void>>::from_promise(*this));
+}
+
+/* Owns a spawned task until it completes */
+struct detached {
+    struct promise_type {
+        detached get_return_object() const noexcept { return {}; }
+        std::suspend_never initial_suspend() const noexcept { return {}; }
+        std::suspend_never final_suspend() const noexcept { return {}; }
+        void return_void() const noexcept {}
+        void unhandled_exception() const noexcept { std::terminate(); }
+    };
+};
+
+inline detached run_detached(task<void> t)
+{
+    co_await t;
+}
+
+} // namespace detail
+
+/* Reactor */
+
+class reactor {
+public:
+    struct waiter {
+        int fd;
+        short events;
+        clock::time_point deadline;
+        std::coroutine_handle<> handle;
+        int result;
+        bool waiting;
+    };
+
+    class wait_awaiter {
+    public:
+        wait_awaiter(reactor &r, int fd, short events, clock::time_point deadline,
+                     std::stop_token stop) noexcept
+            : reactor_(r), waiter_{fd, events, deadline, nullptr, 0, false},
+              stop_(std::move(stop)) {}
+
+        bool await_ready() const noexcept { return false; }
+        void await_suspend(std::coroutine_handle<> h)
+        {
+            waiter_.handle = h;
+            reactor_.add(&waiter_);
+            if (stop_.stop_possible())
+                callback_.emplace(stop_, cancel{&reactor_, &waiter_});
+        }
+        /* 0 when the fd is ready, ETIMEDOUT or ECANCELED */
+        int await_resume() noexcept
+        {
+            callback_.reset();
+            return waiter_.result;
+        }
+
+    private:
+        struct cancel {
+            reactor *r;
+            waiter *w;
+            void operator()() const noexcept { r->complete(w, ECANCELED); }
+        };
+
+        reactor &reactor_;
+        waiter waiter_;
+        std::stop_token stop_;
+        std::optional<std::stop_callback<cancel>> callback_;
+    };
+
+    reactor() = default;
+    reactor(const reactor &) = delete;
+    reactor &operator=(const reactor &) = delete;
+
+    /* events: POLLIN/POLLOUT, fd -1 to only wait for the deadline */
+    wait_awaiter wait(int fd, short events, clock::time_point deadline,
+                      std::stop_token stop = {}) noexcept
+    {
+        return wait_awaiter(*this, fd, events, deadline, std::move(stop));
+    }
+    wait_awaiter sleep_until(clock::time_point deadline, std::stop_token stop = {}) noexcept
+    {
+        return wait_awaiter(*this, -1, 0, deadline, std::move(stop));
+    }
+
+    /* Starts a task, it runs until its first wait */
+    void spawn(task<void> t) { detail::run_detached(std::move(t)); }
+
+    /* Resumes the coroutine in the next run_once() */
+    void post(std::coroutine_handle<> h) { ready_.push_back(h); }
+
+    bool empty() const noexcept { return waiting_.empty() && ready_.empty(); }
+
+    /* Waits at most timeout_ms (-1 until an event), returns the number of
+       coroutines resumed */
+    int run_once(int timeout_ms = -1)
+    {
+        clock::time_point now;
+        std::size_t i;
+        std::size_t n;
+        int resumed = 0;
+
+        if (!ready_.empty()) {
+            timeout_ms = 0;
+        } else if (waiting_.empty()) {
+            return 0;
+        }
+
+        now = clock::now();
+        for (i = 0; i < waiting_.size(); i++) {
+            auto left = std::chrono::ceil<std::chrono::milliseconds>(waiting_[i]->deadline - now);
+            int ms = left.count() < 0 ? 0 : (int)left.count();
+
+            if (timeout_ms < 0 || ms < timeout_ms)
+                timeout_ms = ms;
+        }
+
+        pfds_.resize(waiting_.size());
+        for (i = 0; i < waiting_.size(); i++) {
+            pfds_[i].fd = waiting_[i]->fd;
+            pfds_[i].events = waiting_[i]->events;
+            pfds_[i].revents = 0;
+        }
+#if defined(_WIN32)
+        if (pfds_.empty()) {
+            Sleep(timeout_ms);
+        } else {
+            WSAPoll(pfds_.data(), (ULONG)pfds_.size(), timeout_ms);
+        }
+#else
+        poll(pfds_.data(), (nfds_t)pfds_.size(), timeout_ms);
+#endif
+
+        /* complete() moves the last entry into the freed slot */
+        now = clock::now();
+        for (i = 0; i < waiting_.size();) {
+            waiter *w = waiting_[i];
+
+            if (pfds_[i].revents != 0) {
+                complete(w, 0);
+            } else if (w->deadline <= now) {
+                complete(w, ETIMEDOUT);
+            } else {
+                i++;
+            }
+        }
+
+        for (n = ready_.size(); n > 0; n--) {
+            std::coroutine_handle<> h = ready_.front();
+
+            ready_.pop_front();
+            h.resume();
+            resumed++;
+        }
+
+        return resumed;
+    }
+
+    /* Runs until no coroutine is waiting */
+    void run()
+    {
+        while (!empty())
+            run_once(-1);
+    }
+
+private:
+    void add(waiter *w)
+    {
+        w->waiting = true;
+        waiting_.push_back(w);
+    }
+
+    void complete(waiter *w, int result)
+    {
+        if (!w->waiting)
+            return;
+
+        for (std::size_t i = 0; i < waiting_.size(); i++) {
+            if (waiting_[i] == w) {
+                waiting_[i] = waiting_.back();
+                waiting_.pop_back();
+                if (i < pfds_.size()) {
+                    pfds_[i] = pfds_.back();
+                    pfds_.pop_back();
+                }
+                break;
+            }
+        }
+        w->waiting = false;
+        w->result = result;
+        ready_.push_back(w->handle);
+    }
+
+    std::vector<waiter *> waiting_;
+    std::vector<pollfd> pfds_;
+    std::deque<std::coroutine_handle<>> ready_;
+};
+
+/* Client */
+
+struct options {
+    /* Defaults to the response timeout of the context */
+    std::optional<clock::duration> timeout;
+    std::stop_token stop;
+};
+
+class client {
+public:
+    client(reactor &r, context ctx) noexcept
+        : reactor_(r), ctx_(std::move(ctx)), busy_(false), flush_(false) {}
+    client(const client &) = delete;
+    client &operator=(const client &) = delete;
+
+    context &ctx() noexcept { return ctx_; }
+
+    task<result<void>> connect(options opt = {})
+    {
+        co_await lock();
+        result<void> rc = co_await connect_locked(opt);
+        unlock();
+        co_return rc;
+    }
+
+    task<result<int>> read_coils(int addr, span<uint8_t> dest, options opt = {})
+    {
+        return read_bits(MODBUS_FC_READ_COILS, addr, dest, std::move(opt));
+    }
+    task<result<int>> read_discrete_inputs(int addr, span<uint8_t> dest, options opt = {})
+    {
+        return read_bits(MODBUS_FC_READ_DISCRETE_INPUTS, addr, dest, std::move(opt));
+    }
+    task<result<int>> read_holding(int addr, span<uint16_t> dest, options opt = {})
+    {
+        return read_registers(MODBUS_FC_READ_HOLDING_REGISTERS, addr, dest, std::move(opt));
+    }
+    task<result<int>> read_input(int addr, span<uint16_t> dest, options opt = {})
+    {
+        return read_registers(MODBUS_FC_READ_INPUT_REGISTERS, addr, dest, std::move(opt));
+    }
+
+    task<result<int>> write_coil(int addr, bool status, options opt = {})
+    {
+        const uint16_t value = status ? 0xFF00 : 0;
+        const uint8_t pdu[5] = {MODBUS_FC_WRITE_SINGLE_COIL, (uint8_t)(addr >> 8),
+                                (uint8_t)addr, (uint8_t)(value >> 8), (uint8_t)value};
+        co_return co_await transaction(pdu, sizeof(pdu), nullptr, std::move(opt));
+    }
+    task<result<int>> write_register(int addr, uint16_t value, options opt = {})
+    {
+        const uint8_t pdu[5] = {MODBUS_FC_WRITE_SINGLE_REGISTER, (uint8_t)(addr >> 8),
+                                (uint8_t)addr, (uint8_t)(value >> 8), (uint8_t)value};
+        co_return co_await transaction(pdu, sizeof(pdu), nullptr, std::move(opt));
+    }
+    task<result<int>> write_coils(int addr, span<const uint8_t> src, options opt = {})
+    {
+        uint8_t pdu[MODBUS_MAX_PDU_LENGTH];
+        const int nb = (int)src.size();
+        int length = 6;
+
+        if (nb < 1 || nb > MODBUS_MAX_WRITE_BITS)
+            co_return std::error_code(EMBMDATA, category());
+        pdu[0] = MODBUS_FC_WRITE_MULTIPLE_COILS;
+        pdu[1] = (uint8_t)(addr >> 8);
+        pdu[2] = (uint8_t)addr;
+        pdu[3] = (uint8_t)(nb >> 8);
+        pdu[4] = (uint8_t)nb;
+        pdu[5] = (uint8_t)((nb + 7) / 8);
+        for (int i = 0; i < pdu[5]; i++) {
+            pdu[length++] = modbus_get_byte_from_bits(src.data(), i * 8,
+                                                      nb - i * 8 < 8 ? nb - i * 8 : 8);
+        }
+        co_return co_await transaction(pdu, length, nullptr, std::move(opt));
+    }
+    task<result<int>> write_registers(int addr, span<const uint16_t> src, options opt = {})
+    {
+        uint8_t pdu[MODBUS_MAX_PDU_LENGTH];
+        const int nb = (int)src.size();
+        int length = 6;
+
+        if (nb < 1 || nb > MODBUS_MAX_WRITE_REGISTERS)
+            co_return std::error_code(EMBMDATA, category());
+        pdu[0] = MODBUS_FC_WRITE_MULTIPLE_REGISTERS;
+        pdu[1] = (uint8_t)(addr >> 8);
+        pdu[2] = (uint8_t)addr;
+        pdu[3] = (uint8_t)(nb >> 8);
+        pdu[4] = (uint8_t)nb;
+        pdu[5] = (uint8_t)(nb * 2);
+        for (int i = 0; i < nb; i++) {
+            pdu[length++] = (uint8_t)(src[i] >> 8);
+            pdu[length++] = (uint8_t)src[i];
+        }
+        co_return co_await transaction(pdu, length, nullptr, std::move(opt));
+    }
+    task<result<int>> mask_write_register(int addr, uint16_t and_mask, uint16_t or_mask,
+                                          options opt = {})
+    {
+        const uint8_t pdu[7] = {MODBUS_FC_MASK_WRITE_REGISTER,
+                                (uint8_t)(addr >> 8), (uint8_t)addr,
+                                (uint8_t)(and_mask >> 8), (uint8_t)and_mask,
+                                (uint8_t)(or_mask >> 8), (uint8_t)or_mask};
+        co_return co_await transaction(pdu, sizeof(pdu), nullptr, std::move(opt));
+    }
+
+    /* Any request, rsp (may be NULL) receives the whole response */
+    task<result<int>> transaction(const uint8_t *pdu, int pdu_length, uint8_t *rsp,
+                                  options opt = {})
+    {
+        co_await lock();
+        result<int> rc = co_await transaction_locked(pdu, pdu_length, rsp, opt);
+        unlock();
+        co_return rc;
+    }
+
+private:
+    class lock_awaiter {
+    public:
+        explicit lock_awaiter(client &c) noexcept : client_(c) {}
+        bool await_ready() const noexcept
+        {
+            if (client_.busy_)
+                return false;
+            client_.busy_ = true;
+            return true;
+        }
+        void await_suspend(std::coroutine_handle<> h) { client_.queue_.push_back(h); }
+        void await_resume() const noexcept {}
+
+    private:
+        client &client_;
+    };
+
+    /* One transaction at a time, in the order of the calls */
+    lock_awaiter lock() noexcept { return lock_awaiter(*this); }
+    void unlock()
+    {
+        if (queue_.empty()) {
+            busy_ = false;
+        } else {
+            /* Still busy, handed over to the next caller */
+            reactor_.post(queue_.front());
+            queue_.pop_front();
+        }
+    }
+
+    clock::time_point deadline(const options &opt) const
+    {
+        uint32_t sec = 0;
+        uint32_t usec = 0;
+
+        if (opt.timeout)
+            return clock::now() + *opt.timeout;
+        modbus_get_response_timeout(ctx_.get(), &sec, &usec);
+        return clock::now() + std::chrono::seconds(sec) + std::chrono::microseconds(usec);
+    }
+
+    task<result<void>> connect_locked(const options &opt)
+    {
+        modbus_t *ctx = ctx_.get();
+        int rc;
+
+        if (opt.stop.stop_requested())
+            co_return std::error_code(ECANCELED, category());
+
+        if (modbus_connect_start(ctx) == 0)
+            co_return result<void>();
+        if (errno != EINPROGRESS)
+            co_return last_error();
+
+        rc = co_await reactor_.wait(modbus_get_socket(ctx), POLLOUT, deadline(opt), opt.stop);
+        if (rc == 0 && modbus_connect_finish(ctx) == -1)
+            rc = errno;
+        if (rc != 0) {
+            modbus_close(ctx);
+            co_return std::error_code(rc, category());
+        }
+        co_return result<void>();
+    }
+
+    task<result<int>> transaction_locked(const uint8_t *pdu, int pdu_length, uint8_t *dest,
+                                         const options &opt)
+    {
+        modbus_t *ctx = ctx_.get();
+        const int header_length = modbus_get_header_length(ctx);
+        uint8_t req[MODBUS_MAX_ADU_LENGTH];
+        uint8_t rsp[MODBUS_MAX_ADU_LENGTH];
+        const clock::time_point end = deadline(opt);
+        int req_length;
+        int length;
+        int rc;
+
+        if (opt.stop.stop_requested())
+            co_return std::error_code(ECANCELED, category());
+
+        if (flush_) {
+            modbus_flush(ctx);
+            flush_ = false;
+        }
+
+        req_length = modbus_encode_request(ctx, pdu, pdu_length, req);
+        if (req_length == -1)
+            co_return last_error();
+
+        for (length = 0; length < req_length;) {
+            rc = modbus_send_bytes(ctx, req + length, req_length - length);
+            if (rc > 0) {
+                length += rc;
+            } else if (rc == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                rc = co_await reactor_.wait(modbus_get_socket(ctx), POLLOUT, end, opt.stop);
+                if (rc != 0) {
+                    flush_ = true;
+                    co_return std::error_code(rc, category());
+                }
+            } else {
+                co_return co_await link_error();
+            }
+        }
+
+        length = 0;
+        for (;;) {
+            const int needed = modbus_confirmation_length(ctx, rsp, length);
+
+            if (needed > MODBUS_MAX_ADU_LENGTH) {
+                flush_ = true;
+                co_return std::error_code(EMBBADDATA, category());
+            }
+
+            if (needed == length) {
+                /* Late response to a request which has timed out (MBAP
+                   transaction ID) */
+                if (header_length == 7 && (rsp[0] != req[0] || rsp[1] != req[1])) {
+                    length = 0;
+                    continue;
+                }
+                rc = modbus_check_confirmation(ctx, req, rsp, length);
+                if (rc == -1) {
+                    result<int> error = last_error();
+
+                    flush_ = (modbus_get_error_recovery(ctx) & MODBUS_ERROR_RECOVERY_PROTOCOL) != 0;
+                    co_return error;
+                }
+                if (dest != nullptr)
+                    std::copy(rsp, rsp + length, dest);
+                co_return rc;
+            }
+
+            rc = modbus_receive_bytes(ctx, rsp + length, needed - length);
+            if (rc > 0) {
+                length += rc;
+            } else if (rc == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                rc = co_await reactor_.wait(modbus_get_socket(ctx), POLLIN, end, opt.stop);
+                if (rc != 0) {
+                    flush_ = true;
+                    co_return std::error_code(rc, category());
+                }
+            } else {
+                co_return co_await link_error();
+            }
+        }
+    }
+
+    /* The connection is reestablished with the link recovery, the error is
+       reported anyway */
+    task<result<int>> link_error()
+    {
+        result<int> error = last_error();
+
+        if (modbus_get_error_recovery(ctx_.get()) & MODBUS_ERROR_RECOVERY_LINK) {
+            modbus_close(ctx_.get());
+            co_await connect_locked(options());
+        }
+        co_return error;
+    }
+
+    task<result<int>> read_bits(int function, int addr, span<uint8_t> dest, options opt)
+    {
+        uint8_t rsp[MODBUS_MAX_ADU_LENGTH];
+        const int nb = (int)dest.size();
+        const uint8_t pdu[5] = {(uint8_t)function, (uint8_t)(addr >> 8), (uint8_t)addr,
+                                (uint8_t)(nb >> 8), (uint8_t)nb};
+
+        if (nb < 1 || nb > MODBUS_MAX_READ_BITS)
+            co_return std::error_code(EMBMDATA, category());
+        result<int> rc = co_await transaction(pdu, sizeof(pdu), rsp, std::move(opt));
+        if (!rc)
+            co_return rc;
+        modbus_set_bits_from_bytes(dest.data(), 0, nb,
+                                   rsp + modbus_get_header_length(ctx_.get()) + 2);
+        co_return nb;
+    }
+
+    task<result<int>> read_registers(int function, int addr, span<uint16_t> dest, options opt)
+    {
+        uint8_t rsp[MODBUS_MAX_ADU_LENGTH];
+        const int nb = (int)dest.size();
+        const uint8_t pdu[5] = {(uint8_t)function, (uint8_t)(addr >> 8), (uint8_t)addr,
+                                (uint8_t)(nb >> 8), (uint8_t)nb};
+
+        if (nb < 1 || nb > MODBUS_MAX_READ_REGISTERS)
+            co_return std::error_code(EMBMDATA, category());
+        result<int> rc = co_await transaction(pdu, sizeof(pdu), rsp, std::move(opt));
+        if (!rc)
+            co_return rc;
+        const uint8_t *data = rsp + modbus_get_header_length(ctx_.get()) + 2;
+        for (int i = 0; i < nb; i++) {
+            dest[i] = (uint16_t)((data[2 * i] << 8) | data[2 * i + 1]);
+        }
+        co_return nb;
+    }
+
+    reactor &reactor_;
+    context ctx_;
+    bool busy_;
+    bool flush_;
+    std::deque<std::coroutine_handle<>> queue_;
+};
+
+} // namespace coro
+} // namespace modbus
+
+#endif /* MODBUS_CORO_HPP */
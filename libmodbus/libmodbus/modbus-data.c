@@ -14,6 +14,7 @@
 
 #include <string.h>
 #include <assert.h>
+#include <errno.h>
 
 #if defined(_WIN32)
 #  include <winsock2.h>
@@ -24,6 +25,7 @@
 #include <config.h>
 
 #include "modbus.h"
+#include "modbus-private.h"
 
 #if defined(HAVE_BYTESWAP_H)
 #  include <byteswap.h>
@@ -54,6 +56,11 @@
 #  define bswap_16 _byteswap_ushort
 #endif
 
+#if defined(__SSSE3__) || defined(__AVX__)
+#  include <tmmintrin.h>
+#  define HAVE_SHUFFLE_EPI8 1
+#endif
+
 #if !defined(bswap_16)
 #  warning "Fallback on C functions for bswap_16"
 static inline uint16_t bswap_16(uint16_t x)
@@ -231,3 +238,122 @@ void modbus_set_float(float f, uint16_t *dest)
     dest[0] = (uint16_t)i;
     dest[1] = (uint16_t)(i >> 16);
 }
+
+/* Index of the register byte (2 bytes per register, high byte first) which
+   gives the byte i (least significant first) of a value of width bytes.
+   The orders are named as modbus_get_float_abcd() and co: in DCBA and BADC
+   the bytes of the registers are kept, in ABCD and CDAB they are swapped;
+   in DCBA and CDAB the first register holds the most significant word. */
+static int value_byte_index(modbus_order_t order, int width, int i)
+{
+    int word = i / 2;
+    int low = ((i % 2) == 0);
+    int reg;
+
+    if (order == MODBUS_ORDER_DCBA || order == MODBUS_ORDER_CDAB) {
+        reg = width / 2 - 1 - word;
+    } else {
+        reg = word;
+    }
+
+    if (order == MODBUS_ORDER_DCBA || order == MODBUS_ORDER_BADC) {
+        return 2 * reg + low;
+    } else {
+        return 2 * reg + !low;
+    }
+}
+
+/* Decodes nb values of 4 or 8 bytes. regs holds the registers as received or,
+   with host_order set, as an uint16_t array in memory. */
+void _modbus_decode_values(const uint8_t *regs, int host_order, int width, int nb,
+                           modbus_order_t order, void *dest)
+{
+    const uint16_t one = 1;
+    uint8_t *out = (uint8_t *)dest;
+    int perm[8];
+    int swap;
+    int i;
+    int j;
+
+    /* An uint16_t array on a little endian host has the bytes of each
+       register swapped */
+    swap = (host_order && *(const uint8_t *)&one == 1);
+    for (j = 0; j < width; j++) {
+        perm[j] = value_byte_index(order, width, j) ^ swap;
+    }
+
+    i = 0;
+#ifdef HAVE_SHUFFLE_EPI8
+    /* x86 is little endian, the bytes of the values are stored in order */
+    {
+        uint8_t mask[16];
+        __m128i shuffle;
+
+        for (j = 0; j < 16; j++) {
+            mask[j] = (uint8_t)((j / width) * width + perm[j % width]);
+        }
+        shuffle = _mm_loadu_si128((const __m128i *)mask);
+        for (; (i + 16 / width) <= nb; i += 16 / width) {
+            __m128i v = _mm_loadu_si128((const __m128i *)(regs + i * width));
+            _mm_storeu_si128((__m128i *)(out + i * width), _mm_shuffle_epi8(v, shuffle));
+        }
+    }
+#endif
+
+    for (; i < nb; i++) {
+        const uint8_t *p = regs + i * width;
+
+        if (width == 4) {
+            uint32_t v = ((uint32_t)p[perm[3]] << 24) | ((uint32_t)p[perm[2]] << 16) |
+                ((uint32_t)p[perm[1]] << 8) | p[perm[0]];
+            memcpy(out + i * 4, &v, 4);
+        } else {
+            uint64_t v = 0;
+
+            for (j = 7; j >= 0; j--) {
+                v = (v << 8) | p[perm[j]];
+            }
+            memcpy(out + i * 8, &v, 8);
+        }
+    }
+}
+
+static int decode_array(const uint16_t *src, int nb, modbus_order_t order,
+                        int width, void *dest)
+{
+    if (src == NULL || dest == NULL || nb < 0 ||
+        order < MODBUS_ORDER_ABCD || order > MODBUS_ORDER_CDAB) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    _modbus_decode_values((const uint8_t *)src, TRUE, width, nb, order, dest);
+    return nb;
+}
+
+/* Get nb floats from 2 * nb registers */
+int modbus_get_float_array(const uint16_t *src, int nb, modbus_order_t order, float *dest)
+{
+    return decode_array(src, nb, order, 4, dest);
+}
+
+/* Get nb doubles from 4 * nb registers */
+int modbus_get_double_array(const uint16_t *src, int nb, modbus_order_t order, double *dest)
+{
+    return decode_array(src, nb, order, 8, dest);
+}
+
+int modbus_get_int32_array(const uint16_t *src, int nb, modbus_order_t order, int32_t *dest)
+{
+    return decode_array(src, nb, order, 4, dest);
+}
+
+int modbus_get_uint32_array(const uint16_t *src, int nb, modbus_order_t order, uint32_t *dest)
+{
+    return decode_array(src, nb, order, 4, dest);
+}
+
+int modbus_get_int64_array(const uint16_t *src, int nb, modbus_order_t order, int64_t *dest)
+{
+    return decode_array(src, nb, order, 8, dest);
+}
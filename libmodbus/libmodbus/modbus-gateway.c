@@ -0,0 +1,656 @@
+/*
+ * Copyright © 2001-2013 Stéphane Raimbault <stephane.raimbault@gmail.com>
+ *
+ * SPDX-License-Identifier: LGPL-2.1+
+ */
+
+/*
+ TCP到RTU网关：TCP端的请求在处理函数中只入队，串口的应答在串口可读时
+ 由服务端的事件循环回调读取，按应答长度判断一帧结束，整个过程不阻塞，
+ 多个串口可以同时进行各自的事务。
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#ifndef _MSC_VER
+#include <unistd.h>
+#endif
+
+#include "modbus-private.h"
+
+#include "modbus-tcp.h"
+#include "modbus-tcp-private.h"
+#include "modbus-rtu.h"
+#include "modbus-rtu-private.h"
+#include "modbus-server.h"
+#include "modbus-gateway.h"
+
+#define _GATEWAY_LINE_IDLE 0
+#define _GATEWAY_LINE_WAIT 1
+
+#define _GATEWAY_CACHE_SIZE 256
+
+typedef struct _gateway_request {
+    int64_t connection;
+    /* Transaction and unit identifiers of the client, given back as is */
+    uint8_t tid[2];
+    uint8_t unit;
+    /* Slave and PDU, the CRC is added when sent */
+    uint8_t req[MODBUS_RTU_MAX_ADU_LENGTH];
+    int req_length;
+    /* Same reads of other clients answered with this one */
+    struct _gateway_request *followers;
+    struct _gateway_request *next;
+} gateway_request_t;
+
+typedef struct _gateway_line {
+    modbus_t *ctx;
+    struct _modbus_gateway *gateway;
+    int state;
+    /* Time in micro seconds of one character and of t3.5 */
+    int char_time;
+    int t35;
+    /* End of the response wait or of the silence before the next request */
+    int64_t deadline;
+    int64_t free_at;
+    gateway_request_t *current;
+    gateway_request_t *head;
+    gateway_request_t *tail;
+    int nb_queued;
+    int rsp_length;
+    uint8_t rsp[MODBUS_RTU_MAX_ADU_LENGTH];
+} gateway_line_t;
+
+typedef struct _gateway_route {
+    /* -1 when the unit isn't mapped */
+    int line;
+    int slave;
+} gateway_route_t;
+
+/* Last response to a read, direct mapped on the line, slave and range */
+typedef struct _gateway_cache_entry {
+    /* -1 when unused */
+    int line;
+    /* Slave, function, address and quantity */
+    uint8_t req[6];
+    int64_t time;
+    int rsp_length;
+    uint8_t rsp[MODBUS_RTU_MAX_ADU_LENGTH];
+} gateway_cache_entry_t;
+
+struct _modbus_gateway {
+    modbus_server_t *server;
+    gateway_line_t lines[MODBUS_GATEWAY_MAX_LINES];
+    int nb_lines;
+    gateway_route_t routes[256];
+    int queue_length;
+    int nb_pending;
+    int coalescing;
+    /* Max age in micro seconds of a cached response, 0 when disabled */
+    int64_t cache_age;
+    gateway_cache_entry_t *cache;
+};
+
+static int _gateway_is_write_function(int function)
+{
+    return function == MODBUS_FC_WRITE_SINGLE_COIL ||
+           function == MODBUS_FC_WRITE_SINGLE_REGISTER ||
+           function == MODBUS_FC_WRITE_MULTIPLE_COILS ||
+           function == MODBUS_FC_WRITE_MULTIPLE_REGISTERS;
+}
+
+static int _gateway_is_read_function(int function)
+{
+    return function >= MODBUS_FC_READ_COILS &&
+           function <= MODBUS_FC_READ_INPUT_REGISTERS;
+}
+
+/* Gives the response (slave and PDU) or an exception back to a client */
+static void _gateway_answer(modbus_gateway_t *gateway, const gateway_request_t *r,
+                            const uint8_t *rsp, int rsp_length, int exception_code)
+{
+    uint8_t adu[MODBUS_TCP_MAX_ADU_LENGTH];
+    int pdu_length;
+
+    adu[0] = r->tid[0];
+    adu[1] = r->tid[1];
+    adu[2] = 0;
+    adu[3] = 0;
+    adu[6] = r->unit;
+    if (exception_code != 0) {
+        adu[7] = r->req[1] | 0x80;
+        adu[8] = exception_code;
+        pdu_length = 2;
+    } else {
+        pdu_length = rsp_length - 1;
+        memcpy(adu + 7, rsp + 1, pdu_length);
+    }
+    adu[4] = (pdu_length + 1) >> 8;
+    adu[5] = (pdu_length + 1) & 0x00FF;
+
+    /* The client may be gone, nothing to do then */
+    modbus_server_send(gateway->server, r->connection, adu, pdu_length + 7);
+}
+
+static gateway_cache_entry_t *_gateway_cache_slot(modbus_gateway_t *gateway, int line,
+                                                  const uint8_t *req)
+{
+    unsigned int h = line * 31 + req[0] * 7 + req[1];
+
+    h = h * 131 + ((req[2] << 8) | req[3]);
+    h = h * 131 + ((req[4] << 8) | req[5]);
+    return &gateway->cache[h % _GATEWAY_CACHE_SIZE];
+}
+
+/* Drops the cached reads overlapping the range written by req */
+static void _gateway_cache_invalidate(modbus_gateway_t *gateway, int line,
+                                      const uint8_t *req)
+{
+    int function = req[1];
+    int addr = (req[2] << 8) | req[3];
+    int nb = 1;
+    int target = MODBUS_FC_READ_HOLDING_REGISTERS;
+    int i;
+
+    switch (function) {
+    case MODBUS_FC_WRITE_SINGLE_COIL:
+        target = MODBUS_FC_READ_COILS;
+        break;
+    case MODBUS_FC_WRITE_MULTIPLE_COILS:
+        target = MODBUS_FC_READ_COILS;
+        nb = (req[4] << 8) | req[5];
+        break;
+    case MODBUS_FC_WRITE_SINGLE_REGISTER:
+    case MODBUS_FC_MASK_WRITE_REGISTER:
+        break;
+    case MODBUS_FC_WRITE_MULTIPLE_REGISTERS:
+        nb = (req[4] << 8) | req[5];
+        break;
+    case MODBUS_FC_WRITE_AND_READ_REGISTERS:
+        addr = (req[6] << 8) | req[7];
+        nb = (req[8] << 8) | req[9];
+        break;
+    default:
+        return;
+    }
+
+    for (i = 0; i < _GATEWAY_CACHE_SIZE; i++) {
+        gateway_cache_entry_t *e = &gateway->cache[i];
+        int e_addr = (e->req[2] << 8) | e->req[3];
+        int e_nb = (e->req[4] << 8) | e->req[5];
+
+        if (e->line == line && e->req[1] == target &&
+            (e->req[0] == req[0] || req[0] == MODBUS_BROADCAST_ADDRESS) &&
+            e_addr < addr + nb && addr < e_addr + e_nb) {
+            e->line = -1;
+        }
+    }
+}
+
+/* Ends the current transaction of the line for every client waiting on it */
+static void _gateway_finish(gateway_line_t *line, const uint8_t *rsp, int rsp_length,
+                            int exception_code)
+{
+    modbus_gateway_t *gateway = line->gateway;
+    gateway_request_t *r = line->current;
+    int n = line - gateway->lines;
+
+    if (gateway->cache != NULL) {
+        if (exception_code == 0 && _gateway_is_read_function(r->req[1]) &&
+            (rsp[1] & 0x80) == 0) {
+            gateway_cache_entry_t *e = _gateway_cache_slot(gateway, n, r->req);
+
+            e->line = n;
+            memcpy(e->req, r->req, 6);
+            e->time = _modbus_monotonic_us();
+            e->rsp_length = rsp_length;
+            memcpy(e->rsp, rsp, rsp_length);
+        } else {
+            /* Done or not, the written values are unknown now */
+            _gateway_cache_invalidate(gateway, n, r->req);
+        }
+    }
+
+    while (r != NULL) {
+        gateway_request_t *next = r->followers;
+
+        _gateway_answer(gateway, r, rsp, rsp_length, exception_code);
+        free(r);
+        gateway->nb_pending--;
+        r = next;
+    }
+    line->current = NULL;
+    line->state = _GATEWAY_LINE_IDLE;
+    line->rsp_length = 0;
+    line->free_at = _modbus_monotonic_us() + line->t35;
+}
+
+/* Serial port readable, called from modbus_server_run() */
+static void _gateway_line_read(modbus_server_t *server, int fd, void *user_data)
+{
+    gateway_line_t *line = (gateway_line_t *)user_data;
+    modbus_t *ctx = line->ctx;
+
+    for (;;) {
+        int length;
+        ssize_t n;
+
+        if (line->rsp_length == MODBUS_RTU_MAX_ADU_LENGTH)
+            line->rsp_length = 0;
+        n = ctx->backend->recv(ctx, line->rsp + line->rsp_length,
+                               MODBUS_RTU_MAX_ADU_LENGTH - line->rsp_length);
+        if (n <= 0)
+            break;
+
+        if (line->state != _GATEWAY_LINE_WAIT) {
+            /* Late response or noise, dropped */
+            if (ctx->debug) {
+                printf("%d unexpected bytes dropped\n", (int)n);
+            }
+            continue;
+        }
+        line->rsp_length += n;
+
+        length = _modbus_frame_length(ctx, line->rsp, line->rsp_length, MSG_CONFIRMATION);
+        if (length == 0 || line->rsp_length < length)
+            continue;
+
+        if (length > MODBUS_RTU_MAX_ADU_LENGTH) {
+            errno = EMBBADDATA;
+            length = -1;
+        } else {
+            length = ctx->backend->check_integrity(ctx, line->rsp, length);
+        }
+
+        if (length == 0) {
+            /* Frame of another slave, keeps waiting */
+            line->rsp_length = 0;
+        } else if (length == -1 ||
+                   (line->rsp[1] & 0x7F) != line->current->req[1]) {
+            if (ctx->debug) {
+                fprintf(stderr, "Invalid response on the line of %s\n",
+                        ((modbus_rtu_t *)ctx->backend_data)->device);
+            }
+            _gateway_finish(line, NULL, 0, MODBUS_EXCEPTION_GATEWAY_TARGET);
+        } else {
+            if (ctx->debug) {
+                int i;
+                for (i = 0; i < length; i++)
+                    printf("<%.2X>", line->rsp[i]);
+                printf("\n");
+            }
+            _gateway_finish(line, line->rsp, length - _MODBUS_RTU_CHECKSUM_LENGTH, 0);
+        }
+    }
+}
+
+/* Ends the expired transactions and sends the next requests, returns the
+   time of the next deadline or -1 */
+static int64_t _gateway_schedule(modbus_gateway_t *gateway)
+{
+    int64_t now = _modbus_monotonic_us();
+    int64_t next = -1;
+    int i;
+
+    for (i = 0; i < gateway->nb_lines; i++) {
+        gateway_line_t *line = &gateway->lines[i];
+
+        if (line->state == _GATEWAY_LINE_WAIT && now >= line->deadline) {
+            if (line->ctx->debug) {
+                fprintf(stderr, "No response from slave %d\n", line->current->req[0]);
+            }
+            modbus_flush(line->ctx);
+            _gateway_finish(line, NULL, 0, MODBUS_EXCEPTION_GATEWAY_TARGET);
+        }
+
+        while (line->state == _GATEWAY_LINE_IDLE && line->head != NULL &&
+               now >= line->free_at) {
+            gateway_request_t *r = line->head;
+            const struct timeval *tv = &line->ctx->response_timeout;
+
+            line->head = r->next;
+            if (line->head == NULL)
+                line->tail = NULL;
+            line->nb_queued--;
+            line->current = r;
+            line->rsp_length = 0;
+
+            modbus_set_slave(line->ctx, r->req[0]);
+            if (modbus_send_raw_request(line->ctx, r->req, r->req_length) == -1) {
+                _gateway_finish(line, NULL, 0, MODBUS_EXCEPTION_GATEWAY_TARGET);
+                now = _modbus_monotonic_us();
+                continue;
+            }
+            now = _modbus_monotonic_us();
+
+            if (r->req[0] == MODBUS_BROADCAST_ADDRESS) {
+                /* No response, the slaves are given time to process it */
+                if (gateway->cache != NULL)
+                    _gateway_cache_invalidate(gateway, i, r->req);
+                free(r);
+                line->current = NULL;
+                line->free_at = now + MODBUS_RTU_BUS_TURNAROUND_DELAY;
+                gateway->nb_pending--;
+                continue;
+            }
+
+            /* The timeout starts once the request has left the line */
+            line->state = _GATEWAY_LINE_WAIT;
+            line->deadline = now +
+                (int64_t)(r->req_length + _MODBUS_RTU_CHECKSUM_LENGTH) * line->char_time +
+                (int64_t)tv->tv_sec * 1000000 + tv->tv_usec;
+        }
+
+        if (line->state == _GATEWAY_LINE_WAIT) {
+            if (next == -1 || line->deadline < next)
+                next = line->deadline;
+        } else if (line->head != NULL) {
+            if (next == -1 || line->free_at < next)
+                next = line->free_at;
+        }
+    }
+
+    return next;
+}
+
+static int _gateway_handler(modbus_t *ctx, const uint8_t *req, int req_length,
+                            void *user_data)
+{
+    modbus_gateway_t *gateway = (modbus_gateway_t *)user_data;
+    gateway_route_t *route = &gateway->routes[req[6]];
+    gateway_line_t *line;
+    gateway_request_t *r;
+
+    if (route->line == -1) {
+        return modbus_reply_exception(ctx, req, MODBUS_EXCEPTION_GATEWAY_PATH);
+    }
+    if (route->slave == MODBUS_BROADCAST_ADDRESS && !_gateway_is_write_function(req[7])) {
+        return modbus_reply_exception(ctx, req, MODBUS_EXCEPTION_ILLEGAL_FUNCTION);
+    }
+
+    line = &gateway->lines[route->line];
+    r = (gateway_request_t *)malloc(sizeof(gateway_request_t));
+    if (r == NULL) {
+        return modbus_reply_exception(ctx, req, MODBUS_EXCEPTION_SLAVE_OR_SERVER_FAILURE);
+    }
+
+    r->connection = modbus_server_get_connection(gateway->server);
+    r->tid[0] = req[0];
+    r->tid[1] = req[1];
+    r->unit = req[6];
+    r->req[0] = route->slave;
+    memcpy(r->req + 1, req + _MODBUS_TCP_HEADER_LENGTH, req_length - _MODBUS_TCP_HEADER_LENGTH);
+    r->req_length = req_length - _MODBUS_TCP_HEADER_LENGTH + 1;
+    r->followers = NULL;
+    r->next = NULL;
+
+    if (_gateway_is_read_function(r->req[1]) && r->req_length == 6) {
+        gateway_request_t *match = NULL;
+        gateway_request_t *q;
+
+        if (gateway->cache != NULL) {
+            gateway_cache_entry_t *e = _gateway_cache_slot(gateway, route->line, r->req);
+
+            if (e->line == route->line && memcmp(e->req, r->req, 6) == 0 &&
+                _modbus_monotonic_us() - e->time <= gateway->cache_age) {
+                _gateway_answer(gateway, r, e->rsp, e->rsp_length, 0);
+                free(r);
+                return 0;
+            }
+        }
+
+        if (gateway->coalescing) {
+            /* Same read already on its way, but not before a write to the
+               slave, the client must see what it wrote */
+            if (line->current != NULL && memcmp(line->current->req, r->req, 6) == 0)
+                match = line->current;
+            for (q = line->head; q != NULL; q = q->next) {
+                if (q->req[0] == r->req[0] && !_gateway_is_read_function(q->req[1]))
+                    match = NULL;
+                else if (q->req_length == 6 && memcmp(q->req, r->req, 6) == 0)
+                    match = q;
+            }
+            if (match != NULL) {
+                r->followers = match->followers;
+                match->followers = r;
+                gateway->nb_pending++;
+                return 0;
+            }
+        }
+    } else if (gateway->cache != NULL) {
+        /* A read queued from now on must not be served the old values */
+        _gateway_cache_invalidate(gateway, route->line, r->req);
+    }
+
+    if (line->nb_queued >= gateway->queue_length) {
+        free(r);
+        return modbus_reply_exception(ctx, req, MODBUS_EXCEPTION_SLAVE_OR_SERVER_BUSY);
+    }
+
+    if (line->tail != NULL) {
+        line->tail->next = r;
+    } else {
+        line->head = r;
+    }
+    line->tail = r;
+    line->nb_queued++;
+    gateway->nb_pending++;
+
+    return 0;
+}
+
+modbus_gateway_t* modbus_gateway_new(modbus_t *ctx, int server_socket, int engine)
+{
+    modbus_gateway_t *gateway;
+    int i;
+
+#if defined(_WIN32)
+    /* The serial ports can't be waited with the sockets */
+    errno = ENOTSUP;
+    return NULL;
+#else
+    gateway = (modbus_gateway_t *)calloc(1, sizeof(modbus_gateway_t));
+    if (gateway == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    gateway->server = modbus_server_new(ctx, server_socket, engine);
+    if (gateway->server == NULL) {
+        free(gateway);
+        return NULL;
+    }
+    modbus_server_set_handler(gateway->server, _gateway_handler, gateway);
+
+    for (i = 0; i < 256; i++) {
+        gateway->routes[i].line = -1;
+    }
+    gateway->queue_length = MODBUS_GATEWAY_DEFAULT_QUEUE_LENGTH;
+    gateway->coalescing = TRUE;
+
+    return gateway;
+#endif
+}
+
+modbus_server_t* modbus_gateway_get_server(modbus_gateway_t *gateway)
+{
+    if (gateway == NULL) {
+        errno = EINVAL;
+        return NULL;
+    }
+    return gateway->server;
+}
+
+int modbus_gateway_add_line(modbus_gateway_t *gateway, modbus_t *ctx)
+{
+    gateway_line_t *line;
+    modbus_rtu_t *ctx_rtu;
+
+    /* The line timing needs the serial settings, not known for an
+       encapsulated line (baud 0, modbus_new_rtu_tcp()) */
+    if (gateway == NULL || ctx == NULL || ctx->s < 0 ||
+        ctx->backend->backend_type != _MODBUS_BACKEND_TYPE_RTU ||
+        ((modbus_rtu_t *)ctx->backend_data)->baud == 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (gateway->nb_lines == MODBUS_GATEWAY_MAX_LINES) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    line = &gateway->lines[gateway->nb_lines];
+    memset(line, 0, sizeof(gateway_line_t));
+    if (modbus_server_watch(gateway->server, ctx->s, _gateway_line_read, line) == -1)
+        return -1;
+
+    ctx_rtu = ctx->backend_data;
+    line->ctx = ctx;
+    line->gateway = gateway;
+    line->char_time = (int)(1000000LL *
+        (1 + ctx_rtu->data_bit + (ctx_rtu->parity == 'N' ? 0 : 1) + ctx_rtu->stop_bit) /
+        ctx_rtu->baud) + 1;
+    line->t35 = ctx_rtu->t35;
+
+    return gateway->nb_lines++;
+}
+
+int modbus_gateway_map_unit(modbus_gateway_t *gateway, int unit, int line, int slave)
+{
+    if (gateway == NULL || unit < 0 || unit > 255 ||
+        line < -1 || line >= gateway->nb_lines ||
+        slave < 0 || slave > 247) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* A line of -1 removes the mapping */
+    gateway->routes[unit].line = line;
+    gateway->routes[unit].slave = slave;
+    return 0;
+}
+
+int modbus_gateway_set_queue_length(modbus_gateway_t *gateway, int length)
+{
+    if (gateway == NULL || length < 1) {
+        errno = EINVAL;
+        return -1;
+    }
+    gateway->queue_length = length;
+    return 0;
+}
+
+int modbus_gateway_set_coalescing(modbus_gateway_t *gateway, int enable)
+{
+    if (gateway == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    gateway->coalescing = enable ? TRUE : FALSE;
+    return 0;
+}
+
+int modbus_gateway_set_cache_age(modbus_gateway_t *gateway, uint32_t to_sec, uint32_t to_usec)
+{
+    int i;
+
+    if (gateway == NULL || to_usec > 999999) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (to_sec == 0 && to_usec == 0) {
+        free(gateway->cache);
+        gateway->cache = NULL;
+        gateway->cache_age = 0;
+        return 0;
+    }
+
+    if (gateway->cache == NULL) {
+        gateway->cache = (gateway_cache_entry_t *)malloc(
+            _GATEWAY_CACHE_SIZE * sizeof(gateway_cache_entry_t));
+        if (gateway->cache == NULL) {
+            errno = ENOMEM;
+            return -1;
+        }
+        for (i = 0; i < _GATEWAY_CACHE_SIZE; i++) {
+            gateway->cache[i].line = -1;
+        }
+    }
+    gateway->cache_age = (int64_t)to_sec * 1000000 + to_usec;
+    return 0;
+}
+
+int modbus_gateway_get_pending(modbus_gateway_t *gateway)
+{
+    if (gateway == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    return gateway->nb_pending;
+}
+
+int modbus_gateway_run(modbus_gateway_t *gateway, int timeout_ms)
+{
+    int64_t next;
+    int rc;
+
+    if (gateway == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* Wakes up for the next response timeout or end of silence */
+    next = _gateway_schedule(gateway);
+    if (next != -1) {
+        int64_t wait = next - _modbus_monotonic_us();
+        int wait_ms = (wait <= 0) ? 0 : (int)((wait + 999) / 1000);
+
+        if (timeout_ms < 0 || wait_ms < timeout_ms)
+            timeout_ms = wait_ms;
+    }
+
+    rc = modbus_server_run(gateway->server, timeout_ms);
+    if (rc == -1)
+        return -1;
+
+    /* Requests received on an idle line are sent right away */
+    _gateway_schedule(gateway);
+
+    return rc;
+}
+
+void modbus_gateway_free(modbus_gateway_t *gateway)
+{
+    int i;
+
+    if (gateway == NULL)
+        return;
+
+    for (i = 0; i < gateway->nb_lines; i++) {
+        gateway_line_t *line = &gateway->lines[i];
+        gateway_request_t *r = line->head;
+
+        if (line->current != NULL) {
+            line->current->next = r;
+            r = line->current;
+        }
+        while (r != NULL) {
+            gateway_request_t *next = r->next;
+
+            while (r->followers != NULL) {
+                gateway_request_t *follower = r->followers;
+
+                r->followers = follower->followers;
+                free(follower);
+            }
+            free(r);
+            r = next;
+        }
+    }
+    free(gateway->cache);
+    modbus_server_free(gateway->server);
+    free(gateway);
+}
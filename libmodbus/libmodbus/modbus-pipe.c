@@ -0,0 +1,406 @@
+/*
+ * Copyright © 2001-2013 Stéphane Raimbault <stephane.raimbault@gmail.com>
+ *
+ * SPDX-License-Identifier: LGPL-2.1+
+ */
+
+/*
+ 进程内内存管道：每个方向一个单生产者单消费者的字节环，写入位置只由发送方、
+ 读取位置只由接收方修改（获取/释放语义），不需要锁。
+ 两端的后端复制TCP或RTU后端的函数表，只替换收发、等待及连接管理。
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "modbus-private.h"
+
+#include "modbus-tcp.h"
+#include "modbus-tcp-private.h"
+#include "modbus-rtu.h"
+#include "modbus-rtu-private.h"
+#include "modbus-pipe.h"
+
+#if defined(_WIN32)
+# include <windows.h>
+#else
+# include <sched.h>
+#endif
+
+/* Acquire loads and release stores of the ring positions and of the close
+   flags. MSVC has no __atomic builtins: the aligned word accesses are atomic,
+   the barriers order them. */
+#if defined(_MSC_VER)
+static size_t _pipe_load(const volatile size_t *p)
+{
+    size_t v = *p;
+
+    MemoryBarrier();
+    return v;
+}
+
+static void _pipe_store(volatile size_t *p, size_t v)
+{
+    MemoryBarrier();
+    *p = v;
+}
+
+static int _pipe_load_flag(const volatile int *p)
+{
+    int v = *p;
+
+    MemoryBarrier();
+    return v;
+}
+
+static void _pipe_store_flag(volatile int *p, int v)
+{
+    MemoryBarrier();
+    *p = v;
+}
+
+/* Returns the references left */
+static long _pipe_unref(volatile long *p)
+{
+    return InterlockedDecrement(p);
+}
+#else
+# define _pipe_load(p)          __atomic_load_n(p, __ATOMIC_ACQUIRE)
+# define _pipe_store(p, v)      __atomic_store_n(p, v, __ATOMIC_RELEASE)
+# define _pipe_load_flag(p)     __atomic_load_n(p, __ATOMIC_ACQUIRE)
+# define _pipe_store_flag(p, v) __atomic_store_n(p, v, __ATOMIC_RELEASE)
+# define _pipe_unref(p)         __atomic_sub_fetch(p, 1, __ATOMIC_ACQ_REL)
+#endif
+
+/* Spins before giving the CPU away, the peer may share it */
+#define _PIPE_SPINS_BEFORE_YIELD 64
+/* Clock reads while waiting, every n spins */
+#define _PIPE_CLOCK_MASK         63
+
+#define _PIPE_CACHE_LINE         64
+
+typedef struct _pipe_ring {
+    /* Written by the sender only */
+    size_t head;
+    char head_pad[_PIPE_CACHE_LINE - sizeof(size_t)];
+    /* Written by the receiver only */
+    size_t tail;
+    char tail_pad[_PIPE_CACHE_LINE - sizeof(size_t)];
+    uint8_t data[MODBUS_PIPE_SIZE];
+} pipe_ring_t;
+
+typedef struct _pipe {
+    /* From the client to the server and back */
+    pipe_ring_t rings[2];
+    /* Set by each end on close, the peer reads the end of the stream */
+    int closed[2];
+    /* Ends not freed yet */
+    long refs;
+} pipe_t;
+
+typedef struct _pipe_end {
+    /* First member, the TCP and RTU functions cast the backend data */
+    union {
+        modbus_tcp_t tcp;
+        modbus_rtu_t rtu;
+    } framing;
+    modbus_backend_t backend;
+    pipe_t *pipe;
+    /* 0 for the client, 1 for the server */
+    int side;
+} pipe_end_t;
+
+static pipe_ring_t *_pipe_out(pipe_end_t *end)
+{
+    return &end->pipe->rings[end->side];
+}
+
+static pipe_ring_t *_pipe_in(pipe_end_t *end)
+{
+    return &end->pipe->rings[1 - end->side];
+}
+
+static int _pipe_peer_closed(pipe_end_t *end)
+{
+    return _pipe_load_flag(&end->pipe->closed[1 - end->side]);
+}
+
+static size_t _pipe_readable(pipe_end_t *end)
+{
+    pipe_ring_t *ring = _pipe_in(end);
+
+    return _pipe_load(&ring->head) - ring->tail;
+}
+
+static size_t _pipe_writable(pipe_end_t *end)
+{
+    pipe_ring_t *ring = _pipe_out(end);
+
+    return MODBUS_PIPE_SIZE - (ring->head - _pipe_load(&ring->tail));
+}
+
+static int _pipe_ready(pipe_end_t *end, int for_write, int length)
+{
+    if (_pipe_peer_closed(end))
+        return TRUE;
+
+    if (for_write)
+        return _pipe_writable(end) >= (size_t)length;
+
+    return _pipe_readable(end) > 0;
+}
+
+/* Busy waits for the peer thread, returns 0 on timeout (tv NULL to wait
+   forever). Only the clock is read, no system call until the yield. */
+static int _pipe_wait(pipe_end_t *end, int for_write, int length, const struct timeval *tv)
+{
+    int64_t deadline = -1;
+    unsigned int spins = 0;
+
+    if (tv != NULL) {
+        deadline = _modbus_monotonic_us() + (int64_t)tv->tv_sec * 1000000 + tv->tv_usec;
+    }
+
+    while (!_pipe_ready(end, for_write, length)) {
+        if (deadline != -1 && (spins & _PIPE_CLOCK_MASK) == 0 &&
+            _modbus_monotonic_us() >= deadline) {
+            return 0;
+        }
+        spins++;
+        if (spins < _PIPE_SPINS_BEFORE_YIELD) {
+#if defined(_MSC_VER)
+            YieldProcessor();
+#elif defined(__x86_64__) || defined(__i386__)
+            __builtin_ia32_pause();
+#endif
+        } else {
+#if defined(_WIN32)
+            SwitchToThread();
+#else
+            sched_yield();
+#endif
+        }
+    }
+
+    return 1;
+}
+
+static ssize_t _pipe_send(modbus_t *ctx, const uint8_t *req, int req_length)
+{
+    pipe_end_t *end = ctx->backend_data;
+    pipe_ring_t *ring = _pipe_out(end);
+    size_t offset;
+    size_t first;
+
+    if (end->pipe->closed[end->side]) {
+        errno = EBADF;
+        return -1;
+    }
+    if (req_length > MODBUS_PIPE_SIZE) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* A message is written as a whole, as send() on a blocking socket */
+    if (_pipe_writable(end) < (size_t)req_length &&
+        _pipe_wait(end, TRUE, req_length, &ctx->response_timeout) == 0) {
+        errno = ETIMEDOUT;
+        return -1;
+    }
+    if (_pipe_peer_closed(end)) {
+        errno = EPIPE;
+        return -1;
+    }
+
+    offset = ring->head & (MODBUS_PIPE_SIZE - 1);
+    first = MODBUS_PIPE_SIZE - offset;
+    if (first > (size_t)req_length)
+        first = req_length;
+    memcpy(ring->data + offset, req, first);
+    memcpy(ring->data, req + first, req_length - first);
+    _pipe_store(&ring->head, ring->head + req_length);
+
+    return req_length;
+}
+
+/* Returns 0 at the end of the stream and EAGAIN when empty, as a non blocking
+   socket */
+static ssize_t _pipe_recv(modbus_t *ctx, uint8_t *rsp, int rsp_length)
+{
+    pipe_end_t *end = ctx->backend_data;
+    pipe_ring_t *ring = _pipe_in(end);
+    size_t available = _pipe_readable(end);
+    size_t offset;
+    size_t first;
+
+    if (end->pipe->closed[end->side]) {
+        errno = EBADF;
+        return -1;
+    }
+    if (available == 0) {
+        if (_pipe_peer_closed(end))
+            return 0;
+        errno = EAGAIN;
+        return -1;
+    }
+
+    if (available > (size_t)rsp_length)
+        available = rsp_length;
+
+    offset = ring->tail & (MODBUS_PIPE_SIZE - 1);
+    first = MODBUS_PIPE_SIZE - offset;
+    if (first > available)
+        first = available;
+    memcpy(rsp, ring->data + offset, first);
+    memcpy(rsp + first, ring->data, available - first);
+    _pipe_store(&ring->tail, ring->tail + available);
+
+    return (ssize_t)available;
+}
+
+static int _pipe_select(modbus_t *ctx, struct timeval *tv, int length_to_read)
+{
+    pipe_end_t *end = ctx->backend_data;
+
+    if (end->pipe->closed[end->side]) {
+        errno = EBADF;
+        return -1;
+    }
+
+    if (_pipe_wait(end, FALSE, 0, tv) == 0) {
+        errno = ETIMEDOUT;
+        return -1;
+    }
+
+    return 1;
+}
+
+/* The ends are connected when created, connect only reopens a closed one */
+static int _pipe_connect(modbus_t *ctx)
+{
+    pipe_end_t *end = ctx->backend_data;
+
+    _pipe_store_flag(&end->pipe->closed[end->side], FALSE);
+    return 0;
+}
+
+static void _pipe_close(modbus_t *ctx)
+{
+    pipe_end_t *end = ctx->backend_data;
+
+    _pipe_store_flag(&end->pipe->closed[end->side], TRUE);
+}
+
+static int _pipe_flush(modbus_t *ctx)
+{
+    pipe_end_t *end = ctx->backend_data;
+    pipe_ring_t *ring = _pipe_in(end);
+    size_t head = _pipe_load(&ring->head);
+    int flushed = (int)(head - ring->tail);
+
+    _pipe_store(&ring->tail, head);
+    return flushed;
+}
+
+static void _pipe_free(modbus_t *ctx)
+{
+    pipe_end_t *end = ctx->backend_data;
+
+    if (end != NULL) {
+        pipe_t *pipe = end->pipe;
+
+        /* The peer reads the end of the stream */
+        _pipe_store_flag(&pipe->closed[end->side], TRUE);
+        if (_pipe_unref(&pipe->refs) == 0)
+            free(pipe);
+        free(end);
+    }
+    free(ctx);
+}
+
+static modbus_t *_pipe_new_end(pipe_t *pipe, int framing, int side)
+{
+    modbus_t *ctx;
+    pipe_end_t *end;
+
+    ctx = (modbus_t *)malloc(sizeof(modbus_t));
+    end = (pipe_end_t *)calloc(1, sizeof(pipe_end_t));
+    if (ctx == NULL || end == NULL) {
+        free(ctx);
+        free(end);
+        errno = ENOMEM;
+        return NULL;
+    }
+    _modbus_init_common(ctx);
+
+    /* Same framing functions, the transport is replaced */
+    if (framing == MODBUS_PIPE_TCP) {
+        end->backend = _modbus_tcp_backend;
+        ctx->slave = MODBUS_TCP_SLAVE;
+    } else {
+        end->backend = _modbus_rtu_backend;
+        /* No silence on a memory pipe, the frames are parsed by length */
+        end->backend.receive_frame = NULL;
+        end->framing.rtu.frame_mode = MODBUS_RTU_FRAME_LENGTH;
+    }
+    end->backend.send = _pipe_send;
+    end->backend.recv = _pipe_recv;
+    end->backend.connect = _pipe_connect;
+    end->backend.close = _pipe_close;
+    end->backend.flush = _pipe_flush;
+    end->backend.select = _pipe_select;
+    end->backend.free = _pipe_free;
+
+    end->pipe = pipe;
+    end->side = side;
+    ctx->backend = &end->backend;
+    ctx->backend_data = end;
+
+    return ctx;
+}
+
+int modbus_new_pipe(int framing, modbus_t **client, modbus_t **server)
+{
+    pipe_t *pipe;
+
+    if ((framing != MODBUS_PIPE_TCP && framing != MODBUS_PIPE_RTU) ||
+        client == NULL || server == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    pipe = (pipe_t *)calloc(1, sizeof(pipe_t));
+    if (pipe == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    *client = _pipe_new_end(pipe, framing, 0);
+    if (*client == NULL) {
+        free(pipe);
+        return -1;
+    }
+    *server = _pipe_new_end(pipe, framing, 1);
+    if (*server == NULL) {
+        free((*client)->backend_data);
+        free(*client);
+        *client = NULL;
+        free(pipe);
+        return -1;
+    }
+    pipe->refs = 2;
+
+    return 0;
+}
+
+int modbus_pipe_get_pending(modbus_t *ctx)
+{
+    if (ctx == NULL || ctx->backend->free != _pipe_free) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return (int)_pipe_readable(ctx->backend_data);
+}
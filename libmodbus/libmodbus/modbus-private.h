@@ -35,6 +35,10 @@ MODBUS_BEGIN_DECLS
 
 #define _MODBUS_EXCEPTION_RSP_LENGTH 5
 
+/* Returned by receive_frame() when the frame length is computed from the
+   function code as usual */
+#define _MODBUS_FRAME_BY_LENGTH -2
+
 /* Timeouts in microsecond (0.5 s) */
 #define _RESPONSE_TIMEOUT    500000
 #define _BYTE_TIMEOUT        500000
@@ -188,11 +192,27 @@ typedef struct _modbus_backend {
 	/*
 	内部函数，此函数用于设置超时并读取通信事件，
 	以检测是否存在待接收数据。
+	tv为距截止时间的剩余时间（NULL表示一直等待），被信号中断时返回-1且errno为EINTR，
+	由_modbus_receive_msg()按同一截止时间重新等待。
 	*/
-    int (*select) (modbus_t *ctx, fd_set *rset, struct timeval *tv, int msg_length);
+    int (*select) (modbus_t *ctx, struct timeval *tv, int msg_length);
     void (*free) (modbus_t *ctx);  //此函数用于释放相关联的内存，防止内存泄漏
+
+	/*
+	可选（可为NULL），由后端自行界定一帧报文，不再按功能码计算长度。
+	RTU模式下为按t3.5静默间隔分帧；返回_MODBUS_FRAME_BY_LENGTH时按原方式逐步解析。
+	*/
+    int (*receive_frame) (modbus_t *ctx, uint8_t *msg, msg_type_t msg_type);
+	/*
+	可选（可为NULL），为预编码的请求填写下一个事务号，RTU模式下没有事务号。
+	*/
+    void (*set_request_tid) (modbus_t *ctx, uint8_t *req);
 } modbus_backend_t;
 
+/* Framing of the memory pipe (modbus-pipe.c) */
+extern const modbus_backend_t _modbus_tcp_backend;
+extern const modbus_backend_t _modbus_rtu_backend;
+
 struct _modbus {
     /* Slave address */
     int slave;                              //从站设备地址
@@ -205,11 +225,22 @@ struct _modbus {
     struct timeval indication_timeout;
     const modbus_backend_t *backend;      //包含一系列共通函数指针，如消息发送、接收等，试用TCP、RTU两种模式
     void *backend_data;                //上面共通部分之外的数据，如TCP模式下的特殊配置数据，或者RTU模式下的特殊配置数据
+    uint8_t view_rsp[MODBUS_MAX_ADU_LENGTH];  //modbus_read_view()的应答，供modbus_view_t引用
+    int connect_nowait;                //modbus_connect_start()：TCP连接不等待完成
+    struct _modbus_step *step;         //分步接口（modbus-step.c）的请求队列及状态，首次使用时分配
 };
 
 void _modbus_init_common(modbus_t *ctx);
 void _error_print(modbus_t *ctx, const char *context);
 int _modbus_receive_msg(modbus_t *ctx, uint8_t *msg, msg_type_t msg_type);
+int _modbus_receive_confirmation(modbus_t *ctx, uint8_t *req, uint8_t *rsp);
+int _modbus_frame_length(modbus_t *ctx, uint8_t *msg, int msg_length,
+                         msg_type_t msg_type);
+int64_t _modbus_monotonic_us(void);
+void _modbus_remaining_time(int64_t deadline, struct timeval *tv);
+int _modbus_wait_fd(int fd, int for_write, const struct timeval *tv);
+void _modbus_decode_values(const uint8_t *regs, int host_order, int width, int nb,
+                           modbus_order_t order, void *dest);
 
 #ifndef HAVE_STRLCPY
 size_t strlcpy(char *dest, const char *src, size_t dest_size);
@@ -0,0 +1,734 @@
+/*
+ * Copyright © 2001-2013 Stéphane Raimbault <stephane.raimbault@gmail.com>
+ *
+ * SPDX-License-Identifier: LGPL-2.1+
+ */
+
+/*
+ 本地连接共享代理：本地连接的请求在处理函数中按连接分组排队，
+ 设备的连接可写（在途请求数未满）时轮流从各组取一个发送，
+ 设备的应答在其套接字可读时由服务端的事件循环回调读取，按MBAP长度切分，
+ 按事务号找到请求，换回本地连接的事务号和单元号后返回。整个过程不阻塞。
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#ifndef _MSC_VER
+#include <unistd.h>
+#endif
+
+#include "modbus-private.h"
+
+#if !defined(_WIN32)
+# include <sys/socket.h>
+#endif
+
+#include "modbus-tcp.h"
+#include "modbus-tcp-private.h"
+#include "modbus-server.h"
+#include "modbus-proxy.h"
+
+#define _PROXY_DEVICE_DOWN       0
+#define _PROXY_DEVICE_CONNECTING 1
+#define _PROXY_DEVICE_UP         2
+
+#define _PROXY_IN_LENGTH         4096
+/* Retry delays of a device which can't be reached, in micro seconds */
+#define _PROXY_MIN_BACKOFF       100000
+#define _PROXY_MAX_BACKOFF       5000000
+/* Polling of a connection in progress */
+#define _PROXY_CONNECT_POLL      5000
+
+typedef struct _proxy_request {
+    int64_t connection;
+    /* Transaction and unit identifiers of the local client, given back as is */
+    uint8_t tid[2];
+    uint8_t unit;
+    /* Unit of the device and PDU */
+    uint8_t req[1 + MODBUS_MAX_PDU_LENGTH];
+    int req_length;
+    /* Transaction ID on the device connection */
+    uint8_t device_tid[2];
+    int64_t deadline;
+    /* Same reads of other clients answered with this one */
+    struct _proxy_request *followers;
+    struct _proxy_request *next;
+} proxy_request_t;
+
+/* Requests queued by one local connection */
+typedef struct _proxy_flow {
+    int64_t connection;
+    proxy_request_t *head;
+    proxy_request_t *tail;
+    struct _proxy_flow *next;
+} proxy_flow_t;
+
+typedef struct _proxy_device {
+    modbus_t *ctx;
+    struct _modbus_proxy *proxy;
+    int state;
+    int64_t connect_deadline;
+    int64_t retry_at;
+    int64_t backoff;
+    uint16_t next_tid;
+    /* Round robin: the flow at the head sends next and goes to the tail */
+    proxy_flow_t *flows;
+    proxy_flow_t *flows_tail;
+    int nb_queued;
+    proxy_request_t *inflight[MODBUS_PROXY_MAX_WINDOW];
+    int nb_inflight;
+    int out_length;
+    uint8_t out[MODBUS_PROXY_MAX_WINDOW * MODBUS_TCP_MAX_ADU_LENGTH];
+    int in_length;
+    uint8_t in[_PROXY_IN_LENGTH];
+} proxy_device_t;
+
+typedef struct _proxy_route {
+    /* -1 when the unit isn't mapped */
+    int device;
+    int unit;
+} proxy_route_t;
+
+struct _modbus_proxy {
+    modbus_server_t *server;
+    proxy_device_t *devices[MODBUS_PROXY_MAX_DEVICES];
+    int nb_devices;
+    proxy_route_t routes[256];
+    int window;
+    int queue_length;
+    int dedup;
+    int nb_pending;
+};
+
+static int _proxy_is_read_function(int function)
+{
+    return function >= MODBUS_FC_READ_COILS &&
+           function <= MODBUS_FC_READ_INPUT_REGISTERS;
+}
+
+/* Gives the response PDU or an exception back to a local client */
+static void _proxy_answer(modbus_proxy_t *proxy, const proxy_request_t *r,
+                          const uint8_t *pdu, int pdu_length, int exception_code)
+{
+    uint8_t adu[MODBUS_TCP_MAX_ADU_LENGTH];
+
+    adu[0] = r->tid[0];
+    adu[1] = r->tid[1];
+    adu[2] = 0;
+    adu[3] = 0;
+    adu[6] = r->unit;
+    if (exception_code != 0) {
+        adu[7] = r->req[1] | 0x80;
+        adu[8] = exception_code;
+        pdu_length = 2;
+    } else {
+        memcpy(adu + 7, pdu, pdu_length);
+    }
+    adu[4] = (pdu_length + 1) >> 8;
+    adu[5] = (pdu_length + 1) & 0x00FF;
+
+    /* The client may be gone, nothing to do then */
+    modbus_server_send(proxy->server, r->connection, adu, pdu_length + 7);
+}
+
+/* Answers a request and the reads merged with it */
+static void _proxy_finish(modbus_proxy_t *proxy, proxy_request_t *r,
+                          const uint8_t *pdu, int pdu_length, int exception_code)
+{
+    while (r != NULL) {
+        proxy_request_t *next = r->followers;
+
+        _proxy_answer(proxy, r, pdu, pdu_length, exception_code);
+        free(r);
+        proxy->nb_pending--;
+        r = next;
+    }
+}
+
+static void _proxy_remove_inflight(proxy_device_t *device, int i)
+{
+    device->nb_inflight--;
+    memmove(device->inflight + i, device->inflight + i + 1,
+            (device->nb_inflight - i) * sizeof(proxy_request_t *));
+}
+
+/* Fails the queued requests, the device can't be reached */
+static void _proxy_fail_queued(proxy_device_t *device)
+{
+    while (device->flows != NULL) {
+        proxy_flow_t *flow = device->flows;
+
+        while (flow->head != NULL) {
+            proxy_request_t *r = flow->head;
+
+            flow->head = r->next;
+            _proxy_finish(device->proxy, r, NULL, 0, MODBUS_EXCEPTION_GATEWAY_TARGET);
+        }
+        device->flows = flow->next;
+        free(flow);
+    }
+    device->flows_tail = NULL;
+    device->nb_queued = 0;
+}
+
+/* Connection lost or refused, the requests sent can't be replayed */
+static void _proxy_device_down(proxy_device_t *device, int64_t retry_delay)
+{
+    modbus_t *ctx = device->ctx;
+
+    if (ctx->debug) {
+        fprintf(stderr, "Device connection closed (%s)\n", modbus_strerror(errno));
+    }
+
+    if (device->state == _PROXY_DEVICE_UP)
+        modbus_server_unwatch(device->proxy->server, ctx->s);
+    modbus_close(ctx);
+    device->state = _PROXY_DEVICE_DOWN;
+    device->out_length = 0;
+    device->in_length = 0;
+    device->retry_at = _modbus_monotonic_us() + retry_delay;
+
+    while (device->nb_inflight > 0) {
+        proxy_request_t *r = device->inflight[0];
+
+        _proxy_remove_inflight(device, 0);
+        _proxy_finish(device->proxy, r, NULL, 0, MODBUS_EXCEPTION_GATEWAY_TARGET);
+    }
+}
+
+/* The device can't be reached, the next attempts wait longer */
+static void _proxy_connect_failed(proxy_device_t *device)
+{
+    device->backoff = (device->backoff == 0) ? _PROXY_MIN_BACKOFF : device->backoff * 2;
+    if (device->backoff > _PROXY_MAX_BACKOFF)
+        device->backoff = _PROXY_MAX_BACKOFF;
+
+    _proxy_device_down(device, device->backoff);
+    _proxy_fail_queued(device);
+}
+
+static void _proxy_parse(proxy_device_t *device)
+{
+    int offset = 0;
+
+    while (device->in_length - offset >= _MODBUS_TCP_HEADER_LENGTH + 1) {
+        const uint8_t *rsp = device->in + offset;
+        int length = 6 + ((rsp[4] << 8) | rsp[5]);
+        int i;
+
+        if (length < _MODBUS_TCP_HEADER_LENGTH + 1 || length > MODBUS_TCP_MAX_ADU_LENGTH) {
+            /* The stream can't be split into responses anymore */
+            errno = EMBBADDATA;
+            _proxy_device_down(device, 0);
+            return;
+        }
+        if (device->in_length - offset < length)
+            break;
+
+        for (i = 0; i < device->nb_inflight; i++) {
+            proxy_request_t *r = device->inflight[i];
+
+            if (rsp[0] == r->device_tid[0] && rsp[1] == r->device_tid[1]) {
+                _proxy_remove_inflight(device, i);
+                _proxy_finish(device->proxy, r, rsp + _MODBUS_TCP_HEADER_LENGTH,
+                              length - _MODBUS_TCP_HEADER_LENGTH, 0);
+                break;
+            }
+        }
+        /* Otherwise a late response to a request which has timed out */
+        offset += length;
+    }
+
+    device->in_length -= offset;
+    memmove(device->in, device->in + offset, device->in_length);
+}
+
+/* Device socket readable, called from modbus_server_run() */
+static void _proxy_device_read(modbus_server_t *server, int fd, void *user_data)
+{
+    proxy_device_t *device = (proxy_device_t *)user_data;
+
+    while (device->state == _PROXY_DEVICE_UP) {
+        int rc = modbus_receive_bytes(device->ctx, device->in + device->in_length,
+                                      _PROXY_IN_LENGTH - device->in_length);
+
+        if (rc == -1) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                _proxy_device_down(device, 0);
+            break;
+        }
+        device->in_length += rc;
+        _proxy_parse(device);
+    }
+}
+
+static void _proxy_send_out(proxy_device_t *device)
+{
+    while (device->out_length > 0) {
+        int rc = modbus_send_bytes(device->ctx, device->out, device->out_length);
+
+        if (rc == -1) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                _proxy_device_down(device, 0);
+            return;
+        }
+        device->out_length -= rc;
+        memmove(device->out, device->out + rc, device->out_length);
+    }
+}
+
+static proxy_request_t *_proxy_next_request(proxy_device_t *device)
+{
+    proxy_flow_t *flow = device->flows;
+    proxy_request_t *r = flow->head;
+
+    flow->head = r->next;
+    device->flows = flow->next;
+    if (flow->head == NULL) {
+        free(flow);
+        if (device->flows == NULL)
+            device->flows_tail = NULL;
+    } else if (device->flows != NULL) {
+        /* Other clients go first */
+        flow->next = NULL;
+        device->flows_tail->next = flow;
+        device->flows_tail = flow;
+    } else {
+        device->flows = flow;
+    }
+    device->nb_queued--;
+
+    return r;
+}
+
+/* Sends queued requests, one per client in turn, up to the window */
+static void _proxy_dispatch(proxy_device_t *device, int64_t now)
+{
+    modbus_t *ctx = device->ctx;
+    const struct timeval *tv = &ctx->response_timeout;
+
+    while (device->flows != NULL && device->nb_inflight < device->proxy->window) {
+        proxy_request_t *r = _proxy_next_request(device);
+        uint8_t *adu = device->out + device->out_length;
+        int pdu_length = r->req_length - 1;
+
+        r->device_tid[0] = device->next_tid >> 8;
+        r->device_tid[1] = device->next_tid & 0x00FF;
+        device->next_tid++;
+
+        adu[0] = r->device_tid[0];
+        adu[1] = r->device_tid[1];
+        adu[2] = 0;
+        adu[3] = 0;
+        adu[4] = (pdu_length + 1) >> 8;
+        adu[5] = (pdu_length + 1) & 0x00FF;
+        memcpy(adu + 6, r->req, r->req_length);
+        device->out_length += r->req_length + 6;
+
+        if (ctx->debug) {
+            int i;
+            for (i = 0; i < r->req_length + 6; i++)
+                printf("[%.2X]", adu[i]);
+            printf("\n");
+        }
+
+        r->deadline = now + (int64_t)tv->tv_sec * 1000000 + tv->tv_usec;
+        device->inflight[device->nb_inflight++] = r;
+    }
+
+    _proxy_send_out(device);
+}
+
+static void _proxy_connect(proxy_device_t *device)
+{
+    modbus_t *ctx = device->ctx;
+    const struct timeval *tv = &ctx->response_timeout;
+
+    /* Completed by _proxy_check_connect(), even when it's done already */
+    if (modbus_connect_start(ctx) == -1 && errno != EINPROGRESS) {
+        _proxy_connect_failed(device);
+        return;
+    }
+
+    device->state = _PROXY_DEVICE_CONNECTING;
+    device->connect_deadline = _modbus_monotonic_us() +
+        (int64_t)tv->tv_sec * 1000000 + tv->tv_usec;
+}
+
+/* Completes a connection in progress, returns FALSE while it goes on */
+static int _proxy_check_connect(proxy_device_t *device, int64_t now)
+{
+    modbus_t *ctx = device->ctx;
+    struct timeval tv;
+    int rc;
+
+    tv.tv_sec = 0;
+    tv.tv_usec = 0;
+    rc = _modbus_wait_fd(ctx->s, TRUE, &tv);
+    if (rc == 0) {
+        if (now < device->connect_deadline)
+            return FALSE;
+        errno = ETIMEDOUT;
+        _proxy_connect_failed(device);
+        return TRUE;
+    }
+
+    if (rc == -1 || modbus_connect_finish(ctx) == -1 ||
+        modbus_server_watch(device->proxy->server, ctx->s, _proxy_device_read,
+                            device) == -1) {
+        _proxy_connect_failed(device);
+        return TRUE;
+    }
+
+    device->state = _PROXY_DEVICE_UP;
+    device->backoff = 0;
+    return TRUE;
+}
+
+/* Advances every device, returns the time of the next deadline or -1 */
+static int64_t _proxy_schedule(modbus_proxy_t *proxy)
+{
+    int64_t now = _modbus_monotonic_us();
+    int64_t next = -1;
+    int i;
+
+    for (i = 0; i < proxy->nb_devices; i++) {
+        proxy_device_t *device = proxy->devices[i];
+        int j = 0;
+
+        if (device->state == _PROXY_DEVICE_DOWN && device->flows != NULL &&
+            now >= device->retry_at) {
+            _proxy_connect(device);
+        }
+
+        if (device->state == _PROXY_DEVICE_CONNECTING &&
+            !_proxy_check_connect(device, now)) {
+            if (next == -1 || now + _PROXY_CONNECT_POLL < next)
+                next = now + _PROXY_CONNECT_POLL;
+            continue;
+        }
+
+        if (device->state != _PROXY_DEVICE_UP)
+            continue;
+
+        while (j < device->nb_inflight) {
+            proxy_request_t *r = device->inflight[j];
+
+            if (now >= r->deadline) {
+                if (device->ctx->debug) {
+                    fprintf(stderr, "No response from unit %d\n", r->req[0]);
+                }
+                _proxy_remove_inflight(device, j);
+                _proxy_finish(proxy, r, NULL, 0, MODBUS_EXCEPTION_GATEWAY_TARGET);
+                continue;
+            }
+            j++;
+        }
+
+        if (device->out_length > 0)
+            _proxy_send_out(device);
+        if (device->state == _PROXY_DEVICE_UP && device->out_length == 0)
+            _proxy_dispatch(device, now);
+        if (device->state != _PROXY_DEVICE_UP)
+            continue;
+
+        if (device->out_length > 0) {
+            /* Socket buffer full, tried again shortly */
+            if (next == -1 || now + 1000 < next)
+                next = now + 1000;
+        }
+        for (j = 0; j < device->nb_inflight; j++) {
+            if (next == -1 || device->inflight[j]->deadline < next)
+                next = device->inflight[j]->deadline;
+        }
+    }
+
+    return next;
+}
+
+static int _proxy_handler(modbus_t *ctx, const uint8_t *req, int req_length,
+                          void *user_data)
+{
+    modbus_proxy_t *proxy = (modbus_proxy_t *)user_data;
+    proxy_route_t *route = &proxy->routes[req[6]];
+    proxy_device_t *device;
+    proxy_request_t *r;
+    proxy_flow_t *flow;
+    int64_t connection;
+    int i;
+
+    if (route->device == -1) {
+        return modbus_reply_exception(ctx, req, MODBUS_EXCEPTION_GATEWAY_PATH);
+    }
+
+    device = proxy->devices[route->device];
+    if (device->state == _PROXY_DEVICE_DOWN && device->backoff != 0 &&
+        _modbus_monotonic_us() < device->retry_at) {
+        /* Failed to connect a moment ago, the client doesn't wait */
+        return modbus_reply_exception(ctx, req, MODBUS_EXCEPTION_GATEWAY_TARGET);
+    }
+
+    r = (proxy_request_t *)malloc(sizeof(proxy_request_t));
+    if (r == NULL) {
+        return modbus_reply_exception(ctx, req, MODBUS_EXCEPTION_SLAVE_OR_SERVER_FAILURE);
+    }
+
+    connection = modbus_server_get_connection(proxy->server);
+    r->connection = connection;
+    r->tid[0] = req[0];
+    r->tid[1] = req[1];
+    r->unit = req[6];
+    r->req[0] = route->unit;
+    memcpy(r->req + 1, req + _MODBUS_TCP_HEADER_LENGTH, req_length - _MODBUS_TCP_HEADER_LENGTH);
+    r->req_length = req_length - _MODBUS_TCP_HEADER_LENGTH + 1;
+    r->followers = NULL;
+    r->next = NULL;
+
+    if (proxy->dedup && _proxy_is_read_function(r->req[1]) && r->req_length == 6) {
+        proxy_request_t *match = NULL;
+        proxy_request_t *q;
+        int written = FALSE;
+
+        /* Same read already sent or queued, unless a write to the unit is
+           on its way: the client must see what it wrote */
+        for (i = 0; i < device->nb_inflight && !written; i++) {
+            q = device->inflight[i];
+            if (q->req[0] == r->req[0] && !_proxy_is_read_function(q->req[1]))
+                written = TRUE;
+            else if (q->req_length == 6 && memcmp(q->req, r->req, 6) == 0)
+                match = q;
+        }
+        for (flow = device->flows; flow != NULL && !written; flow = flow->next) {
+            for (q = flow->head; q != NULL; q = q->next) {
+                if (q->req[0] == r->req[0] && !_proxy_is_read_function(q->req[1])) {
+                    written = TRUE;
+                    break;
+                } else if (q->req_length == 6 && memcmp(q->req, r->req, 6) == 0) {
+                    match = q;
+                }
+            }
+        }
+        if (match != NULL && !written) {
+            r->followers = match->followers;
+            match->followers = r;
+            proxy->nb_pending++;
+            return 0;
+        }
+    }
+
+    if (device->nb_queued >= proxy->queue_length) {
+        free(r);
+        return modbus_reply_exception(ctx, req, MODBUS_EXCEPTION_SLAVE_OR_SERVER_BUSY);
+    }
+
+    for (flow = device->flows; flow != NULL; flow = flow->next) {
+        if (flow->connection == connection)
+            break;
+    }
+    if (flow == NULL) {
+        flow = (proxy_flow_t *)malloc(sizeof(proxy_flow_t));
+        if (flow == NULL) {
+            free(r);
+            return modbus_reply_exception(ctx, req, MODBUS_EXCEPTION_SLAVE_OR_SERVER_FAILURE);
+        }
+        flow->connection = connection;
+        flow->head = NULL;
+        flow->next = NULL;
+        if (device->flows_tail != NULL) {
+            device->flows_tail->next = flow;
+        } else {
+            device->flows = flow;
+        }
+        device->flows_tail = flow;
+    }
+
+    if (flow->head != NULL) {
+        flow->tail->next = r;
+    } else {
+        flow->head = r;
+    }
+    flow->tail = r;
+    device->nb_queued++;
+    proxy->nb_pending++;
+
+    return 0;
+}
+
+/* Same as modbus_unix_listen(), the local clients may use modbus_new_unix() */
+int modbus_proxy_listen(const char *path, int nb_connection)
+{
+    return _modbus_unix_listen(path, nb_connection);
+}
+
+modbus_proxy_t* modbus_proxy_new(modbus_t *ctx, int server_socket, int engine)
+{
+    modbus_proxy_t *proxy;
+    int i;
+
+#if defined(_WIN32)
+    errno = ENOTSUP;
+    return NULL;
+#else
+    proxy = (modbus_proxy_t *)calloc(1, sizeof(modbus_proxy_t));
+    if (proxy == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    proxy->server = modbus_server_new(ctx, server_socket, engine);
+    if (proxy->server == NULL) {
+        free(proxy);
+        return NULL;
+    }
+    modbus_server_set_handler(proxy->server, _proxy_handler, proxy);
+
+    for (i = 0; i < 256; i++) {
+        proxy->routes[i].device = -1;
+    }
+    proxy->window = MODBUS_PROXY_DEFAULT_WINDOW;
+    proxy->queue_length = MODBUS_PROXY_DEFAULT_QUEUE_LENGTH;
+    proxy->dedup = TRUE;
+
+    return proxy;
+#endif
+}
+
+modbus_server_t* modbus_proxy_get_server(modbus_proxy_t *proxy)
+{
+    if (proxy == NULL) {
+        errno = EINVAL;
+        return NULL;
+    }
+    return proxy->server;
+}
+
+int modbus_proxy_add_device(modbus_proxy_t *proxy, modbus_t *ctx)
+{
+    proxy_device_t *device;
+
+    if (proxy == NULL || ctx == NULL ||
+        ctx->backend->backend_type != _MODBUS_BACKEND_TYPE_TCP) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (proxy->nb_devices == MODBUS_PROXY_MAX_DEVICES) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    device = (proxy_device_t *)calloc(1, sizeof(proxy_device_t));
+    if (device == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    device->ctx = ctx;
+    device->proxy = proxy;
+    device->state = _PROXY_DEVICE_DOWN;
+    proxy->devices[proxy->nb_devices] = device;
+
+    return proxy->nb_devices++;
+}
+
+int modbus_proxy_map_unit(modbus_proxy_t *proxy, int unit, int device, int device_unit)
+{
+    if (proxy == NULL || unit < 0 || unit > 255 ||
+        device < -1 || device >= proxy->nb_devices ||
+        device_unit < 0 || device_unit > 255) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    proxy->routes[unit].device = device;
+    proxy->routes[unit].unit = device_unit;
+    return 0;
+}
+
+int modbus_proxy_set_window(modbus_proxy_t *proxy, int window)
+{
+    if (proxy == NULL || window < 1 || window > MODBUS_PROXY_MAX_WINDOW) {
+        errno = EINVAL;
+        return -1;
+    }
+    proxy->window = window;
+    return 0;
+}
+
+int modbus_proxy_set_queue_length(modbus_proxy_t *proxy, int length)
+{
+    if (proxy == NULL || length < 1) {
+        errno = EINVAL;
+        return -1;
+    }
+    proxy->queue_length = length;
+    return 0;
+}
+
+int modbus_proxy_set_dedup(modbus_proxy_t *proxy, int enable)
+{
+    if (proxy == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    proxy->dedup = enable ? TRUE : FALSE;
+    return 0;
+}
+
+int modbus_proxy_get_pending(modbus_proxy_t *proxy)
+{
+    if (proxy == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    return proxy->nb_pending;
+}
+
+int modbus_proxy_run(modbus_proxy_t *proxy, int timeout_ms)
+{
+    int64_t next;
+    int rc;
+
+    if (proxy == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* Wakes up for the next response timeout or connection check */
+    next = _proxy_schedule(proxy);
+    if (next != -1) {
+        int64_t wait = next - _modbus_monotonic_us();
+        int wait_ms = (wait <= 0) ? 0 : (int)((wait + 999) / 1000);
+
+        if (timeout_ms < 0 || wait_ms < timeout_ms)
+            timeout_ms = wait_ms;
+    }
+
+    rc = modbus_server_run(proxy->server, timeout_ms);
+    if (rc == -1)
+        return -1;
+
+    /* Requests received for a connected device are sent right away */
+    _proxy_schedule(proxy);
+
+    return rc;
+}
+
+void modbus_proxy_free(modbus_proxy_t *proxy)
+{
+    int i;
+
+    if (proxy == NULL)
+        return;
+
+    for (i = 0; i < proxy->nb_devices; i++) {
+        proxy_device_t *device = proxy->devices[i];
+
+        if (device->state != _PROXY_DEVICE_DOWN)
+            _proxy_device_down(device, 0);
+        _proxy_fail_queued(device);
+        free(device);
+    }
+    modbus_server_free(proxy->server);
+    free(proxy);
+}
@@ -0,0 +1,69 @@
+/*
+ * Copyright © 2001-2013 Stéphane Raimbault <stephane.raimbault@gmail.com>
+ *
+ * SPDX-License-Identifier: LGPL-2.1+
+ */
+
+#ifndef MODBUS_PROXY_H
+#define MODBUS_PROXY_H
+
+#include "modbus.h"
+
+MODBUS_BEGIN_DECLS
+
+/*
+ 本地连接共享代理。
+ 本机的多个应用（HMI、历史库、报警等）通过Unix域套接字（modbus_new_unix()）连接代理，
+ 代理对每台设备只保持一个长连接，把所有本地连接的请求按单元号转发过去：
+ - 每台设备同时在途的请求数可设置（流水线，按事务号匹配应答）
+ - 各本地连接的请求轮流发送，一个连接的大量请求不会让其他连接等待
+ - 相同的并发读请求（同一单元、功能码、地址和数量）只发送一次，共用应答；
+   该单元有未完成的写请求时不合并
+ - 设备断开后在下一个请求时重新连接（连接失败后逐步延长重试间隔），不影响本地连接
+ 超时或设备不可用时回复网关目标无响应异常，未映射的单元号回复网关路径不可用异常。
+ 所有函数需在同一线程中调用，Windows下不支持（返回ENOTSUP）。
+ */
+
+#define MODBUS_PROXY_MAX_DEVICES            16
+#define MODBUS_PROXY_DEFAULT_WINDOW         8
+#define MODBUS_PROXY_MAX_WINDOW             64
+/* Requests waiting for one device, the next ones get a busy exception */
+#define MODBUS_PROXY_DEFAULT_QUEUE_LENGTH   256
+
+typedef struct _modbus_proxy modbus_proxy_t;
+
+/* 创建监听的Unix域套接字（同modbus_unix_listen()，'@'开头为抽象命名空间），返回套接字 */
+MODBUS_API int modbus_proxy_listen(const char *path, int nb_connection);
+
+/*
+ ctx: modbus_new_tcp()创建的实例，本地连接的服务端配置（调试等）
+ server_socket: modbus_proxy_listen()返回的监听套接字
+ engine: MODBUS_SERVER_ENGINE_xxx
+ */
+MODBUS_API modbus_proxy_t* modbus_proxy_new(modbus_t *ctx, int server_socket, int engine);
+MODBUS_API modbus_server_t* modbus_proxy_get_server(modbus_proxy_t *proxy);
+
+/*
+ 添加一台设备，ctx为modbus_new_tcp()/modbus_new_tcp_pi()创建、未连接的实例，
+ 其应答超时用作转发的超时。返回设备编号（从0开始）
+ */
+MODBUS_API int modbus_proxy_add_device(modbus_proxy_t *proxy, modbus_t *ctx);
+/* 单元号unit的请求转发到设备device的单元device_unit，device为-1时删除映射 */
+MODBUS_API int modbus_proxy_map_unit(modbus_proxy_t *proxy, int unit, int device,
+                                     int device_unit);
+/* 每台设备同时在途的请求数，1~MODBUS_PROXY_MAX_WINDOW */
+MODBUS_API int modbus_proxy_set_window(modbus_proxy_t *proxy, int window);
+MODBUS_API int modbus_proxy_set_queue_length(modbus_proxy_t *proxy, int length);
+/* 相同并发读请求合并，默认开启 */
+MODBUS_API int modbus_proxy_set_dedup(modbus_proxy_t *proxy, int enable);
+/* 所有设备上排队及在途的请求数（合并的请求也计入） */
+MODBUS_API int modbus_proxy_get_pending(modbus_proxy_t *proxy);
+
+/* 处理一轮本地连接及设备事件，返回收到的请求数，timeout_ms < 0 表示一直等待 */
+MODBUS_API int modbus_proxy_run(modbus_proxy_t *proxy, int timeout_ms);
+/* 关闭设备连接，设备的实例仍归调用者 */
+MODBUS_API void modbus_proxy_free(modbus_proxy_t *proxy);
+
+MODBUS_END_DECLS
+
+#endif /* MODBUS_PROXY_H */
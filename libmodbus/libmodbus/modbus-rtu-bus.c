@@ -0,0 +1,421 @@
+/*
+ * Copyright © 2001-2013 Stéphane Raimbault <stephane.raimbault@gmail.com>
+ *
+ * SPDX-License-Identifier: LGPL-2.1+
+ */
+
+/*
+ RS-485总线主站调度：每个从站一个FIFO请求队列，每次取优先级最高的从站
+ （相同优先级轮询），上一帧结束后只等待t3.5即发送下一帧。
+ 连续超时的从站暂时跳过，不再拖慢整条总线。
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#ifndef _MSC_VER
+#include <unistd.h>
+#endif
+
+#include "modbus-private.h"
+
+#include "modbus-rtu.h"
+#include "modbus-rtu-private.h"
+#include "modbus-rtu-bus.h"
+
+#if defined(_WIN32) && !defined(ECANCELED)
+#define ECANCELED WSAECANCELLED
+#endif
+
+#define _BUS_NB_SLAVES 248
+
+typedef struct _bus_request {
+    int slave;
+    /* Slave and PDU, the CRC is added when sent */
+    uint8_t req[MODBUS_RTU_MAX_ADU_LENGTH];
+    int req_length;
+    modbus_rtu_bus_callback_t callback;
+    void *user_data;
+    struct _bus_request *next;
+} bus_request_t;
+
+typedef struct _bus_slave {
+    int priority;
+    int has_timeout;
+    struct timeval timeout;
+    /* Consecutive timeouts */
+    int timeouts;
+    /* Skipped until this time when offline */
+    int64_t retry_at;
+    bus_request_t *head;
+    bus_request_t *tail;
+} bus_slave_t;
+
+struct _modbus_rtu_bus {
+    modbus_t *ctx;
+    /* Index 0 is the broadcast queue */
+    bus_slave_t slaves[_BUS_NB_SLAVES];
+    /* Round robin start between slaves of the same priority */
+    int next;
+    int nb_pending;
+    int turnaround_delay;
+    /* Time in nanoseconds of one character and t3.5 in micro seconds */
+    int64_t char_time_ns;
+    int t35;
+    /* End of the last frame plus the inter-frame gap */
+    int64_t line_free_at;
+    int64_t stats_start;
+    modbus_rtu_bus_stats_t stats;
+};
+
+static void _bus_sleep_until(int64_t t)
+{
+    int64_t remaining = t - _modbus_monotonic_us();
+
+    if (remaining <= 0)
+        return;
+#ifdef _WIN32
+    Sleep((DWORD)((remaining + 999) / 1000));
+#else
+    {
+        struct timespec request;
+
+        request.tv_sec = (time_t)(remaining / 1000000);
+        request.tv_nsec = (long)(remaining % 1000000) * 1000;
+        while (nanosleep(&request, &request) == -1 && errno == EINTR)
+            ;
+    }
+#endif
+}
+
+static int _bus_is_write_function(int function)
+{
+    return function == MODBUS_FC_WRITE_SINGLE_COIL ||
+           function == MODBUS_FC_WRITE_SINGLE_REGISTER ||
+           function == MODBUS_FC_WRITE_MULTIPLE_COILS ||
+           function == MODBUS_FC_WRITE_MULTIPLE_REGISTERS;
+}
+
+modbus_rtu_bus_t* modbus_rtu_bus_new(modbus_t *ctx)
+{
+    modbus_rtu_bus_t *bus;
+    modbus_rtu_t *ctx_rtu;
+
+    /* The frame timing needs the serial settings, see modbus_new_rtu_tcp() */
+    if (ctx == NULL || ctx->backend->backend_type != _MODBUS_BACKEND_TYPE_RTU ||
+        ((modbus_rtu_t *)ctx->backend_data)->baud == 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    bus = (modbus_rtu_bus_t *)calloc(1, sizeof(modbus_rtu_bus_t));
+    if (bus == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    ctx_rtu = ctx->backend_data;
+    bus->ctx = ctx;
+    bus->turnaround_delay = MODBUS_RTU_BUS_TURNAROUND_DELAY;
+    bus->char_time_ns = 1000000000LL *
+        (1 + ctx_rtu->data_bit + (ctx_rtu->parity == 'N' ? 0 : 1) + ctx_rtu->stop_bit) /
+        ctx_rtu->baud;
+    bus->t35 = ctx_rtu->t35;
+    bus->stats_start = _modbus_monotonic_us();
+
+    return bus;
+}
+
+void modbus_rtu_bus_free(modbus_rtu_bus_t *bus)
+{
+    int i;
+
+    if (bus == NULL)
+        return;
+
+    /* The pending requests are cancelled */
+    for (i = 0; i < _BUS_NB_SLAVES; i++) {
+        bus_request_t *r = bus->slaves[i].head;
+
+        while (r != NULL) {
+            bus_request_t *next = r->next;
+
+            if (r->callback != NULL) {
+                r->callback(bus, r->slave, NULL, 0, ECANCELED, r->user_data);
+            }
+            free(r);
+            r = next;
+        }
+    }
+    free(bus);
+}
+
+int modbus_rtu_bus_set_slave_timeout(modbus_rtu_bus_t *bus, int slave,
+                                     uint32_t to_sec, uint32_t to_usec)
+{
+    if (bus == NULL || slave < 1 || slave >= _BUS_NB_SLAVES || to_usec > 999999) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* Zero gets back to the response timeout of the context */
+    bus->slaves[slave].has_timeout = (to_sec != 0 || to_usec != 0);
+    bus->slaves[slave].timeout.tv_sec = to_sec;
+    bus->slaves[slave].timeout.tv_usec = to_usec;
+    return 0;
+}
+
+int modbus_rtu_bus_set_slave_priority(modbus_rtu_bus_t *bus, int slave, int priority)
+{
+    if (bus == NULL || slave < 0 || slave >= _BUS_NB_SLAVES) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    bus->slaves[slave].priority = priority;
+    return 0;
+}
+
+int modbus_rtu_bus_set_turnaround_delay(modbus_rtu_bus_t *bus, int us)
+{
+    if (bus == NULL || us < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    bus->turnaround_delay = us;
+    return 0;
+}
+
+int modbus_rtu_bus_submit(modbus_rtu_bus_t *bus, int slave,
+                          const uint8_t *pdu, int pdu_length,
+                          modbus_rtu_bus_callback_t callback, void *user_data)
+{
+    bus_request_t *r;
+    bus_slave_t *s;
+
+    if (bus == NULL || pdu == NULL || slave < 0 || slave >= _BUS_NB_SLAVES ||
+        pdu_length < 1 || pdu_length > MODBUS_MAX_PDU_LENGTH) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* No response to a broadcast, only the writes make sense */
+    if (slave == MODBUS_BROADCAST_ADDRESS && !_bus_is_write_function(pdu[0])) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    r = (bus_request_t *)malloc(sizeof(bus_request_t));
+    if (r == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    r->slave = slave;
+    r->req[0] = slave;
+    memcpy(r->req + 1, pdu, pdu_length);
+    r->req_length = pdu_length + 1;
+    r->callback = callback;
+    r->user_data = user_data;
+    r->next = NULL;
+
+    s = &bus->slaves[slave];
+    if (s->tail != NULL) {
+        s->tail->next = r;
+    } else {
+        s->head = r;
+    }
+    s->tail = r;
+    bus->nb_pending++;
+
+    return 0;
+}
+
+int modbus_rtu_bus_pending(modbus_rtu_bus_t *bus)
+{
+    if (bus == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    return bus->nb_pending;
+}
+
+/* Highest priority slave with a request, round robin on equal priorities */
+static int _bus_pick(modbus_rtu_bus_t *bus, int64_t now)
+{
+    int best = -1;
+    int i;
+
+    for (i = 0; i < _BUS_NB_SLAVES; i++) {
+        int n = (bus->next + i) % _BUS_NB_SLAVES;
+        bus_slave_t *s = &bus->slaves[n];
+
+        if (s->head == NULL || s->retry_at > now)
+            continue;
+        if (best == -1 || s->priority > bus->slaves[best].priority)
+            best = n;
+    }
+
+    if (best != -1) {
+        bus->next = (best + 1) % _BUS_NB_SLAVES;
+    }
+    return best;
+}
+
+int modbus_rtu_bus_run_once(modbus_rtu_bus_t *bus)
+{
+    modbus_t *ctx;
+    bus_slave_t *s;
+    bus_request_t *r;
+    uint8_t rsp[MODBUS_RTU_MAX_ADU_LENGTH];
+    struct timeval saved_timeout;
+    int64_t start;
+    int64_t end;
+    int n;
+    int rc;
+    int rsp_length = 0;
+    int error = 0;
+
+    if (bus == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    n = _bus_pick(bus, _modbus_monotonic_us());
+    if (n == -1)
+        return 0;
+
+    s = &bus->slaves[n];
+    r = s->head;
+    s->head = r->next;
+    if (s->head == NULL)
+        s->tail = NULL;
+    bus->nb_pending--;
+
+    ctx = bus->ctx;
+    saved_timeout = ctx->response_timeout;
+    if (s->has_timeout) {
+        ctx->response_timeout = s->timeout;
+    }
+    /* The slave filter of the RTU backend */
+    modbus_set_slave(ctx, r->slave);
+
+    /* Minimum inter-frame gap after the previous frame */
+    _bus_sleep_until(bus->line_free_at);
+    start = _modbus_monotonic_us();
+
+    rc = modbus_send_raw_request(ctx, r->req, r->req_length);
+    if (rc == -1) {
+        /* The serial port itself is failing, stops the scheduling */
+        error = errno;
+        ctx->response_timeout = saved_timeout;
+        if (r->callback != NULL) {
+            r->callback(bus, r->slave, NULL, 0, error, r->user_data);
+        }
+        free(r);
+        errno = error;
+        return -1;
+    }
+    bus->stats.bytes += rc;
+
+    if (r->slave == MODBUS_BROADCAST_ADDRESS) {
+        /* The slaves process the request silently, the line is free
+           again once they are done */
+        end = _modbus_monotonic_us();
+        bus->line_free_at = end + bus->turnaround_delay;
+        bus->stats.broadcasts++;
+    } else {
+        rsp_length = _modbus_receive_confirmation(ctx, r->req, rsp);
+        end = _modbus_monotonic_us();
+
+        if (rsp_length == -1) {
+            error = errno;
+            rsp_length = 0;
+        } else if (rsp_length == 0) {
+            /* Response of another slave */
+            error = EMBBADSLAVE;
+        } else {
+            bus->stats.bytes += rsp_length;
+            rsp_length -= _MODBUS_RTU_CHECKSUM_LENGTH;
+            if (rsp[1] == (r->req[1] | 0x80)) {
+                error = MODBUS_ENOBASE + rsp[2];
+            } else if (rsp[1] != r->req[1]) {
+                error = EMBBADDATA;
+            }
+        }
+
+        if (error == ETIMEDOUT) {
+            bus->stats.timeouts++;
+            if (++s->timeouts >= MODBUS_RTU_BUS_OFFLINE_TIMEOUTS) {
+                s->retry_at = end + MODBUS_RTU_BUS_OFFLINE_PERIOD;
+                if (ctx->debug) {
+                    fprintf(stderr, "Slave %d offline\n", r->slave);
+                }
+            }
+        } else {
+            s->timeouts = 0;
+            s->retry_at = 0;
+            if (error != 0) {
+                bus->stats.errors++;
+            }
+        }
+
+        if (error != 0 && (error < MODBUS_ENOBASE + MODBUS_EXCEPTION_ILLEGAL_FUNCTION ||
+                           error > EMBXGTAR)) {
+            /* Garbage or a late response may still be on the line */
+            _bus_sleep_until(_modbus_monotonic_us() + bus->t35);
+            modbus_flush(ctx);
+            end = _modbus_monotonic_us();
+        }
+        bus->line_free_at = end + bus->t35;
+    }
+
+    ctx->response_timeout = saved_timeout;
+    bus->stats.transactions++;
+    bus->stats.busy_us += end - start;
+    bus->stats.frame_us = bus->stats.bytes * bus->char_time_ns / 1000;
+
+    if (r->callback != NULL) {
+        r->callback(bus, r->slave, rsp_length > 0 ? rsp : NULL, rsp_length,
+                    error, r->user_data);
+    }
+    free(r);
+
+    return 1;
+}
+
+int modbus_rtu_bus_run(modbus_rtu_bus_t *bus)
+{
+    int nb = 0;
+    int rc;
+
+    while ((rc = modbus_rtu_bus_run_once(bus)) == 1) {
+        nb++;
+    }
+
+    return (rc == -1) ? -1 : nb;
+}
+
+int modbus_rtu_bus_get_stats(modbus_rtu_bus_t *bus, modbus_rtu_bus_stats_t *stats,
+                             int reset)
+{
+    int64_t now;
+
+    if (bus == NULL || stats == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    now = _modbus_monotonic_us();
+    *stats = bus->stats;
+    stats->elapsed_us = now - bus->stats_start;
+
+    if (reset) {
+        memset(&bus->stats, 0, sizeof(modbus_rtu_bus_stats_t));
+        bus->stats_start = now;
+    }
+    return 0;
+}
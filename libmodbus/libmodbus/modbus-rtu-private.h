@@ -67,10 +67,18 @@ typedef struct _modbus_rtu {
     int rts;
     int rts_delay;
     int onebyte_time;
+    /* Exact time to send one character, in nanoseconds */
+    long onebyte_time_ns;
+    /* The driver toggles RTS itself (kernel RS485 mode) */
+    int rts_kernel;
     void (*set_rts) (modbus_t *ctx, int on);
 #endif
     /* To handle many slaves on the same link */
     int confirmation_to_ignore;
+    /* MODBUS_RTU_FRAME_LENGTH or MODBUS_RTU_FRAME_SILENCE */
+    int frame_mode;
+    /* t3.5, end of frame silence in micro seconds */
+    int t35;
 } modbus_rtu_t;
 
 #endif /* MODBUS_RTU_PRIVATE_H */
@@ -0,0 +1,152 @@
+/*
+ * Copyright © 2001-2013 Stéphane Raimbault <stephane.raimbault@gmail.com>
+ *
+ * SPDX-License-Identifier: LGPL-2.1+
+ */
+
+/*
+ RTU over TCP：后端复制RTU后端的函数表（CRC、从站地址过滤、按长度划分帧），
+ 收发及连接管理使用TCP后端的函数。不按t3.5静默划分帧（receive_frame为NULL），
+ 一帧的长度由通用的接收流程按功能码计算。
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "modbus-private.h"
+
+#include "modbus-tcp.h"
+#include "modbus-tcp-private.h"
+#include "modbus-rtu.h"
+#include "modbus-rtu-private.h"
+#include "modbus-rtu-tcp.h"
+
+typedef struct _modbus_rtu_tcp {
+    /* First member, the RTU functions cast the backend data */
+    modbus_rtu_t rtu;
+    modbus_backend_t backend;
+    /* Empty for any address (server) */
+    char node[_MODBUS_TCP_PI_NODE_LENGTH];
+    char service[_MODBUS_TCP_PI_SERVICE_LENGTH];
+} modbus_rtu_tcp_t;
+
+/* The RTU backend type reads 0 byte as an empty serial port, the end of the
+   stream is reported as an error */
+static ssize_t _rtu_tcp_recv(modbus_t *ctx, uint8_t *rsp, int rsp_length)
+{
+    ssize_t rc = _modbus_tcp_backend.recv(ctx, rsp, rsp_length);
+
+    if (rc == 0 && rsp_length > 0) {
+        errno = ECONNRESET;
+        return -1;
+    }
+
+    return rc;
+}
+
+static int _rtu_tcp_connect(modbus_t *ctx)
+{
+    modbus_rtu_tcp_t *rtu_tcp = ctx->backend_data;
+
+    /* Any frame received before belongs to the previous connection */
+    rtu_tcp->rtu.confirmation_to_ignore = FALSE;
+
+    return _modbus_tcp_pi_open(ctx, (rtu_tcp->node[0] == 0) ? NULL : rtu_tcp->node,
+                               rtu_tcp->service);
+}
+
+static void _rtu_tcp_free(modbus_t *ctx)
+{
+    free(ctx->backend_data);
+    free(ctx);
+}
+
+modbus_t* modbus_new_rtu_tcp(const char *node, const char *service)
+{
+    modbus_t *ctx;
+    modbus_rtu_tcp_t *rtu_tcp;
+    size_t ret_size;
+
+    if (service == NULL || service[0] == 0) {
+        fprintf(stderr, "The service string is empty\n");
+        errno = EINVAL;
+        return NULL;
+    }
+
+    ctx = (modbus_t *)malloc(sizeof(modbus_t));
+    if (ctx == NULL) {
+        return NULL;
+    }
+    _modbus_init_common(ctx);
+
+    rtu_tcp = (modbus_rtu_tcp_t *)calloc(1, sizeof(modbus_rtu_tcp_t));
+    if (rtu_tcp == NULL) {
+        free(ctx);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    /* Same framing as RTU, the transport is replaced. The send of the RTU
+       backend (RTS, drain of the serial port) isn't used. */
+    rtu_tcp->backend = _modbus_rtu_backend;
+    rtu_tcp->backend.send = _modbus_tcp_backend.send;
+    rtu_tcp->backend.recv = _rtu_tcp_recv;
+    rtu_tcp->backend.connect = _rtu_tcp_connect;
+    rtu_tcp->backend.close = _modbus_tcp_backend.close;
+    rtu_tcp->backend.flush = _modbus_tcp_backend.flush;
+    rtu_tcp->backend.select = _modbus_tcp_backend.select;
+    rtu_tcp->backend.free = _rtu_tcp_free;
+    rtu_tcp->backend.receive_frame = NULL;
+    ctx->backend = &rtu_tcp->backend;
+    ctx->backend_data = rtu_tcp;
+
+    /* No serial settings, baud 0 marks an encapsulated line */
+    rtu_tcp->rtu.frame_mode = MODBUS_RTU_FRAME_LENGTH;
+    rtu_tcp->rtu.confirmation_to_ignore = FALSE;
+
+    if (node != NULL) {
+        ret_size = strlcpy(rtu_tcp->node, node, sizeof(rtu_tcp->node));
+        if (ret_size == 0 || ret_size >= sizeof(rtu_tcp->node)) {
+            fprintf(stderr, "Invalid node string\n");
+            modbus_free(ctx);
+            errno = EINVAL;
+            return NULL;
+        }
+    }
+
+    ret_size = strlcpy(rtu_tcp->service, service, sizeof(rtu_tcp->service));
+    if (ret_size >= sizeof(rtu_tcp->service)) {
+        fprintf(stderr, "The service string has been truncated\n");
+        modbus_free(ctx);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    return ctx;
+}
+
+int modbus_rtu_tcp_listen(modbus_t *ctx, int nb_connection)
+{
+    modbus_rtu_tcp_t *rtu_tcp;
+
+    if (ctx == NULL || ctx->backend->connect != _rtu_tcp_connect) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    rtu_tcp = ctx->backend_data;
+    return _modbus_tcp_pi_listen(ctx, rtu_tcp->node, rtu_tcp->service, nb_connection);
+}
+
+int modbus_rtu_tcp_accept(modbus_t *ctx, int *s)
+{
+    if (ctx == NULL || ctx->backend->connect != _rtu_tcp_connect) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    ((modbus_rtu_tcp_t *)ctx->backend_data)->rtu.confirmation_to_ignore = FALSE;
+    return modbus_tcp_pi_accept(ctx, s);
+}
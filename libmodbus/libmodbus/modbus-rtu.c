@@ -9,6 +9,7 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <string.h>
+#include <time.h>
 #ifndef _MSC_VER
 #include <unistd.h>
 #endif
@@ -269,6 +270,113 @@ static void _modbus_rtu_ioctl_rts(modbus_t *ctx, int on)
     }
     ioctl(fd, TIOCMSET, &flags);
 }
+
+static void _modbus_rtu_deadline(struct timespec *deadline, long ns)
+{
+    clock_gettime(CLOCK_MONOTONIC, deadline);
+    deadline->tv_sec += ns / 1000000000;
+    deadline->tv_nsec += ns % 1000000000;
+    if (deadline->tv_nsec >= 1000000000) {
+        deadline->tv_sec++;
+        deadline->tv_nsec -= 1000000000;
+    }
+}
+
+/* Sleeps until an absolute time, unlike usleep() the delay doesn't add up
+   with the time spent in the calls before */
+static void _modbus_rtu_sleep_until(const struct timespec *deadline)
+{
+#if defined(__linux__)
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, deadline, NULL) == EINTR)
+        ;
+#else
+    struct timespec now, request;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    request.tv_sec = deadline->tv_sec - now.tv_sec;
+    request.tv_nsec = deadline->tv_nsec - now.tv_nsec;
+    if (request.tv_nsec < 0) {
+        request.tv_sec--;
+        request.tv_nsec += 1000000000;
+    }
+    if (request.tv_sec >= 0) {
+        while (nanosleep(&request, &request) == -1 && errno == EINTR)
+            ;
+    }
+#endif
+}
+
+/* Waits for the last bit of the frame to leave the transmitter */
+static void _modbus_rtu_wait_sent(modbus_t *ctx, int length, const struct timespec *start)
+{
+    modbus_rtu_t *ctx_rtu = ctx->backend_data;
+    struct timespec deadline;
+
+    if (tcdrain(ctx->s) == 0) {
+#if defined(TIOCSERGETLSR) && defined(TIOCSER_TEMT)
+        /* Some drivers return from tcdrain() with the FIFO still being
+           shifted out, the line status register tells when it's empty */
+        unsigned int lsr;
+        int i;
+
+        for (i = 0; i < 64; i++) {
+            if (ioctl(ctx->s, TIOCSERGETLSR, &lsr) < 0 || (lsr & TIOCSER_TEMT))
+                break;
+            _modbus_rtu_deadline(&deadline, ctx_rtu->onebyte_time_ns);
+            _modbus_rtu_sleep_until(&deadline);
+        }
+#endif
+        return;
+    }
+
+    /* No drain on this device, wait until the computed end of the frame */
+    deadline = *start;
+    deadline.tv_sec += (ctx_rtu->onebyte_time_ns * length) / 1000000000;
+    deadline.tv_nsec += (ctx_rtu->onebyte_time_ns * length) % 1000000000;
+    if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+    _modbus_rtu_sleep_until(&deadline);
+}
+#endif
+
+#if HAVE_DECL_TIOCSRS485 && HAVE_DECL_TIOCM_RTS
+/* In RS485 mode, the direction is handed over to the driver which toggles
+   RTS right when the transmitter is empty. Not possible with a custom
+   set_rts function (eg. a GPIO). */
+static void _modbus_rtu_kernel_rts(modbus_t *ctx)
+{
+    modbus_rtu_t *ctx_rtu = ctx->backend_data;
+    struct serial_rs485 rs485conf;
+
+    ctx_rtu->rts_kernel = FALSE;
+    if (ctx_rtu->serial_mode != MODBUS_RTU_RS485 ||
+        ctx_rtu->rts == MODBUS_RTU_RTS_NONE ||
+        ctx_rtu->set_rts != _modbus_rtu_ioctl_rts ||
+        ioctl(ctx->s, TIOCGRS485, &rs485conf) < 0) {
+        return;
+    }
+
+    if (ctx_rtu->rts == MODBUS_RTU_RTS_UP) {
+        rs485conf.flags |= SER_RS485_RTS_ON_SEND;
+        rs485conf.flags &= ~SER_RS485_RTS_AFTER_SEND;
+    } else {
+        rs485conf.flags &= ~SER_RS485_RTS_ON_SEND;
+        rs485conf.flags |= SER_RS485_RTS_AFTER_SEND;
+    }
+    /* The driver delays are in milliseconds */
+    rs485conf.delay_rts_before_send = (ctx_rtu->rts_delay + 999) / 1000;
+    rs485conf.delay_rts_after_send = (ctx_rtu->rts_delay + 999) / 1000;
+    if (ioctl(ctx->s, TIOCSRS485, &rs485conf) < 0) {
+        return;
+    }
+
+    ctx_rtu->rts_kernel = TRUE;
+    if (ctx->debug) {
+        fprintf(stderr, "RTS driven by the kernel RS485 mode\n");
+    }
+}
 #endif
 
 static ssize_t _modbus_rtu_send(modbus_t *ctx, const uint8_t *req, int req_length)
@@ -280,19 +388,27 @@ static ssize_t _modbus_rtu_send(modbus_t *ctx, const uint8_t *req, int req_lengt
 #else
 #if HAVE_DECL_TIOCM_RTS
     modbus_rtu_t *ctx_rtu = ctx->backend_data;
-    if (ctx_rtu->rts != MODBUS_RTU_RTS_NONE) {
+    if (ctx_rtu->rts != MODBUS_RTU_RTS_NONE && !ctx_rtu->rts_kernel) {
         ssize_t size;
+        struct timespec deadline;
 
         if (ctx->debug) {
             fprintf(stderr, "Sending request using RTS signal\n");
         }
 
         ctx_rtu->set_rts(ctx, ctx_rtu->rts == MODBUS_RTU_RTS_UP);
-        usleep(ctx_rtu->rts_delay);
+        _modbus_rtu_deadline(&deadline, (long)ctx_rtu->rts_delay * 1000);
+        _modbus_rtu_sleep_until(&deadline);
 
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
         size = write(ctx->s, req, req_length);
 
-        usleep(ctx_rtu->onebyte_time * req_length + ctx_rtu->rts_delay);
+        /* Real end of the transmission instead of an estimated sleep */
+        if (size > 0) {
+            _modbus_rtu_wait_sent(ctx, size, &deadline);
+        }
+        _modbus_rtu_deadline(&deadline, (long)ctx_rtu->rts_delay * 1000);
+        _modbus_rtu_sleep_until(&deadline);
         ctx_rtu->set_rts(ctx, ctx_rtu->rts != MODBUS_RTU_RTS_UP);
 
         return size;
@@ -337,7 +453,116 @@ static ssize_t _modbus_rtu_recv(modbus_t *ctx, uint8_t *rsp, int rsp_length)
 #endif
 }
 
-static int _modbus_rtu_flush(modbus_t *);
+static int _modbus_rtu_check_integrity(modbus_t *ctx, uint8_t *msg,
+                                       const int msg_length);
+
+#if !defined(_WIN32)
+/* Receives a whole frame delimited by a t3.5 silence, the function code
+   isn't parsed so frames for other slaves or with an unknown function are
+   skipped at once. A silence over t1.5 inside a frame isn't reported,
+   wake-up latencies make it unreliable to measure from user space, the CRC
+   check catches such broken frames anyway. */
+static int _modbus_rtu_receive_frame(modbus_t *ctx, uint8_t *msg, msg_type_t msg_type)
+{
+    modbus_rtu_t *ctx_rtu = ctx->backend_data;
+    uint8_t discard[MODBUS_RTU_MAX_ADU_LENGTH];
+    struct timeval tv;
+    struct timeval *p_tv;
+    const struct timeval *timeout;
+    int64_t deadline = -1;
+    int msg_length = 0;
+    int overflow = FALSE;
+    int rc;
+
+    if (ctx_rtu->frame_mode != MODBUS_RTU_FRAME_SILENCE) {
+        return _MODBUS_FRAME_BY_LENGTH;
+    }
+
+    if (ctx->debug) {
+        if (msg_type == MSG_INDICATION) {
+            printf("Waiting for an indication...\n");
+        } else {
+            printf("Waiting for a confirmation...\n");
+        }
+    }
+
+    timeout = (msg_type == MSG_INDICATION) ? &ctx->indication_timeout : &ctx->response_timeout;
+    if (timeout->tv_sec != 0 || timeout->tv_usec != 0) {
+        deadline = _modbus_monotonic_us() +
+            (int64_t)timeout->tv_sec * 1000000 + timeout->tv_usec;
+    }
+
+    /* Start of the frame */
+    do {
+        if (deadline >= 0) {
+            _modbus_remaining_time(deadline, &tv);
+            p_tv = &tv;
+        } else {
+            p_tv = NULL;
+        }
+        rc = _modbus_wait_fd(ctx->s, 0, p_tv);
+    } while (rc == -1 && errno == EINTR);
+    if (rc == 0) {
+        errno = ETIMEDOUT;
+        rc = -1;
+    }
+    if (rc == -1) {
+        _error_print(ctx, "select");
+        return -1;
+    }
+
+    /* Everything until t3.5 of silence belongs to the frame */
+    while (1) {
+        if (msg_length < MODBUS_RTU_MAX_ADU_LENGTH) {
+            rc = _modbus_rtu_recv(ctx, msg + msg_length,
+                                  MODBUS_RTU_MAX_ADU_LENGTH - msg_length);
+        } else {
+            rc = _modbus_rtu_recv(ctx, discard, sizeof(discard));
+            overflow = TRUE;
+        }
+        if (rc == -1 && errno != EINTR && errno != EAGAIN) {
+            _error_print(ctx, "read");
+            return -1;
+        }
+
+        if (rc > 0) {
+            if (ctx->debug) {
+                int i;
+                for (i = 0; i < rc; i++)
+                    printf("<%.2X>", overflow ? discard[i] : msg[msg_length + i]);
+            }
+            if (!overflow) {
+                msg_length += rc;
+            }
+        }
+
+        do {
+            tv.tv_sec = 0;
+            tv.tv_usec = ctx_rtu->t35;
+            rc = _modbus_wait_fd(ctx->s, 0, &tv);
+        } while (rc == -1 && errno == EINTR);
+        if (rc == 0) {
+            break;
+        }
+        if (rc == -1) {
+            _error_print(ctx, "select");
+            return -1;
+        }
+    }
+
+    if (ctx->debug)
+        printf("\n");
+
+    /* Slave, function and CRC at least */
+    if (overflow || msg_length < _MODBUS_RTU_HEADER_LENGTH + 1 + _MODBUS_RTU_CHECKSUM_LENGTH) {
+        errno = EMBBADDATA;
+        _error_print(ctx, overflow ? "too many data" : "frame too short");
+        return -1;
+    }
+
+    return _modbus_rtu_check_integrity(ctx, msg, msg_length);
+}
+#endif
 
 static int _modbus_rtu_pre_check_confirmation(modbus_t *ctx, const uint8_t *req,
                                               const uint8_t *rsp, int rsp_length)
@@ -390,7 +615,7 @@ static int _modbus_rtu_check_integrity(modbus_t *ctx, uint8_t *msg,
         }
 
         if (ctx->error_recovery & MODBUS_ERROR_RECOVERY_PROTOCOL) {
-            _modbus_rtu_flush(ctx);
+            ctx->backend->flush(ctx);
         }
         errno = EMBBADCRC;
         return -1;
@@ -926,6 +1151,9 @@ int modbus_rtu_set_serial_mode(modbus_t *ctx, int mode)
             }
 
             ctx_rtu->serial_mode = MODBUS_RTU_RS485;
+#if HAVE_DECL_TIOCM_RTS
+            _modbus_rtu_kernel_rts(ctx);
+#endif
             return 0;
         } else if (mode == MODBUS_RTU_RS232) {
             /* Turn off RS485 mode only if required */
@@ -940,6 +1168,9 @@ int modbus_rtu_set_serial_mode(modbus_t *ctx, int mode)
                 }
             }
             ctx_rtu->serial_mode = MODBUS_RTU_RS232;
+#if HAVE_DECL_TIOCM_RTS
+            ctx_rtu->rts_kernel = FALSE;
+#endif
             return 0;
         }
 #else
@@ -1021,6 +1252,9 @@ int modbus_rtu_set_rts(modbus_t *ctx, int mode)
 
             /* Set the RTS bit in order to not reserve the RS485 bus */
             ctx_rtu->set_rts(ctx, ctx_rtu->rts != MODBUS_RTU_RTS_UP);
+#if HAVE_DECL_TIOCSRS485
+            _modbus_rtu_kernel_rts(ctx);
+#endif
 
             return 0;
         } else {
@@ -1051,6 +1285,9 @@ int modbus_rtu_set_custom_rts(modbus_t *ctx, void (*set_rts) (modbus_t *ctx, int
 #if HAVE_DECL_TIOCM_RTS
         modbus_rtu_t *ctx_rtu = ctx->backend_data;
         ctx_rtu->set_rts = set_rts;
+#if HAVE_DECL_TIOCSRS485
+        _modbus_rtu_kernel_rts(ctx);
+#endif
         return 0;
 #else
         if (ctx->debug) {
@@ -1102,6 +1339,9 @@ int modbus_rtu_set_rts_delay(modbus_t *ctx, int us)
         modbus_rtu_t *ctx_rtu;
         ctx_rtu = (modbus_rtu_t *)ctx->backend_data;
         ctx_rtu->rts_delay = us;
+#if HAVE_DECL_TIOCSRS485
+        _modbus_rtu_kernel_rts(ctx);
+#endif
         return 0;
 #else
         if (ctx->debug) {
@@ -1116,6 +1356,48 @@ int modbus_rtu_set_rts_delay(modbus_t *ctx, int us)
     }
 }
 
+int modbus_rtu_set_frame_mode(modbus_t *ctx, int mode)
+{
+    if (ctx == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (ctx->backend->backend_type == _MODBUS_BACKEND_TYPE_RTU) {
+        modbus_rtu_t *ctx_rtu = ctx->backend_data;
+
+        if (mode == MODBUS_RTU_FRAME_LENGTH) {
+            ctx_rtu->frame_mode = mode;
+            return 0;
+        } else if (mode == MODBUS_RTU_FRAME_SILENCE) {
+#if defined(_WIN32)
+            if (ctx->debug) {
+                fprintf(stderr, "This function isn't supported on your platform\n");
+            }
+            errno = ENOTSUP;
+            return -1;
+#else
+            ctx_rtu->frame_mode = mode;
+            return 0;
+#endif
+        }
+    }
+
+    /* Wrong backend or invalid mode specified */
+    errno = EINVAL;
+    return -1;
+}
+
+int modbus_rtu_get_frame_mode(modbus_t *ctx)
+{
+    if (ctx == NULL || ctx->backend->backend_type != _MODBUS_BACKEND_TYPE_RTU) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return ((modbus_rtu_t *)ctx->backend_data)->frame_mode;
+}
+
 static void _modbus_rtu_close(modbus_t *ctx)
 {
     /* Restore line settings and close file descriptor in RTU mode */
@@ -1152,8 +1434,7 @@ static int _modbus_rtu_flush(modbus_t *ctx)
 #endif
 }
 
-static int _modbus_rtu_select(modbus_t *ctx, fd_set *rset,
-                              struct timeval *tv, int length_to_read)
+static int _modbus_rtu_select(modbus_t *ctx, struct timeval *tv, int length_to_read)
 {
     int s_rc;
 #if defined(_WIN32)
@@ -1168,19 +1449,7 @@ static int _modbus_rtu_select(modbus_t *ctx, fd_set *rset,
         return -1;
     }
 #else
-    while ((s_rc = select(ctx->s+1, rset, NULL, NULL, tv)) == -1) {
-        if (errno == EINTR) {
-            if (ctx->debug) {
-                fprintf(stderr, "A non blocked signal was caught\n");
-            }
-            /* Necessary after an error */
-            FD_ZERO(rset);
-            FD_SET(ctx->s, rset);
-        } else {
-            return -1;
-        }
-    }
-
+    s_rc = _modbus_wait_fd(ctx->s, 0, tv);
     if (s_rc == 0) {
         /* Timeout */
         errno = ETIMEDOUT;
@@ -1219,7 +1488,13 @@ const modbus_backend_t _modbus_rtu_backend = {
     _modbus_rtu_close,
     _modbus_rtu_flush,
     _modbus_rtu_select,
-    _modbus_rtu_free
+    _modbus_rtu_free,
+#if defined(_WIN32)
+    NULL,
+#else
+    _modbus_rtu_receive_frame,
+#endif
+    NULL
 };
 
 modbus_t* modbus_new_rtu(const char *device,
@@ -1287,8 +1562,11 @@ modbus_t* modbus_new_rtu(const char *device,
     /* The RTS use has been set by default */
     ctx_rtu->rts = MODBUS_RTU_RTS_NONE;
 
-    /* Calculate estimated time in micro second to send one byte */
-    ctx_rtu->onebyte_time = 1000000 * (1 + data_bit + (parity == 'N' ? 0 : 1) + stop_bit) / baud;
+    /* Calculate the time to send one byte, the micro second value is rounded up */
+    ctx_rtu->onebyte_time_ns = (long)(1000000000LL *
+        (1 + data_bit + (parity == 'N' ? 0 : 1) + stop_bit) / baud);
+    ctx_rtu->onebyte_time = (int)((ctx_rtu->onebyte_time_ns + 999) / 1000);
+    ctx_rtu->rts_kernel = FALSE;
 
     /* The internal function is used by default to set RTS */
     ctx_rtu->set_rts = _modbus_rtu_ioctl_rts;
@@ -1299,5 +1577,9 @@ modbus_t* modbus_new_rtu(const char *device,
 
     ctx_rtu->confirmation_to_ignore = FALSE;
 
+    /* t3.5 from 11 bits characters, fixed to 1750 us above 19200 bauds */
+    ctx_rtu->frame_mode = MODBUS_RTU_FRAME_LENGTH;
+    ctx_rtu->t35 = (baud > 19200) ? 1750 : (int)(35LL * 11 * 1000000 / 10 / baud);
+
     return ctx;
 }
@@ -0,0 +1,1434 @@
+/*
+ * Copyright © 2001-2013 Stéphane Raimbault <stephane.raimbault@gmail.com>
+ *
+ * SPDX-License-Identifier: LGPL-2.1+
+ */
+
+/*
+ 多连接Modbus TCP服务端。
+ 收到的数据按MBAP长度字段切分成请求，逐个交给处理函数（默认modbus_reply()），
+ 应答先缓存在连接上，一轮事件处理完后再统一发送：
+ - io_uring：multishot accept/recv + 注册的缓冲区环，一次io_uring_enter提交全部发送；
+ - epoll：内核不支持io_uring（或被禁用）时使用；
+ - poll：其他平台（Windows下为WSAPoll）。
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#ifndef _MSC_VER
+#include <unistd.h>
+#endif
+
+#include "modbus-private.h"
+
+#if defined(_WIN32)
+# include <winsock2.h>
+# define poll WSAPoll
+# define close closesocket
+# define SHUT_RDWR 2
+#else
+# include <sys/socket.h>
+# include <poll.h>
+# include <fcntl.h>
+#endif
+
+#ifdef HAVE_SYS_EPOLL_H
+# include <sys/epoll.h>
+#endif
+
+#ifdef HAVE_LINUX_IO_URING_H
+# include <linux/io_uring.h>
+# include <sys/mman.h>
+# include <sys/syscall.h>
+# include <sys/utsname.h>
+#endif
+
+#if !defined(MSG_NOSIGNAL)
+#define MSG_NOSIGNAL 0
+#endif
+
+#include "modbus-tcp.h"
+#include "modbus-tcp-private.h"
+#include "modbus-server.h"
+
+/* Receive buffer of a connection, large enough for many pipelined requests */
+#define _SERVER_IN_LENGTH        4096
+#define _SERVER_MAX_EVENTS       256
+#define _SERVER_MAX_WATCHES      16
+
+#define _SERVER_URING_ENTRIES    4096
+#define _SERVER_URING_BUFFERS    4096
+#define _SERVER_URING_BUF_LENGTH 1024
+#define _SERVER_URING_BGID       0
+
+/* Kind of the io_uring operation, in the upper half of user_data */
+#define _SERVER_OP_ACCEPT  1
+#define _SERVER_OP_RECV    2
+#define _SERVER_OP_SEND    3
+#define _SERVER_OP_CANCEL  4
+#define _SERVER_OP_WATCH   5
+#define _SERVER_OP_UNWATCH 6
+#define _SERVER_OP_STOP_RECV 7
+
+/* Responses waiting behind a send after which the requests of the
+   connection aren't received anymore (io_uring) */
+#define _SERVER_URING_OUT_LIMIT (16 * _SERVER_IN_LENGTH)
+
+typedef struct _server_session {
+    int s;
+    /* Tells apart the successive connections on the same socket number */
+    unsigned int id;
+    int closing;
+    /* io_uring operations in flight, the socket is closed when none is left */
+    int ops;
+    int in_length;
+    uint8_t in[_SERVER_IN_LENGTH];
+    /* Responses built during the current batch, or not sent yet when the
+       client doesn't read (poll and epoll engines) */
+    uint8_t *out;
+    int out_length;
+    int out_size;
+    /* Waits for the socket to be writable (poll and epoll) or for the
+       responses to be sent (io_uring), the requests aren't read meanwhile */
+    int blocked;
+    /* Multishot reception armed (io_uring) */
+    int receiving;
+    /* Received while blocked, processed as the responses are sent (io_uring) */
+    uint8_t *backlog;
+    int backlog_length;
+    int backlog_size;
+    /* Responses being sent (io_uring) */
+    uint8_t *sending;
+    int sending_length;
+    int sending_offset;
+    int sending_size;
+    int pending;
+    struct _server_session *next_pending;
+    struct _server_session *next_closed;
+} server_session_t;
+
+typedef struct _server_watch {
+    int fd;
+    modbus_server_watch_t callback;
+    void *user_data;
+} server_watch_t;
+
+#ifdef HAVE_LINUX_IO_URING_H
+typedef struct _server_uring {
+    int fd;
+    void *sq_ptr;
+    void *cq_ptr;
+    size_t sq_size;
+    size_t cq_size;
+    unsigned int *sq_head;
+    unsigned int *sq_tail;
+    unsigned int *sq_mask;
+    unsigned int *sq_array;
+    unsigned int sq_entries;
+    unsigned int sq_local_tail;
+    unsigned int *cq_head;
+    unsigned int *cq_tail;
+    unsigned int *cq_mask;
+    struct io_uring_cqe *cqes;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    /* Provided buffer ring for the multishot receptions */
+    struct io_uring_buf_ring *br;
+    size_t br_size;
+    uint8_t *bufs;
+    unsigned short br_tail;
+} server_uring_t;
+#endif
+
+struct _modbus_server {
+    /* Copy of the user context whose send() appends to the current session,
+       must stay first (the backend gets it back from ctx) */
+    modbus_t ctx;
+    modbus_backend_t backend;
+    int server_socket;
+    int engine;
+    modbus_server_handler_t handler;
+    void *user_data;
+    modbus_mapping_t *mb_mapping;
+    int max_connections;
+    int nb_connections;
+    /* Sessions indexed by socket */
+    server_session_t **sessions;
+    int nb_sessions;
+    unsigned int next_id;
+    server_session_t *current;
+    server_session_t *pending;
+    /* Closed sessions waiting for their io_uring operations to end */
+    server_session_t *closed;
+    /* External descriptors waited with the connections */
+    server_watch_t watches[_SERVER_MAX_WATCHES];
+    int nb_watches;
+#ifdef HAVE_SYS_EPOLL_H
+    int epfd;
+#endif
+#ifdef HAVE_LINUX_IO_URING_H
+    server_uring_t *ring;
+#endif
+    struct pollfd *pfds;
+    int nb_pfds;
+};
+
+static ssize_t _server_append(modbus_server_t *server, server_session_t *session,
+                              const uint8_t *rsp, int rsp_length)
+{
+    if (session->out_length + rsp_length > session->out_size) {
+        int size = session->out_size ? session->out_size * 2 : _SERVER_IN_LENGTH;
+        uint8_t *out;
+
+        while (size < session->out_length + rsp_length)
+            size *= 2;
+        out = (uint8_t *)realloc(session->out, size);
+        if (out == NULL) {
+            errno = ENOMEM;
+            return -1;
+        }
+        session->out = out;
+        session->out_size = size;
+    }
+    memcpy(session->out + session->out_length, rsp, rsp_length);
+    session->out_length += rsp_length;
+
+    if (!session->pending) {
+        session->pending = 1;
+        session->next_pending = server->pending;
+        server->pending = session;
+    }
+    return rsp_length;
+}
+
+static ssize_t _server_send(modbus_t *ctx, const uint8_t *rsp, int rsp_length)
+{
+    modbus_server_t *server = (modbus_server_t *)ctx;
+
+    return _server_append(server, server->current, rsp, rsp_length);
+}
+
+static server_watch_t *_server_find_watch(modbus_server_t *server, int fd)
+{
+    int i;
+
+    for (i = 0; i < server->nb_watches; i++) {
+        if (server->watches[i].fd == fd)
+            return &server->watches[i];
+    }
+    return NULL;
+}
+
+/* The following requests of a pipelining client must not be lost */
+static int _server_flush(modbus_t *ctx)
+{
+    return 0;
+}
+
+static int _server_default_handler(modbus_t *ctx, const uint8_t *req,
+                                   int req_length, void *user_data)
+{
+    modbus_server_t *server = (modbus_server_t *)ctx;
+
+    if (server->mb_mapping == NULL) {
+        return modbus_reply_exception(ctx, req,
+                                      MODBUS_EXCEPTION_SLAVE_OR_SERVER_FAILURE);
+    }
+    return modbus_reply(ctx, req, req_length, server->mb_mapping);
+}
+
+static server_session_t *_server_session_new(modbus_server_t *server, int s)
+{
+    server_session_t *session;
+
+    if (s >= server->nb_sessions) {
+        int nb = server->nb_sessions ? server->nb_sessions : 64;
+        server_session_t **sessions;
+
+        while (nb <= s)
+            nb *= 2;
+        sessions = (server_session_t **)realloc(server->sessions,
+                                                nb * sizeof(server_session_t *));
+        if (sessions == NULL) {
+            errno = ENOMEM;
+            return NULL;
+        }
+        memset(sessions + server->nb_sessions, 0,
+               (nb - server->nb_sessions) * sizeof(server_session_t *));
+        server->sessions = sessions;
+        server->nb_sessions = nb;
+    }
+
+    session = (server_session_t *)calloc(1, sizeof(server_session_t));
+    if (session == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    session->s = s;
+    session->id = ++server->next_id & 0x7FFFFFFF;
+    server->sessions[s] = session;
+    server->nb_connections++;
+
+    if (server->ctx.debug) {
+        printf("New connection on socket %d (%d connected)\n",
+               s, server->nb_connections);
+    }
+    return session;
+}
+
+static void _server_session_release(modbus_server_t *server, server_session_t *session)
+{
+    server_session_t **p;
+
+    for (p = &server->pending; *p != NULL; p = &(*p)->next_pending) {
+        if (*p == session) {
+            *p = session->next_pending;
+            break;
+        }
+    }
+    server->sessions[session->s] = NULL;
+    close(session->s);
+    free(session->out);
+    free(session->sending);
+    free(session->backlog);
+    free(session);
+}
+
+/* Splits the received data in requests and calls the handler for each one,
+   returns the number of requests or -1 if the stream is not Modbus TCP */
+static int _server_process(modbus_server_t *server, server_session_t *session)
+{
+    int offset = 0;
+    int nb = 0;
+
+    while (session->in_length - offset >= _MODBUS_TCP_HEADER_LENGTH + 1) {
+        const uint8_t *req = session->in + offset;
+        int length = 6 + ((req[4] << 8) | req[5]);
+
+        if (length < _MODBUS_TCP_HEADER_LENGTH + 1 ||
+            length > MODBUS_TCP_MAX_ADU_LENGTH) {
+            errno = EMBBADDATA;
+            return -1;
+        }
+        if (session->in_length - offset < length)
+            break;
+
+        if (server->ctx.debug) {
+            int i;
+            for (i = 0; i < length; i++)
+                printf("<%.2X>", req[i]);
+            printf("\n");
+        }
+
+        server->ctx.s = session->s;
+        server->current = session;
+        server->handler(&server->ctx, req, length, server->user_data);
+        server->current = NULL;
+        offset += length;
+        nb++;
+    }
+
+    if (offset > 0) {
+        session->in_length -= offset;
+        memmove(session->in, session->in + offset, session->in_length);
+    }
+    return nb;
+}
+
+static int _server_would_block(void)
+{
+#if defined(_WIN32)
+    return WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+    return errno == EAGAIN || errno == EWOULDBLOCK;
+#endif
+}
+
+/* Waits for the socket to be writable instead of readable, or back */
+static int _server_set_blocked(modbus_server_t *server, server_session_t *session,
+                               int blocked)
+{
+    session->blocked = blocked;
+#ifdef HAVE_SYS_EPOLL_H
+    if (server->engine == MODBUS_SERVER_ENGINE_EPOLL) {
+        struct epoll_event ev;
+
+        memset(&ev, 0, sizeof(ev));
+        ev.events = blocked ? EPOLLOUT : EPOLLIN;
+        ev.data.fd = session->s;
+        return epoll_ctl(server->epfd, EPOLL_CTL_MOD, session->s, &ev);
+    }
+#endif
+    return 0;
+}
+
+/* Sends the pending responses without blocking, the tail a client doesn't
+   read is kept until its socket is writable (poll and epoll engines) */
+static void _server_send_pending(modbus_server_t *server)
+{
+    while (server->pending != NULL) {
+        server_session_t *session = server->pending;
+        int offset = 0;
+        int rc = 0;
+
+        server->pending = session->next_pending;
+        session->pending = 0;
+
+        while (offset < session->out_length) {
+            ssize_t n = send(session->s, (const char *)session->out + offset,
+                             session->out_length - offset, MSG_NOSIGNAL);
+            if (n == -1) {
+                if (errno == EINTR)
+                    continue;
+                rc = _server_would_block() ? 0 : -1;
+                break;
+            }
+            offset += n;
+        }
+
+        if (rc == 0) {
+            session->out_length -= offset;
+            memmove(session->out, session->out + offset, session->out_length);
+            if (session->blocked != (session->out_length > 0))
+                rc = _server_set_blocked(server, session, session->out_length > 0);
+        }
+        if (rc == -1) {
+            if (server->ctx.debug) {
+                printf("Connection on socket %d closed\n", session->s);
+            }
+            server->nb_connections--;
+            _server_session_release(server, session);
+        }
+    }
+}
+
+/* The socket of a blocked session is writable again */
+static void _server_resume(modbus_server_t *server, server_session_t *session)
+{
+    if (!session->pending) {
+        session->pending = 1;
+        session->next_pending = server->pending;
+        server->pending = session;
+    }
+}
+
+static void _server_accept_one(modbus_server_t *server, int s)
+{
+#if defined(_WIN32)
+    u_long on = 1;
+#endif
+
+    if (server->nb_connections >= server->max_connections ||
+        _server_session_new(server, s) == NULL) {
+        close(s);
+        return;
+    }
+
+    /* A client that doesn't read its responses must not stall the others */
+#if defined(_WIN32)
+    ioctlsocket(s, FIONBIO, &on);
+#else
+    fcntl(s, F_SETFL, fcntl(s, F_GETFL) | O_NONBLOCK);
+#endif
+
+#ifdef HAVE_SYS_EPOLL_H
+    if (server->engine == MODBUS_SERVER_ENGINE_EPOLL) {
+        struct epoll_event ev;
+
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.fd = s;
+        if (epoll_ctl(server->epfd, EPOLL_CTL_ADD, s, &ev) == -1) {
+            server->nb_connections--;
+            _server_session_release(server, server->sessions[s]);
+        }
+    }
+#endif
+}
+
+/* Accepts the pending connections, the listening socket may be blocking so
+   it's polled again before each accept (poll and epoll engines) */
+static void _server_accept(modbus_server_t *server)
+{
+    struct pollfd pfd;
+    int i;
+
+    pfd.fd = server->server_socket;
+    pfd.events = POLLIN;
+    for (i = 0; i < _SERVER_MAX_EVENTS; i++) {
+        int s;
+
+        pfd.revents = 0;
+        if (i > 0 && poll(&pfd, 1, 0) <= 0)
+            break;
+        s = accept(server->server_socket, NULL, NULL);
+        if (s < 0)
+            break;
+        _server_accept_one(server, s);
+    }
+}
+
+/* Reads the socket straight into the session buffer (poll and epoll engines) */
+static int _server_read(modbus_server_t *server, server_session_t *session)
+{
+    ssize_t rc = recv(session->s, (char *)session->in + session->in_length,
+                      _SERVER_IN_LENGTH - session->in_length, 0);
+
+    if (rc > 0) {
+        session->in_length += rc;
+        rc = _server_process(server, session);
+        if (rc != -1)
+            return rc;
+    } else if (rc == -1 && (errno == EINTR || _server_would_block())) {
+        return 0;
+    }
+
+    /* Connection closed by the client or invalid stream */
+    if (server->ctx.debug) {
+        printf("Connection on socket %d closed\n", session->s);
+    }
+    server->nb_connections--;
+    _server_session_release(server, session);
+    return 0;
+}
+
+static int _server_run_poll(modbus_server_t *server, int timeout_ms)
+{
+    int nb_fds = 1;
+    int i;
+    int rc;
+    int nb = 0;
+
+    int nb_pfds = server->nb_connections + 1 + server->nb_watches;
+
+    if (server->nb_pfds < nb_pfds) {
+        struct pollfd *pfds = (struct pollfd *)realloc(
+            server->pfds, nb_pfds * sizeof(struct pollfd));
+        if (pfds == NULL) {
+            errno = ENOMEM;
+            return -1;
+        }
+        server->pfds = pfds;
+        server->nb_pfds = nb_pfds;
+    }
+
+    server->pfds[0].fd = server->server_socket;
+    server->pfds[0].events = POLLIN;
+    server->pfds[0].revents = 0;
+    for (i = 0; i < server->nb_sessions; i++) {
+        if (server->sessions[i] != NULL) {
+            server->pfds[nb_fds].fd = i;
+            server->pfds[nb_fds].events = server->sessions[i]->blocked ? POLLOUT : POLLIN;
+            server->pfds[nb_fds].revents = 0;
+            nb_fds++;
+        }
+    }
+    nb_pfds = nb_fds;
+    for (i = 0; i < server->nb_watches; i++) {
+        server->pfds[nb_pfds].fd = server->watches[i].fd;
+        server->pfds[nb_pfds].events = POLLIN;
+        server->pfds[nb_pfds].revents = 0;
+        nb_pfds++;
+    }
+
+    rc = poll(server->pfds, nb_pfds, timeout_ms);
+    if (rc == -1) {
+        return (errno == EINTR) ? 0 : -1;
+    }
+
+    for (i = 1; i < nb_fds; i++) {
+        if (server->pfds[i].revents != 0) {
+            server_session_t *session = server->sessions[server->pfds[i].fd];
+
+            if (session->blocked)
+                _server_resume(server, session);
+            else
+                nb += _server_read(server, session);
+        }
+    }
+    for (i = nb_fds; i < nb_pfds; i++) {
+        server_watch_t *watch;
+
+        /* The callback of a previous one may have removed it */
+        if (server->pfds[i].revents != 0 &&
+            (watch = _server_find_watch(server, server->pfds[i].fd)) != NULL) {
+            watch->callback(server, watch->fd, watch->user_data);
+        }
+    }
+    if (server->pfds[0].revents & POLLIN) {
+        _server_accept(server);
+    }
+
+    _server_send_pending(server);
+    return nb;
+}
+
+#ifdef HAVE_SYS_EPOLL_H
+static int _server_init_epoll(modbus_server_t *server)
+{
+    struct epoll_event ev;
+
+    server->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (server->epfd == -1)
+        return -1;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = server->server_socket;
+    if (epoll_ctl(server->epfd, EPOLL_CTL_ADD, server->server_socket, &ev) == -1) {
+        close(server->epfd);
+        server->epfd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+static int _server_run_epoll(modbus_server_t *server, int timeout_ms)
+{
+    struct epoll_event events[_SERVER_MAX_EVENTS];
+    int rc;
+    int i;
+    int nb = 0;
+
+    rc = epoll_wait(server->epfd, events, _SERVER_MAX_EVENTS, timeout_ms);
+    if (rc == -1) {
+        return (errno == EINTR) ? 0 : -1;
+    }
+
+    for (i = 0; i < rc; i++) {
+        int s = events[i].data.fd;
+
+        server_watch_t *watch;
+
+        if (s == server->server_socket) {
+            _server_accept(server);
+        } else if (s < server->nb_sessions && server->sessions[s] != NULL) {
+            if (server->sessions[s]->blocked)
+                _server_resume(server, server->sessions[s]);
+            else
+                nb += _server_read(server, server->sessions[s]);
+        } else if ((watch = _server_find_watch(server, s)) != NULL) {
+            watch->callback(server, s, watch->user_data);
+        }
+    }
+
+    _server_send_pending(server);
+    return nb;
+}
+#endif
+
+#ifdef HAVE_LINUX_IO_URING_H
+/* Appends received data to the session, may be larger than the buffer */
+static int _server_feed(modbus_server_t *server, server_session_t *session,
+                        const uint8_t *data, int length)
+{
+    int nb = 0;
+
+    while (length > 0) {
+        int n = _SERVER_IN_LENGTH - session->in_length;
+        int rc;
+
+        if (n > length)
+            n = length;
+        memcpy(session->in + session->in_length, data, n);
+        session->in_length += n;
+        data += n;
+        length -= n;
+
+        rc = _server_process(server, session);
+        if (rc == -1)
+            return -1;
+        nb += rc;
+    }
+    return nb;
+}
+
+/* Keeps the data received while the responses are backed up, only what was
+   in flight before the reception is stopped */
+static int _uring_keep(server_session_t *session, const uint8_t *data, int length)
+{
+    if (session->backlog_length + length > session->backlog_size) {
+        int size = session->backlog_size ? session->backlog_size * 2 : _SERVER_IN_LENGTH;
+        uint8_t *backlog;
+
+        while (size < session->backlog_length + length)
+            size *= 2;
+        backlog = (uint8_t *)realloc(session->backlog, size);
+        if (backlog == NULL) {
+            errno = ENOMEM;
+            return -1;
+        }
+        session->backlog = backlog;
+        session->backlog_size = size;
+    }
+    memcpy(session->backlog + session->backlog_length, data, length);
+    session->backlog_length += length;
+    return 0;
+}
+
+/* Processes the kept data while the responses stay under the limit */
+static int _uring_drain(modbus_server_t *server, server_session_t *session)
+{
+    int offset = 0;
+    int nb = 0;
+
+    while (offset < session->backlog_length &&
+           session->out_length < _SERVER_URING_OUT_LIMIT) {
+        int n = session->backlog_length - offset;
+        int rc;
+
+        if (n > _SERVER_IN_LENGTH)
+            n = _SERVER_IN_LENGTH;
+        rc = _server_feed(server, session, session->backlog + offset, n);
+        if (rc == -1)
+            return -1;
+        nb += rc;
+        offset += n;
+    }
+
+    session->backlog_length -= offset;
+    memmove(session->backlog, session->backlog + offset, session->backlog_length);
+    return nb;
+}
+
+static int _uring_enter(server_uring_t *ring, unsigned int min_complete, int timeout_ms)
+{
+    unsigned int to_submit;
+    unsigned int flags = 0;
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec ts;
+    int rc;
+
+    __atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+    to_submit = ring->sq_local_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+
+    if (min_complete > 0) {
+        flags |= IORING_ENTER_GETEVENTS;
+        if (timeout_ms >= 0) {
+            memset(&arg, 0, sizeof(arg));
+            ts.tv_sec = timeout_ms / 1000;
+            ts.tv_nsec = (long long)(timeout_ms % 1000) * 1000000;
+            arg.ts = (uint64_t)(uintptr_t)&ts;
+            flags |= IORING_ENTER_EXT_ARG;
+            rc = syscall(__NR_io_uring_enter, ring->fd, to_submit, min_complete,
+                         flags, &arg, sizeof(arg));
+        } else {
+            rc = syscall(__NR_io_uring_enter, ring->fd, to_submit, min_complete,
+                         flags, NULL, 0);
+        }
+    } else if (to_submit > 0) {
+        rc = syscall(__NR_io_uring_enter, ring->fd, to_submit, 0, 0, NULL, 0);
+    } else {
+        return 0;
+    }
+
+    if (rc == -1 && (errno == ETIME || errno == EINTR || errno == EBUSY))
+        return 0;
+    return rc;
+}
+
+static struct io_uring_sqe *_uring_get_sqe(server_uring_t *ring)
+{
+    struct io_uring_sqe *sqe;
+    unsigned int idx;
+
+    if (ring->sq_local_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >=
+        ring->sq_entries) {
+        /* Submission queue full, hand it over to the kernel */
+        _uring_enter(ring, 0, 0);
+        if (ring->sq_local_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >=
+            ring->sq_entries)
+            return NULL;
+    }
+
+    idx = ring->sq_local_tail & *ring->sq_mask;
+    sqe = &ring->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[idx] = idx;
+    ring->sq_local_tail++;
+    return sqe;
+}
+
+static void _uring_add_buffer(server_uring_t *ring, unsigned short bid)
+{
+    struct io_uring_buf *buf =
+        &ring->br->bufs[ring->br_tail & (_SERVER_URING_BUFFERS - 1)];
+
+    buf->addr = (uint64_t)(uintptr_t)(ring->bufs + (size_t)bid * _SERVER_URING_BUF_LENGTH);
+    buf->len = _SERVER_URING_BUF_LENGTH;
+    buf->bid = bid;
+    ring->br_tail++;
+    __atomic_store_n(&ring->br->tail, ring->br_tail, __ATOMIC_RELEASE);
+}
+
+static void _uring_free(server_uring_t *ring)
+{
+    if (ring->sqes != NULL && ring->sqes != MAP_FAILED)
+        munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ptr != NULL && ring->cq_ptr != MAP_FAILED && ring->cq_ptr != ring->sq_ptr)
+        munmap(ring->cq_ptr, ring->cq_size);
+    if (ring->sq_ptr != NULL && ring->sq_ptr != MAP_FAILED)
+        munmap(ring->sq_ptr, ring->sq_size);
+    if (ring->fd >= 0)
+        close(ring->fd);
+    if (ring->br != NULL && ring->br != MAP_FAILED)
+        munmap(ring->br, ring->br_size);
+    free(ring->bufs);
+    free(ring);
+}
+
+/* Multishot receive needs Linux 6.0 */
+static int _uring_kernel_supported(void)
+{
+    struct utsname u;
+    int major = 0;
+    int minor = 0;
+
+    if (uname(&u) == -1 || sscanf(u.release, "%d.%d", &major, &minor) != 2)
+        return 0;
+    return major >= 6;
+}
+
+static server_uring_t *_uring_new(void)
+{
+    struct io_uring_params p;
+    struct io_uring_buf_reg reg;
+    server_uring_t *ring;
+    unsigned short i;
+
+    if (!_uring_kernel_supported()) {
+        errno = ENOSYS;
+        return NULL;
+    }
+
+    ring = (server_uring_t *)calloc(1, sizeof(server_uring_t));
+    if (ring == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CQSIZE;
+    p.cq_entries = 4 * _SERVER_URING_ENTRIES;
+    ring->fd = syscall(__NR_io_uring_setup, _SERVER_URING_ENTRIES, &p);
+    if (ring->fd < 0 || !(p.features & IORING_FEAT_EXT_ARG)) {
+        if (ring->fd >= 0)
+            errno = ENOSYS;
+        goto error;
+    }
+
+    ring->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    ring->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_size > ring->sq_size)
+            ring->sq_size = ring->cq_size;
+        ring->cq_size = ring->sq_size;
+    }
+    ring->sq_ptr = mmap(NULL, ring->sq_size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ptr == MAP_FAILED)
+        goto error;
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_ptr = ring->sq_ptr;
+    } else {
+        ring->cq_ptr = mmap(NULL, ring->cq_size, PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ptr == MAP_FAILED)
+            goto error;
+    }
+    ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = (struct io_uring_sqe *)mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                                             MAP_SHARED | MAP_POPULATE, ring->fd,
+                                             IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED)
+        goto error;
+
+    ring->sq_head = (unsigned int *)((char *)ring->sq_ptr + p.sq_off.head);
+    ring->sq_tail = (unsigned int *)((char *)ring->sq_ptr + p.sq_off.tail);
+    ring->sq_mask = (unsigned int *)((char *)ring->sq_ptr + p.sq_off.ring_mask);
+    ring->sq_array = (unsigned int *)((char *)ring->sq_ptr + p.sq_off.array);
+    ring->sq_entries = p.sq_entries;
+    ring->sq_local_tail = *ring->sq_tail;
+    ring->cq_head = (unsigned int *)((char *)ring->cq_ptr + p.cq_off.head);
+    ring->cq_tail = (unsigned int *)((char *)ring->cq_ptr + p.cq_off.tail);
+    ring->cq_mask = (unsigned int *)((char *)ring->cq_ptr + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)((char *)ring->cq_ptr + p.cq_off.cqes);
+
+    /* Buffers registered once, picked by the kernel for each reception */
+    ring->br_size = _SERVER_URING_BUFFERS * sizeof(struct io_uring_buf);
+    ring->br = (struct io_uring_buf_ring *)mmap(NULL, ring->br_size, PROT_READ | PROT_WRITE,
+                                                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring->br == MAP_FAILED)
+        goto error;
+    ring->bufs = (uint8_t *)malloc((size_t)_SERVER_URING_BUFFERS * _SERVER_URING_BUF_LENGTH);
+    if (ring->bufs == NULL) {
+        errno = ENOMEM;
+        goto error;
+    }
+
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)ring->br;
+    reg.ring_entries = _SERVER_URING_BUFFERS;
+    reg.bgid = _SERVER_URING_BGID;
+    if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) != 0)
+        goto error;
+
+    for (i = 0; i < _SERVER_URING_BUFFERS; i++)
+        _uring_add_buffer(ring, i);
+
+    return ring;
+
+error:
+    {
+        int saved_errno = errno;
+        _uring_free(ring);
+        errno = saved_errno;
+    }
+    return NULL;
+}
+
+static int _uring_prep(modbus_server_t *server, int kind, int s)
+{
+    struct io_uring_sqe *sqe = _uring_get_sqe(server->ring);
+    server_session_t *session = (kind == _SERVER_OP_RECV || kind == _SERVER_OP_SEND) ?
+        server->sessions[s] : NULL;
+
+    if (sqe == NULL) {
+        errno = EBUSY;
+        return -1;
+    }
+
+    sqe->fd = s;
+    sqe->user_data = ((uint64_t)kind << 32) | (uint32_t)s;
+    switch (kind) {
+    case _SERVER_OP_ACCEPT:
+        sqe->opcode = IORING_OP_ACCEPT;
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+        break;
+    case _SERVER_OP_RECV:
+        sqe->opcode = IORING_OP_RECV;
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = _SERVER_URING_BGID;
+        session->ops++;
+        session->receiving = 1;
+        break;
+    case _SERVER_OP_SEND:
+        sqe->opcode = IORING_OP_SEND;
+        sqe->addr = (uint64_t)(uintptr_t)(session->sending + session->sending_offset);
+        sqe->len = session->sending_length - session->sending_offset;
+        sqe->msg_flags = MSG_NOSIGNAL;
+        session->ops++;
+        break;
+    case _SERVER_OP_CANCEL:
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+        break;
+    case _SERVER_OP_WATCH:
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->poll32_events = POLLIN;
+        sqe->len = IORING_POLL_ADD_MULTI;
+        break;
+    case _SERVER_OP_UNWATCH:
+        sqe->opcode = IORING_OP_POLL_REMOVE;
+        sqe->fd = -1;
+        sqe->addr = ((uint64_t)_SERVER_OP_WATCH << 32) | (uint32_t)s;
+        break;
+    case _SERVER_OP_STOP_RECV:
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->fd = -1;
+        sqe->addr = ((uint64_t)_SERVER_OP_RECV << 32) | (uint32_t)s;
+        break;
+    }
+    return 0;
+}
+
+static void _uring_close(modbus_server_t *server, server_session_t *session)
+{
+    if (session->closing)
+        return;
+
+    if (server->ctx.debug) {
+        printf("Connection on socket %d closed\n", session->s);
+    }
+    session->closing = 1;
+    server->nb_connections--;
+
+    /* The socket is kept open until the kernel is done with it, so its
+       number can't be reused by a new session in the meantime */
+    session->next_closed = server->closed;
+    server->closed = session;
+    if (session->ops > 0) {
+        _uring_prep(server, _SERVER_OP_CANCEL, session->s);
+        shutdown(session->s, SHUT_RDWR);
+    }
+}
+
+static void _uring_send(modbus_server_t *server, server_session_t *session)
+{
+    uint8_t *tmp = session->sending;
+    int size = session->sending_size;
+
+    /* Swap the buffers, new responses are built while this one is sent */
+    session->sending = session->out;
+    session->sending_size = session->out_size;
+    session->sending_length = session->out_length;
+    session->sending_offset = 0;
+    session->out = tmp;
+    session->out_size = size;
+    session->out_length = 0;
+
+    if (_uring_prep(server, _SERVER_OP_SEND, session->s) == -1)
+        _uring_close(server, session);
+}
+
+static int _uring_complete(modbus_server_t *server, const struct io_uring_cqe *cqe)
+{
+    int kind = (int)(cqe->user_data >> 32);
+    int s = (int)(uint32_t)cqe->user_data;
+    server_session_t *session;
+    int nb = 0;
+
+    if (kind == _SERVER_OP_CANCEL || kind == _SERVER_OP_UNWATCH ||
+        kind == _SERVER_OP_STOP_RECV)
+        return 0;
+
+    if (kind == _SERVER_OP_WATCH) {
+        server_watch_t *watch = _server_find_watch(server, s);
+
+        if (watch == NULL)
+            return 0;
+        if (cqe->res > 0)
+            watch->callback(server, s, watch->user_data);
+        /* Multishot poll stopped, rearm it if the callback kept the watch */
+        if (!(cqe->flags & IORING_CQE_F_MORE) && _server_find_watch(server, s) != NULL)
+            _uring_prep(server, _SERVER_OP_WATCH, s);
+        return 0;
+    }
+
+    if (kind == _SERVER_OP_ACCEPT) {
+        if (cqe->res >= 0) {
+            if (server->nb_connections >= server->max_connections ||
+                _server_session_new(server, cqe->res) == NULL) {
+                close(cqe->res);
+            } else if (_uring_prep(server, _SERVER_OP_RECV, cqe->res) == -1) {
+                _uring_close(server, server->sessions[cqe->res]);
+            }
+        }
+        if (!(cqe->flags & IORING_CQE_F_MORE))
+            _uring_prep(server, _SERVER_OP_ACCEPT, server->server_socket);
+        return 0;
+    }
+
+    if (s >= server->nb_sessions || server->sessions[s] == NULL)
+        return 0;
+    session = server->sessions[s];
+
+    if (kind == _SERVER_OP_RECV) {
+        if (!(cqe->flags & IORING_CQE_F_MORE)) {
+            session->ops--;
+            session->receiving = 0;
+        }
+
+        if (cqe->res > 0 && (cqe->flags & IORING_CQE_F_BUFFER)) {
+            unsigned short bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+
+            if (!session->closing) {
+                const uint8_t *data =
+                    server->ring->bufs + (size_t)bid * _SERVER_URING_BUF_LENGTH;
+
+                if (session->blocked)
+                    nb = _uring_keep(session, data, cqe->res);
+                else
+                    nb = _server_feed(server, session, data, cqe->res);
+                if (nb == -1) {
+                    nb = 0;
+                    _uring_close(server, session);
+                }
+            }
+            _uring_add_buffer(server->ring, bid);
+        } else if (cqe->res != -ENOBUFS && cqe->res != -ECANCELED) {
+            /* End of stream or error */
+            _uring_close(server, session);
+        }
+
+        /* The client doesn't read its responses, the reception stops until
+           they are sent */
+        if (!session->closing && !session->blocked &&
+            session->out_length >= _SERVER_URING_OUT_LIMIT) {
+            session->blocked = 1;
+            if (session->receiving)
+                _uring_prep(server, _SERVER_OP_STOP_RECV, s);
+        }
+
+        /* Multishot reception stopped (no more buffer or unblocked), rearm it */
+        if (!session->receiving && !session->closing && !session->blocked) {
+            if (_uring_prep(server, _SERVER_OP_RECV, s) == -1)
+                _uring_close(server, session);
+        }
+    } else if (kind == _SERVER_OP_SEND) {
+        session->ops--;
+        if (session->closing) {
+            /* Nothing to do */
+        } else if (cqe->res < 0) {
+            _uring_close(server, session);
+        } else {
+            session->sending_offset += cqe->res;
+            if (session->sending_offset < session->sending_length) {
+                if (_uring_prep(server, _SERVER_OP_SEND, s) == -1)
+                    _uring_close(server, session);
+            } else {
+                session->sending_length = 0;
+                if (session->out_length > 0)
+                    _uring_send(server, session);
+                if (session->blocked && !session->closing) {
+                    nb = _uring_drain(server, session);
+                    if (nb == -1) {
+                        nb = 0;
+                        _uring_close(server, session);
+                    } else if (session->backlog_length == 0 &&
+                               session->out_length < _SERVER_URING_OUT_LIMIT) {
+                        session->blocked = 0;
+                        if (!session->receiving &&
+                            _uring_prep(server, _SERVER_OP_RECV, s) == -1)
+                            _uring_close(server, session);
+                    }
+                }
+            }
+        }
+    }
+
+    return nb;
+}
+
+/* One send per connection for all the responses of the batch */
+static void _uring_send_pending(modbus_server_t *server)
+{
+    while (server->pending != NULL) {
+        server_session_t *session = server->pending;
+
+        server->pending = session->next_pending;
+        session->pending = 0;
+        if (!session->closing && session->sending_length == 0)
+            _uring_send(server, session);
+    }
+}
+
+static int _server_run_uring(modbus_server_t *server, int timeout_ms)
+{
+    server_uring_t *ring = server->ring;
+    server_session_t **closed;
+    unsigned int head;
+    unsigned int tail;
+    int nb = 0;
+
+    /* Submits what the previous batch queued and waits in the same call */
+    if (_uring_enter(ring, 1, timeout_ms) == -1)
+        return -1;
+
+    head = *ring->cq_head;
+    tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    while (head != tail) {
+        struct io_uring_cqe cqe = ring->cqes[head & *ring->cq_mask];
+
+        head++;
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+        nb += _uring_complete(server, &cqe);
+        if (head == tail)
+            tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    }
+
+    _uring_send_pending(server);
+
+    closed = &server->closed;
+    while (*closed != NULL) {
+        server_session_t *session = *closed;
+
+        if (session->ops == 0) {
+            *closed = session->next_closed;
+            _server_session_release(server, session);
+        } else {
+            closed = &session->next_closed;
+        }
+    }
+
+    if (_uring_enter(ring, 0, 0) == -1)
+        return -1;
+
+    return nb;
+}
+#endif
+
+modbus_server_t* modbus_server_new(modbus_t *ctx, int server_socket, int engine)
+{
+    modbus_server_t *server;
+
+    if (ctx == NULL || server_socket < 0 ||
+        ctx->backend->backend_type != _MODBUS_BACKEND_TYPE_TCP ||
+        engine < MODBUS_SERVER_ENGINE_AUTO || engine > MODBUS_SERVER_ENGINE_IO_URING) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    server = (modbus_server_t *)calloc(1, sizeof(modbus_server_t));
+    if (server == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    server->ctx = *ctx;
+    server->backend = *ctx->backend;
+    server->backend.send = _server_send;
+    server->backend.flush = _server_flush;
+    server->ctx.backend = &server->backend;
+    /* No sleep before the exception responses, it would stall every connection */
+    server->ctx.response_timeout.tv_sec = 0;
+    server->ctx.response_timeout.tv_usec = 0;
+    server->ctx.error_recovery = MODBUS_ERROR_RECOVERY_NONE;
+    server->server_socket = server_socket;
+    server->handler = _server_default_handler;
+    server->max_connections = MODBUS_SERVER_DEFAULT_MAX_CONNECTIONS;
+#ifdef HAVE_SYS_EPOLL_H
+    server->epfd = -1;
+#endif
+
+#ifdef HAVE_LINUX_IO_URING_H
+    if (engine == MODBUS_SERVER_ENGINE_AUTO || engine == MODBUS_SERVER_ENGINE_IO_URING) {
+        server->ring = _uring_new();
+        if (server->ring != NULL) {
+            server->engine = MODBUS_SERVER_ENGINE_IO_URING;
+            if (_uring_prep(server, _SERVER_OP_ACCEPT, server_socket) == 0)
+                return server;
+            _uring_free(server->ring);
+            server->ring = NULL;
+        }
+        if (ctx->debug) {
+            fprintf(stderr, "io_uring unavailable (%s), fall back to epoll\n",
+                    strerror(errno));
+        }
+    }
+#endif
+#ifdef HAVE_SYS_EPOLL_H
+    if (engine != MODBUS_SERVER_ENGINE_POLL &&
+        _server_init_epoll(server) == 0) {
+        server->engine = MODBUS_SERVER_ENGINE_EPOLL;
+        return server;
+    }
+#endif
+    if (engine == MODBUS_SERVER_ENGINE_AUTO || engine == MODBUS_SERVER_ENGINE_POLL) {
+        server->engine = MODBUS_SERVER_ENGINE_POLL;
+        return server;
+    }
+
+    /* Neither the requested engine nor epoll is available */
+    free(server);
+    errno = ENOTSUP;
+    return NULL;
+}
+
+int modbus_server_get_engine(modbus_server_t *server)
+{
+    if (server == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    return server->engine;
+}
+
+int modbus_server_set_mapping(modbus_server_t *server, modbus_mapping_t *mb_mapping)
+{
+    if (server == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    server->mb_mapping = mb_mapping;
+    return 0;
+}
+
+int modbus_server_set_handler(modbus_server_t *server,
+                              modbus_server_handler_t handler, void *user_data)
+{
+    if (server == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    server->handler = (handler != NULL) ? handler : _server_default_handler;
+    server->user_data = user_data;
+    return 0;
+}
+
+int modbus_server_set_max_connections(modbus_server_t *server, int nb_connection)
+{
+    if (server == NULL || nb_connection < 1) {
+        errno = EINVAL;
+        return -1;
+    }
+    server->max_connections = nb_connection;
+    return 0;
+}
+
+int modbus_server_get_nb_connections(modbus_server_t *server)
+{
+    if (server == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    return server->nb_connections;
+}
+
+int modbus_server_watch(modbus_server_t *server, int fd,
+                        modbus_server_watch_t callback, void *user_data)
+{
+    server_watch_t *watch;
+
+    if (server == NULL || fd < 0 || fd == server->server_socket || callback == NULL ||
+        _server_find_watch(server, fd) != NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (server->nb_watches == _SERVER_MAX_WATCHES) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+#ifdef HAVE_SYS_EPOLL_H
+    if (server->engine == MODBUS_SERVER_ENGINE_EPOLL) {
+        struct epoll_event ev;
+
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.fd = fd;
+        if (epoll_ctl(server->epfd, EPOLL_CTL_ADD, fd, &ev) == -1)
+            return -1;
+    }
+#endif
+#ifdef HAVE_LINUX_IO_URING_H
+    if (server->engine == MODBUS_SERVER_ENGINE_IO_URING &&
+        _uring_prep(server, _SERVER_OP_WATCH, fd) == -1)
+        return -1;
+#endif
+
+    watch = &server->watches[server->nb_watches++];
+    watch->fd = fd;
+    watch->callback = callback;
+    watch->user_data = user_data;
+    return 0;
+}
+
+int modbus_server_unwatch(modbus_server_t *server, int fd)
+{
+    server_watch_t *watch;
+
+    if (server == NULL || (watch = _server_find_watch(server, fd)) == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+#ifdef HAVE_SYS_EPOLL_H
+    if (server->engine == MODBUS_SERVER_ENGINE_EPOLL)
+        epoll_ctl(server->epfd, EPOLL_CTL_DEL, fd, NULL);
+#endif
+#ifdef HAVE_LINUX_IO_URING_H
+    if (server->engine == MODBUS_SERVER_ENGINE_IO_URING)
+        _uring_prep(server, _SERVER_OP_UNWATCH, fd);
+#endif
+
+    *watch = server->watches[--server->nb_watches];
+    return 0;
+}
+
+int64_t modbus_server_get_connection(modbus_server_t *server)
+{
+    if (server == NULL || server->current == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    return ((int64_t)server->current->id << 32) | (uint32_t)server->current->s;
+}
+
+int modbus_server_send(modbus_server_t *server, int64_t connection,
+                       const uint8_t *rsp, int rsp_length)
+{
+    server_session_t *session;
+    int s;
+
+    if (server == NULL || connection < 0 || rsp == NULL || rsp_length <= 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    s = (int)(uint32_t)connection;
+    if (s >= server->nb_sessions || (session = server->sessions[s]) == NULL ||
+        session->id != (unsigned int)(connection >> 32) || session->closing) {
+        /* Closed by the client in the meantime */
+        errno = ENOTCONN;
+        return -1;
+    }
+
+    if (server->ctx.debug) {
+        int i;
+        for (i = 0; i < rsp_length; i++)
+            printf("[%.2X]", rsp[i]);
+        printf("\n");
+    }
+    return (int)_server_append(server, session, rsp, rsp_length);
+}
+
+int modbus_server_run(modbus_server_t *server, int timeout_ms)
+{
+    if (server == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* Responses given with modbus_server_send() since the previous run */
+    if (server->pending != NULL) {
+#ifdef HAVE_LINUX_IO_URING_H
+        if (server->engine == MODBUS_SERVER_ENGINE_IO_URING)
+            _uring_send_pending(server);
+        else
+#endif
+            _server_send_pending(server);
+    }
+
+    switch (server->engine) {
+#ifdef HAVE_LINUX_IO_URING_H
+    case MODBUS_SERVER_ENGINE_IO_URING:
+        return _server_run_uring(server, timeout_ms);
+#endif
+#ifdef HAVE_SYS_EPOLL_H
+    case MODBUS_SERVER_ENGINE_EPOLL:
+        return _server_run_epoll(server, timeout_ms);
+#endif
+    default:
+        return _server_run_poll(server, timeout_ms);
+    }
+}
+
+void modbus_server_free(modbus_server_t *server)
+{
+    int i;
+
+    if (server == NULL)
+        return;
+
+#ifdef HAVE_LINUX_IO_URING_H
+    /* Closing the ring cancels whatever is still in flight */
+    if (server->ring != NULL)
+        _uring_free(server->ring);
+#endif
+    server->pending = NULL;
+    for (i = 0; i < server->nb_sessions; i++) {
+        if (server->sessions[i] != NULL)
+            _server_session_release(server, server->sessions[i]);
+    }
+#ifdef HAVE_SYS_EPOLL_H
+    if (server->epfd >= 0)
+        close(server->epfd);
+#endif
+    free(server->sessions);
+    free(server->pfds);
+    free(server);
+}
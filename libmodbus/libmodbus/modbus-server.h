@@ -0,0 +1,70 @@
+/*
+ * Copyright © 2001-2013 Stéphane Raimbault <stephane.raimbault@gmail.com>
+ *
+ * SPDX-License-Identifier: LGPL-2.1+
+ */
+
+#ifndef MODBUS_SERVER_H
+#define MODBUS_SERVER_H
+
+#include "modbus.h"
+
+MODBUS_BEGIN_DECLS
+
+/*
+ 多连接Modbus TCP服务端的I/O引擎。
+ AUTO依次尝试io_uring、epoll、poll，内核不支持io_uring（或被禁用）时退回epoll。
+ */
+#define MODBUS_SERVER_ENGINE_AUTO      0
+#define MODBUS_SERVER_ENGINE_POLL      1
+#define MODBUS_SERVER_ENGINE_EPOLL     2
+#define MODBUS_SERVER_ENGINE_IO_URING  3
+
+#define MODBUS_SERVER_DEFAULT_MAX_CONNECTIONS 10000
+
+typedef struct _modbus_server modbus_server_t;
+
+/*
+ 每收到一个完整请求调用一次，ctx->s为该请求所属的连接。
+ 通常在其中调用modbus_reply()/modbus_reply_exception()，应答不会立即发送，
+ 而是在本轮事件处理完后与其他连接的应答一起批量提交。
+ */
+typedef int (*modbus_server_handler_t)(modbus_t *ctx, const uint8_t *req,
+                                       int req_length, void *user_data);
+
+/*
+ ctx: modbus_new_tcp()/modbus_new_tcp_pi()创建的实例（仅复制其配置）
+ server_socket: modbus_tcp_listen()/modbus_tcp_pi_listen()返回的监听套接字
+ */
+MODBUS_API modbus_server_t* modbus_server_new(modbus_t *ctx, int server_socket, int engine);
+MODBUS_API int modbus_server_get_engine(modbus_server_t *server);
+MODBUS_API int modbus_server_set_mapping(modbus_server_t *server, modbus_mapping_t *mb_mapping);
+MODBUS_API int modbus_server_set_handler(modbus_server_t *server,
+                                         modbus_server_handler_t handler, void *user_data);
+MODBUS_API int modbus_server_set_max_connections(modbus_server_t *server, int nb_connection);
+MODBUS_API int modbus_server_get_nb_connections(modbus_server_t *server);
+/*
+ 外部描述符（如串口）可读时在modbus_server_run()中调用，最多16个。
+ 回调中应读完所有可读数据（io_uring引擎只在有新数据时通知）。
+ */
+typedef void (*modbus_server_watch_t)(modbus_server_t *server, int fd, void *user_data);
+MODBUS_API int modbus_server_watch(modbus_server_t *server, int fd,
+                                   modbus_server_watch_t callback, void *user_data);
+MODBUS_API int modbus_server_unwatch(modbus_server_t *server, int fd);
+
+/*
+ 异步应答：在handler中取得当前请求所属连接的标识，之后（handler返回后）
+ 用modbus_server_send()发送完整的应答报文（含MBAP头），在下一轮run()中提交。
+ 连接已关闭时返回-1，errno为ENOTCONN。
+ */
+MODBUS_API int64_t modbus_server_get_connection(modbus_server_t *server);
+MODBUS_API int modbus_server_send(modbus_server_t *server, int64_t connection,
+                                  const uint8_t *rsp, int rsp_length);
+
+/* 处理一轮I/O事件，返回处理的请求数，超时返回0，timeout_ms < 0 表示一直等待 */
+MODBUS_API int modbus_server_run(modbus_server_t *server, int timeout_ms);
+MODBUS_API void modbus_server_free(modbus_server_t *server);
+
+MODBUS_END_DECLS
+
+#endif /* MODBUS_SERVER_H */
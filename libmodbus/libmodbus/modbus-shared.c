@@ -0,0 +1,972 @@
+/*
+ * Copyright © 2001-2013 Stéphane Raimbault <stephane.raimbault@gmail.com>
+ *
+ * SPDX-License-Identifier: LGPL-2.1+
+ */
+
+/*
+ 多线程共用的客户端：提交的请求压入无锁的单向链表（多生产者，I/O线程一次全部取走），
+ 管道（Windows下为事件）唤醒I/O线程；I/O线程编码、批量发送，按事务号匹配应答后回调或
+ 唤醒等待的线程。
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#ifndef _MSC_VER
+#include <unistd.h>
+#endif
+
+#include "modbus-private.h"
+#include "modbus-shared.h"
+
+#if defined(_WIN32)
+# include <windows.h>
+# include <process.h>
+#else
+# include <fcntl.h>
+# include <poll.h>
+# include <pthread.h>
+#endif
+
+/* Received bytes, several pipelined responses are parsed from one read */
+#define _SHARED_IN_LENGTH 4096
+
+/* Events returned by wait_io() */
+#define _SHARED_IO_IN  1
+#define _SHARED_IO_OUT 2
+
+#if defined(_WIN32)
+typedef CRITICAL_SECTION shared_mutex_t;
+typedef CONDITION_VARIABLE shared_cond_t;
+# define _shared_mutex_init(m)    InitializeCriticalSection(m)
+# define _shared_mutex_destroy(m) DeleteCriticalSection(m)
+# define _shared_lock(m)          EnterCriticalSection(m)
+# define _shared_unlock(m)        LeaveCriticalSection(m)
+# define _shared_cond_init(c)     InitializeConditionVariable(c)
+/* Nothing to release */
+# define _shared_cond_destroy(c)  ((void)0)
+# define _shared_wait(c, m)       SleepConditionVariableCS(c, m, INFINITE)
+# define _shared_signal(c)        WakeConditionVariable(c)
+# define _shared_load(p)          InterlockedCompareExchange(p, 0, 0)
+# define _shared_store(p, v)      InterlockedExchange(p, v)
+#else
+typedef pthread_mutex_t shared_mutex_t;
+typedef pthread_cond_t shared_cond_t;
+# define _shared_mutex_init(m)    pthread_mutex_init(m, NULL)
+# define _shared_mutex_destroy(m) pthread_mutex_destroy(m)
+# define _shared_lock(m)          pthread_mutex_lock(m)
+# define _shared_unlock(m)        pthread_mutex_unlock(m)
+# define _shared_cond_init(c)     pthread_cond_init(c, NULL)
+# define _shared_cond_destroy(c)  pthread_cond_destroy(c)
+# define _shared_wait(c, m)       pthread_cond_wait(c, m)
+# define _shared_signal(c)        pthread_cond_signal(c)
+# define _shared_load(p)          __atomic_load_n(p, __ATOMIC_ACQUIRE)
+# define _shared_store(p, v)      __atomic_store_n(p, v, __ATOMIC_RELEASE)
+#endif
+
+typedef struct _shared_request {
+    /* Submission queue, free list, pending list */
+    struct _shared_request *next;
+    int slave;
+    int pdu_length;
+    uint8_t pdu[MODBUS_MAX_PDU_LENGTH];
+    /* NULL for the synchronous calls */
+    modbus_shared_callback_t callback;
+    void *user_data;
+    /* Set by the I/O thread */
+    int adu_length;
+    uint8_t adu[MODBUS_MAX_ADU_LENGTH];
+    int64_t deadline;
+    /* Result of a synchronous call, under the mutex */
+    int done;
+    int rc;
+    int error;
+    int rsp_length;
+    uint8_t rsp[MODBUS_MAX_PDU_LENGTH];
+    shared_cond_t cond;
+} shared_request_t;
+
+struct _modbus_shared {
+    modbus_t *ctx;
+    int default_slave;
+    long window;
+    long stop;
+    /* Lock-free submissions, in reverse order */
+    shared_request_t *volatile queue;
+#if defined(_WIN32)
+    /* Auto-reset event, and the one of the socket (WSAEventSelect) */
+    HANDLE wake;
+    HANDLE io_event;
+    int event_s;
+    HANDLE thread;
+#else
+    int wake[2];
+    pthread_t thread;
+#endif
+
+    /* Free list and completions of the synchronous calls */
+    shared_mutex_t mutex;
+    shared_cond_t pool_cond;
+    shared_request_t *pool;
+    shared_request_t *requests;
+    int nb_requests;
+
+    /* Owned by the I/O thread. The serial port of Windows has no descriptor,
+       ctx->s doesn't tell whether it's open. */
+    int connected;
+    shared_request_t *pending_head;
+    shared_request_t *pending_tail;
+    shared_request_t *inflight[MODBUS_SHARED_MAX_WINDOW];
+    int nb_inflight;
+    int flush;
+    int out_sent;
+    int out_length;
+    uint8_t out[MODBUS_SHARED_MAX_WINDOW * MODBUS_MAX_ADU_LENGTH];
+    int in_length;
+    uint8_t in[_SHARED_IN_LENGTH];
+};
+
+static shared_request_t *acquire_request(modbus_shared_t *shared, int wait)
+{
+    shared_request_t *req;
+
+    _shared_lock(&shared->mutex);
+    while (shared->pool == NULL) {
+        if (!wait) {
+            _shared_unlock(&shared->mutex);
+            errno = EAGAIN;
+            return NULL;
+        }
+        _shared_wait(&shared->pool_cond, &shared->mutex);
+    }
+    req = shared->pool;
+    shared->pool = req->next;
+    _shared_unlock(&shared->mutex);
+
+    return req;
+}
+
+static void release_request(modbus_shared_t *shared, shared_request_t *req)
+{
+    _shared_lock(&shared->mutex);
+    req->next = shared->pool;
+    shared->pool = req;
+    _shared_signal(&shared->pool_cond);
+    _shared_unlock(&shared->mutex);
+}
+
+static void wake_io(modbus_shared_t *shared)
+{
+#if defined(_WIN32)
+    SetEvent(shared->wake);
+#else
+    ssize_t rc = write(shared->wake[1], "", 1);
+
+    (void)rc;
+#endif
+}
+
+static void push_request(modbus_shared_t *shared, shared_request_t *req)
+{
+    shared_request_t *head;
+
+#if defined(_WIN32)
+    do {
+        head = shared->queue;
+        req->next = head;
+    } while (InterlockedCompareExchangePointer((PVOID volatile *)&shared->queue,
+                                               req, head) != head);
+#else
+    head = __atomic_load_n(&shared->queue, __ATOMIC_RELAXED);
+    do {
+        req->next = head;
+    } while (!__atomic_compare_exchange_n(&shared->queue, &head, req, 1,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+#endif
+
+    /* The I/O thread takes the whole list, it's woken up by the first one */
+    if (head == NULL)
+        wake_io(shared);
+}
+
+/* rsp is the whole response, NULL on error */
+static void complete(modbus_shared_t *shared, shared_request_t *req, int rc, int error,
+                     const uint8_t *rsp, int rsp_length)
+{
+    modbus_t *ctx = shared->ctx;
+    modbus_view_t view;
+    int pdu_length = 0;
+
+    if (rsp != NULL) {
+        view.pdu = rsp + ctx->backend->header_length;
+        view.pdu_length = rsp_length - ctx->backend->header_length -
+            ctx->backend->checksum_length;
+        view.data = view.pdu + 2;
+        view.nb = rc;
+        pdu_length = view.pdu_length;
+    }
+
+    if (req->callback != NULL) {
+        errno = error;
+        req->callback(rc, rsp != NULL ? &view : NULL, req->user_data);
+        release_request(shared, req);
+        return;
+    }
+
+    _shared_lock(&shared->mutex);
+    if (rsp != NULL)
+        memcpy(req->rsp, view.pdu, pdu_length);
+    req->rsp_length = pdu_length;
+    req->rc = rc;
+    req->error = error;
+    req->done = TRUE;
+    _shared_signal(&req->cond);
+    _shared_unlock(&shared->mutex);
+}
+
+static void remove_inflight(modbus_shared_t *shared, int i)
+{
+    shared->nb_inflight--;
+    memmove(shared->inflight + i, shared->inflight + i + 1,
+            (shared->nb_inflight - i) * sizeof(shared_request_t *));
+}
+
+/* All the requests on the connection fail, the next one reconnects */
+static void link_error(modbus_shared_t *shared, int error)
+{
+    if (shared->ctx->debug) {
+        fprintf(stderr, "ERROR %s\n", modbus_strerror(error));
+    }
+
+    modbus_close(shared->ctx);
+    shared->connected = FALSE;
+#if defined(_WIN32)
+    /* The next socket may get the same number */
+    shared->event_s = -1;
+#endif
+    shared->out_sent = 0;
+    shared->out_length = 0;
+    shared->in_length = 0;
+    shared->flush = FALSE;
+    while (shared->nb_inflight > 0) {
+        shared_request_t *req = shared->inflight[0];
+
+        remove_inflight(shared, 0);
+        complete(shared, req, -1, error, NULL, 0);
+    }
+}
+
+static void take_submissions(modbus_shared_t *shared)
+{
+#if defined(_WIN32)
+    shared_request_t *list = (shared_request_t *)InterlockedExchangePointer(
+        (PVOID volatile *)&shared->queue, NULL);
+#else
+    shared_request_t *list = __atomic_exchange_n(&shared->queue, NULL, __ATOMIC_ACQUIRE);
+#endif
+    shared_request_t *head = NULL;
+
+    /* Back to the order of submission */
+    while (list != NULL) {
+        shared_request_t *next = list->next;
+
+        list->next = head;
+        head = list;
+        list = next;
+    }
+
+    if (head == NULL)
+        return;
+
+    if (shared->pending_tail != NULL) {
+        shared->pending_tail->next = head;
+    } else {
+        shared->pending_head = head;
+    }
+    while (head->next != NULL)
+        head = head->next;
+    shared->pending_tail = head;
+}
+
+static shared_request_t *pop_pending(modbus_shared_t *shared)
+{
+    shared_request_t *req = shared->pending_head;
+
+    shared->pending_head = req->next;
+    if (shared->pending_head == NULL)
+        shared->pending_tail = NULL;
+
+    return req;
+}
+
+/* Encodes the pending requests into the output buffer up to the window */
+static void dispatch(modbus_shared_t *shared)
+{
+    modbus_t *ctx = shared->ctx;
+    int window = (ctx->backend->backend_type == _MODBUS_BACKEND_TYPE_RTU) ?
+        1 : (int)shared->window;
+
+    while (shared->pending_head != NULL && shared->nb_inflight < window) {
+        shared_request_t *req;
+
+        if (shared->out_sent > 0) {
+            shared->out_length -= shared->out_sent;
+            memmove(shared->out, shared->out + shared->out_sent, shared->out_length);
+            shared->out_sent = 0;
+        }
+        /* The broadcasts and the requests which have timed out before being
+           sent aren't in flight, the rest waits for the output to drain */
+        if (shared->out_length + MODBUS_MAX_ADU_LENGTH > (int)sizeof(shared->out))
+            break;
+
+        if (!shared->connected) {
+            if (modbus_connect(ctx) == -1) {
+                complete(shared, pop_pending(shared), -1, errno, NULL, 0);
+                continue;
+            }
+            shared->connected = TRUE;
+        }
+
+        /* Garbage of a serial response which has timed out */
+        if (shared->flush && shared->nb_inflight == 0) {
+            modbus_flush(ctx);
+            shared->in_length = 0;
+            shared->flush = FALSE;
+        }
+
+        req = pop_pending(shared);
+        ctx->slave = (req->slave == -1) ? shared->default_slave : req->slave;
+        req->adu_length = modbus_encode_request(ctx, req->pdu, req->pdu_length, req->adu);
+        if (req->adu_length == -1) {
+            complete(shared, req, -1, errno, NULL, 0);
+            continue;
+        }
+
+        memcpy(shared->out + shared->out_length, req->adu, req->adu_length);
+        shared->out_length += req->adu_length;
+
+        if (ctx->backend->backend_type == _MODBUS_BACKEND_TYPE_RTU &&
+            ctx->slave == MODBUS_BROADCAST_ADDRESS) {
+            /* No response on a serial line */
+            complete(shared, req, 0, 0, NULL, 0);
+            continue;
+        }
+
+        req->deadline = _modbus_monotonic_us() +
+            (int64_t)ctx->response_timeout.tv_sec * 1000000 +
+            ctx->response_timeout.tv_usec;
+        shared->inflight[shared->nb_inflight++] = req;
+    }
+}
+
+static void send_out(modbus_shared_t *shared)
+{
+    while (shared->out_sent < shared->out_length) {
+        int rc = modbus_send_bytes(shared->ctx, shared->out + shared->out_sent,
+                                   shared->out_length - shared->out_sent);
+
+        if (rc > 0) {
+            shared->out_sent += rc;
+        } else if (rc == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return;
+        } else {
+            link_error(shared, errno);
+            return;
+        }
+    }
+
+    shared->out_sent = 0;
+    shared->out_length = 0;
+}
+
+static void handle_response(modbus_shared_t *shared, const uint8_t *rsp, int rsp_length)
+{
+    modbus_t *ctx = shared->ctx;
+    shared_request_t *req = NULL;
+    int i;
+    int rc;
+
+    for (i = 0; i < shared->nb_inflight; i++) {
+        req = shared->inflight[i];
+        /* Serial line: only one request in flight */
+        if (ctx->backend->backend_type != _MODBUS_BACKEND_TYPE_TCP ||
+            (rsp[0] == req->adu[0] && rsp[1] == req->adu[1]))
+            break;
+    }
+    if (i == shared->nb_inflight) {
+        /* Late response to a request which has timed out */
+        return;
+    }
+
+    remove_inflight(shared, i);
+    rc = modbus_check_confirmation(ctx, req->adu, rsp, rsp_length);
+    if (rc == -1) {
+        if (ctx->backend->backend_type == _MODBUS_BACKEND_TYPE_RTU)
+            shared->flush = TRUE;
+        complete(shared, req, -1, errno, NULL, 0);
+    } else {
+        complete(shared, req, rc, 0, rsp, rsp_length);
+    }
+}
+
+static void receive_in(modbus_shared_t *shared)
+{
+    modbus_t *ctx = shared->ctx;
+    int offset = 0;
+    int length;
+    int rc;
+
+    rc = modbus_receive_bytes(ctx, shared->in + shared->in_length,
+                              _SHARED_IN_LENGTH - shared->in_length);
+    if (rc == -1) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
+            link_error(shared, errno);
+        return;
+    }
+    shared->in_length += rc;
+
+    for (;;) {
+        length = modbus_confirmation_length(ctx, shared->in + offset,
+                                            shared->in_length - offset);
+        if (length > MODBUS_MAX_ADU_LENGTH) {
+            if (ctx->backend->backend_type == _MODBUS_BACKEND_TYPE_TCP) {
+                /* The stream can't be split into responses anymore */
+                link_error(shared, EMBBADDATA);
+                return;
+            }
+            shared->flush = TRUE;
+            shared->in_length = 0;
+            if (shared->nb_inflight > 0) {
+                shared_request_t *req = shared->inflight[0];
+
+                remove_inflight(shared, 0);
+                complete(shared, req, -1, EMBBADDATA, NULL, 0);
+            }
+            return;
+        }
+        if (length > shared->in_length - offset)
+            break;
+
+        handle_response(shared, shared->in + offset, length);
+        offset += length;
+    }
+
+    if (ctx->backend->backend_type == _MODBUS_BACKEND_TYPE_RTU) {
+        /* Nothing is expected after the response */
+        if (offset > 0)
+            shared->in_length = 0;
+    } else if (offset > 0) {
+        shared->in_length -= offset;
+        memmove(shared->in, shared->in + offset, shared->in_length);
+    }
+}
+
+static int expire(modbus_shared_t *shared)
+{
+    int64_t now = _modbus_monotonic_us();
+    int64_t next = -1;
+    int i = 0;
+
+    while (i < shared->nb_inflight) {
+        shared_request_t *req = shared->inflight[i];
+
+        if (req->deadline <= now) {
+            remove_inflight(shared, i);
+            if (shared->ctx->backend->backend_type == _MODBUS_BACKEND_TYPE_RTU)
+                shared->flush = TRUE;
+            complete(shared, req, -1, ETIMEDOUT, NULL, 0);
+            continue;
+        }
+        if (next == -1 || req->deadline < next)
+            next = req->deadline;
+        i++;
+    }
+
+    /* Milliseconds to the next deadline, rounded up */
+    return (next == -1) ? -1 : (int)((next - now + 999) / 1000);
+}
+
+#if defined(_WIN32)
+/* Returns the events of the connection, 0 on timeout or wake up */
+static int wait_io(modbus_shared_t *shared, int timeout)
+{
+    modbus_t *ctx = shared->ctx;
+    HANDLE events[2];
+    DWORD nb_events = 1;
+    DWORD rc;
+
+    if (ctx->backend->backend_type == _MODBUS_BACKEND_TYPE_RTU) {
+        struct timeval tv;
+
+        if (!shared->connected || shared->nb_inflight == 0) {
+            rc = WaitForSingleObject(shared->wake, (timeout < 0) ? INFINITE : (DWORD)timeout);
+            return (rc == WAIT_FAILED) ? -1 : 0;
+        }
+
+        /* The serial port is read by the select of the backend. One request
+           is in flight, the next ones wait for its response anyway. */
+        tv.tv_sec = timeout / 1000;
+        tv.tv_usec = (timeout % 1000) * 1000;
+        return (ctx->backend->select(ctx, &tv, MODBUS_MAX_ADU_LENGTH) == -1) ?
+            0 : _SHARED_IO_IN;
+    }
+
+    events[0] = shared->wake;
+    if (shared->connected && (shared->nb_inflight > 0 || shared->out_length > 0)) {
+        if (shared->event_s != ctx->s) {
+            if (WSAEventSelect(ctx->s, shared->io_event,
+                               FD_READ | FD_WRITE | FD_CLOSE) == SOCKET_ERROR)
+                return _SHARED_IO_IN;
+            shared->event_s = ctx->s;
+        }
+        events[nb_events++] = shared->io_event;
+    }
+
+    rc = WaitForMultipleObjects(nb_events, events, FALSE,
+                                (timeout < 0) ? INFINITE : (DWORD)timeout);
+    if (rc == WAIT_FAILED)
+        return -1;
+
+    if (rc == WAIT_OBJECT_0 + 1) {
+        WSANETWORKEVENTS network_events;
+        int io = 0;
+
+        /* The error is reported by the next receive */
+        if (WSAEnumNetworkEvents(ctx->s, shared->io_event, &network_events) == SOCKET_ERROR)
+            return _SHARED_IO_IN;
+        /* Write is signaled again after a send which would block */
+        if (network_events.lNetworkEvents & FD_WRITE)
+            io |= _SHARED_IO_OUT;
+        /* Read again after each receive while data is left */
+        if (network_events.lNetworkEvents & (FD_READ | FD_CLOSE))
+            io |= _SHARED_IO_IN;
+        return io;
+    }
+    return 0;
+}
+#else
+/* Returns the events of the connection, 0 on timeout or wake up */
+static int wait_io(modbus_shared_t *shared, int timeout)
+{
+    modbus_t *ctx = shared->ctx;
+    struct pollfd fds[2];
+    nfds_t nfds = 1;
+    char drain[64];
+    int io = 0;
+
+    fds[0].fd = shared->wake[0];
+    fds[0].events = POLLIN;
+    fds[0].revents = 0;
+    if (shared->connected && (shared->nb_inflight > 0 || shared->out_length > 0)) {
+        fds[1].fd = ctx->s;
+        fds[1].events = (shared->nb_inflight > 0 ? POLLIN : 0) |
+            (shared->out_length > 0 ? POLLOUT : 0);
+        fds[1].revents = 0;
+        nfds = 2;
+    }
+
+    if (poll(fds, nfds, timeout) == -1)
+        return (errno == EINTR) ? 0 : -1;
+
+    if (nfds == 2) {
+        if (fds[1].revents & POLLOUT)
+            io |= _SHARED_IO_OUT;
+        if (fds[1].revents & (POLLIN | POLLERR | POLLHUP))
+            io |= _SHARED_IO_IN;
+    }
+    if (fds[0].revents & POLLIN) {
+        while (read(shared->wake[0], drain, sizeof(drain)) > 0)
+            ;
+    }
+    return io;
+}
+#endif
+
+static void io_loop(modbus_shared_t *shared)
+{
+    while (!_shared_load(&shared->stop)) {
+        int timeout;
+        int io;
+
+        take_submissions(shared);
+        dispatch(shared);
+        if (shared->out_length > 0)
+            send_out(shared);
+
+        timeout = expire(shared);
+        io = wait_io(shared, timeout);
+        if (io == -1)
+            break;
+
+        if (io & _SHARED_IO_OUT)
+            send_out(shared);
+        if (io & _SHARED_IO_IN)
+            receive_in(shared);
+        expire(shared);
+    }
+
+    /* Shutdown, everything left is cancelled */
+    take_submissions(shared);
+    while (shared->nb_inflight > 0) {
+        shared_request_t *req = shared->inflight[0];
+
+        remove_inflight(shared, 0);
+        complete(shared, req, -1, ECANCELED, NULL, 0);
+    }
+    while (shared->pending_head != NULL)
+        complete(shared, pop_pending(shared), -1, ECANCELED, NULL, 0);
+}
+
+#if defined(_WIN32)
+static unsigned __stdcall io_thread(void *arg)
+{
+    io_loop((modbus_shared_t *)arg);
+    return 0;
+}
+#else
+static void *io_thread(void *arg)
+{
+    io_loop((modbus_shared_t *)arg);
+    return NULL;
+}
+#endif
+
+/* Releases what modbus_shared_new() has created, the I/O thread is stopped */
+static void destroy(modbus_shared_t *shared)
+{
+    int i;
+
+    for (i = 0; i < shared->nb_requests; i++)
+        _shared_cond_destroy(&shared->requests[i].cond);
+    _shared_cond_destroy(&shared->pool_cond);
+    _shared_mutex_destroy(&shared->mutex);
+#if defined(_WIN32)
+    CloseHandle(shared->wake);
+    WSACloseEvent(shared->io_event);
+#else
+    close(shared->wake[0]);
+    close(shared->wake[1]);
+#endif
+    free(shared->requests);
+    free(shared);
+}
+
+modbus_shared_t* modbus_shared_new(modbus_t *ctx, int nb_requests)
+{
+    modbus_shared_t *shared;
+    int i;
+
+    if (ctx == NULL || nb_requests < 1) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    shared = (modbus_shared_t *)calloc(1, sizeof(modbus_shared_t));
+    if (shared == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    shared->requests = (shared_request_t *)calloc(nb_requests, sizeof(shared_request_t));
+    if (shared->requests == NULL) {
+        free(shared);
+        errno = ENOMEM;
+        return NULL;
+    }
+#if defined(_WIN32)
+    shared->wake = CreateEvent(NULL, FALSE, FALSE, NULL);
+    shared->io_event = WSACreateEvent();
+    if (shared->wake == NULL || shared->io_event == WSA_INVALID_EVENT) {
+        if (shared->wake != NULL)
+            CloseHandle(shared->wake);
+        if (shared->io_event != WSA_INVALID_EVENT)
+            WSACloseEvent(shared->io_event);
+        free(shared->requests);
+        free(shared);
+        errno = ENOMEM;
+        return NULL;
+    }
+    shared->event_s = -1;
+    /* Opened by the I/O thread */
+    shared->connected = (ctx->backend->backend_type == _MODBUS_BACKEND_TYPE_TCP &&
+                         ctx->s != -1);
+#else
+    if (pipe(shared->wake) == -1) {
+        free(shared->requests);
+        free(shared);
+        return NULL;
+    }
+    fcntl(shared->wake[0], F_SETFL, O_NONBLOCK);
+    fcntl(shared->wake[1], F_SETFL, O_NONBLOCK);
+    shared->connected = (ctx->s != -1);
+#endif
+
+    shared->ctx = ctx;
+    shared->default_slave = ctx->slave;
+    shared->window = MODBUS_SHARED_DEFAULT_WINDOW;
+    shared->nb_requests = nb_requests;
+    _shared_mutex_init(&shared->mutex);
+    _shared_cond_init(&shared->pool_cond);
+    for (i = nb_requests - 1; i >= 0; i--) {
+        _shared_cond_init(&shared->requests[i].cond);
+        shared->requests[i].next = shared->pool;
+        shared->pool = &shared->requests[i];
+    }
+
+#if defined(_WIN32)
+    shared->thread = (HANDLE)_beginthreadex(NULL, 0, io_thread, shared, 0, NULL);
+    if (shared->thread == 0) {
+        destroy(shared);
+        return NULL;
+    }
+#else
+    errno = pthread_create(&shared->thread, NULL, io_thread, shared);
+    if (errno != 0) {
+        destroy(shared);
+        return NULL;
+    }
+#endif
+
+    return shared;
+}
+
+int modbus_shared_set_window(modbus_shared_t *shared, int window)
+{
+    if (shared == NULL || window < 1 || window > MODBUS_SHARED_MAX_WINDOW) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    _shared_store(&shared->window, window);
+    return 0;
+}
+
+void modbus_shared_free(modbus_shared_t *shared)
+{
+    if (shared == NULL)
+        return;
+
+    _shared_store(&shared->stop, TRUE);
+    wake_io(shared);
+#if defined(_WIN32)
+    WaitForSingleObject(shared->thread, INFINITE);
+    CloseHandle(shared->thread);
+    /* The socket goes back to the caller without the event */
+    if (shared->event_s != -1 && shared->event_s == shared->ctx->s)
+        WSAEventSelect(shared->ctx->s, NULL, 0);
+#else
+    pthread_join(shared->thread, NULL);
+#endif
+
+    shared->ctx->slave = shared->default_slave;
+    destroy(shared);
+}
+
+static shared_request_t *fill_request(modbus_shared_t *shared, int wait, int slave,
+                                      const uint8_t *pdu, int pdu_length)
+{
+    shared_request_t *req;
+
+    if (shared == NULL || slave < -1 || slave > 247 || pdu == NULL ||
+        pdu_length < 1 || pdu_length > MODBUS_MAX_PDU_LENGTH) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    req = acquire_request(shared, wait);
+    if (req == NULL)
+        return NULL;
+
+    req->slave = slave;
+    req->pdu_length = pdu_length;
+    memcpy(req->pdu, pdu, pdu_length);
+    req->done = FALSE;
+
+    return req;
+}
+
+int modbus_shared_submit(modbus_shared_t *shared, int slave,
+                         const uint8_t *pdu, int pdu_length,
+                         modbus_shared_callback_t callback, void *user_data)
+{
+    shared_request_t *req;
+
+    if (callback == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    req = fill_request(shared, FALSE, slave, pdu, pdu_length);
+    if (req == NULL)
+        return -1;
+
+    req->callback = callback;
+    req->user_data = user_data;
+    push_request(shared, req);
+
+    return 0;
+}
+
+int modbus_shared_transaction(modbus_shared_t *shared, int slave,
+                              const uint8_t *pdu, int pdu_length,
+                              uint8_t *rsp_pdu)
+{
+    shared_request_t *req;
+    int error;
+    int rc;
+
+    req = fill_request(shared, TRUE, slave, pdu, pdu_length);
+    if (req == NULL)
+        return -1;
+
+    req->callback = NULL;
+    req->user_data = NULL;
+    push_request(shared, req);
+
+    _shared_lock(&shared->mutex);
+    while (!req->done)
+        _shared_wait(&req->cond, &shared->mutex);
+    _shared_unlock(&shared->mutex);
+
+    rc = req->rc;
+    error = req->error;
+    if (rc != -1 && rsp_pdu != NULL)
+        memcpy(rsp_pdu, req->rsp, req->rsp_length);
+    release_request(shared, req);
+
+    if (rc == -1)
+        errno = error;
+    return rc;
+}
+
+static int read_io_status(modbus_shared_t *shared, int slave, int function,
+                          int addr, int nb, uint8_t *dest)
+{
+    uint8_t pdu[5];
+    uint8_t rsp[MODBUS_MAX_PDU_LENGTH];
+    int rc;
+
+    if (dest == NULL || nb < 1) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (nb > MODBUS_MAX_READ_BITS) {
+        errno = EMBMDATA;
+        return -1;
+    }
+
+    pdu[0] = (uint8_t)function;
+    pdu[1] = (uint8_t)(addr >> 8);
+    pdu[2] = (uint8_t)(addr & 0x00ff);
+    pdu[3] = (uint8_t)(nb >> 8);
+    pdu[4] = (uint8_t)(nb & 0x00ff);
+
+    rc = modbus_shared_transaction(shared, slave, pdu, sizeof(pdu), rsp);
+    if (rc == -1)
+        return -1;
+
+    modbus_set_bits_from_bytes(dest, 0, nb, rsp + 2);
+    return nb;
+}
+
+static int read_registers(modbus_shared_t *shared, int slave, int function,
+                          int addr, int nb, uint16_t *dest)
+{
+    uint8_t pdu[5];
+    uint8_t rsp[MODBUS_MAX_PDU_LENGTH];
+    int rc;
+    int i;
+
+    if (dest == NULL || nb < 1) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (nb > MODBUS_MAX_READ_REGISTERS) {
+        errno = EMBMDATA;
+        return -1;
+    }
+
+    pdu[0] = (uint8_t)function;
+    pdu[1] = (uint8_t)(addr >> 8);
+    pdu[2] = (uint8_t)(addr & 0x00ff);
+    pdu[3] = (uint8_t)(nb >> 8);
+    pdu[4] = (uint8_t)(nb & 0x00ff);
+
+    rc = modbus_shared_transaction(shared, slave, pdu, sizeof(pdu), rsp);
+    if (rc == -1)
+        return -1;
+
+    for (i = 0; i < nb; i++) {
+        dest[i] = (rsp[2 + 2 * i] << 8) | rsp[3 + 2 * i];
+    }
+    return nb;
+}
+
+int modbus_shared_read_bits(modbus_shared_t *shared, int slave, int addr, int nb,
+                            uint8_t *dest)
+{
+    return read_io_status(shared, slave, MODBUS_FC_READ_COILS, addr, nb, dest);
+}
+
+int modbus_shared_read_input_bits(modbus_shared_t *shared, int slave, int addr,
+                                  int nb, uint8_t *dest)
+{
+    return read_io_status(shared, slave, MODBUS_FC_READ_DISCRETE_INPUTS, addr, nb, dest);
+}
+
+int modbus_shared_read_registers(modbus_shared_t *shared, int slave, int addr,
+                                 int nb, uint16_t *dest)
+{
+    return read_registers(shared, slave, MODBUS_FC_READ_HOLDING_REGISTERS, addr, nb, dest);
+}
+
+int modbus_shared_read_input_registers(modbus_shared_t *shared, int slave,
+                                       int addr, int nb, uint16_t *dest)
+{
+    return read_registers(shared, slave, MODBUS_FC_READ_INPUT_REGISTERS, addr, nb, dest);
+}
+
+int modbus_shared_write_register(modbus_shared_t *shared, int slave, int addr,
+                                 uint16_t value)
+{
+    uint8_t pdu[5];
+
+    pdu[0] = MODBUS_FC_WRITE_SINGLE_REGISTER;
+    pdu[1] = (uint8_t)(addr >> 8);
+    pdu[2] = (uint8_t)(addr & 0x00ff);
+    pdu[3] = (uint8_t)(value >> 8);
+    pdu[4] = (uint8_t)(value & 0x00ff);
+
+    return modbus_shared_transaction(shared, slave, pdu, sizeof(pdu), NULL);
+}
+
+int modbus_shared_write_registers(modbus_shared_t *shared, int slave, int addr,
+                                  int nb, const uint16_t *src)
+{
+    uint8_t pdu[MODBUS_MAX_PDU_LENGTH];
+    int pdu_length = 6;
+    int i;
+
+    if (src == NULL || nb < 1) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (nb > MODBUS_MAX_WRITE_REGISTERS) {
+        errno = EMBMDATA;
+        return -1;
+    }
+
+    pdu[0] = MODBUS_FC_WRITE_MULTIPLE_REGISTERS;
+    pdu[1] = (uint8_t)(addr >> 8);
+    pdu[2] = (uint8_t)(addr & 0x00ff);
+    pdu[3] = (uint8_t)(nb >> 8);
+    pdu[4] = (uint8_t)(nb & 0x00ff);
+    pdu[5] = (uint8_t)(nb * 2);
+    for (i = 0; i < nb; i++) {
+        pdu[pdu_length++] = (uint8_t)(src[i] >> 8);
+        pdu[pdu_length++] = (uint8_t)(src[i] & 0x00ff);
+    }
+
+    return modbus_shared_transaction(shared, slave, pdu, pdu_length, NULL);
+}
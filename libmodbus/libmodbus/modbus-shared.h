@@ -0,0 +1,73 @@
+/*
+ * Copyright © 2001-2013 Stéphane Raimbault <stephane.raimbault@gmail.com>
+ *
+ * SPDX-License-Identifier: LGPL-2.1+
+ */
+
+#ifndef MODBUS_SHARED_H
+#define MODBUS_SHARED_H
+
+#include "modbus.h"
+
+MODBUS_BEGIN_DECLS
+
+/*
+ 多线程共用的客户端。
+ modbus_t不是线程安全的，各线程各自连接又会超出设备的连接数限制（很多PLC只允许4~8个）。
+ modbus_shared_t内部有一个I/O线程独占该实例的连接，任何线程提交的请求经无锁队列交给它，
+ TCP下按事务号(transaction id)同时发出多个请求（流水线），RTU下逐个进行。
+ - 请求对象来自创建时分配的池，运行中不再分配内存；池用完时异步提交返回EAGAIN，同步调用等待
+ - 每个请求的超时为实例的应答超时，从发出时计算
+ - 连接由I/O线程建立，断开后在下一个请求前重新连接
+ - 创建后不能再直接使用该实例，modbus_shared_free()之后归还调用者
+ Windows下RTU实例的串口总是由I/O线程打开，创建前不要连接。
+ */
+
+/* Requests sent without waiting for the responses, TCP only */
+#define MODBUS_SHARED_DEFAULT_WINDOW 16
+#define MODBUS_SHARED_MAX_WINDOW     64
+
+typedef struct _modbus_shared modbus_shared_t;
+
+/*
+ 在I/O线程中调用，不能阻塞。
+ rc：同阻塞调用的返回值，失败为-1且errno为错误码；view：成功时为应答，只在回调中有效
+ */
+typedef void (*modbus_shared_callback_t)(int rc, const modbus_view_t *view, void *user_data);
+
+/* ctx: modbus_new_tcp()/modbus_new_tcp_pi()/modbus_new_rtu()创建的实例；nb_requests: 池的大小 */
+MODBUS_API modbus_shared_t* modbus_shared_new(modbus_t *ctx, int nb_requests);
+/* 同时在途的请求数，1~MODBUS_SHARED_MAX_WINDOW，在第一个请求前设置 */
+MODBUS_API int modbus_shared_set_window(modbus_shared_t *shared, int window);
+/* 停止I/O线程，未完成的请求以ECANCELED结束 */
+MODBUS_API void modbus_shared_free(modbus_shared_t *shared);
+
+/*
+ 异步提交，slave为-1时使用实例的从站地址，pdu为功能码+数据，
+ 结果在I/O线程中通过回调报告
+ */
+MODBUS_API int modbus_shared_submit(modbus_shared_t *shared, int slave,
+                                    const uint8_t *pdu, int pdu_length,
+                                    modbus_shared_callback_t callback, void *user_data);
+/* 同步调用，rsp（可为NULL）得到应答的PDU，返回值同阻塞调用 */
+MODBUS_API int modbus_shared_transaction(modbus_shared_t *shared, int slave,
+                                         const uint8_t *pdu, int pdu_length,
+                                         uint8_t *rsp_pdu);
+
+/* 与modbus_read_bits()等相同，可在任意线程中调用 */
+MODBUS_API int modbus_shared_read_bits(modbus_shared_t *shared, int slave, int addr, int nb,
+                                       uint8_t *dest);
+MODBUS_API int modbus_shared_read_input_bits(modbus_shared_t *shared, int slave, int addr,
+                                             int nb, uint8_t *dest);
+MODBUS_API int modbus_shared_read_registers(modbus_shared_t *shared, int slave, int addr,
+                                            int nb, uint16_t *dest);
+MODBUS_API int modbus_shared_read_input_registers(modbus_shared_t *shared, int slave,
+                                                  int addr, int nb, uint16_t *dest);
+MODBUS_API int modbus_shared_write_register(modbus_shared_t *shared, int slave, int addr,
+                                            uint16_t value);
+MODBUS_API int modbus_shared_write_registers(modbus_shared_t *shared, int slave, int addr,
+                                             int nb, const uint16_t *src);
+
+MODBUS_END_DECLS
+
+#endif /* MODBUS_SHARED_H */
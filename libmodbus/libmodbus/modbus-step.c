@@ -0,0 +1,525 @@
+/*
+ * Copyright © 2001-2013 Stéphane Raimbault <stephane.raimbault@gmail.com>
+ *
+ * SPDX-License-Identifier: LGPL-2.1+
+ */
+
+/*
+ 分步接口：请求的发送和应答的接收由外部事件循环按套接字的就绪状态推进，
+ 不调用会等待的函数。状态在第一次使用时分配，随modbus_free()释放。
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "modbus-private.h"
+#include "modbus-step.h"
+
+typedef struct _modbus_step_entry {
+    /* modbus_begin_connect() in progress, no request */
+    int connect;
+    int req_length;
+    modbus_step_callback_t callback;
+    void *user_data;
+    uint8_t req[MODBUS_MAX_ADU_LENGTH];
+} modbus_step_entry_t;
+
+struct _modbus_step {
+    modbus_step_state_t state;
+    /* Connection in progress, from modbus_begin_connect() or the link
+       recovery */
+    int connecting;
+    /* Flush the receive side before the next request */
+    int flush;
+    int64_t deadline;
+    int sent;
+    int rsp_length;
+    /* Result of the head request when it has no callback */
+    int rc;
+    int error;
+    int head;
+    int count;
+    modbus_step_entry_t entries[MODBUS_STEP_QUEUE_LENGTH];
+    uint8_t rsp[MODBUS_MAX_ADU_LENGTH];
+};
+
+static struct _modbus_step *get_step(modbus_t *ctx)
+{
+    if (ctx->step == NULL) {
+        ctx->step = (struct _modbus_step *)calloc(1, sizeof(struct _modbus_step));
+        if (ctx->step == NULL) {
+            errno = ENOMEM;
+            return NULL;
+        }
+        ctx->step->state = MODBUS_STEP_IDLE;
+    }
+
+    return ctx->step;
+}
+
+static void set_deadline(modbus_t *ctx, struct _modbus_step *step)
+{
+    step->deadline = _modbus_monotonic_us() +
+        (int64_t)ctx->response_timeout.tv_sec * 1000000 +
+        ctx->response_timeout.tv_usec;
+}
+
+/* Starts the head of the queue, no I/O but the flush */
+static void start_next(modbus_t *ctx, struct _modbus_step *step)
+{
+    if (step->connecting) {
+        step->state = MODBUS_STEP_CONNECTING;
+        return;
+    }
+
+    if (step->count == 0) {
+        step->state = MODBUS_STEP_IDLE;
+        return;
+    }
+
+    if (step->flush) {
+        modbus_flush(ctx);
+        step->flush = FALSE;
+    }
+    step->sent = 0;
+    step->rsp_length = 0;
+    step->state = MODBUS_STEP_SENDING;
+    set_deadline(ctx, step);
+}
+
+static void fill_view(modbus_t *ctx, struct _modbus_step *step, int rc,
+                      modbus_view_t *view)
+{
+    view->pdu = step->rsp + ctx->backend->header_length;
+    view->pdu_length = step->rsp_length - ctx->backend->header_length -
+        ctx->backend->checksum_length;
+    view->data = view->pdu + 2;
+    view->nb = rc;
+}
+
+/* Reports the result of the head entry, returns the number of completions */
+static int finish(modbus_t *ctx, struct _modbus_step *step, int rc, int error)
+{
+    modbus_step_entry_t *entry = &step->entries[step->head];
+    modbus_step_callback_t callback = entry->callback;
+    void *user_data = entry->user_data;
+    modbus_view_t view;
+    int with_view = (rc != -1 && !entry->connect);
+
+    if (callback == NULL) {
+        /* Kept until modbus_get_step_result() */
+        step->rc = rc;
+        step->error = error;
+        step->state = MODBUS_STEP_DONE;
+        return 1;
+    }
+
+    if (with_view)
+        fill_view(ctx, step, rc, &view);
+
+    step->head = (step->head + 1) % MODBUS_STEP_QUEUE_LENGTH;
+    step->count--;
+    start_next(ctx, step);
+
+    /* The response stays in step->rsp until the next one is received */
+    errno = error;
+    callback(ctx, rc, with_view ? &view : NULL, user_data);
+
+    return 1;
+}
+
+/* Send or receive error, the connection is reestablished with the link
+   recovery before the next request */
+static int link_error(modbus_t *ctx, struct _modbus_step *step)
+{
+    int error = errno;
+
+    if (ctx->error_recovery & MODBUS_ERROR_RECOVERY_LINK) {
+        modbus_close(ctx);
+        if (modbus_connect_start(ctx) == -1) {
+            if (errno == EINPROGRESS) {
+                step->connecting = TRUE;
+                set_deadline(ctx, step);
+            } else {
+                modbus_close(ctx);
+            }
+        }
+    }
+
+    return finish(ctx, step, -1, error);
+}
+
+static int end_connect(modbus_t *ctx, struct _modbus_step *step, int error)
+{
+    step->connecting = FALSE;
+    if (error != 0)
+        modbus_close(ctx);
+
+    if (step->count > 0 && step->entries[step->head].connect)
+        return finish(ctx, step, error == 0 ? 0 : -1, error);
+
+    start_next(ctx, step);
+    return 0;
+}
+
+int modbus_begin_connect(modbus_t *ctx, modbus_step_callback_t callback,
+                         void *user_data)
+{
+    struct _modbus_step *step;
+    modbus_step_entry_t *entry;
+
+    if (ctx == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    step = get_step(ctx);
+    if (step == NULL)
+        return -1;
+
+    if (step->state != MODBUS_STEP_IDLE) {
+        errno = EBUSY;
+        return -1;
+    }
+
+    if (modbus_connect_start(ctx) == 0)
+        return 0;
+    if (errno != EINPROGRESS)
+        return -1;
+
+    entry = &step->entries[step->head];
+    entry->connect = TRUE;
+    entry->req_length = 0;
+    entry->callback = callback;
+    entry->user_data = user_data;
+    step->count = 1;
+    step->connecting = TRUE;
+    step->flush = FALSE;
+    step->state = MODBUS_STEP_CONNECTING;
+    set_deadline(ctx, step);
+
+    errno = EINPROGRESS;
+    return -1;
+}
+
+int modbus_begin_request(modbus_t *ctx, const uint8_t *pdu, int pdu_length,
+                         modbus_step_callback_t callback, void *user_data)
+{
+    struct _modbus_step *step;
+    modbus_step_entry_t *entry;
+    int rc;
+
+    if (ctx == NULL || pdu == NULL || pdu_length < 1 ||
+        pdu_length > MODBUS_MAX_PDU_LENGTH) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    step = get_step(ctx);
+    if (step == NULL)
+        return -1;
+
+    if (step->count == MODBUS_STEP_QUEUE_LENGTH) {
+        errno = EBUSY;
+        return -1;
+    }
+
+    entry = &step->entries[(step->head + step->count) % MODBUS_STEP_QUEUE_LENGTH];
+    rc = modbus_encode_request(ctx, pdu, pdu_length, entry->req);
+    if (rc == -1)
+        return -1;
+
+    entry->connect = FALSE;
+    entry->req_length = rc;
+    entry->callback = callback;
+    entry->user_data = user_data;
+    step->count++;
+
+    if (step->state == MODBUS_STEP_IDLE)
+        start_next(ctx, step);
+
+    return 0;
+}
+
+int modbus_begin_read(modbus_t *ctx, int function, int addr, int nb,
+                      modbus_step_callback_t callback, void *user_data)
+{
+    uint8_t pdu[5];
+    int max_nb;
+
+    if (ctx == NULL || function < MODBUS_FC_READ_COILS ||
+        function > MODBUS_FC_READ_INPUT_REGISTERS || nb < 1) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    max_nb = (function <= MODBUS_FC_READ_DISCRETE_INPUTS) ?
+        MODBUS_MAX_READ_BITS : MODBUS_MAX_READ_REGISTERS;
+    if (nb > max_nb) {
+        if (ctx->debug) {
+            fprintf(stderr, "ERROR Too many values requested (%d > %d)\n",
+                    nb, max_nb);
+        }
+        errno = EMBMDATA;
+        return -1;
+    }
+
+    pdu[0] = (uint8_t)function;
+    pdu[1] = (uint8_t)(addr >> 8);
+    pdu[2] = (uint8_t)(addr & 0x00ff);
+    pdu[3] = (uint8_t)(nb >> 8);
+    pdu[4] = (uint8_t)(nb & 0x00ff);
+
+    return modbus_begin_request(ctx, pdu, sizeof(pdu), callback, user_data);
+}
+
+int modbus_get_wanted_events(modbus_t *ctx)
+{
+    if (ctx == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (ctx->step == NULL)
+        return 0;
+
+    switch (ctx->step->state) {
+    case MODBUS_STEP_CONNECTING:
+    case MODBUS_STEP_SENDING:
+        return MODBUS_EVENT_WRITE;
+    case MODBUS_STEP_RECEIVING:
+        return MODBUS_EVENT_READ;
+    default:
+        return 0;
+    }
+}
+
+modbus_step_state_t modbus_get_step_state(modbus_t *ctx)
+{
+    if (ctx == NULL || ctx->step == NULL)
+        return MODBUS_STEP_IDLE;
+
+    return ctx->step->state;
+}
+
+int modbus_get_step_timeout(modbus_t *ctx)
+{
+    int64_t remaining;
+
+    if (ctx == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (ctx->step == NULL || ctx->step->state == MODBUS_STEP_IDLE ||
+        ctx->step->state == MODBUS_STEP_DONE)
+        return -1;
+
+    remaining = ctx->step->deadline - _modbus_monotonic_us();
+    if (remaining <= 0)
+        return 0;
+
+    /* Rounded up, the deadline has passed when the loop wakes up */
+    return (int)((remaining + 999) / 1000);
+}
+
+int modbus_on_writable(modbus_t *ctx)
+{
+    struct _modbus_step *step;
+    modbus_step_entry_t *entry;
+    int rc;
+
+    if (ctx == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    step = ctx->step;
+    if (step == NULL)
+        return 0;
+
+    if (step->state == MODBUS_STEP_CONNECTING) {
+        rc = modbus_connect_finish(ctx);
+        if (rc == -1 && (errno == EINPROGRESS || errno == EALREADY))
+            return 0;
+        return end_connect(ctx, step, rc == 0 ? 0 : errno);
+    }
+
+    if (step->state != MODBUS_STEP_SENDING)
+        return 0;
+
+    entry = &step->entries[step->head];
+    while (step->sent < entry->req_length) {
+        rc = modbus_send_bytes(ctx, entry->req + step->sent,
+                               entry->req_length - step->sent);
+        if (rc > 0) {
+            step->sent += rc;
+        } else if (rc == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return 0;
+        } else {
+            return link_error(ctx, step);
+        }
+    }
+
+    step->state = MODBUS_STEP_RECEIVING;
+    return 0;
+}
+
+int modbus_on_readable(modbus_t *ctx)
+{
+    struct _modbus_step *step;
+    modbus_step_entry_t *entry;
+    int length;
+    int rc;
+
+    if (ctx == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    step = ctx->step;
+    if (step == NULL || step->state != MODBUS_STEP_RECEIVING)
+        return 0;
+
+    entry = &step->entries[step->head];
+    for (;;) {
+        length = modbus_confirmation_length(ctx, step->rsp, step->rsp_length);
+        if (length > MODBUS_MAX_ADU_LENGTH) {
+            step->flush = TRUE;
+            return finish(ctx, step, -1, EMBBADDATA);
+        }
+
+        if (length == step->rsp_length) {
+            /* Late response to a request which has timed out */
+            if (ctx->backend->backend_type == _MODBUS_BACKEND_TYPE_TCP &&
+                (step->rsp[0] != entry->req[0] || step->rsp[1] != entry->req[1])) {
+                step->rsp_length = 0;
+                continue;
+            }
+
+            rc = modbus_check_confirmation(ctx, entry->req, step->rsp,
+                                           step->rsp_length);
+            if (rc == -1) {
+                if (ctx->error_recovery & MODBUS_ERROR_RECOVERY_PROTOCOL)
+                    step->flush = TRUE;
+                return finish(ctx, step, -1, errno);
+            }
+            return finish(ctx, step, rc, 0);
+        }
+
+        rc = modbus_receive_bytes(ctx, step->rsp + step->rsp_length,
+                                  length - step->rsp_length);
+        if (rc > 0) {
+            step->rsp_length += rc;
+        } else if (rc == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return 0;
+        } else {
+            return link_error(ctx, step);
+        }
+    }
+}
+
+int modbus_on_timeout(modbus_t *ctx)
+{
+    struct _modbus_step *step;
+
+    if (ctx == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    step = ctx->step;
+    if (step == NULL || step->state == MODBUS_STEP_IDLE ||
+        step->state == MODBUS_STEP_DONE ||
+        step->deadline > _modbus_monotonic_us())
+        return 0;
+
+    if (step->state == MODBUS_STEP_CONNECTING)
+        return end_connect(ctx, step, ETIMEDOUT);
+
+    if (ctx->debug) {
+        fprintf(stderr, "ERROR %s\n", modbus_strerror(ETIMEDOUT));
+    }
+    step->flush = TRUE;
+    return finish(ctx, step, -1, ETIMEDOUT);
+}
+
+int modbus_get_step_result(modbus_t *ctx, modbus_view_t *view)
+{
+    struct _modbus_step *step;
+    int rc;
+
+    if (ctx == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    step = ctx->step;
+    if (step == NULL || step->state != MODBUS_STEP_DONE) {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    rc = step->rc;
+    if (view != NULL && rc != -1 && !step->entries[step->head].connect)
+        fill_view(ctx, step, rc, view);
+
+    step->head = (step->head + 1) % MODBUS_STEP_QUEUE_LENGTH;
+    step->count--;
+    start_next(ctx, step);
+
+    if (rc == -1)
+        errno = step->error;
+    return rc;
+}
+
+int modbus_cancel_requests(modbus_t *ctx)
+{
+    struct _modbus_step *step;
+    modbus_step_callback_t callbacks[MODBUS_STEP_QUEUE_LENGTH];
+    void *user_data[MODBUS_STEP_QUEUE_LENGTH];
+    int nb;
+    int i;
+
+    if (ctx == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    step = ctx->step;
+    if (step == NULL)
+        return 0;
+
+    if (step->connecting) {
+        step->connecting = FALSE;
+        modbus_close(ctx);
+    } else if (step->state == MODBUS_STEP_SENDING ||
+               step->state == MODBUS_STEP_RECEIVING) {
+        /* A part of the exchange may still arrive */
+        step->flush = TRUE;
+    }
+
+    /* The queue is emptied first, the callbacks may add new requests */
+    nb = step->count;
+    for (i = 0; i < nb; i++) {
+        modbus_step_entry_t *entry =
+            &step->entries[(step->head + i) % MODBUS_STEP_QUEUE_LENGTH];
+
+        callbacks[i] = entry->callback;
+        user_data[i] = entry->user_data;
+    }
+    step->head = 0;
+    step->count = 0;
+    start_next(ctx, step);
+
+    for (i = 0; i < nb; i++) {
+        if (callbacks[i] != NULL) {
+            errno = ECANCELED;
+            callbacks[i](ctx, -1, NULL, user_data[i]);
+        }
+    }
+
+    return nb;
+}
@@ -0,0 +1,85 @@
+/*
+ * Copyright © 2001-2013 Stéphane Raimbault <stephane.raimbault@gmail.com>
+ *
+ * SPDX-License-Identifier: LGPL-2.1+
+ */
+
+#ifndef MODBUS_STEP_H
+#define MODBUS_STEP_H
+
+#include "modbus.h"
+
+MODBUS_BEGIN_DECLS
+
+/*
+ 不阻塞的分步接口，用于libuv、Boost.Asio、epoll等外部事件循环。
+ modbus_begin_request()将编码好的请求加入实例的队列，队列中的请求按顺序逐个进行；
+ 事件循环按modbus_get_wanted_events()监视modbus_get_socket()，
+ 可读/可写时调用modbus_on_readable()/modbus_on_writable()，
+ 到达modbus_get_step_timeout()的时间时调用modbus_on_timeout()。
+ - 每个请求的超时为modbus_set_response_timeout()的设置，从开始发送时计算
+ - 结果通过回调报告，或不设回调时由modbus_get_step_result()取得（取得后下一个请求才开始）
+ - 沿用错误恢复设置：超时或协议错误（MODBUS_ERROR_RECOVERY_PROTOCOL）后，
+   下一个请求前清空接收；链路错误且设置了MODBUS_ERROR_RECOVERY_LINK时重新连接
+ - 分步接口进行中不能调用阻塞的读写函数；回调中可以加入新请求，但不能释放实例
+ */
+
+#define MODBUS_STEP_QUEUE_LENGTH 16
+
+#define MODBUS_EVENT_READ        (1 << 0)
+#define MODBUS_EVENT_WRITE       (1 << 1)
+
+typedef enum {
+    MODBUS_STEP_IDLE = 0,   /* 队列为空 */
+    MODBUS_STEP_CONNECTING, /* 等待连接完成 */
+    MODBUS_STEP_SENDING,    /* 发送请求 */
+    MODBUS_STEP_RECEIVING,  /* 接收应答 */
+    MODBUS_STEP_DONE        /* 结果等待modbus_get_step_result()取得 */
+} modbus_step_state_t;
+
+/*
+ rc：同阻塞调用的返回值，失败为-1且errno为错误码（超时ETIMEDOUT，取消ECANCELED）
+ view：成功时为应答（data为字节数之后的数据），在下一个请求开始接收前有效；失败时为NULL
+ */
+typedef void (*modbus_step_callback_t)(modbus_t *ctx, int rc, const modbus_view_t *view,
+                                       void *user_data);
+
+/*
+ 开始连接，立即完成时返回0；TCP连接进行中时返回-1且errno为EINPROGRESS，
+ 套接字可写时由modbus_on_writable()完成，结果通过回调（rc为0或-1，view为NULL）报告。
+ 队列不为空时返回-1且errno为EBUSY
+ */
+MODBUS_API int modbus_begin_connect(modbus_t *ctx, modbus_step_callback_t callback,
+                                    void *user_data);
+/*
+ 加入一个请求，pdu为功能码+数据，从站地址取自modbus_set_slave()，TCP的事务号在加入时分配。
+ 队列已满时返回-1且errno为EBUSY。不进行读写，由事件循环推进
+ */
+MODBUS_API int modbus_begin_request(modbus_t *ctx, const uint8_t *pdu, int pdu_length,
+                                    modbus_step_callback_t callback, void *user_data);
+/* 读请求（功能码0x01~0x04）的简便形式 */
+MODBUS_API int modbus_begin_read(modbus_t *ctx, int function, int addr, int nb,
+                                 modbus_step_callback_t callback, void *user_data);
+
+/* 下一步需要的事件MODBUS_EVENT_xxx，0表示不需要监视套接字 */
+MODBUS_API int modbus_get_wanted_events(modbus_t *ctx);
+MODBUS_API modbus_step_state_t modbus_get_step_state(modbus_t *ctx);
+/* 到超时还剩的毫秒数，-1表示没有进行中的请求 */
+MODBUS_API int modbus_get_step_timeout(modbus_t *ctx);
+
+/* 推进读写，返回本次完成的请求数，失败的请求也计入 */
+MODBUS_API int modbus_on_writable(modbus_t *ctx);
+MODBUS_API int modbus_on_readable(modbus_t *ctx);
+MODBUS_API int modbus_on_timeout(modbus_t *ctx);
+
+/*
+ 取得未设回调的请求结果：返回值同回调的rc，view可为NULL；
+ 还没有结果时返回-1且errno为EAGAIN
+ */
+MODBUS_API int modbus_get_step_result(modbus_t *ctx, modbus_view_t *view);
+/* 取消队列中的所有请求（回调的errno为ECANCELED），返回取消的个数 */
+MODBUS_API int modbus_cancel_requests(modbus_t *ctx);
+
+MODBUS_END_DECLS
+
+#endif /* MODBUS_STEP_H */
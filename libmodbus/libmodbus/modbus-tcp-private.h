@@ -41,4 +41,23 @@ typedef struct _modbus_tcp_pi {
     char service[_MODBUS_TCP_PI_SERVICE_LENGTH];
 } modbus_tcp_pi_t;
 
+/* Size of sun_path on Linux, the smallest ones (BSD) are checked at connection */
+#define _MODBUS_UNIX_PATH_LENGTH 108
+
+typedef struct _modbus_unix {
+    /* Transaction ID */
+    uint16_t t_id;
+    /* Socket path, a leading '@' for the Linux abstract namespace */
+    char path[_MODBUS_UNIX_PATH_LENGTH];
+} modbus_unix_t;
+
+/* Listening Unix-domain socket shared by modbus_unix_listen() and the proxy */
+int _modbus_unix_listen(const char *path, int nb_connection);
+
+/* Connection and listening socket by node and service, shared by the TCP PI
+   and RTU over TCP backends */
+int _modbus_tcp_pi_open(modbus_t *ctx, const char *node, const char *service);
+int _modbus_tcp_pi_listen(modbus_t *ctx, const char *node, const char *service,
+                          int nb_connection);
+
 #endif /* MODBUS_TCP_PRIVATE_H */
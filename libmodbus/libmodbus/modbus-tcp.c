@@ -43,6 +43,9 @@
 # include <netinet/tcp.h>
 # include <arpa/inet.h>
 # include <netdb.h>
+# include <sys/un.h>
+# include <sys/stat.h>
+# include <stddef.h>
 #endif
 
 #if !defined(MSG_NOSIGNAL)
@@ -91,20 +94,26 @@ static int _modbus_set_slave(modbus_t *ctx, int slave)
     return 0;
 }
 
-/* Builds a TCP request header */
-static int _modbus_tcp_build_request_basis(modbus_t *ctx, int function,
-                                           int addr, int nb,
-                                           uint8_t *req)
+/* Increases the transaction ID and writes it in the request */
+static void _modbus_tcp_set_request_tid(modbus_t *ctx, uint8_t *req)
 {
     modbus_tcp_t *ctx_tcp = ctx->backend_data;
 
-    /* Increase transaction ID */
     if (ctx_tcp->t_id < UINT16_MAX)
         ctx_tcp->t_id++;
     else
         ctx_tcp->t_id = 0;
     req[0] = ctx_tcp->t_id >> 8;
     req[1] = ctx_tcp->t_id & 0x00ff;
+}
+
+/* Builds a TCP request header */
+static int _modbus_tcp_build_request_basis(modbus_t *ctx, int function,
+                                           int addr, int nb,
+                                           uint8_t *req)
+{
+    /* Increase transaction ID */
+    _modbus_tcp_set_request_tid(ctx, req);
 
     /* Protocol Modbus */
     req[2] = 0;
@@ -273,15 +282,25 @@ static int _connect(int sockfd, const struct sockaddr *addr, socklen_t addrlen,
 #else
     if (rc == -1 && errno == EINPROGRESS) {
 #endif
-        fd_set wset;
         int optval;
         socklen_t optlen = sizeof(optval);
-        struct timeval tv = *ro_tv;
+        struct timeval tv;
+        int64_t deadline;
+
+        /* Not waited for, see modbus_connect_start() */
+        if (ro_tv == NULL) {
+            errno = EINPROGRESS;
+            return -1;
+        }
+
+        deadline = _modbus_monotonic_us() +
+            (int64_t)ro_tv->tv_sec * 1000000 + ro_tv->tv_usec;
 
         /* Wait to be available in writing */
-        FD_ZERO(&wset);
-        FD_SET(sockfd, &wset);
-        rc = select(sockfd + 1, NULL, &wset, NULL, &tv);
+        do {
+            _modbus_remaining_time(deadline, &tv);
+            rc = _modbus_wait_fd(sockfd, 1, &tv);
+        } while (rc == -1 && errno == EINTR);
         if (rc <= 0) {
             /* Timeout or fail */
             return -1;
@@ -341,24 +360,25 @@ static int _modbus_tcp_connect(modbus_t *ctx)
     addr.sin_family = AF_INET;
     addr.sin_port = htons(ctx_tcp->port);
     addr.sin_addr.s_addr = inet_addr(ctx_tcp->ip);
-    rc = _connect(ctx->s, (struct sockaddr *)&addr, sizeof(addr), &ctx->response_timeout);
-    if (rc == -1) {
+    rc = _connect(ctx->s, (struct sockaddr *)&addr, sizeof(addr),
+                  ctx->connect_nowait ? NULL : &ctx->response_timeout);
+    if (rc == -1 && !(ctx->connect_nowait && errno == EINPROGRESS)) {
         close(ctx->s);
         ctx->s = -1;
         return -1;
     }
 
-    return 0;
+    return rc;
 }
 
-/* Establishes a modbus TCP PI connection with a Modbus server. */
-static int _modbus_tcp_pi_connect(modbus_t *ctx)
+/* Connects to the first reachable address of node and service, shared by
+   the TCP PI and RTU over TCP backends */
+int _modbus_tcp_pi_open(modbus_t *ctx, const char *node, const char *service)
 {
     int rc;
     struct addrinfo *ai_list;
     struct addrinfo *ai_ptr;
     struct addrinfo ai_hints;
-    modbus_tcp_pi_t *ctx_tcp_pi = ctx->backend_data;
 
 #ifdef OS_WIN32
     if (_modbus_tcp_init_win32() == -1) {
@@ -377,8 +397,7 @@ static int _modbus_tcp_pi_connect(modbus_t *ctx)
     ai_hints.ai_next = NULL;
 
     ai_list = NULL;
-    rc = getaddrinfo(ctx_tcp_pi->node, ctx_tcp_pi->service,
-                     &ai_hints, &ai_list);
+    rc = getaddrinfo(node, service, &ai_hints, &ai_list);
     if (rc != 0) {
         if (ctx->debug) {
             fprintf(stderr, "Error returned by getaddrinfo: %s\n", gai_strerror(rc));
@@ -407,11 +426,12 @@ static int _modbus_tcp_pi_connect(modbus_t *ctx)
             _modbus_tcp_set_ipv4_options(s);
 
         if (ctx->debug) {
-            printf("Connecting to [%s]:%s\n", ctx_tcp_pi->node, ctx_tcp_pi->service);
+            printf("Connecting to [%s]:%s\n", node, service);
         }
 
-        rc = _connect(s, ai_ptr->ai_addr, ai_ptr->ai_addrlen, &ctx->response_timeout);
-        if (rc == -1) {
+        rc = _connect(s, ai_ptr->ai_addr, ai_ptr->ai_addrlen,
+                      ctx->connect_nowait ? NULL : &ctx->response_timeout);
+        if (rc == -1 && !(ctx->connect_nowait && errno == EINPROGRESS)) {
             close(s);
             continue;
         }
@@ -426,6 +446,51 @@ static int _modbus_tcp_pi_connect(modbus_t *ctx)
         return -1;
     }
 
+    if (rc == -1) {
+        /* In progress, only the first address is tried */
+        errno = EINPROGRESS;
+    }
+
+    return rc;
+}
+
+/* Establishes a modbus TCP PI connection with a Modbus server. */
+static int _modbus_tcp_pi_connect(modbus_t *ctx)
+{
+    modbus_tcp_pi_t *ctx_tcp_pi = ctx->backend_data;
+
+    return _modbus_tcp_pi_open(ctx, ctx_tcp_pi->node, ctx_tcp_pi->service);
+}
+
+/* Result of a connection started by modbus_connect_start(), to call once
+   the socket is writable */
+int modbus_connect_finish(modbus_t *ctx)
+{
+    int optval = 0;
+    socklen_t optlen = sizeof(optval);
+
+    if (ctx == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (ctx->s < 0) {
+        errno = EBADF;
+        return -1;
+    }
+
+    /* A serial port is opened at once */
+    if (ctx->backend->connect == _modbus_rtu_backend.connect)
+        return 0;
+
+    if (getsockopt(ctx->s, SOL_SOCKET, SO_ERROR, (void *)&optval, &optlen) == -1)
+        return -1;
+
+    if (optval != 0) {
+        errno = optval;
+        return -1;
+    }
+
     return 0;
 }
 
@@ -451,14 +516,11 @@ static int _modbus_tcp_flush(modbus_t *ctx)
         rc = recv(ctx->s, devnull, MODBUS_TCP_MAX_ADU_LENGTH, MSG_DONTWAIT);
 #else
         /* On Win32, it's a bit more complicated to not wait */
-        fd_set rset;
         struct timeval tv;
 
         tv.tv_sec = 0;
         tv.tv_usec = 0;
-        FD_ZERO(&rset);
-        FD_SET(ctx->s, &rset);
-        rc = select(ctx->s+1, &rset, NULL, NULL, &tv);
+        rc = _modbus_wait_fd(ctx->s, 0, &tv);
         if (rc == -1) {
             return -1;
         }
@@ -540,23 +602,16 @@ int modbus_tcp_listen(modbus_t *ctx, int nb_connection)
     return new_s;
 }
 
-int modbus_tcp_pi_listen(modbus_t *ctx, int nb_connection)
+/* Listening socket of node and service, an empty node for any address and an
+   empty service for 502. Shared by the TCP PI and RTU over TCP backends. */
+int _modbus_tcp_pi_listen(modbus_t *ctx, const char *node, const char *service,
+                          int nb_connection)
 {
     int rc;
     struct addrinfo *ai_list;
     struct addrinfo *ai_ptr;
     struct addrinfo ai_hints;
-    const char *node;
-    const char *service;
     int new_s;
-    modbus_tcp_pi_t *ctx_tcp_pi;
-
-    if (ctx == NULL) {
-        errno = EINVAL;
-        return -1;
-    }
-
-    ctx_tcp_pi = ctx->backend_data;
 
 #ifdef OS_WIN32
     if (_modbus_tcp_init_win32() == -1) {
@@ -564,16 +619,12 @@ int modbus_tcp_pi_listen(modbus_t *ctx, int nb_connection)
     }
 #endif
 
-    if (ctx_tcp_pi->node[0] == 0) {
+    if (node[0] == 0) {
         node = NULL; /* == any */
-    } else {
-        node = ctx_tcp_pi->node;
     }
 
-    if (ctx_tcp_pi->service[0] == 0) {
+    if (service[0] == 0) {
         service = "502";
-    } else {
-        service = ctx_tcp_pi->service;
     }
 
     memset(&ai_hints, 0, sizeof (ai_hints));
@@ -656,10 +707,25 @@ int modbus_tcp_pi_listen(modbus_t *ctx, int nb_connection)
     return new_s;
 }
 
+int modbus_tcp_pi_listen(modbus_t *ctx, int nb_connection)
+{
+    modbus_tcp_pi_t *ctx_tcp_pi;
+
+    if (ctx == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    ctx_tcp_pi = ctx->backend_data;
+    return _modbus_tcp_pi_listen(ctx, ctx_tcp_pi->node, ctx_tcp_pi->service,
+                                 nb_connection);
+}
+
 int modbus_tcp_accept(modbus_t *ctx, int *s)
 {
     struct sockaddr_in addr;
     socklen_t addrlen;
+    int option;
 
     if (ctx == NULL) {
         errno = EINVAL;
@@ -678,6 +744,11 @@ int modbus_tcp_accept(modbus_t *ctx, int *s)
         return -1;
     }
 
+    /* The responses to pipelined requests would wait for the ACK of the
+       previous one with Nagle's algorithm */
+    option = 1;
+    setsockopt(ctx->s, IPPROTO_TCP, TCP_NODELAY, (const void *)&option, sizeof(int));
+
     if (ctx->debug) {
         printf("The client connection from %s is accepted\n",
                inet_ntoa(addr.sin_addr));
@@ -690,6 +761,7 @@ int modbus_tcp_pi_accept(modbus_t *ctx, int *s)
 {
     struct sockaddr_storage addr;
     socklen_t addrlen;
+    int option;
 
     if (ctx == NULL) {
         errno = EINVAL;
@@ -708,6 +780,10 @@ int modbus_tcp_pi_accept(modbus_t *ctx, int *s)
         return -1;
     }
 
+    /* See modbus_tcp_accept() */
+    option = 1;
+    setsockopt(ctx->s, IPPROTO_TCP, TCP_NODELAY, (const void *)&option, sizeof(int));
+
     if (ctx->debug) {
         printf("The client connection is accepted.\n");
     }
@@ -715,22 +791,215 @@ int modbus_tcp_pi_accept(modbus_t *ctx, int *s)
     return ctx->s;
 }
 
-static int _modbus_tcp_select(modbus_t *ctx, fd_set *rset, struct timeval *tv, int length_to_read)
+#ifndef OS_WIN32
+/* Fills the address of a socket path, '@' stands for the leading null byte
+   of the Linux abstract namespace (no file, removed with the last socket) */
+static int _modbus_unix_address(const char *path, struct sockaddr_un *addr,
+                                socklen_t *addrlen)
 {
-    int s_rc;
-    while ((s_rc = select(ctx->s+1, rset, NULL, NULL, tv)) == -1) {
-        if (errno == EINTR) {
-            if (ctx->debug) {
-                fprintf(stderr, "A non blocked signal was caught\n");
-            }
-            /* Necessary after an error */
-            FD_ZERO(rset);
-            FD_SET(ctx->s, rset);
-        } else {
-            return -1;
-        }
+    size_t length = strlen(path);
+
+    if (length == 0 || length >= sizeof(addr->sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (path[0] == '@') {
+#ifdef __linux__
+        /* Not null terminated, the length gives the end of the name */
+        memcpy(addr->sun_path + 1, path + 1, length - 1);
+        *addrlen = (socklen_t)(offsetof(struct sockaddr_un, sun_path) + length);
+#else
+        errno = ENOTSUP;
+        return -1;
+#endif
+    } else {
+        memcpy(addr->sun_path, path, length);
+        *addrlen = (socklen_t)(offsetof(struct sockaddr_un, sun_path) + length + 1);
+    }
+
+    return 0;
+}
+#endif
+
+/* Establishes a modbus connection on a Unix-domain socket, the MBAP framing
+   is kept but without the TCP/IP stack (no Nagle, no port) */
+static int _modbus_unix_connect(modbus_t *ctx)
+{
+#ifdef OS_WIN32
+    errno = ENOTSUP;
+    return -1;
+#else
+    int rc;
+    struct sockaddr_un addr;
+    socklen_t addrlen;
+    modbus_unix_t *ctx_unix = ctx->backend_data;
+    int flags = SOCK_STREAM;
+
+    if (_modbus_unix_address(ctx_unix->path, &addr, &addrlen) == -1) {
+        return -1;
+    }
+
+#ifdef SOCK_CLOEXEC
+    flags |= SOCK_CLOEXEC;
+#endif
+
+#ifdef SOCK_NONBLOCK
+    flags |= SOCK_NONBLOCK;
+#endif
+
+    ctx->s = socket(AF_UNIX, flags, 0);
+    if (ctx->s == -1) {
+        return -1;
+    }
+
+#if !defined(SOCK_NONBLOCK) && defined(FIONBIO)
+    {
+        int option = 1;
+        ioctl(ctx->s, FIONBIO, &option);
+    }
+#endif
+
+    if (ctx->debug) {
+        printf("Connecting to %s\n", ctx_unix->path);
+    }
+
+    /* A local connection is established or refused at once, a full backlog
+       gives EAGAIN */
+    rc = _connect(ctx->s, (struct sockaddr *)&addr, addrlen,
+                  ctx->connect_nowait ? NULL : &ctx->response_timeout);
+    if (rc == -1 && !(ctx->connect_nowait && errno == EINPROGRESS)) {
+        close(ctx->s);
+        ctx->s = -1;
+        return -1;
+    }
+
+    return rc;
+#endif
+}
+
+#ifndef OS_WIN32
+/* Removes the socket file of a previous run. Any other file, or a socket on
+   which a server still listens, fails with EADDRINUSE. */
+static int _modbus_unix_remove_stale(const char *path, const struct sockaddr_un *addr,
+                                     socklen_t addrlen)
+{
+    struct stat st;
+    int s;
+    int rc;
+
+    if (lstat(path, &st) == -1) {
+        return (errno == ENOENT) ? 0 : -1;
+    }
+    if (!S_ISSOCK(st.st_mode)) {
+        errno = EADDRINUSE;
+        return -1;
+    }
+
+    s = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (s == -1) {
+        return -1;
+    }
+    rc = connect(s, (const struct sockaddr *)addr, addrlen);
+    if (rc == -1 && errno == ECONNREFUSED) {
+        close(s);
+        return unlink(path);
+    }
+
+    close(s);
+    errno = EADDRINUSE;
+    return -1;
+}
+#endif
+
+int _modbus_unix_listen(const char *path, int nb_connection)
+{
+#ifdef OS_WIN32
+    errno = ENOTSUP;
+    return -1;
+#else
+    struct sockaddr_un addr;
+    socklen_t addrlen;
+    int flags = SOCK_STREAM;
+    int new_s;
+
+    if (path == NULL || nb_connection < 1) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (_modbus_unix_address(path, &addr, &addrlen) == -1) {
+        return -1;
+    }
+
+#ifdef SOCK_CLOEXEC
+    flags |= SOCK_CLOEXEC;
+#endif
+
+    new_s = socket(AF_UNIX, flags, 0);
+    if (new_s == -1) {
+        return -1;
+    }
+
+    /* The file of a previous run would make bind() fail, same as
+       SO_REUSEADDR for TCP */
+    if (path[0] != '@' && _modbus_unix_remove_stale(path, &addr, addrlen) == -1) {
+        close(new_s);
+        return -1;
+    }
+
+    if (bind(new_s, (struct sockaddr *)&addr, addrlen) == -1 ||
+        listen(new_s, nb_connection) == -1) {
+        close(new_s);
+        return -1;
     }
 
+    return new_s;
+#endif
+}
+
+/* Listens on the path of the context, the file is left to the caller */
+int modbus_unix_listen(modbus_t *ctx, int nb_connection)
+{
+    if (ctx == NULL || ctx->backend->connect != _modbus_unix_connect) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return _modbus_unix_listen(((modbus_unix_t *)ctx->backend_data)->path,
+                               nb_connection);
+}
+
+int modbus_unix_accept(modbus_t *ctx, int *s)
+{
+    if (ctx == NULL || s == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+#ifdef HAVE_ACCEPT4
+    ctx->s = accept4(*s, NULL, NULL, SOCK_CLOEXEC);
+#else
+    ctx->s = accept(*s, NULL, NULL);
+#endif
+
+    if (ctx->s == -1) {
+        return -1;
+    }
+
+    if (ctx->debug) {
+        printf("The client connection on %s is accepted\n",
+               ((modbus_unix_t *)ctx->backend_data)->path);
+    }
+
+    return ctx->s;
+}
+
+static int _modbus_tcp_select(modbus_t *ctx, struct timeval *tv, int length_to_read)
+{
+    int s_rc = _modbus_wait_fd(ctx->s, 0, tv);
+
     if (s_rc == 0) {
         errno = ETIMEDOUT;
         return -1;
@@ -763,7 +1032,9 @@ const modbus_backend_t _modbus_tcp_backend = {
     _modbus_tcp_close,
     _modbus_tcp_flush,
     _modbus_tcp_select,
-    _modbus_tcp_free
+    _modbus_tcp_free,
+    NULL,
+    _modbus_tcp_set_request_tid
 };
 
 
@@ -786,7 +1057,33 @@ const modbus_backend_t _modbus_tcp_pi_backend = {
     _modbus_tcp_close,
     _modbus_tcp_flush,
     _modbus_tcp_select,
-    _modbus_tcp_free
+    _modbus_tcp_free,
+    NULL,
+    _modbus_tcp_set_request_tid
+};
+
+const modbus_backend_t _modbus_unix_backend = {
+    _MODBUS_BACKEND_TYPE_TCP,
+    _MODBUS_TCP_HEADER_LENGTH,
+    _MODBUS_TCP_CHECKSUM_LENGTH,
+    MODBUS_TCP_MAX_ADU_LENGTH,
+    _modbus_set_slave,
+    _modbus_tcp_build_request_basis,
+    _modbus_tcp_build_response_basis,
+    _modbus_tcp_prepare_response_tid,
+    _modbus_tcp_send_msg_pre,
+    _modbus_tcp_send,
+    _modbus_tcp_receive,
+    _modbus_tcp_recv,
+    _modbus_tcp_check_integrity,
+    _modbus_tcp_pre_check_confirmation,
+    _modbus_unix_connect,
+    _modbus_tcp_close,
+    _modbus_tcp_flush,
+    _modbus_tcp_select,
+    _modbus_tcp_free,
+    NULL,
+    _modbus_tcp_set_request_tid
 };
 
 modbus_t* modbus_new_tcp(const char *ip, int port)
@@ -927,3 +1224,50 @@ modbus_t* modbus_new_tcp_pi(const char *node, const char *service)
 
     return ctx;
 }
+
+modbus_t* modbus_new_unix(const char *path)
+{
+#if defined(OS_WIN32)
+    errno = ENOTSUP;
+    return NULL;
+#else
+    modbus_t *ctx;
+    modbus_unix_t *ctx_unix;
+    size_t ret_size;
+
+    if (path == NULL) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    ctx = (modbus_t *)malloc(sizeof(modbus_t));
+    if (ctx == NULL) {
+        return NULL;
+    }
+    _modbus_init_common(ctx);
+
+    /* Same as TCP, a local server can be a gateway to serial devices */
+    ctx->slave = MODBUS_TCP_SLAVE;
+
+    ctx->backend = &_modbus_unix_backend;
+
+    ctx->backend_data = (modbus_unix_t *)malloc(sizeof(modbus_unix_t));
+    if (ctx->backend_data == NULL) {
+        modbus_free(ctx);
+        errno = ENOMEM;
+        return NULL;
+    }
+    ctx_unix = (modbus_unix_t *)ctx->backend_data;
+
+    ret_size = strlcpy(ctx_unix->path, path, sizeof(ctx_unix->path));
+    if (ret_size == 0 || ret_size >= sizeof(ctx_unix->path)) {
+        fprintf(stderr, "The socket path is empty or too long\n");
+        modbus_free(ctx);
+        errno = EINVAL;
+        return NULL;
+    }
+    ctx_unix->t_id = 0;
+
+    return ctx;
+#endif
+}
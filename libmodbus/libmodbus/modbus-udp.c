@@ -0,0 +1,1002 @@
+/*
+ * Copyright © 2001-2013 Stéphane Raimbault <stephane.raimbault@gmail.com>
+ *
+ * SPDX-License-Identifier: LGPL-2.1+
+ */
+
+/*
+ Modbus UDP：后端复制TCP后端的函数表（MBAP的编码、校验），替换传输部分。
+ 一帧由receive_frame一次读完一个数据报，确认时丢弃事务号不符的应答并按定时器重发；
+ recv按字节流的方式从缓存的数据报中读取，供分步接口等使用。
+ */
+
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+/* recvmmsg(), sendmmsg() */
+# define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#ifndef _MSC_VER
+#include <unistd.h>
+#endif
+
+#include "modbus-private.h"
+
+#if !defined(_WIN32)
+# include <fcntl.h>
+# include <poll.h>
+# include <sys/socket.h>
+# include <netinet/in.h>
+# include <arpa/inet.h>
+#endif
+
+#if !defined(MSG_NOSIGNAL)
+#define MSG_NOSIGNAL 0
+#endif
+
+#include "modbus-tcp.h"
+#include "modbus-tcp-private.h"
+#include "modbus-udp.h"
+
+/* Smallest MBAP datagram: header, function code and one byte */
+#define _UDP_MIN_LENGTH (_MODBUS_TCP_HEADER_LENGTH + 2)
+
+#if !defined(_WIN32)
+
+#if !defined(__linux__)
+/* One system call per datagram */
+struct mmsghdr {
+    struct msghdr msg_hdr;
+    unsigned int msg_len;
+};
+
+static int sendmmsg(int s, struct mmsghdr *vec, unsigned int vlen, int flags)
+{
+    unsigned int i;
+
+    for (i = 0; i < vlen; i++) {
+        ssize_t rc = sendmsg(s, &vec[i].msg_hdr, flags);
+        if (rc == -1)
+            return (i > 0) ? (int)i : -1;
+        vec[i].msg_len = (unsigned int)rc;
+    }
+    return (int)vlen;
+}
+
+static int recvmmsg(int s, struct mmsghdr *vec, unsigned int vlen, int flags, void *timeout)
+{
+    unsigned int i;
+
+    for (i = 0; i < vlen; i++) {
+        ssize_t rc = recvmsg(s, &vec[i].msg_hdr, flags | MSG_DONTWAIT);
+        if (rc == -1)
+            return (i > 0) ? (int)i : -1;
+        vec[i].msg_len = (unsigned int)rc;
+    }
+    return (int)vlen;
+}
+#endif
+
+/* Replies of modbus_udp_serve(), sent together */
+typedef struct _udp_batch {
+    int nb;
+    struct mmsghdr msgs[MODBUS_UDP_BATCH];
+    struct iovec iov[MODBUS_UDP_BATCH];
+    struct sockaddr_storage addrs[MODBUS_UDP_BATCH];
+    uint8_t bufs[MODBUS_UDP_BATCH][MODBUS_TCP_MAX_ADU_LENGTH];
+} udp_batch_t;
+
+/* Request waiting for its response, sent again by the retransmission timer */
+typedef struct _udp_request {
+    uint8_t adu[MODBUS_TCP_MAX_ADU_LENGTH];
+    /* 0 for a free entry */
+    int length;
+} udp_request_t;
+
+typedef struct _modbus_udp {
+    /* First member, the TCP functions cast the backend data */
+    modbus_tcp_t tcp;
+    modbus_backend_t backend;
+    int nb_retries;
+    /* Bound by modbus_udp_bind(), the replies go to the peer */
+    int bound;
+    struct sockaddr_storage peer;
+    socklen_t peer_length;
+    /* Requests sent and not answered, as many as a pipelined batch */
+    udp_request_t reqs[MODBUS_BATCH_WINDOW];
+    int nb_reqs;
+    /* Entry reused when all are taken, the oldest one */
+    int next_req;
+    /* Datagram read as a byte stream by recv() */
+    uint8_t in[MODBUS_TCP_MAX_ADU_LENGTH];
+    int in_length;
+    int in_offset;
+    udp_batch_t *batch;
+} modbus_udp_t;
+
+/* MBAP header of a whole datagram */
+static int _udp_valid(const uint8_t *msg, int length)
+{
+    return length >= _UDP_MIN_LENGTH && msg[2] == 0 && msg[3] == 0 &&
+        ((msg[4] << 8) | msg[5]) == length - 6;
+}
+
+static int _udp_wait(modbus_t *ctx, int64_t deadline)
+{
+    struct timeval tv;
+    int rc;
+
+    do {
+        if (deadline != -1) {
+            _modbus_remaining_time(deadline, &tv);
+            rc = _modbus_wait_fd(ctx->s, 0, &tv);
+        } else {
+            rc = _modbus_wait_fd(ctx->s, 0, NULL);
+        }
+    } while (rc == -1 && errno == EINTR);
+
+    return rc;
+}
+
+/* Sends each buffer as a datagram, in one system call per MODBUS_UDP_BATCH */
+static int _udp_send_datagrams(modbus_t *ctx, struct iovec *iov, int nb)
+{
+    struct mmsghdr msgs[MODBUS_UDP_BATCH];
+    int sent = 0;
+
+    while (sent < nb) {
+        int n = nb - sent;
+        int rc;
+        int i;
+
+        if (n > MODBUS_UDP_BATCH)
+            n = MODBUS_UDP_BATCH;
+        memset(msgs, 0, n * sizeof(struct mmsghdr));
+        for (i = 0; i < n; i++) {
+            msgs[i].msg_hdr.msg_iov = &iov[sent + i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+        rc = sendmmsg(ctx->s, msgs, n, MSG_NOSIGNAL);
+        if (rc == -1)
+            return -1;
+        sent += rc;
+    }
+
+    return 0;
+}
+
+/* Finds the pending request of a response and removes it */
+static int _udp_match(modbus_udp_t *udp, const uint8_t *rsp)
+{
+    int i;
+
+    for (i = 0; i < MODBUS_BATCH_WINDOW; i++) {
+        udp_request_t *r = &udp->reqs[i];
+
+        if (r->length > 0 && r->adu[0] == rsp[0] && r->adu[1] == rsp[1]) {
+            r->length = 0;
+            udp->nb_reqs--;
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+static void _udp_forget(modbus_udp_t *udp)
+{
+    int i;
+
+    for (i = 0; i < MODBUS_BATCH_WINDOW; i++)
+        udp->reqs[i].length = 0;
+    udp->nb_reqs = 0;
+}
+
+/* A pipelined batch writes several MBAP frames at once, each one is a
+   datagram and a pending request */
+static ssize_t _udp_send_requests(modbus_t *ctx, const uint8_t *req, int req_length)
+{
+    modbus_udp_t *udp = ctx->backend_data;
+    struct iovec iov[MODBUS_BATCH_WINDOW];
+    int offset = 0;
+    int nb = 0;
+
+    while (offset < req_length) {
+        udp_request_t *r;
+        int length = req_length - offset;
+        int i;
+
+        if (length >= _MODBUS_TCP_HEADER_LENGTH) {
+            int frame = 6 + ((req[offset + 4] << 8) | req[offset + 5]);
+            if (frame < length)
+                length = frame;
+        }
+        if (length > MODBUS_TCP_MAX_ADU_LENGTH || nb == MODBUS_BATCH_WINDOW) {
+            errno = EINVAL;
+            return -1;
+        }
+
+        /* A free entry, else the oldest request isn't waited for anymore */
+        i = udp->next_req;
+        while (udp->nb_reqs < MODBUS_BATCH_WINDOW && udp->reqs[i].length > 0)
+            i = (i + 1) % MODBUS_BATCH_WINDOW;
+        r = &udp->reqs[i];
+        if (r->length == 0)
+            udp->nb_reqs++;
+        udp->next_req = (i + 1) % MODBUS_BATCH_WINDOW;
+
+        memcpy(r->adu, req + offset, length);
+        r->length = length;
+        iov[nb].iov_base = r->adu;
+        iov[nb].iov_len = length;
+        nb++;
+        offset += length;
+    }
+
+    if (_udp_send_datagrams(ctx, iov, nb) == -1)
+        return -1;
+
+    return req_length;
+}
+
+/* Sends the requests not answered yet */
+static void _udp_retransmit(modbus_t *ctx)
+{
+    modbus_udp_t *udp = ctx->backend_data;
+    struct iovec iov[MODBUS_BATCH_WINDOW];
+    int nb = 0;
+    int i;
+
+    for (i = 0; i < MODBUS_BATCH_WINDOW; i++) {
+        if (udp->reqs[i].length > 0) {
+            iov[nb].iov_base = udp->reqs[i].adu;
+            iov[nb].iov_len = udp->reqs[i].length;
+            nb++;
+        }
+    }
+    _udp_send_datagrams(ctx, iov, nb);
+}
+
+static ssize_t _udp_send(modbus_t *ctx, const uint8_t *req, int req_length)
+{
+    modbus_udp_t *udp = ctx->backend_data;
+
+    if (udp->batch != NULL) {
+        udp_batch_t *batch = udp->batch;
+        int i = batch->nb;
+
+        if (i == MODBUS_UDP_BATCH) {
+            errno = ENOBUFS;
+            return -1;
+        }
+        memcpy(batch->bufs[i], req, req_length);
+        memcpy(&batch->addrs[i], &udp->peer, udp->peer_length);
+        batch->iov[i].iov_base = batch->bufs[i];
+        batch->iov[i].iov_len = req_length;
+        memset(&batch->msgs[i].msg_hdr, 0, sizeof(struct msghdr));
+        batch->msgs[i].msg_hdr.msg_name = &batch->addrs[i];
+        batch->msgs[i].msg_hdr.msg_namelen = udp->peer_length;
+        batch->msgs[i].msg_hdr.msg_iov = &batch->iov[i];
+        batch->msgs[i].msg_hdr.msg_iovlen = 1;
+        batch->nb++;
+        return req_length;
+    }
+
+    if (udp->bound) {
+        return sendto(ctx->s, (const char *)req, req_length, MSG_NOSIGNAL,
+                      (struct sockaddr *)&udp->peer, udp->peer_length);
+    }
+
+    return _udp_send_requests(ctx, req, req_length);
+}
+
+/* Serves the bytes of one datagram at a time, the rest of a datagram would
+   be lost by a short read on the socket */
+static ssize_t _udp_recv(modbus_t *ctx, uint8_t *rsp, int rsp_length)
+{
+    modbus_udp_t *udp = ctx->backend_data;
+    int length;
+
+    if (udp->in_offset == udp->in_length) {
+        ssize_t rc;
+
+        udp->peer_length = sizeof(udp->peer);
+        rc = recvfrom(ctx->s, (char *)udp->in, sizeof(udp->in), 0,
+                      (struct sockaddr *)&udp->peer, &udp->peer_length);
+        if (rc <= 0) {
+            /* An empty datagram isn't the end of a stream */
+            if (rc == 0)
+                errno = EAGAIN;
+            return -1;
+        }
+        udp->in_length = (int)rc;
+        udp->in_offset = 0;
+    }
+
+    length = udp->in_length - udp->in_offset;
+    if (length > rsp_length)
+        length = rsp_length;
+    memcpy(rsp, udp->in + udp->in_offset, length);
+    udp->in_offset += length;
+
+    return length;
+}
+
+static int _udp_select(modbus_t *ctx, struct timeval *tv, int length_to_read)
+{
+    modbus_udp_t *udp = ctx->backend_data;
+    int rc;
+
+    if (udp->in_offset < udp->in_length)
+        return 1;
+
+    rc = _modbus_wait_fd(ctx->s, 0, tv);
+    if (rc == 0) {
+        errno = ETIMEDOUT;
+        return -1;
+    }
+
+    return rc;
+}
+
+/* A datagram is a frame: the responses to requests not pending (answered
+   twice after a retransmission, or late) are dropped and the pending
+   requests are sent again after each part of the response timeout */
+static int _udp_receive_frame(modbus_t *ctx, uint8_t *msg, msg_type_t msg_type)
+{
+    modbus_udp_t *udp = ctx->backend_data;
+    const struct timeval *timeout;
+    struct sockaddr_storage addr;
+    socklen_t addr_length;
+    int64_t timeout_us;
+    int64_t deadline = -1;
+    int64_t retransmit = -1;
+    int64_t slot = 0;
+    int retries = 0;
+    int rc;
+
+    /* The stream of recv() is dropped */
+    udp->in_offset = udp->in_length = 0;
+
+    if (ctx->debug) {
+        if (msg_type == MSG_INDICATION) {
+            printf("Waiting for an indication...\n");
+        } else {
+            printf("Waiting for a confirmation...\n");
+        }
+    }
+
+    timeout = (msg_type == MSG_INDICATION) ? &ctx->indication_timeout : &ctx->response_timeout;
+    timeout_us = (int64_t)timeout->tv_sec * 1000000 + timeout->tv_usec;
+    if (timeout_us > 0 || msg_type == MSG_CONFIRMATION) {
+        deadline = _modbus_monotonic_us() + timeout_us;
+    }
+    if (msg_type == MSG_CONFIRMATION && !udp->bound &&
+        udp->nb_reqs > 0 && udp->nb_retries > 0) {
+        retries = udp->nb_retries;
+        slot = timeout_us / (retries + 1);
+        retransmit = _modbus_monotonic_us() + slot;
+    }
+
+    while (1) {
+        int64_t wake = deadline;
+
+        if (retransmit != -1 && retransmit < wake)
+            wake = retransmit;
+
+        rc = _udp_wait(ctx, wake);
+        if (rc == -1) {
+            _error_print(ctx, "select");
+            return -1;
+        }
+        if (rc == 0) {
+            if (retransmit == -1 || _modbus_monotonic_us() >= deadline) {
+                /* Given up by the caller, their responses are late ones */
+                if (msg_type == MSG_CONFIRMATION)
+                    _udp_forget(udp);
+                errno = ETIMEDOUT;
+                _error_print(ctx, "select");
+                return -1;
+            }
+            if (ctx->debug) {
+                printf("Retransmission of the request\n");
+            }
+            _udp_retransmit(ctx);
+            retries--;
+            retransmit = (retries > 0) ? retransmit + slot : -1;
+            continue;
+        }
+
+        addr_length = sizeof(addr);
+        rc = (int)recvfrom(ctx->s, (char *)msg, MODBUS_TCP_MAX_ADU_LENGTH, 0,
+                           (struct sockaddr *)&addr, &addr_length);
+        if (rc == -1) {
+            if (errno == EAGAIN || errno == EINTR)
+                continue;
+            /* ECONNREFUSED: ICMP port unreachable on a connected socket */
+            _error_print(ctx, "read");
+            return -1;
+        }
+
+        if (ctx->debug) {
+            int i;
+            for (i = 0; i < rc; i++)
+                printf("<%.2X>", msg[i]);
+            printf("\n");
+        }
+
+        if (!_udp_valid(msg, rc)) {
+            if (ctx->debug) {
+                fprintf(stderr, "Invalid datagram ignored\n");
+            }
+            continue;
+        }
+        if (msg_type == MSG_CONFIRMATION && !udp->bound && !_udp_match(udp, msg)) {
+            if (ctx->debug) {
+                fprintf(stderr, "Response to another request ignored\n");
+            }
+            continue;
+        }
+
+        if (msg_type == MSG_INDICATION) {
+            memcpy(&udp->peer, &addr, addr_length);
+            udp->peer_length = addr_length;
+        }
+        return rc;
+    }
+}
+
+static int _udp_open(modbus_t *ctx)
+{
+    int flags = SOCK_DGRAM;
+
+#ifdef SOCK_CLOEXEC
+    flags |= SOCK_CLOEXEC;
+#endif
+#ifdef SOCK_NONBLOCK
+    flags |= SOCK_NONBLOCK;
+#endif
+
+    ctx->s = socket(AF_INET, flags, 0);
+    if (ctx->s == -1)
+        return -1;
+
+#if !defined(SOCK_NONBLOCK)
+    fcntl(ctx->s, F_SETFL, fcntl(ctx->s, F_GETFL) | O_NONBLOCK);
+#endif
+
+    return 0;
+}
+
+/* Without an address, the socket isn't connected for modbus_udp_transact() */
+static int _udp_connect(modbus_t *ctx)
+{
+    modbus_udp_t *udp = ctx->backend_data;
+    struct sockaddr_in addr;
+
+    if (_udp_open(ctx) == -1)
+        return -1;
+    udp->bound = FALSE;
+    _udp_forget(udp);
+    udp->in_offset = udp->in_length = 0;
+
+    if (udp->tcp.ip[0] == '0' && udp->tcp.ip[1] == '\0')
+        return 0;
+
+    if (ctx->debug) {
+        printf("Connecting to %s:%d (udp)\n", udp->tcp.ip, udp->tcp.port);
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(udp->tcp.port);
+    addr.sin_addr.s_addr = inet_addr(udp->tcp.ip);
+    if (connect(ctx->s, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        close(ctx->s);
+        ctx->s = -1;
+        return -1;
+    }
+
+    return 0;
+}
+
+static void _udp_close(modbus_t *ctx)
+{
+    modbus_udp_t *udp = ctx->backend_data;
+
+    if (ctx->s != -1) {
+        close(ctx->s);
+        ctx->s = -1;
+    }
+    udp->bound = FALSE;
+}
+
+static int _udp_flush(modbus_t *ctx)
+{
+    modbus_udp_t *udp = ctx->backend_data;
+    uint8_t devnull[MODBUS_TCP_MAX_ADU_LENGTH];
+    int rc_sum = udp->in_length - udp->in_offset;
+    ssize_t rc;
+
+    udp->in_offset = udp->in_length = 0;
+    while ((rc = recv(ctx->s, (char *)devnull, sizeof(devnull), MSG_DONTWAIT)) >= 0) {
+        rc_sum += (int)rc;
+    }
+
+    return rc_sum;
+}
+
+static void _udp_free(modbus_t *ctx)
+{
+    free(ctx->backend_data);
+    free(ctx);
+}
+
+#endif /* !_WIN32 */
+
+modbus_t* modbus_new_udp(const char *ip, int port)
+{
+#if defined(_WIN32)
+    errno = ENOTSUP;
+    return NULL;
+#else
+    modbus_t *ctx;
+    modbus_udp_t *udp;
+
+    ctx = (modbus_t *)malloc(sizeof(modbus_t));
+    if (ctx == NULL) {
+        return NULL;
+    }
+    _modbus_init_common(ctx);
+    ctx->slave = MODBUS_TCP_SLAVE;
+
+    udp = (modbus_udp_t *)calloc(1, sizeof(modbus_udp_t));
+    if (udp == NULL) {
+        free(ctx);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    /* Same framing as TCP, the transport is replaced */
+    udp->backend = _modbus_tcp_backend;
+    udp->backend.send = _udp_send;
+    udp->backend.recv = _udp_recv;
+    udp->backend.connect = _udp_connect;
+    udp->backend.close = _udp_close;
+    udp->backend.flush = _udp_flush;
+    udp->backend.select = _udp_select;
+    udp->backend.free = _udp_free;
+    udp->backend.receive_frame = _udp_receive_frame;
+    ctx->backend = &udp->backend;
+    ctx->backend_data = udp;
+
+    if (ip != NULL) {
+        if (strlcpy(udp->tcp.ip, ip, sizeof(udp->tcp.ip)) >= sizeof(udp->tcp.ip) ||
+            inet_addr(ip) == INADDR_NONE) {
+            fprintf(stderr, "Invalid IP address %s\n", ip);
+            modbus_free(ctx);
+            errno = EINVAL;
+            return NULL;
+        }
+    } else {
+        udp->tcp.ip[0] = '0';
+    }
+    udp->tcp.port = port;
+    udp->nb_retries = MODBUS_UDP_DEFAULT_RETRIES;
+
+    return ctx;
+#endif
+}
+
+#if !defined(_WIN32)
+static modbus_udp_t *_udp_data(modbus_t *ctx)
+{
+    if (ctx == NULL || ctx->backend->connect != _udp_connect) {
+        errno = EINVAL;
+        return NULL;
+    }
+    return ctx->backend_data;
+}
+#endif
+
+int modbus_udp_bind(modbus_t *ctx)
+{
+#if defined(_WIN32)
+    errno = ENOTSUP;
+    return -1;
+#else
+    modbus_udp_t *udp = _udp_data(ctx);
+    struct sockaddr_in addr;
+    int enable = 1;
+
+    if (udp == NULL)
+        return -1;
+
+    if (_udp_open(ctx) == -1)
+        return -1;
+
+    setsockopt(ctx->s, SOL_SOCKET, SO_REUSEADDR, (char *)&enable, sizeof(enable));
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(udp->tcp.port);
+    if (udp->tcp.ip[0] == '0') {
+        addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    } else {
+        addr.sin_addr.s_addr = inet_addr(udp->tcp.ip);
+    }
+    if (bind(ctx->s, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        close(ctx->s);
+        ctx->s = -1;
+        return -1;
+    }
+    udp->bound = TRUE;
+    udp->in_offset = udp->in_length = 0;
+
+    return ctx->s;
+#endif
+}
+
+int modbus_udp_set_retries(modbus_t *ctx, int nb_retries)
+{
+#if defined(_WIN32)
+    errno = ENOTSUP;
+    return -1;
+#else
+    modbus_udp_t *udp = _udp_data(ctx);
+
+    if (udp == NULL)
+        return -1;
+    if (nb_retries < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    udp->nb_retries = nb_retries;
+    return 0;
+#endif
+}
+
+int modbus_udp_serve(modbus_t *ctx, modbus_server_handler_t handler,
+                     void *user_data, int timeout_ms)
+{
+#if defined(_WIN32)
+    errno = ENOTSUP;
+    return -1;
+#else
+    modbus_udp_t *udp = _udp_data(ctx);
+    struct mmsghdr msgs[MODBUS_UDP_BATCH];
+    struct iovec iov[MODBUS_UDP_BATCH];
+    struct sockaddr_storage addrs[MODBUS_UDP_BATCH];
+    uint8_t bufs[MODBUS_UDP_BATCH][MODBUS_TCP_MAX_ADU_LENGTH];
+    udp_batch_t *batch;
+    struct pollfd pfd;
+    int nb_received;
+    int nb_served = 0;
+    int sent = 0;
+    int i;
+
+    if (udp == NULL)
+        return -1;
+    if (!udp->bound || (handler == NULL && user_data == NULL)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    pfd.fd = ctx->s;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    do {
+        i = poll(&pfd, 1, timeout_ms);
+    } while (i == -1 && errno == EINTR);
+    if (i <= 0)
+        return i;
+
+    for (i = 0; i < MODBUS_UDP_BATCH; i++) {
+        iov[i].iov_base = bufs[i];
+        iov[i].iov_len = sizeof(bufs[i]);
+        memset(&msgs[i].msg_hdr, 0, sizeof(struct msghdr));
+        msgs[i].msg_hdr.msg_name = &addrs[i];
+        msgs[i].msg_hdr.msg_namelen = sizeof(addrs[i]);
+        msgs[i].msg_hdr.msg_iov = &iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    /* Everything which arrived, in one system call */
+    nb_received = recvmmsg(ctx->s, msgs, MODBUS_UDP_BATCH, MSG_DONTWAIT, NULL);
+    if (nb_received == -1) {
+        return (errno == EAGAIN || errno == EINTR) ? 0 : -1;
+    }
+
+    batch = (udp_batch_t *)malloc(sizeof(udp_batch_t));
+    if (batch == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    batch->nb = 0;
+    udp->batch = batch;
+
+    for (i = 0; i < nb_received; i++) {
+        int length = (int)msgs[i].msg_len;
+
+        if (ctx->debug) {
+            int j;
+            for (j = 0; j < length; j++)
+                printf("<%.2X>", bufs[i][j]);
+            printf("\n");
+        }
+        if (!_udp_valid(bufs[i], length)) {
+            if (ctx->debug) {
+                fprintf(stderr, "Invalid datagram ignored\n");
+            }
+            continue;
+        }
+
+        /* The replies made by the handler go to this sender */
+        memcpy(&udp->peer, &addrs[i], msgs[i].msg_hdr.msg_namelen);
+        udp->peer_length = msgs[i].msg_hdr.msg_namelen;
+        if (handler != NULL) {
+            handler(ctx, bufs[i], length, user_data);
+        } else {
+            modbus_reply(ctx, bufs[i], length, (modbus_mapping_t *)user_data);
+        }
+        nb_served++;
+    }
+    udp->batch = NULL;
+
+    /* A full socket buffer drops the rest, as the network could */
+    while (sent < batch->nb) {
+        int rc = sendmmsg(ctx->s, batch->msgs + sent, batch->nb - sent, MSG_NOSIGNAL);
+        if (rc <= 0)
+            break;
+        sent += rc;
+    }
+    free(batch);
+
+    return nb_served;
+#endif
+}
+
+#if !defined(_WIN32)
+typedef struct _udp_pending {
+    struct sockaddr_in addr;
+    uint8_t req[MODBUS_TCP_MAX_ADU_LENGTH];
+    int req_length;
+    /* -1 until sent */
+    int64_t deadline;
+    int64_t retransmit;
+    int retries;
+    int done;
+} udp_pending_t;
+
+static void _udp_complete(modbus_udp_request_t *request, udp_pending_t *pending,
+                          int rc, int error)
+{
+    request->rc = rc;
+    request->error = (rc == -1) ? error : 0;
+    pending->done = TRUE;
+}
+#endif
+
+int modbus_udp_transact(modbus_t *ctx, modbus_udp_request_t *requests, int nb)
+{
+#if defined(_WIN32)
+    errno = ENOTSUP;
+    return -1;
+#else
+    modbus_udp_t *udp = _udp_data(ctx);
+    udp_pending_t *pending;
+    struct mmsghdr msgs[MODBUS_UDP_BATCH];
+    struct iovec iov[MODBUS_UDP_BATCH];
+    struct sockaddr_in addrs[MODBUS_UDP_BATCH];
+    uint8_t bufs[MODBUS_UDP_BATCH][MODBUS_TCP_MAX_ADU_LENGTH];
+    int64_t timeout_us;
+    int64_t slot;
+    uint16_t base_tid;
+    int slave = ctx ? ctx->slave : 0;
+    int next = 0;
+    int nb_inflight = 0;
+    int nb_done = 0;
+    int nb_ok = 0;
+    int i;
+
+    if (udp == NULL)
+        return -1;
+    if (requests == NULL || nb < 0 || nb > UINT16_MAX || udp->bound) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (ctx->s == -1 && _udp_connect(ctx) == -1)
+        return -1;
+
+    pending = (udp_pending_t *)malloc(sizeof(udp_pending_t) * (nb > 0 ? nb : 1));
+    if (pending == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    /* Consecutive transaction IDs, the response gives the request back */
+    base_tid = (uint16_t)(udp->tcp.t_id + 1);
+    for (i = 0; i < nb; i++) {
+        modbus_udp_request_t *request = &requests[i];
+        udp_pending_t *p = &pending[i];
+
+        p->done = FALSE;
+        p->deadline = -1;
+        memset(&p->addr, 0, sizeof(p->addr));
+        p->addr.sin_family = AF_INET;
+        p->addr.sin_port = htons(request->port);
+        ctx->slave = request->slave;
+        if (request->ip == NULL ||
+            inet_pton(AF_INET, request->ip, &p->addr.sin_addr) != 1) {
+            /* Its transaction ID is skipped */
+            udp->tcp.t_id++;
+            _udp_complete(request, p, -1, EINVAL);
+            nb_done++;
+            continue;
+        }
+        p->req_length = modbus_encode_request(ctx, request->pdu, request->pdu_length, p->req);
+        if (p->req_length == -1) {
+            udp->tcp.t_id++;
+            _udp_complete(request, p, -1, errno);
+            nb_done++;
+        }
+    }
+    ctx->slave = slave;
+
+    timeout_us = (int64_t)ctx->response_timeout.tv_sec * 1000000 + ctx->response_timeout.tv_usec;
+    slot = timeout_us / (udp->nb_retries + 1);
+
+    while (nb_done < nb) {
+        int64_t now = _modbus_monotonic_us();
+        int64_t wake = -1;
+        int nb_msgs = 0;
+        int want_write = FALSE;
+        struct pollfd pfd;
+        int rc;
+
+        /* Timeouts and retransmissions due, then new requests in the window */
+        for (i = 0; i < next; i++) {
+            udp_pending_t *p = &pending[i];
+
+            if (p->done || p->deadline == -1)
+                continue;
+            if (now >= p->deadline) {
+                _udp_complete(&requests[i], p, -1, ETIMEDOUT);
+                nb_done++;
+                nb_inflight--;
+                continue;
+            }
+            if (p->retries > 0 && now >= p->retransmit && nb_msgs < MODBUS_UDP_BATCH) {
+                p->retries--;
+                p->retransmit += slot;
+                iov[nb_msgs].iov_base = p->req;
+                iov[nb_msgs].iov_len = p->req_length;
+                memset(&msgs[nb_msgs].msg_hdr, 0, sizeof(struct msghdr));
+                msgs[nb_msgs].msg_hdr.msg_name = &p->addr;
+                msgs[nb_msgs].msg_hdr.msg_namelen = sizeof(p->addr);
+                msgs[nb_msgs].msg_hdr.msg_iov = &iov[nb_msgs];
+                msgs[nb_msgs].msg_hdr.msg_iovlen = 1;
+                nb_msgs++;
+            }
+        }
+        while (next < nb && nb_inflight < MODBUS_UDP_WINDOW && nb_msgs < MODBUS_UDP_BATCH) {
+            udp_pending_t *p = &pending[next++];
+
+            if (p->done)
+                continue;
+            p->deadline = now + timeout_us;
+            p->retries = udp->nb_retries;
+            p->retransmit = now + slot;
+            nb_inflight++;
+            iov[nb_msgs].iov_base = p->req;
+            iov[nb_msgs].iov_len = p->req_length;
+            memset(&msgs[nb_msgs].msg_hdr, 0, sizeof(struct msghdr));
+            msgs[nb_msgs].msg_hdr.msg_name = &p->addr;
+            msgs[nb_msgs].msg_hdr.msg_namelen = sizeof(p->addr);
+            msgs[nb_msgs].msg_hdr.msg_iov = &iov[nb_msgs];
+            msgs[nb_msgs].msg_hdr.msg_iovlen = 1;
+            nb_msgs++;
+        }
+        if (nb_msgs > 0) {
+            if (ctx->debug) {
+                printf("Sending %d datagrams\n", nb_msgs);
+            }
+            rc = sendmmsg(ctx->s, msgs, nb_msgs, MSG_NOSIGNAL);
+            /* The unsent ones are retransmitted by their timer, unless the
+               socket buffer is full */
+            if (rc < nb_msgs)
+                want_write = TRUE;
+        }
+
+        /* Responses already there */
+        while (1) {
+            int j;
+
+            for (i = 0; i < MODBUS_UDP_BATCH; i++) {
+                iov[i].iov_base = bufs[i];
+                iov[i].iov_len = sizeof(bufs[i]);
+                memset(&msgs[i].msg_hdr, 0, sizeof(struct msghdr));
+                msgs[i].msg_hdr.msg_name = &addrs[i];
+                msgs[i].msg_hdr.msg_namelen = sizeof(addrs[i]);
+                msgs[i].msg_hdr.msg_iov = &iov[i];
+                msgs[i].msg_hdr.msg_iovlen = 1;
+            }
+            rc = recvmmsg(ctx->s, msgs, MODBUS_UDP_BATCH, MSG_DONTWAIT, NULL);
+            if (rc <= 0)
+                break;
+
+            for (j = 0; j < rc; j++) {
+                const uint8_t *rsp = bufs[j];
+                int length = (int)msgs[j].msg_len;
+                int index;
+                int result;
+                udp_pending_t *p;
+
+                if (!_udp_valid(rsp, length))
+                    continue;
+                index = (uint16_t)(((rsp[0] << 8) | rsp[1]) - base_tid);
+                if (index >= nb)
+                    continue;
+                p = &pending[index];
+                /* Late, duplicated or from another host */
+                if (p->done || p->deadline == -1 ||
+                    addrs[j].sin_addr.s_addr != p->addr.sin_addr.s_addr ||
+                    addrs[j].sin_port != p->addr.sin_port)
+                    continue;
+
+                result = modbus_check_confirmation(ctx, p->req, rsp, length);
+                if (result != -1 && requests[index].rsp_pdu != NULL) {
+                    memcpy(requests[index].rsp_pdu, rsp + _MODBUS_TCP_HEADER_LENGTH,
+                           length - _MODBUS_TCP_HEADER_LENGTH);
+                }
+                _udp_complete(&requests[index], p, result, errno);
+                nb_done++;
+                nb_inflight--;
+                if (result != -1)
+                    nb_ok++;
+            }
+            if (rc < MODBUS_UDP_BATCH)
+                break;
+        }
+
+        if (nb_done == nb)
+            break;
+
+        /* Next timer */
+        for (i = 0; i < next; i++) {
+            udp_pending_t *p = &pending[i];
+            int64_t t;
+
+            if (p->done || p->deadline == -1)
+                continue;
+            t = (p->retries > 0 && p->retransmit < p->deadline) ? p->retransmit : p->deadline;
+            if (wake == -1 || t < wake)
+                wake = t;
+        }
+        if (next < nb && nb_inflight < MODBUS_UDP_WINDOW)
+            wake = now;
+
+        pfd.fd = ctx->s;
+        pfd.events = POLLIN | (want_write ? POLLOUT : 0);
+        pfd.revents = 0;
+        now = _modbus_monotonic_us();
+        rc = (wake == -1) ? -1 : (wake <= now) ? 0 : (int)((wake - now + 999) / 1000);
+        if (rc != 0 && poll(&pfd, 1, rc) == -1 && errno != EINTR) {
+            int error = errno;
+
+            for (i = 0; i < nb; i++) {
+                if (!pending[i].done) {
+                    _udp_complete(&requests[i], &pending[i], -1, error);
+                }
+            }
+            break;
+        }
+    }
+
+    free(pending);
+    return nb_ok;
+#endif
+}
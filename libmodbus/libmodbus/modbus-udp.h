@@ -0,0 +1,75 @@
+/*
+ * Copyright © 2001-2013 Stéphane Raimbault <stephane.raimbault@gmail.com>
+ *
+ * SPDX-License-Identifier: LGPL-2.1+
+ */
+
+#ifndef MODBUS_UDP_H
+#define MODBUS_UDP_H
+
+#include "modbus.h"
+
+MODBUS_BEGIN_DECLS
+
+/*
+ Modbus UDP：报文格式与TCP相同（MBAP），一个数据报为一帧。
+ 没有连接，不受设备连接数的限制，也没有TCP的队头阻塞；报文可能丢失，因此：
+ - 应答按事务号匹配，迟到的（其他请求的）应答丢弃
+ - 应答超时时间分为重试次数+1段，每段内无应答时重发请求（事务号不变）
+ - modbus_batch()等一次发送的多个请求各为一个数据报，按事务号分别匹配，只重发未应答的
+ 服务端可用modbus_receive()/modbus_reply()逐个处理，或用modbus_udp_serve()
+ 一次系统调用收取、发送一批数据报（Linux下为recvmmsg()/sendmmsg()）。
+ Windows下不支持（返回ENOTSUP）。
+ */
+
+#define MODBUS_UDP_DEFAULT_RETRIES 2
+/* Datagrams received or sent per system call */
+#define MODBUS_UDP_BATCH           64
+/* Requests of modbus_udp_transact() waiting for a response at once */
+#define MODBUS_UDP_WINDOW          256
+
+/*
+ 客户端：ip为设备地址，modbus_connect()创建已连接的套接字；
+ ip为NULL时创建未连接的套接字，用于modbus_udp_transact()访问多台设备。
+ 服务端：ip为监听地址（NULL为任意地址），用modbus_udp_bind()代替modbus_connect()
+ */
+MODBUS_API modbus_t* modbus_new_udp(const char *ip, int port);
+/* 绑定实例的地址和端口，返回套接字；之后的应答发往最近一个请求的来源 */
+MODBUS_API int modbus_udp_bind(modbus_t *ctx);
+/* 应答超时内的重发次数，0为不重发 */
+MODBUS_API int modbus_udp_set_retries(modbus_t *ctx, int nb_retries);
+
+/*
+ 服务端批量处理：等待最多timeout_ms（< 0 一直等待），收取已到达的所有请求，
+ 逐个调用handler（同服务端引擎，其中调用modbus_reply()等，应答暂存），最后一起发送。
+ handler为NULL时user_data为modbus_mapping_t*，直接用modbus_reply()应答。
+ 返回处理的请求数，超时返回0
+ */
+MODBUS_API int modbus_udp_serve(modbus_t *ctx, modbus_server_handler_t handler,
+                                void *user_data, int timeout_ms);
+
+/* modbus_udp_transact()的一个请求 */
+typedef struct {
+    const char *ip;
+    int port;
+    int slave;
+    /* 功能码+数据 */
+    const uint8_t *pdu;
+    int pdu_length;
+    /* 应答的PDU（MODBUS_MAX_PDU_LENGTH字节），可为NULL */
+    uint8_t *rsp_pdu;
+    /* 结果：同阻塞调用的返回值，失败为-1，error为errno */
+    int rc;
+    int error;
+} modbus_udp_request_t;
+
+/*
+ 从一个套接字并发访问多台设备（实例由modbus_new_udp(NULL, 0)创建）：
+ 最多MODBUS_UDP_WINDOW个请求同时等待应答，每个请求有各自的重发定时器和超时，
+ 批量发送和接收。返回成功的请求数，各请求的结果在rc/error中
+ */
+MODBUS_API int modbus_udp_transact(modbus_t *ctx, modbus_udp_request_t *requests, int nb);
+
+MODBUS_END_DECLS
+
+#endif /* MODBUS_UDP_H */
@@ -7,6 +7,10 @@
  * http://libmodbus.org/
  */
 #define _CRT_SECURE_NO_WARNINGS
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+/* ppoll() */
+# define _GNU_SOURCE
+#endif
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
@@ -17,12 +21,21 @@
 #ifndef _MSC_VER
 #include <unistd.h>
 #endif
+#ifndef _WIN32
+#include <poll.h>
+#include <pthread.h>
+#endif
 
 #include <config.h>
 
 #include "modbus.h"
 #include "modbus-private.h"
 
+#if defined(_WIN32)
+/* After winsock2.h, included by modbus-tcp.h */
+# include <windows.h>
+#endif
+
 /* Internal use */
 #define MSG_LENGTH_UNDEFINED -1
 
@@ -38,7 +51,9 @@ const unsigned int libmodbus_version_micro = LIBMODBUS_VERSION_MICRO;
 typedef enum {
     _STEP_FUNCTION,
     _STEP_META,
-    _STEP_DATA
+    _STEP_DATA,
+    /* Whole length known from the request (RTU confirmation) */
+    _STEP_EXPECTED
 } _step_t;
 
 const char *modbus_strerror(int errnum) {
@@ -90,6 +105,86 @@ void _error_print(modbus_t *ctx, const char *context)
     }
 }
 
+/* Monotonic clock in microseconds, the timeouts are turned into deadlines on
+   it so they don't drift when a wait is interrupted or a read is partial */
+int64_t _modbus_monotonic_us(void)
+{
+#ifdef _WIN32
+    LARGE_INTEGER freq;
+    LARGE_INTEGER count;
+
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&count);
+    return (count.QuadPart / freq.QuadPart) * 1000000 +
+           (count.QuadPart % freq.QuadPart) * 1000000 / freq.QuadPart;
+#else
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+}
+
+/* Time left before the deadline, zero when it's over */
+void _modbus_remaining_time(int64_t deadline, struct timeval *tv)
+{
+    int64_t remaining = deadline - _modbus_monotonic_us();
+
+    if (remaining < 0) {
+        remaining = 0;
+    }
+    tv->tv_sec = (long)(remaining / 1000000);
+    tv->tv_usec = (long)(remaining % 1000000);
+}
+
+/* Waits for the descriptor to be readable (or writable), forever if tv is
+   NULL. Unlike select(), there is no limit on the descriptor number.
+   Returns 1 when ready, 0 on timeout and -1 on error (EINTR included, the
+   caller decides what is left to wait). */
+int _modbus_wait_fd(int fd, int for_write, const struct timeval *tv)
+{
+    int rc;
+#if defined(_WIN32)
+    /* A winsock fd_set is an array of sockets, not a bitmap */
+    fd_set set;
+    struct timeval t;
+
+    FD_ZERO(&set);
+    FD_SET(fd, &set);
+    if (tv != NULL) {
+        t = *tv;
+    }
+    rc = select(fd + 1, for_write ? NULL : &set, for_write ? &set : NULL, NULL,
+                tv != NULL ? &t : NULL);
+#else
+    struct pollfd pfd;
+
+    pfd.fd = fd;
+    pfd.events = for_write ? POLLOUT : POLLIN;
+    pfd.revents = 0;
+# if defined(__linux__)
+    if (tv != NULL) {
+        struct timespec ts;
+
+        ts.tv_sec = tv->tv_sec;
+        ts.tv_nsec = (long)tv->tv_usec * 1000;
+        rc = ppoll(&pfd, 1, &ts, NULL);
+    } else {
+        rc = ppoll(&pfd, 1, NULL, NULL);
+    }
+# else
+    /* Rounded up, a sub-millisecond timeout must not turn into a busy loop */
+    rc = poll(&pfd, 1, tv != NULL ?
+              (int)(tv->tv_sec * 1000 + (tv->tv_usec + 999) / 1000) : -1);
+# endif
+    if (rc > 0 && (pfd.revents & POLLNVAL)) {
+        errno = EBADF;
+        return -1;
+    }
+#endif
+    return rc;
+}
+
 static void _sleep_response_timeout(modbus_t *ctx)
 {
     /* Response timeout is always positive */
@@ -162,14 +257,12 @@ static unsigned int compute_response_length_from_request(modbus_t *ctx, uint8_t
     return offset + length + ctx->backend->checksum_length;
 }
 
-/* Sends a request/response */
-static int send_msg(modbus_t *ctx, uint8_t *msg, int msg_length)
+/* Sends a message already completed by send_msg_pre() */
+static int send_encoded_msg(modbus_t *ctx, uint8_t *msg, int msg_length)
 {
     int rc;
     int i;
 
-    msg_length = ctx->backend->send_msg_pre(msg, msg_length);
-
     if (ctx->debug) {
         for (i = 0; i < msg_length; i++)
             printf("[%.2X]", msg[i]);
@@ -207,6 +300,13 @@ static int send_msg(modbus_t *ctx, uint8_t *msg, int msg_length)
     return rc;
 }
 
+/* Sends a request/response */
+static int send_msg(modbus_t *ctx, uint8_t *msg, int msg_length)
+{
+    msg_length = ctx->backend->send_msg_pre(msg, msg_length);
+    return send_encoded_msg(ctx, msg, msg_length);
+}
+
 int modbus_send_raw_request(modbus_t *ctx, uint8_t *raw_req, int raw_req_length)
 {
     sft_t sft;
@@ -323,6 +423,140 @@ static int compute_data_length_after_meta(modbus_t *ctx, uint8_t *msg,
     return length;
 }
 
+/* Length of the whole message from its first bytes (event driven reception),
+   returns 0 when more bytes are needed to know it */
+int _modbus_frame_length(modbus_t *ctx, uint8_t *msg, int msg_length,
+                         msg_type_t msg_type)
+{
+    int length = ctx->backend->header_length + 1;
+
+    if (msg_length < length)
+        return 0;
+
+    length += compute_meta_length_after_function(msg[ctx->backend->header_length],
+                                                 msg_type);
+    if (msg_length < length)
+        return 0;
+
+    return length + compute_data_length_after_meta(ctx, msg, msg_type);
+}
+
+#if defined(_WIN32)
+/* Winsock doesn't set errno, the errors handled by the callers of the non
+   blocking functions are translated */
+static void _modbus_socket_errno(modbus_t *ctx)
+{
+    int wsa_error;
+
+    if (ctx->backend->backend_type != _MODBUS_BACKEND_TYPE_TCP)
+        return;
+
+    wsa_error = WSAGetLastError();
+    if (wsa_error == WSAEWOULDBLOCK) {
+        errno = EAGAIN;
+    } else if (wsa_error == WSAECONNRESET || wsa_error == WSAECONNABORTED) {
+        errno = ECONNRESET;
+    }
+}
+#endif
+
+/* Sends bytes without waiting, -1 and EAGAIN when the socket or the serial
+   port can't take them */
+int modbus_send_bytes(modbus_t *ctx, const uint8_t *buf, int length)
+{
+    int rc;
+
+    if (ctx == NULL || buf == NULL || length < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    rc = (int)ctx->backend->send(ctx, buf, length);
+#if defined(_WIN32)
+    if (rc == -1)
+        _modbus_socket_errno(ctx);
+#endif
+
+    return rc;
+}
+
+/* Receives up to length bytes without waiting, -1 and EAGAIN when none is
+   available, ECONNRESET when the connection is closed */
+int modbus_receive_bytes(modbus_t *ctx, uint8_t *buf, int length)
+{
+    int rc;
+
+    if (ctx == NULL || buf == NULL || length < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    rc = (int)ctx->backend->recv(ctx, buf, length);
+#if defined(_WIN32)
+    if (rc == -1)
+        _modbus_socket_errno(ctx);
+#endif
+    if (rc == 0 && length > 0) {
+        /* A serial port in raw mode (VMIN = 0) reads 0 byte when empty */
+        errno = (ctx->backend->backend_type == _MODBUS_BACKEND_TYPE_RTU) ?
+            EAGAIN : ECONNRESET;
+        return -1;
+    }
+
+    return rc;
+}
+
+/* Encodes the request of a PDU (function code and data) for the current slave,
+   a TCP request gets the next transaction ID */
+int modbus_encode_request(modbus_t *ctx, const uint8_t *pdu, int pdu_length,
+                          uint8_t *req)
+{
+    sft_t sft;
+    int req_length;
+
+    if (ctx == NULL || pdu == NULL || req == NULL ||
+        pdu_length < 1 || pdu_length > MODBUS_MAX_PDU_LENGTH) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    sft.slave = ctx->slave;
+    sft.function = pdu[0];
+    sft.t_id = 0;
+    req_length = ctx->backend->build_response_basis(&sft, req);
+    memcpy(req + req_length, pdu + 1, pdu_length - 1);
+    req_length = ctx->backend->send_msg_pre(req, req_length + pdu_length - 1);
+    if (ctx->backend->set_request_tid != NULL) {
+        ctx->backend->set_request_tid(ctx, req);
+    }
+
+    return req_length;
+}
+
+/* Length of the response from its first bytes: the whole length once it can
+   be computed, otherwise the number of bytes needed to go further. The
+   response is complete when the returned value is rsp_length. */
+int modbus_confirmation_length(modbus_t *ctx, const uint8_t *rsp, int rsp_length)
+{
+    int length;
+
+    if (ctx == NULL || rsp == NULL || rsp_length < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    length = ctx->backend->header_length + 1;
+    if (rsp_length < length)
+        return length;
+
+    length += compute_meta_length_after_function(rsp[ctx->backend->header_length],
+                                                 MSG_CONFIRMATION);
+    if (rsp_length < length)
+        return length;
+
+    return length + compute_data_length_after_meta(ctx, (uint8_t *)rsp, MSG_CONFIRMATION);
+}
+
 
 /* Waits a response from a modbus server or a request from a modbus client.
    This function blocks if there is no replies (3 timeouts).
@@ -335,18 +569,31 @@ static int compute_data_length_after_meta(modbus_t *ctx, uint8_t *msg,
    - EMBUNKEXC
    - ETIMEDOUT
    - read() or recv() error codes
+
+   When expected_length isn't MSG_LENGTH_UNDEFINED, the whole message is
+   requested at once and the step by step parsing is only used for an
+   exception response.
 */
 
-int _modbus_receive_msg(modbus_t *ctx, uint8_t *msg, msg_type_t msg_type)
+static int receive_msg(modbus_t *ctx, uint8_t *msg, msg_type_t msg_type,
+                       int expected_length)
 {
     int rc;
-    fd_set rset;
     struct timeval tv;
     struct timeval *p_tv;
+    /* Absolute deadline of the current wait, -1 to wait forever */
+    int64_t deadline;
     int length_to_read;
     int msg_length = 0;
     _step_t step;
 
+    if (ctx->backend->receive_frame != NULL) {
+        rc = ctx->backend->receive_frame(ctx, msg, msg_type);
+        if (rc != _MODBUS_FRAME_BY_LENGTH) {
+            return rc;
+        }
+    }
+
     if (ctx->debug) {
         if (msg_type == MSG_INDICATION) {
             printf("Waiting for an indication...\n");
@@ -355,36 +602,52 @@ int _modbus_receive_msg(modbus_t *ctx, uint8_t *msg, msg_type_t msg_type)
         }
     }
 
-    /* Add a file descriptor to the set */
-    FD_ZERO(&rset);
-    FD_SET(ctx->s, &rset);
-
     /* We need to analyse the message step by step.  At the first step, we want
      * to reach the function code because all packets contain this
      * information. */
     step = _STEP_FUNCTION;
     length_to_read = ctx->backend->header_length + 1;
+    if (expected_length != MSG_LENGTH_UNDEFINED &&
+        expected_length > (int)ctx->backend->header_length + 1 &&
+        expected_length <= (int)ctx->backend->max_adu_length) {
+        step = _STEP_EXPECTED;
+        length_to_read = expected_length;
+    }
 
     if (msg_type == MSG_INDICATION) {
         /* Wait for a message, we don't know when the message will be
          * received */
         if (ctx->indication_timeout.tv_sec == 0 && ctx->indication_timeout.tv_usec == 0) {
             /* By default, the indication timeout isn't set */
-            p_tv = NULL;
+            deadline = -1;
         } else {
             /* Wait for an indication (name of a received request by a server, see schema) */
-            tv.tv_sec = ctx->indication_timeout.tv_sec;
-            tv.tv_usec = ctx->indication_timeout.tv_usec;
-            p_tv = &tv;
+            deadline = _modbus_monotonic_us() +
+                (int64_t)ctx->indication_timeout.tv_sec * 1000000 +
+                ctx->indication_timeout.tv_usec;
         }
     } else {
-        tv.tv_sec = ctx->response_timeout.tv_sec;
-        tv.tv_usec = ctx->response_timeout.tv_usec;
-        p_tv = &tv;
+        deadline = _modbus_monotonic_us() +
+            (int64_t)ctx->response_timeout.tv_sec * 1000000 +
+            ctx->response_timeout.tv_usec;
     }
 
     while (length_to_read != 0) {
-        rc = ctx->backend->select(ctx, &rset, p_tv, length_to_read);
+        if (deadline >= 0) {
+            _modbus_remaining_time(deadline, &tv);
+            p_tv = &tv;
+        } else {
+            p_tv = NULL;
+        }
+
+        rc = ctx->backend->select(ctx, p_tv, length_to_read);
+        if (rc == -1 && errno == EINTR) {
+            if (ctx->debug) {
+                fprintf(stderr, "A non blocked signal was caught\n");
+            }
+            /* Waits again until the same deadline */
+            continue;
+        }
         if (rc == -1) {
             _error_print(ctx, "select");
             if (ctx->error_recovery & MODBUS_ERROR_RECOVERY_LINK) {
@@ -434,6 +697,39 @@ int _modbus_receive_msg(modbus_t *ctx, uint8_t *msg, msg_type_t msg_type)
         /* Computes remaining bytes */
         length_to_read -= rc;
 
+        if (step == _STEP_EXPECTED && msg_length > (int)ctx->backend->header_length &&
+            (msg[ctx->backend->header_length] & 0x80)) {
+            /* Exception response: function, exception code and checksum */
+            int exception_length = ctx->backend->header_length + 2 +
+                ctx->backend->checksum_length;
+
+            if (msg_length > exception_length) {
+                errno = EMBBADDATA;
+                _error_print(ctx, "too many data");
+                return -1;
+            }
+            length_to_read = exception_length - msg_length;
+            step = _STEP_DATA;
+        }
+
+        if (step == _STEP_EXPECTED) {
+            /* Known once the function code and the byte count are received,
+               a response of another length is read by its own length and
+               rejected by the check against the request */
+            int frame_length = _modbus_frame_length(ctx, msg, msg_length, msg_type);
+
+            if (frame_length > 0) {
+                if (frame_length < msg_length ||
+                    frame_length > (int)ctx->backend->max_adu_length) {
+                    errno = EMBBADDATA;
+                    _error_print(ctx, "invalid length");
+                    return -1;
+                }
+                length_to_read = frame_length - msg_length;
+                step = _STEP_DATA;
+            }
+        }
+
         if (length_to_read == 0) {
             switch (step) {
             case _STEP_FUNCTION:
@@ -465,9 +761,9 @@ int _modbus_receive_msg(modbus_t *ctx, uint8_t *msg, msg_type_t msg_type)
             /* If there is no character in the buffer, the allowed timeout
                interval between two consecutive bytes is defined by
                byte_timeout */
-            tv.tv_sec = ctx->byte_timeout.tv_sec;
-            tv.tv_usec = ctx->byte_timeout.tv_usec;
-            p_tv = &tv;
+            deadline = _modbus_monotonic_us() +
+                (int64_t)ctx->byte_timeout.tv_sec * 1000000 +
+                ctx->byte_timeout.tv_usec;
         }
         /* else timeout isn't set again, the full response must be read before
            expiration of response timeout (for CONFIRMATION only) */
@@ -479,6 +775,24 @@ int _modbus_receive_msg(modbus_t *ctx, uint8_t *msg, msg_type_t msg_type)
     return ctx->backend->check_integrity(ctx, msg, msg_length);
 }
 
+int _modbus_receive_msg(modbus_t *ctx, uint8_t *msg, msg_type_t msg_type)
+{
+    return receive_msg(ctx, msg, msg_type, MSG_LENGTH_UNDEFINED);
+}
+
+/* Receives the response to req. On a serial line, the response length
+   computed from the request is read in one go, each extra wait costs the
+   latency timer of USB adapters. */
+int _modbus_receive_confirmation(modbus_t *ctx, uint8_t *req, uint8_t *rsp)
+{
+    int expected_length = MSG_LENGTH_UNDEFINED;
+
+    if (ctx->backend->backend_type == _MODBUS_BACKEND_TYPE_RTU) {
+        expected_length = (int)compute_response_length_from_request(ctx, req);
+    }
+    return receive_msg(ctx, rsp, MSG_CONFIRMATION, expected_length);
+}
+
 /* Receive the request from a modbus master */
 int modbus_receive(modbus_t *ctx, uint8_t *req)
 {
@@ -639,6 +953,32 @@ static int check_confirmation(modbus_t *ctx, uint8_t *req,
     return rc;
 }
 
+/* Checks a complete response against its request, returns the same value as
+   the blocking calls (number of values or bytes) or -1 with errno set */
+int modbus_check_confirmation(modbus_t *ctx, const uint8_t *req,
+                              const uint8_t *rsp, int rsp_length)
+{
+    int error_recovery;
+    int rc;
+
+    if (ctx == NULL || req == NULL || rsp == NULL || rsp_length < 1) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* The flush and the wait of the protocol recovery would block, they are
+       left to the event loop of the caller */
+    error_recovery = ctx->error_recovery;
+    ctx->error_recovery &= ~MODBUS_ERROR_RECOVERY_PROTOCOL;
+    rc = ctx->backend->check_integrity(ctx, (uint8_t *)rsp, rsp_length);
+    if (rc != -1) {
+        rc = check_confirmation(ctx, (uint8_t *)req, (uint8_t *)rsp, rsp_length);
+    }
+    ctx->error_recovery = error_recovery;
+
+    return rc;
+}
+
 static int response_io_status(uint8_t *tab_io_status,
                               int address, int nb,
                               uint8_t *rsp, int offset)
@@ -696,6 +1036,184 @@ static int response_exception(modbus_t *ctx, sft_t *sft,
     return rsp_length;
 }
 
+/* Encoded data (byte count and values) of a read response */
+typedef struct _mapping_cache_entry {
+    int function;
+    int address;
+    int nb;
+    unsigned int gen;
+    /* 0 when unused */
+    int length;
+    uint8_t data[MODBUS_MAX_PDU_LENGTH];
+} mapping_cache_entry_t;
+
+/* Reply cache of a mapping and the write counts of its tables. Kept in a list
+   keyed by the mapping and not in modbus_mapping_t, which the applications
+   may allocate and fill themselves. */
+typedef struct _mapping_cache {
+    const modbus_mapping_t *mb_mapping;
+    struct _mapping_cache *next;
+    unsigned int gen_bits;
+    unsigned int gen_input_bits;
+    unsigned int gen_input_registers;
+    unsigned int gen_registers;
+    int nb_entries;
+    mapping_cache_entry_t entries[1];
+} mapping_cache_t;
+
+static mapping_cache_t *mapping_caches = NULL;
+#if defined(_WIN32)
+static SRWLOCK mapping_caches_lock = SRWLOCK_INIT;
+# define MAPPING_CACHES_LOCK()   AcquireSRWLockExclusive(&mapping_caches_lock)
+# define MAPPING_CACHES_UNLOCK() ReleaseSRWLockExclusive(&mapping_caches_lock)
+#else
+static pthread_mutex_t mapping_caches_lock = PTHREAD_MUTEX_INITIALIZER;
+# define MAPPING_CACHES_LOCK()   pthread_mutex_lock(&mapping_caches_lock)
+# define MAPPING_CACHES_UNLOCK() pthread_mutex_unlock(&mapping_caches_lock)
+#endif
+
+/* Caches in the list, read without the lock so that the mappings without a
+   cache never take it. Changed under the lock. */
+static volatile long mapping_caches_count = 0;
+#if defined(_MSC_VER)
+# define MAPPING_CACHES_COUNT()  (mapping_caches_count)
+# define MAPPING_CACHES_ADD(n)   InterlockedExchangeAdd(&mapping_caches_count, n)
+#else
+# define MAPPING_CACHES_COUNT()  __atomic_load_n(&mapping_caches_count, __ATOMIC_RELAXED)
+# define MAPPING_CACHES_ADD(n)   __atomic_add_fetch(&mapping_caches_count, n, __ATOMIC_RELAXED)
+#endif
+
+/* Tables whose write count mapping_cache_bump() increments */
+#define MAPPING_CACHE_BITS            (1 << 0)
+#define MAPPING_CACHE_INPUT_BITS      (1 << 1)
+#define MAPPING_CACHE_REGISTERS       (1 << 2)
+#define MAPPING_CACHE_INPUT_REGISTERS (1 << 3)
+
+/* Cache of the mapping, NULL when disabled */
+static mapping_cache_t *mapping_cache_find(const modbus_mapping_t *mb_mapping)
+{
+    mapping_cache_t *cache;
+
+    if (MAPPING_CACHES_COUNT() == 0)
+        return NULL;
+
+    MAPPING_CACHES_LOCK();
+    for (cache = mapping_caches; cache != NULL; cache = cache->next) {
+        if (cache->mb_mapping == mb_mapping)
+            break;
+    }
+    MAPPING_CACHES_UNLOCK();
+
+    return cache;
+}
+
+/* Removes the cache of the mapping from the list, to be freed */
+static mapping_cache_t *mapping_cache_unlink(const modbus_mapping_t *mb_mapping)
+{
+    mapping_cache_t **link;
+    mapping_cache_t *cache = NULL;
+
+    if (MAPPING_CACHES_COUNT() == 0)
+        return NULL;
+
+    MAPPING_CACHES_LOCK();
+    for (link = &mapping_caches; *link != NULL; link = &(*link)->next) {
+        if ((*link)->mb_mapping == mb_mapping) {
+            cache = *link;
+            *link = cache->next;
+            MAPPING_CACHES_ADD(-1);
+            break;
+        }
+    }
+    MAPPING_CACHES_UNLOCK();
+
+    return cache;
+}
+
+/* Invalidates the cached replies of the tables, under the lock as the cache
+   may be disabled meanwhile */
+static void mapping_cache_bump(const modbus_mapping_t *mb_mapping, int tables)
+{
+    mapping_cache_t *cache;
+
+    if (MAPPING_CACHES_COUNT() == 0)
+        return;
+
+    MAPPING_CACHES_LOCK();
+    for (cache = mapping_caches; cache != NULL; cache = cache->next) {
+        if (cache->mb_mapping == mb_mapping) {
+            if (tables & MAPPING_CACHE_BITS)
+                cache->gen_bits++;
+            if (tables & MAPPING_CACHE_INPUT_BITS)
+                cache->gen_input_bits++;
+            if (tables & MAPPING_CACHE_REGISTERS)
+                cache->gen_registers++;
+            if (tables & MAPPING_CACHE_INPUT_REGISTERS)
+                cache->gen_input_registers++;
+            break;
+        }
+    }
+    MAPPING_CACHES_UNLOCK();
+}
+
+static unsigned int mapping_generation(mapping_cache_t *cache, int function)
+{
+    switch (function) {
+    case MODBUS_FC_READ_COILS:
+        return cache->gen_bits;
+    case MODBUS_FC_READ_DISCRETE_INPUTS:
+        return cache->gen_input_bits;
+    case MODBUS_FC_READ_HOLDING_REGISTERS:
+        return cache->gen_registers;
+    default:
+        return cache->gen_input_registers;
+    }
+}
+
+static mapping_cache_entry_t *mapping_cache_slot(mapping_cache_t *cache,
+                                                 int function, int address, int nb)
+{
+    unsigned int h = ((unsigned int)address * 131 + nb) * 7 + function;
+
+    return &cache->entries[h % cache->nb_entries];
+}
+
+/* Appends the cached data of the read to rsp, returns FALSE on a miss */
+static int mapping_cache_get(mapping_cache_t *cache, int function,
+                             int address, int nb, uint8_t *rsp, int *rsp_length)
+{
+    mapping_cache_entry_t *e;
+
+    if (cache == NULL)
+        return FALSE;
+
+    e = mapping_cache_slot(cache, function, address, nb);
+    if (e->length == 0 || e->function != function || e->address != address ||
+        e->nb != nb || e->gen != mapping_generation(cache, function))
+        return FALSE;
+
+    memcpy(rsp + *rsp_length, e->data, e->length);
+    *rsp_length += e->length;
+    return TRUE;
+}
+
+static void mapping_cache_put(mapping_cache_t *cache, int function,
+                              int address, int nb, const uint8_t *data, int length)
+{
+    mapping_cache_entry_t *e;
+
+    if (cache == NULL)
+        return;
+
+    e = mapping_cache_slot(cache, function, address, nb);
+    e->function = function;
+    e->address = address;
+    e->nb = nb;
+    e->gen = mapping_generation(cache, function);
+    e->length = length;
+    memcpy(e->data, data, length);
+}
+
 /* Send a response to the received request.
    Analyses the request and constructs a response.
 
@@ -712,12 +1230,14 @@ int modbus_reply(modbus_t *ctx, const uint8_t *req,
     uint8_t rsp[MAX_MESSAGE_LENGTH];
     int rsp_length = 0;
     sft_t sft;
+    mapping_cache_t *cache;
 
     if (ctx == NULL) {
         errno = EINVAL;
         return -1;
     }
 
+    cache = mapping_cache_find(mb_mapping);
     offset = ctx->backend->header_length;
     slave = req[offset - 1];
     function = req[offset];
@@ -754,9 +1274,15 @@ int modbus_reply(modbus_t *ctx, const uint8_t *req,
                 mapping_address < 0 ? address : address + nb, name);
         } else {
             rsp_length = ctx->backend->build_response_basis(&sft, rsp);
-            rsp[rsp_length++] = (nb / 8) + ((nb % 8) ? 1 : 0);
-            rsp_length = response_io_status(tab_bits, mapping_address, nb,
-                                            rsp, rsp_length);
+            if (!mapping_cache_get(cache, function, address, nb, rsp, &rsp_length)) {
+                int data_offset = rsp_length;
+
+                rsp[rsp_length++] = (nb / 8) + ((nb % 8) ? 1 : 0);
+                rsp_length = response_io_status(tab_bits, mapping_address, nb,
+                                                rsp, rsp_length);
+                mapping_cache_put(cache, function, address, nb,
+                                  rsp + data_offset, rsp_length - data_offset);
+            }
         }
     }
         break;
@@ -786,10 +1312,16 @@ int modbus_reply(modbus_t *ctx, const uint8_t *req,
             int i;
 
             rsp_length = ctx->backend->build_response_basis(&sft, rsp);
-            rsp[rsp_length++] = nb << 1;
-            for (i = mapping_address; i < mapping_address + nb; i++) {
-                rsp[rsp_length++] = tab_registers[i] >> 8;
-                rsp[rsp_length++] = tab_registers[i] & 0xFF;
+            if (!mapping_cache_get(cache, function, address, nb, rsp, &rsp_length)) {
+                int data_offset = rsp_length;
+
+                rsp[rsp_length++] = nb << 1;
+                for (i = mapping_address; i < mapping_address + nb; i++) {
+                    rsp[rsp_length++] = tab_registers[i] >> 8;
+                    rsp[rsp_length++] = tab_registers[i] & 0xFF;
+                }
+                mapping_cache_put(cache, function, address, nb,
+                                  rsp + data_offset, rsp_length - data_offset);
             }
         }
     }
@@ -807,6 +1339,8 @@ int modbus_reply(modbus_t *ctx, const uint8_t *req,
 
             if (data == 0xFF00 || data == 0x0) {
                 mb_mapping->tab_bits[mapping_address] = data ? ON : OFF;
+                if (cache != NULL)
+                    cache->gen_bits++;
                 memcpy(rsp, req, req_length);
                 rsp_length = req_length;
             } else {
@@ -832,6 +1366,8 @@ int modbus_reply(modbus_t *ctx, const uint8_t *req,
             int data = (req[offset + 3] << 8) + req[offset + 4];
 
             mb_mapping->tab_registers[mapping_address] = data;
+            if (cache != NULL)
+                cache->gen_registers++;
             memcpy(rsp, req, req_length);
             rsp_length = req_length;
         }
@@ -860,6 +1396,8 @@ int modbus_reply(modbus_t *ctx, const uint8_t *req,
             /* 6 = byte count */
             modbus_set_bits_from_bytes(mb_mapping->tab_bits, mapping_address, nb,
                                        &req[offset + 6]);
+            if (cache != NULL)
+                cache->gen_bits++;
 
             rsp_length = ctx->backend->build_response_basis(&sft, rsp);
             /* 4 to copy the bit address (2) and the quantity of bits */
@@ -890,6 +1428,8 @@ int modbus_reply(modbus_t *ctx, const uint8_t *req,
                 mb_mapping->tab_registers[i] =
                     (req[offset + j] << 8) + req[offset + j + 1];
             }
+            if (cache != NULL)
+                cache->gen_registers++;
 
             rsp_length = ctx->backend->build_response_basis(&sft, rsp);
             /* 4 to copy the address (2) and the no. of registers */
@@ -937,6 +1477,8 @@ int modbus_reply(modbus_t *ctx, const uint8_t *req,
 
             data = (data & and) | (or & (~and));
             mb_mapping->tab_registers[mapping_address] = data;
+            if (cache != NULL)
+                cache->gen_registers++;
             memcpy(rsp, req, req_length);
             rsp_length = req_length;
         }
@@ -978,6 +1520,8 @@ int modbus_reply(modbus_t *ctx, const uint8_t *req,
                 mb_mapping->tab_registers[i] =
                     (req[offset + j] << 8) + req[offset + j + 1];
             }
+            if (cache != NULL)
+                cache->gen_registers++;
 
             /* and read the data for the response */
             for (i = mapping_address; i < mapping_address + nb; i++) {
@@ -1035,6 +1579,28 @@ int modbus_reply_exception(modbus_t *ctx, const uint8_t *req,
     }
 }
 
+/* Spreads the rc bytes of bits of a read response over dest */
+static void unpack_io_status(modbus_t *ctx, const uint8_t *rsp, int rc,
+                             int nb, uint8_t *dest)
+{
+    int i, temp, bit;
+    int pos = 0;
+    int offset;
+    int offset_end;
+
+    offset = ctx->backend->header_length + 2;
+    offset_end = offset + rc;
+    for (i = offset; i < offset_end; i++) {
+        /* Shift reg hi_byte to temp */
+        temp = rsp[i];
+
+        for (bit = 0x01; (bit & 0xff) && (pos < nb);) {
+            dest[pos++] = (temp & bit) ? TRUE : FALSE;
+            bit = bit << 1;
+        }
+    }
+}
+
 /* Reads IO status */
 static int read_io_status(modbus_t *ctx, int function,
                           int addr, int nb, uint8_t *dest)
@@ -1049,12 +1615,7 @@ static int read_io_status(modbus_t *ctx, int function,
 
     rc = send_msg(ctx, req, req_length);
     if (rc > 0) {
-        int i, temp, bit;
-        int pos = 0;
-        int offset;
-        int offset_end;
-
-        rc = _modbus_receive_msg(ctx, rsp, MSG_CONFIRMATION);
+        rc = _modbus_receive_confirmation(ctx, req, rsp);
         if (rc == -1)
             return -1;
 
@@ -1062,18 +1623,7 @@ static int read_io_status(modbus_t *ctx, int function,
         if (rc == -1)
             return -1;
 
-        offset = ctx->backend->header_length + 2;
-        offset_end = offset + rc;
-        for (i = offset; i < offset_end; i++) {
-            /* Shift reg hi_byte to temp */
-            temp = rsp[i];
-
-            for (bit = 0x01; (bit & 0xff) && (pos < nb);) {
-                dest[pos++] = (temp & bit) ? TRUE : FALSE;
-                bit = bit << 1;
-            }
-
-        }
+        unpack_io_status(ctx, rsp, rc, nb, dest);
     }
 
     return rc;
@@ -1137,6 +1687,19 @@ int modbus_read_input_bits(modbus_t *ctx, int addr, int nb, uint8_t *dest)
         return nb;
 }
 
+/* Copies the rc registers of a read response to dest */
+static void unpack_registers(modbus_t *ctx, const uint8_t *rsp, int rc, uint16_t *dest)
+{
+    int offset = ctx->backend->header_length;
+    int i;
+
+    for (i = 0; i < rc; i++) {
+        /* shift reg hi_byte to temp OR with lo_byte */
+        dest[i] = (rsp[offset + 2 + (i << 1)] << 8) |
+            rsp[offset + 3 + (i << 1)];
+    }
+}
+
 /* Reads the data from a remove device and put that data into an array */
 static int read_registers(modbus_t *ctx, int function, int addr, int nb,
                           uint16_t *dest)
@@ -1160,10 +1723,7 @@ static int read_registers(modbus_t *ctx, int function, int addr, int nb,
 
     rc = send_msg(ctx, req, req_length);
     if (rc > 0) {
-        int offset;
-        int i;
-
-        rc = _modbus_receive_msg(ctx, rsp, MSG_CONFIRMATION);
+        rc = _modbus_receive_confirmation(ctx, req, rsp);
         if (rc == -1)
             return -1;
 
@@ -1171,13 +1731,7 @@ static int read_registers(modbus_t *ctx, int function, int addr, int nb,
         if (rc == -1)
             return -1;
 
-        offset = ctx->backend->header_length;
-
-        for (i = 0; i < rc; i++) {
-            /* shift reg hi_byte to temp OR with lo_byte */
-            dest[i] = (rsp[offset + 2 + (i << 1)] << 8) |
-                rsp[offset + 3 + (i << 1)];
-        }
+        unpack_registers(ctx, rsp, rc, dest);
     }
 
     return rc;
@@ -1234,9 +1788,308 @@ int modbus_read_input_registers(modbus_t *ctx, int addr, int nb,
     return status;
 }
 
-/* Write a value to the specified register of the remote device.
-   Used by write_bit and write_register */
-static int write_single(modbus_t *ctx, int function, int addr, int value)
+/* Reads registers and decodes the values straight from the response */
+static int read_registers_as(modbus_t *ctx, int function, int addr, int nb,
+                             modbus_order_t order, int width, void *dest)
+{
+    int rc;
+    int req_length;
+    int nb_registers;
+    uint8_t req[_MIN_REQ_LENGTH];
+    uint8_t rsp[MAX_MESSAGE_LENGTH];
+
+    if (ctx == NULL || dest == NULL || nb < 1 ||
+        order < MODBUS_ORDER_ABCD || order > MODBUS_ORDER_CDAB) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* Checked before the product, which may overflow */
+    if (nb > MODBUS_MAX_READ_REGISTERS / (width / 2)) {
+        if (ctx->debug) {
+            fprintf(stderr,
+                    "ERROR Too many values requested (%d > %d)\n",
+                    nb, MODBUS_MAX_READ_REGISTERS / (width / 2));
+        }
+        errno = EMBMDATA;
+        return -1;
+    }
+    nb_registers = nb * width / 2;
+
+    req_length = ctx->backend->build_request_basis(ctx, function, addr,
+                                                   nb_registers, req);
+
+    rc = send_msg(ctx, req, req_length);
+    if (rc > 0) {
+        rc = _modbus_receive_confirmation(ctx, req, rsp);
+        if (rc == -1)
+            return -1;
+
+        rc = check_confirmation(ctx, req, rsp, rc);
+        if (rc == -1)
+            return -1;
+
+        _modbus_decode_values(rsp + ctx->backend->header_length + 2, FALSE,
+                              width, nb, order, dest);
+        rc = nb;
+    }
+
+    return rc;
+}
+
+int modbus_read_registers_as_float(modbus_t *ctx, int addr, int nb,
+                                   modbus_order_t order, float *dest)
+{
+    return read_registers_as(ctx, MODBUS_FC_READ_HOLDING_REGISTERS, addr, nb,
+                             order, 4, dest);
+}
+
+int modbus_read_registers_as_double(modbus_t *ctx, int addr, int nb,
+                                    modbus_order_t order, double *dest)
+{
+    return read_registers_as(ctx, MODBUS_FC_READ_HOLDING_REGISTERS, addr, nb,
+                             order, 8, dest);
+}
+
+int modbus_read_registers_as_int32(modbus_t *ctx, int addr, int nb,
+                                   modbus_order_t order, int32_t *dest)
+{
+    return read_registers_as(ctx, MODBUS_FC_READ_HOLDING_REGISTERS, addr, nb,
+                             order, 4, dest);
+}
+
+int modbus_read_registers_as_uint32(modbus_t *ctx, int addr, int nb,
+                                    modbus_order_t order, uint32_t *dest)
+{
+    return read_registers_as(ctx, MODBUS_FC_READ_HOLDING_REGISTERS, addr, nb,
+                             order, 4, dest);
+}
+
+int modbus_read_registers_as_int64(modbus_t *ctx, int addr, int nb,
+                                   modbus_order_t order, int64_t *dest)
+{
+    return read_registers_as(ctx, MODBUS_FC_READ_HOLDING_REGISTERS, addr, nb,
+                             order, 8, dest);
+}
+
+int modbus_read_input_registers_as_float(modbus_t *ctx, int addr, int nb,
+                                         modbus_order_t order, float *dest)
+{
+    return read_registers_as(ctx, MODBUS_FC_READ_INPUT_REGISTERS, addr, nb,
+                             order, 4, dest);
+}
+
+int modbus_read_input_registers_as_double(modbus_t *ctx, int addr, int nb,
+                                          modbus_order_t order, double *dest)
+{
+    return read_registers_as(ctx, MODBUS_FC_READ_INPUT_REGISTERS, addr, nb,
+                             order, 8, dest);
+}
+
+int modbus_read_input_registers_as_int32(modbus_t *ctx, int addr, int nb,
+                                         modbus_order_t order, int32_t *dest)
+{
+    return read_registers_as(ctx, MODBUS_FC_READ_INPUT_REGISTERS, addr, nb,
+                             order, 4, dest);
+}
+
+int modbus_read_input_registers_as_uint32(modbus_t *ctx, int addr, int nb,
+                                          modbus_order_t order, uint32_t *dest)
+{
+    return read_registers_as(ctx, MODBUS_FC_READ_INPUT_REGISTERS, addr, nb,
+                             order, 4, dest);
+}
+
+int modbus_read_input_registers_as_int64(modbus_t *ctx, int addr, int nb,
+                                         modbus_order_t order, int64_t *dest)
+{
+    return read_registers_as(ctx, MODBUS_FC_READ_INPUT_REGISTERS, addr, nb,
+                             order, 8, dest);
+}
+
+/* Reads values and gives a view of the response left in the context */
+int modbus_read_view(modbus_t *ctx, int function, int addr, int nb, modbus_view_t *view)
+{
+    int rc;
+    int req_length;
+    int max_nb;
+    uint8_t req[_MIN_REQ_LENGTH];
+
+    if (ctx == NULL || view == NULL || function < MODBUS_FC_READ_COILS ||
+        function > MODBUS_FC_READ_INPUT_REGISTERS || nb < 1) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    max_nb = (function <= MODBUS_FC_READ_DISCRETE_INPUTS) ?
+        MODBUS_MAX_READ_BITS : MODBUS_MAX_READ_REGISTERS;
+    if (nb > max_nb) {
+        if (ctx->debug) {
+            fprintf(stderr, "ERROR Too many values requested (%d > %d)\n",
+                    nb, max_nb);
+        }
+        errno = EMBMDATA;
+        return -1;
+    }
+
+    req_length = ctx->backend->build_request_basis(ctx, function, addr, nb, req);
+
+    rc = send_msg(ctx, req, req_length);
+    if (rc > 0) {
+        int rsp_length;
+
+        rsp_length = _modbus_receive_confirmation(ctx, req, ctx->view_rsp);
+        if (rsp_length == -1)
+            return -1;
+
+        rc = check_confirmation(ctx, req, ctx->view_rsp, rsp_length);
+        if (rc == -1)
+            return -1;
+
+        view->pdu = ctx->view_rsp + ctx->backend->header_length;
+        view->pdu_length = rsp_length - ctx->backend->header_length -
+            ctx->backend->checksum_length;
+        view->data = view->pdu + 2;
+        view->nb = nb;
+        rc = nb;
+    }
+
+    return rc;
+}
+
+struct _modbus_prepared {
+    unsigned int backend_type;
+    int function;
+    int nb;
+    /* Whole request, checksum included */
+    int req_length;
+    /* Expected response length or MSG_LENGTH_UNDEFINED */
+    int rsp_length;
+    uint8_t req[_MIN_REQ_LENGTH];
+};
+
+/* Encodes a read request once for the repeated polls of the same values */
+modbus_prepared_t* modbus_prepare_read(modbus_t *ctx, int function, int addr, int nb)
+{
+    modbus_prepared_t *prepared;
+    int max_nb;
+
+    if (ctx == NULL || function < MODBUS_FC_READ_COILS ||
+        function > MODBUS_FC_READ_INPUT_REGISTERS) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    max_nb = (function <= MODBUS_FC_READ_DISCRETE_INPUTS) ?
+        MODBUS_MAX_READ_BITS : MODBUS_MAX_READ_REGISTERS;
+    if (nb < 1 || nb > max_nb) {
+        if (ctx->debug) {
+            fprintf(stderr, "ERROR Too many values requested (%d > %d)\n",
+                    nb, max_nb);
+        }
+        errno = EMBMDATA;
+        return NULL;
+    }
+
+    prepared = (modbus_prepared_t *)malloc(sizeof(modbus_prepared_t));
+    if (prepared == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    prepared->backend_type = ctx->backend->backend_type;
+    prepared->function = function;
+    prepared->nb = nb;
+    prepared->req_length = ctx->backend->build_request_basis(ctx, function, addr, nb,
+                                                             prepared->req);
+    prepared->req_length = ctx->backend->send_msg_pre(prepared->req,
+                                                      prepared->req_length);
+    prepared->rsp_length = MSG_LENGTH_UNDEFINED;
+    if (ctx->backend->backend_type == _MODBUS_BACKEND_TYPE_RTU) {
+        prepared->rsp_length = (int)compute_response_length_from_request(ctx,
+                                                                         prepared->req);
+    }
+
+    return prepared;
+}
+
+/* Sends the prepared request and receives the checked response, returns the
+   number of bytes or values given by check_confirmation() */
+static int send_prepared(modbus_t *ctx, const modbus_prepared_t *prepared,
+                         uint8_t *rsp)
+{
+    uint8_t req[_MIN_REQ_LENGTH];
+    int rc;
+
+    if (ctx == NULL || prepared == NULL ||
+        prepared->backend_type != ctx->backend->backend_type) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* Only the transaction ID changes, the template is left as is */
+    memcpy(req, prepared->req, prepared->req_length);
+    if (ctx->backend->set_request_tid != NULL) {
+        ctx->backend->set_request_tid(ctx, req);
+    }
+
+    rc = send_encoded_msg(ctx, req, prepared->req_length);
+    if (rc == -1)
+        return -1;
+
+    rc = receive_msg(ctx, rsp, MSG_CONFIRMATION, prepared->rsp_length);
+    if (rc == -1)
+        return -1;
+
+    return check_confirmation(ctx, req, rsp, rc);
+}
+
+int modbus_prepared_read_bits(modbus_t *ctx, const modbus_prepared_t *prepared,
+                              uint8_t *dest)
+{
+    uint8_t rsp[MAX_MESSAGE_LENGTH];
+    int rc;
+
+    if (prepared != NULL && prepared->function > MODBUS_FC_READ_DISCRETE_INPUTS) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    rc = send_prepared(ctx, prepared, rsp);
+    if (rc == -1)
+        return -1;
+
+    unpack_io_status(ctx, rsp, rc, prepared->nb, dest);
+    return prepared->nb;
+}
+
+int modbus_prepared_read_registers(modbus_t *ctx, const modbus_prepared_t *prepared,
+                                   uint16_t *dest)
+{
+    uint8_t rsp[MAX_MESSAGE_LENGTH];
+    int rc;
+
+    if (prepared != NULL && prepared->function < MODBUS_FC_READ_HOLDING_REGISTERS) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    rc = send_prepared(ctx, prepared, rsp);
+    if (rc == -1)
+        return -1;
+
+    unpack_registers(ctx, rsp, rc, dest);
+    return rc;
+}
+
+void modbus_prepared_free(modbus_prepared_t *prepared)
+{
+    free(prepared);
+}
+
+/* Write a value to the specified register of the remote device.
+   Used by write_bit and write_register */
+static int write_single(modbus_t *ctx, int function, int addr, int value)
 {
     int rc;
     int req_length;
@@ -1254,7 +2107,7 @@ static int write_single(modbus_t *ctx, int function, int addr, int value)
         /* Used by write_bit and write_register */
         uint8_t rsp[MAX_MESSAGE_LENGTH];
 
-        rc = _modbus_receive_msg(ctx, rsp, MSG_CONFIRMATION);
+        rc = _modbus_receive_confirmation(ctx, req, rsp);
         if (rc == -1)
             return -1;
 
@@ -1287,30 +2140,15 @@ int modbus_write_register(modbus_t *ctx, int addr, int value)
     return write_single(ctx, MODBUS_FC_WRITE_SINGLE_REGISTER, addr, value);
 }
 
-/* Write the bits of the array in the remote device */
-int modbus_write_bits(modbus_t *ctx, int addr, int nb, const uint8_t *src)
+/* Builds the request to write the bits of the array */
+static int build_write_bits(modbus_t *ctx, int addr, int nb, const uint8_t *src,
+                            uint8_t *req)
 {
-    int rc;
     int i;
     int byte_count;
     int req_length;
     int bit_check = 0;
     int pos = 0;
-    uint8_t req[MAX_MESSAGE_LENGTH];
-
-    if (ctx == NULL) {
-        errno = EINVAL;
-        return -1;
-    }
-
-    if (nb > MODBUS_MAX_WRITE_BITS) {
-        if (ctx->debug) {
-            fprintf(stderr, "ERROR Writing too many bits (%d > %d)\n",
-                    nb, MODBUS_MAX_WRITE_BITS);
-        }
-        errno = EMBMDATA;
-        return -1;
-    }
 
     req_length = ctx->backend->build_request_basis(ctx,
                                                    MODBUS_FC_WRITE_MULTIPLE_COILS,
@@ -1335,11 +2173,37 @@ int modbus_write_bits(modbus_t *ctx, int addr, int nb, const uint8_t *src)
         req_length++;
     }
 
+    return req_length;
+}
+
+/* Write the bits of the array in the remote device */
+int modbus_write_bits(modbus_t *ctx, int addr, int nb, const uint8_t *src)
+{
+    int rc;
+    int req_length;
+    uint8_t req[MAX_MESSAGE_LENGTH];
+
+    if (ctx == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (nb > MODBUS_MAX_WRITE_BITS) {
+        if (ctx->debug) {
+            fprintf(stderr, "ERROR Writing too many bits (%d > %d)\n",
+                    nb, MODBUS_MAX_WRITE_BITS);
+        }
+        errno = EMBMDATA;
+        return -1;
+    }
+
+    req_length = build_write_bits(ctx, addr, nb, src, req);
+
     rc = send_msg(ctx, req, req_length);
     if (rc > 0) {
         uint8_t rsp[MAX_MESSAGE_LENGTH];
 
-        rc = _modbus_receive_msg(ctx, rsp, MSG_CONFIRMATION);
+        rc = _modbus_receive_confirmation(ctx, req, rsp);
         if (rc == -1)
             return -1;
 
@@ -1350,13 +2214,33 @@ int modbus_write_bits(modbus_t *ctx, int addr, int nb, const uint8_t *src)
     return rc;
 }
 
+/* Builds the request to write the values of the array to registers */
+static int build_write_registers(modbus_t *ctx, int addr, int nb, const uint16_t *src,
+                                 uint8_t *req)
+{
+    int i;
+    int req_length;
+    int byte_count;
+
+    req_length = ctx->backend->build_request_basis(ctx,
+                                                   MODBUS_FC_WRITE_MULTIPLE_REGISTERS,
+                                                   addr, nb, req);
+    byte_count = nb * 2;
+    req[req_length++] = byte_count;
+
+    for (i = 0; i < nb; i++) {
+        req[req_length++] = src[i] >> 8;
+        req[req_length++] = src[i] & 0x00FF;
+    }
+
+    return req_length;
+}
+
 /* Write the values from the array to the registers of the remote device */
 int modbus_write_registers(modbus_t *ctx, int addr, int nb, const uint16_t *src)
 {
     int rc;
-    int i;
     int req_length;
-    int byte_count;
     uint8_t req[MAX_MESSAGE_LENGTH];
 
     if (ctx == NULL) {
@@ -1374,22 +2258,13 @@ int modbus_write_registers(modbus_t *ctx, int addr, int nb, const uint16_t *src)
         return -1;
     }
 
-    req_length = ctx->backend->build_request_basis(ctx,
-                                                   MODBUS_FC_WRITE_MULTIPLE_REGISTERS,
-                                                   addr, nb, req);
-    byte_count = nb * 2;
-    req[req_length++] = byte_count;
-
-    for (i = 0; i < nb; i++) {
-        req[req_length++] = src[i] >> 8;
-        req[req_length++] = src[i] & 0x00FF;
-    }
+    req_length = build_write_registers(ctx, addr, nb, src, req);
 
     rc = send_msg(ctx, req, req_length);
     if (rc > 0) {
         uint8_t rsp[MAX_MESSAGE_LENGTH];
 
-        rc = _modbus_receive_msg(ctx, rsp, MSG_CONFIRMATION);
+        rc = _modbus_receive_confirmation(ctx, req, rsp);
         if (rc == -1)
             return -1;
 
@@ -1399,14 +2274,10 @@ int modbus_write_registers(modbus_t *ctx, int addr, int nb, const uint16_t *src)
     return rc;
 }
 
-int modbus_mask_write_register(modbus_t *ctx, int addr, uint16_t and_mask, uint16_t or_mask)
+static int build_mask_write_register(modbus_t *ctx, int addr, uint16_t and_mask,
+                                     uint16_t or_mask, uint8_t *req)
 {
-    int rc;
     int req_length;
-    /* The request length can not exceed _MIN_REQ_LENGTH - 2 and 4 bytes to
-     * store the masks. The ugly substraction is there to remove the 'nb' value
-     * (2 bytes) which is not used. */
-    uint8_t req[_MIN_REQ_LENGTH + 2];
 
     req_length = ctx->backend->build_request_basis(ctx,
                                                    MODBUS_FC_MASK_WRITE_REGISTER,
@@ -1420,12 +2291,26 @@ int modbus_mask_write_register(modbus_t *ctx, int addr, uint16_t and_mask, uint1
     req[req_length++] = or_mask >> 8;
     req[req_length++] = or_mask & 0x00ff;
 
+    return req_length;
+}
+
+int modbus_mask_write_register(modbus_t *ctx, int addr, uint16_t and_mask, uint16_t or_mask)
+{
+    int rc;
+    int req_length;
+    /* The request length can not exceed _MIN_REQ_LENGTH - 2 and 4 bytes to
+     * store the masks. The ugly substraction is there to remove the 'nb' value
+     * (2 bytes) which is not used. */
+    uint8_t req[_MIN_REQ_LENGTH + 2];
+
+    req_length = build_mask_write_register(ctx, addr, and_mask, or_mask, req);
+
     rc = send_msg(ctx, req, req_length);
     if (rc > 0) {
         /* Used by write_bit and write_register */
         uint8_t rsp[MAX_MESSAGE_LENGTH];
 
-        rc = _modbus_receive_msg(ctx, rsp, MSG_CONFIRMATION);
+        rc = _modbus_receive_confirmation(ctx, req, rsp);
         if (rc == -1)
             return -1;
 
@@ -1495,7 +2380,7 @@ int modbus_write_and_read_registers(modbus_t *ctx,
     if (rc > 0) {
         int offset;
 
-        rc = _modbus_receive_msg(ctx, rsp, MSG_CONFIRMATION);
+        rc = _modbus_receive_confirmation(ctx, req, rsp);
         if (rc == -1)
             return -1;
 
@@ -1539,7 +2424,7 @@ int modbus_report_slave_id(modbus_t *ctx, int max_dest, uint8_t *dest)
         int offset;
         uint8_t rsp[MAX_MESSAGE_LENGTH];
 
-        rc = _modbus_receive_msg(ctx, rsp, MSG_CONFIRMATION);
+        rc = _modbus_receive_confirmation(ctx, req, rsp);
         if (rc == -1)
             return -1;
 
@@ -1559,6 +2444,338 @@ int modbus_report_slave_id(modbus_t *ctx, int max_dest, uint8_t *dest)
     return rc;
 }
 
+/* Builds the request of a batch operation, without the checksum */
+static int build_batch_request(modbus_t *ctx, const modbus_batch_op_t *op, uint8_t *req)
+{
+    int max_nb;
+    int has_data;
+
+    switch (op->function) {
+    case MODBUS_FC_READ_COILS:
+    case MODBUS_FC_READ_DISCRETE_INPUTS:
+        max_nb = MODBUS_MAX_READ_BITS;
+        has_data = (op->bits != NULL);
+        break;
+    case MODBUS_FC_READ_HOLDING_REGISTERS:
+    case MODBUS_FC_READ_INPUT_REGISTERS:
+        max_nb = MODBUS_MAX_READ_REGISTERS;
+        has_data = (op->registers != NULL);
+        break;
+    case MODBUS_FC_WRITE_MULTIPLE_COILS:
+        max_nb = MODBUS_MAX_WRITE_BITS;
+        has_data = (op->bits != NULL);
+        break;
+    case MODBUS_FC_WRITE_MULTIPLE_REGISTERS:
+        max_nb = MODBUS_MAX_WRITE_REGISTERS;
+        has_data = (op->registers != NULL);
+        break;
+    case MODBUS_FC_WRITE_SINGLE_COIL:
+        return ctx->backend->build_request_basis(ctx, op->function, op->addr,
+                                                 op->value ? 0xFF00 : 0, req);
+    case MODBUS_FC_WRITE_SINGLE_REGISTER:
+        return ctx->backend->build_request_basis(ctx, op->function, op->addr,
+                                                 op->value, req);
+    case MODBUS_FC_MASK_WRITE_REGISTER:
+        return build_mask_write_register(ctx, op->addr, op->value, op->or_mask, req);
+    default:
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (op->nb < 1 || !has_data) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (op->nb > max_nb) {
+        if (ctx->debug) {
+            fprintf(stderr, "ERROR Too many values in the batch operation (%d > %d)\n",
+                    op->nb, max_nb);
+        }
+        errno = EMBMDATA;
+        return -1;
+    }
+
+    switch (op->function) {
+    case MODBUS_FC_WRITE_MULTIPLE_COILS:
+        return build_write_bits(ctx, op->addr, op->nb, op->bits, req);
+    case MODBUS_FC_WRITE_MULTIPLE_REGISTERS:
+        return build_write_registers(ctx, op->addr, op->nb, op->registers, req);
+    default:
+        return ctx->backend->build_request_basis(ctx, op->function, op->addr,
+                                                 op->nb, req);
+    }
+}
+
+static void batch_done(modbus_batch_op_t *op, int rc)
+{
+    op->rc = rc;
+    op->error = (rc == -1) ? errno : 0;
+}
+
+/* Checks the response of a batch operation and stores the values read */
+static void batch_result(modbus_t *ctx, modbus_batch_op_t *op, uint8_t *req,
+                         uint8_t *rsp, int rsp_length)
+{
+    int rc;
+
+    rc = check_confirmation(ctx, req, rsp, rsp_length);
+    if (rc != -1) {
+        switch (op->function) {
+        case MODBUS_FC_READ_COILS:
+        case MODBUS_FC_READ_DISCRETE_INPUTS:
+            unpack_io_status(ctx, rsp, rc, op->nb, op->bits);
+            rc = op->nb;
+            break;
+        case MODBUS_FC_READ_HOLDING_REGISTERS:
+        case MODBUS_FC_READ_INPUT_REGISTERS:
+            unpack_registers(ctx, rsp, rc, op->registers);
+            break;
+        }
+    }
+    batch_done(op, rc);
+}
+
+/* Serial line, one transaction after the other */
+static void batch_serial(modbus_t *ctx, modbus_batch_op_t *ops, int nb_ops)
+{
+    uint8_t req[MAX_MESSAGE_LENGTH];
+    uint8_t rsp[MAX_MESSAGE_LENGTH];
+    int req_length;
+    int rc;
+    int i;
+
+    for (i = 0; i < nb_ops; i++) {
+        req_length = build_batch_request(ctx, &ops[i], req);
+        if (req_length == -1) {
+            batch_done(&ops[i], -1);
+            continue;
+        }
+
+        rc = send_msg(ctx, req, req_length);
+        if (rc > 0) {
+            rc = _modbus_receive_confirmation(ctx, req, rsp);
+        }
+        if (rc == -1) {
+            batch_done(&ops[i], -1);
+            continue;
+        }
+
+        batch_result(ctx, &ops[i], req, rsp, rc);
+    }
+}
+
+/* TCP, up to MODBUS_BATCH_WINDOW requests are sent in one call then the
+   responses are matched by transaction ID, in any order */
+static int batch_pipelined(modbus_t *ctx, modbus_batch_op_t *ops, int nb_ops)
+{
+    uint8_t *reqs;
+    uint8_t rsp[MAX_MESSAGE_LENGTH];
+    int index[MODBUS_BATCH_WINDOW];
+    int start[MODBUS_BATCH_WINDOW];
+    int first;
+    int next;
+    int n;
+    int pending;
+    int length;
+    int req_length;
+    int error_recovery;
+    int rc;
+    int i;
+
+    reqs = (uint8_t *)malloc(MODBUS_BATCH_WINDOW * MAX_MESSAGE_LENGTH);
+    if (reqs == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    for (first = 0; first < nb_ops; first = next) {
+        n = 0;
+        length = 0;
+        for (next = first; next < nb_ops && n < MODBUS_BATCH_WINDOW; next++) {
+            req_length = build_batch_request(ctx, &ops[next], reqs + length);
+            if (req_length == -1) {
+                batch_done(&ops[next], -1);
+                continue;
+            }
+            index[n] = next;
+            start[n] = length;
+            n++;
+            length += ctx->backend->send_msg_pre(reqs + length, req_length);
+        }
+        if (n == 0)
+            continue;
+
+        rc = send_encoded_msg(ctx, reqs, length);
+        if (rc == -1) {
+            for (i = 0; i < n; i++)
+                batch_done(&ops[index[i]], -1);
+            continue;
+        }
+
+        for (pending = n; pending > 0;) {
+            rc = receive_msg(ctx, rsp, MSG_CONFIRMATION, MSG_LENGTH_UNDEFINED);
+            if (rc == -1) {
+                for (i = 0; i < n; i++) {
+                    if (index[i] != -1)
+                        batch_done(&ops[index[i]], -1);
+                }
+                break;
+            }
+
+            for (i = 0; i < n; i++) {
+                if (index[i] != -1 &&
+                    reqs[start[i]] == rsp[0] && reqs[start[i] + 1] == rsp[1])
+                    break;
+            }
+            if (i == n) {
+                /* Late response to a request which has timed out */
+                if (ctx->debug) {
+                    fprintf(stderr, "Response with unknown transaction ID (%d) dropped\n",
+                            (rsp[0] << 8) + rsp[1]);
+                }
+                continue;
+            }
+
+            /* The sleep and flush of the protocol recovery would drop the
+               responses still expected, only this operation fails */
+            error_recovery = ctx->error_recovery;
+            ctx->error_recovery &= ~MODBUS_ERROR_RECOVERY_PROTOCOL;
+            batch_result(ctx, &ops[index[i]], reqs + start[i], rsp, rc);
+            ctx->error_recovery = error_recovery;
+            index[i] = -1;
+            pending--;
+        }
+    }
+
+    free(reqs);
+    return 0;
+}
+
+int modbus_batch(modbus_t *ctx, modbus_batch_op_t *ops, int nb_ops)
+{
+    int nb_done = 0;
+    int i;
+
+    if (ctx == NULL || nb_ops < 0 || (ops == NULL && nb_ops > 0)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (ctx->backend->backend_type == _MODBUS_BACKEND_TYPE_TCP) {
+        if (batch_pipelined(ctx, ops, nb_ops) == -1)
+            return -1;
+    } else {
+        batch_serial(ctx, ops, nb_ops);
+    }
+
+    for (i = 0; i < nb_ops; i++) {
+        if (ops[i].rc != -1)
+            nb_done++;
+    }
+
+    return nb_done;
+}
+
+/* Splits a transfer in batch operations of at most max_nb values */
+static int transfer_range(modbus_t *ctx, int function, int addr, int nb,
+                          void *data, int *failed_offset)
+{
+    modbus_batch_op_t *ops;
+    int max_nb;
+    int nb_ops;
+    int offset;
+    int i;
+    int rc;
+
+    if (failed_offset != NULL)
+        *failed_offset = 0;
+
+    switch (function) {
+    case MODBUS_FC_READ_COILS:
+    case MODBUS_FC_READ_DISCRETE_INPUTS:
+        max_nb = MODBUS_MAX_READ_BITS;
+        break;
+    case MODBUS_FC_READ_HOLDING_REGISTERS:
+    case MODBUS_FC_READ_INPUT_REGISTERS:
+        max_nb = MODBUS_MAX_READ_REGISTERS;
+        break;
+    case MODBUS_FC_WRITE_MULTIPLE_COILS:
+        max_nb = MODBUS_MAX_WRITE_BITS;
+        break;
+    case MODBUS_FC_WRITE_MULTIPLE_REGISTERS:
+        max_nb = MODBUS_MAX_WRITE_REGISTERS;
+        break;
+    default:
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (ctx == NULL || data == NULL || nb < 1 || addr < 0 || addr + nb > 0x10000) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    nb_ops = (nb + max_nb - 1) / max_nb;
+    ops = (modbus_batch_op_t *)calloc(nb_ops, sizeof(modbus_batch_op_t));
+    if (ops == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    for (i = 0, offset = 0; i < nb_ops; i++, offset += max_nb) {
+        ops[i].function = function;
+        ops[i].addr = addr + offset;
+        ops[i].nb = (nb - offset < max_nb) ? nb - offset : max_nb;
+        if (function == MODBUS_FC_READ_COILS ||
+            function == MODBUS_FC_READ_DISCRETE_INPUTS ||
+            function == MODBUS_FC_WRITE_MULTIPLE_COILS) {
+            ops[i].bits = (uint8_t *)data + offset;
+        } else {
+            ops[i].registers = (uint16_t *)data + offset;
+        }
+    }
+
+    rc = modbus_batch(ctx, ops, nb_ops);
+    if (rc == nb_ops) {
+        rc = nb;
+    } else if (rc != -1) {
+        for (i = 0; ops[i].rc != -1; i++)
+            ;
+        if (failed_offset != NULL)
+            *failed_offset = ops[i].addr - addr;
+        errno = ops[i].error;
+        rc = -1;
+    }
+
+    free(ops);
+    return rc;
+}
+
+int modbus_read_range(modbus_t *ctx, int function, int addr, int nb, void *dest,
+                      int *failed_offset)
+{
+    if (function > MODBUS_FC_READ_INPUT_REGISTERS) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return transfer_range(ctx, function, addr, nb, dest, failed_offset);
+}
+
+int modbus_write_range(modbus_t *ctx, int function, int addr, int nb, const void *src,
+                       int *failed_offset)
+{
+    if (function != MODBUS_FC_WRITE_MULTIPLE_COILS &&
+        function != MODBUS_FC_WRITE_MULTIPLE_REGISTERS) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* The batch operations only read the values to write */
+    return transfer_range(ctx, function, addr, nb, (void *)src, failed_offset);
+}
+
 void _modbus_init_common(modbus_t *ctx)
 {
     /* Slave and socket are initialized to -1 */
@@ -1576,6 +2793,9 @@ void _modbus_init_common(modbus_t *ctx)
 
     ctx->indication_timeout.tv_sec = 0;
     ctx->indication_timeout.tv_usec = 0;
+
+    ctx->connect_nowait = FALSE;
+    ctx->step = NULL;
 }
 
 /* Define the slave number */
@@ -1612,6 +2832,16 @@ int modbus_set_error_recovery(modbus_t *ctx,
     return 0;
 }
 
+int modbus_get_error_recovery(modbus_t *ctx)
+{
+    if (ctx == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return ctx->error_recovery;
+}
+
 int modbus_set_socket(modbus_t *ctx, int s)
 {
     if (ctx == NULL) {
@@ -1731,6 +2961,24 @@ int modbus_connect(modbus_t *ctx)
     return ctx->backend->connect(ctx);
 }
 
+/* Same as modbus_connect() but a TCP connection isn't waited for, -1 and
+   EINPROGRESS are returned while it's being established */
+int modbus_connect_start(modbus_t *ctx)
+{
+    int rc;
+
+    if (ctx == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    ctx->connect_nowait = TRUE;
+    rc = ctx->backend->connect(ctx);
+    ctx->connect_nowait = FALSE;
+
+    return rc;
+}
+
 void modbus_close(modbus_t *ctx)
 {
     if (ctx == NULL)
@@ -1744,6 +2992,7 @@ void modbus_free(modbus_t *ctx)
     if (ctx == NULL)
         return;
 
+    free(ctx->step);
     ctx->backend->free(ctx);
 }
 
@@ -1772,7 +3021,7 @@ modbus_mapping_t* modbus_mapping_new_start_address(
 {
     modbus_mapping_t *mb_mapping;
 
-    mb_mapping = (modbus_mapping_t *)malloc(sizeof(modbus_mapping_t));
+    mb_mapping = (modbus_mapping_t *)calloc(1, sizeof(modbus_mapping_t));
     if (mb_mapping == NULL) {
         return NULL;
     }
@@ -1866,9 +3115,132 @@ void modbus_mapping_free(modbus_mapping_t *mb_mapping)
     free(mb_mapping->tab_registers);
     free(mb_mapping->tab_input_bits);
     free(mb_mapping->tab_bits);
+    free(mapping_cache_unlink(mb_mapping));
     free(mb_mapping);
 }
 
+int modbus_mapping_set_reply_cache(modbus_mapping_t *mb_mapping, int nb_entries)
+{
+    mapping_cache_t *cache = NULL;
+
+    if (mb_mapping == NULL || nb_entries < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (nb_entries > 0) {
+        cache = (mapping_cache_t *)calloc(
+            1, sizeof(mapping_cache_t) + (nb_entries - 1) * sizeof(mapping_cache_entry_t));
+        if (cache == NULL) {
+            errno = ENOMEM;
+            return -1;
+        }
+        cache->mb_mapping = mb_mapping;
+        cache->nb_entries = nb_entries;
+    }
+
+    free(mapping_cache_unlink(mb_mapping));
+    if (cache != NULL) {
+        MAPPING_CACHES_LOCK();
+        cache->next = mapping_caches;
+        mapping_caches = cache;
+        MAPPING_CACHES_ADD(1);
+        MAPPING_CACHES_UNLOCK();
+    }
+    return 0;
+}
+
+/* For the applications writing the tab_xxx arrays directly */
+void modbus_mapping_invalidate(modbus_mapping_t *mb_mapping)
+{
+    mapping_cache_bump(mb_mapping, MAPPING_CACHE_BITS | MAPPING_CACHE_INPUT_BITS |
+                                   MAPPING_CACHE_REGISTERS | MAPPING_CACHE_INPUT_REGISTERS);
+}
+
+int modbus_mapping_set_bits(modbus_mapping_t *mb_mapping, int addr, int nb,
+                            const uint8_t *src)
+{
+    int mapping_address;
+
+    if (mb_mapping == NULL || src == NULL || nb < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    mapping_address = addr - mb_mapping->start_bits;
+    if (mapping_address < 0 || mapping_address + nb > mb_mapping->nb_bits) {
+        errno = EMBXILADD;
+        return -1;
+    }
+
+    memcpy(mb_mapping->tab_bits + mapping_address, src, nb * sizeof(uint8_t));
+    mapping_cache_bump(mb_mapping, MAPPING_CACHE_BITS);
+    return 0;
+}
+
+int modbus_mapping_set_input_bits(modbus_mapping_t *mb_mapping, int addr, int nb,
+                                  const uint8_t *src)
+{
+    int mapping_address;
+
+    if (mb_mapping == NULL || src == NULL || nb < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    mapping_address = addr - mb_mapping->start_input_bits;
+    if (mapping_address < 0 || mapping_address + nb > mb_mapping->nb_input_bits) {
+        errno = EMBXILADD;
+        return -1;
+    }
+
+    memcpy(mb_mapping->tab_input_bits + mapping_address, src, nb * sizeof(uint8_t));
+    mapping_cache_bump(mb_mapping, MAPPING_CACHE_INPUT_BITS);
+    return 0;
+}
+
+int modbus_mapping_set_registers(modbus_mapping_t *mb_mapping, int addr, int nb,
+                                 const uint16_t *src)
+{
+    int mapping_address;
+
+    if (mb_mapping == NULL || src == NULL || nb < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    mapping_address = addr - mb_mapping->start_registers;
+    if (mapping_address < 0 || mapping_address + nb > mb_mapping->nb_registers) {
+        errno = EMBXILADD;
+        return -1;
+    }
+
+    memcpy(mb_mapping->tab_registers + mapping_address, src, nb * sizeof(uint16_t));
+    mapping_cache_bump(mb_mapping, MAPPING_CACHE_REGISTERS);
+    return 0;
+}
+
+int modbus_mapping_set_input_registers(modbus_mapping_t *mb_mapping, int addr, int nb,
+                                       const uint16_t *src)
+{
+    int mapping_address;
+
+    if (mb_mapping == NULL || src == NULL || nb < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    mapping_address = addr - mb_mapping->start_input_registers;
+    if (mapping_address < 0 || mapping_address + nb > mb_mapping->nb_input_registers) {
+        errno = EMBXILADD;
+        return -1;
+    }
+
+    memcpy(mb_mapping->tab_input_registers + mapping_address, src, nb * sizeof(uint16_t));
+    mapping_cache_bump(mb_mapping, MAPPING_CACHE_INPUT_REGISTERS);
+    return 0;
+}
+
 #ifndef HAVE_STRLCPY
 /*
  * Function strlcpy was originally developed by
@@ -191,6 +191,7 @@ MODBUS_API int modbus_get_slave(modbus_t* ctx);
 /*
 用于在连接失败或者传输异常的情况下，设置错误恢复模式*/
 MODBUS_API int modbus_set_error_recovery(modbus_t *ctx, modbus_error_recovery_mode error_recovery);
+MODBUS_API int modbus_get_error_recovery(modbus_t *ctx);
 
 /*
 此函数设置当前SOCKET或串口句柄，主要用于多客户端连接到单一服务器的场合*/
@@ -290,6 +291,44 @@ uint8_t *dest：传出的寄存器值
 */
 MODBUS_API int modbus_read_input_registers(modbus_t *ctx, int addr, int nb, uint16_t *dest);
 
+/*
+读取并返回应答的视图，不复制数据（功能码0x01~0x04）。
+视图指向实例内部的接收缓冲区，在该实例的下一次modbus_read_view()或modbus_free()前有效；
+数据为报文中的原始字节，用MODBUS_VIEW_GET_REGISTER()/MODBUS_VIEW_GET_BIT()读取。
+成功返回nb
+*/
+typedef struct {
+    const uint8_t *pdu;  /* 应答PDU，从功能码开始 */
+    int pdu_length;
+    const uint8_t *data; /* 字节数之后的数据 */
+    int nb;              /* 请求的位或寄存器个数 */
+} modbus_view_t;
+
+#define MODBUS_VIEW_GET_REGISTER(view, index) \
+    ((uint16_t)(((view)->data[2 * (index)] << 8) | (view)->data[2 * (index) + 1]))
+#define MODBUS_VIEW_GET_BIT(view, index) \
+    (((view)->data[(index) / 8] >> ((index) % 8)) & 1)
+
+MODBUS_API int modbus_read_view(modbus_t *ctx, int function, int addr, int nb,
+                                modbus_view_t *view);
+
+/*
+预编码的读请求（功能码0x01~0x04），用于反复轮询同一组数据。
+请求报文（含RTU的CRC）及应答长度在modbus_prepare_read()时计算一次，
+之后每次发送只更新TCP的事务号。从站地址取自当时的modbus_set_slave()，
+只能用于同一后端类型（RTU或TCP）的实例。
+function: MODBUS_FC_READ_COILS ~ MODBUS_FC_READ_INPUT_REGISTERS
+*/
+typedef struct _modbus_prepared modbus_prepared_t;
+MODBUS_API modbus_prepared_t* modbus_prepare_read(modbus_t *ctx, int function, int addr, int nb);
+/* 功能码0x01/0x02，成功返回读取的个数 */
+MODBUS_API int modbus_prepared_read_bits(modbus_t *ctx, const modbus_prepared_t *prepared,
+                                         uint8_t *dest);
+/* 功能码0x03/0x04，成功返回读取的个数 */
+MODBUS_API int modbus_prepared_read_registers(modbus_t *ctx, const modbus_prepared_t *prepared,
+                                              uint16_t *dest);
+MODBUS_API void modbus_prepared_free(modbus_prepared_t *prepared);
+
 
 /*
 此函数对应于功能码05(0x05)
@@ -343,6 +382,41 @@ unint8_t *dest:存储返回数据
 */
 MODBUS_API int modbus_report_slave_id(modbus_t *ctx, int max_dest, uint8_t *dest);
 
+/*
+批量请求：一次调用执行多个不同的读写操作，每个操作有各自的结果。
+TCP下每MODBUS_BATCH_WINDOW个请求一次发送，再按事务号匹配应答（可乱序）；
+RTU下逐个连续执行。
+function支持：0x01~0x06、0x0F、0x10、0x16
+*/
+#define MODBUS_BATCH_WINDOW 16
+
+typedef struct {
+    int function;
+    int addr;
+    int nb;              /* 读写的个数，0x05/0x06/0x16不使用 */
+    uint16_t value;      /* 0x05/0x06写入的值（线圈非0为ON），0x16的AND掩码 */
+    uint16_t or_mask;    /* 0x16的OR掩码 */
+    uint8_t *bits;       /* 0x01/0x02读出的位，0x0F写入的位 */
+    uint16_t *registers; /* 0x03/0x04读出的寄存器，0x10写入的寄存器 */
+    int rc;              /* 结果，与对应的单个函数的返回值相同，失败为-1 */
+    int error;           /* 失败时的errno，成功为0 */
+} modbus_batch_op_t;
+
+/* 返回成功的操作个数，参数错误返回-1 */
+MODBUS_API int modbus_batch(modbus_t *ctx, modbus_batch_op_t *ops, int nb_ops);
+
+/*
+超出协议单次上限的连续读写，按上限自动分块后用modbus_batch()执行，
+数据直接读入dest或从src写出（0x01/0x02/0x0F为uint8_t数组，0x03/0x04/0x10为uint16_t数组）。
+全部成功返回nb；否则返回-1，errno为第一个失败块的错误，
+failed_offset（可为NULL）为该块相对addr的偏移，之前的数据已完成。
+写入失败时，之后的块可能已经写入。
+*/
+MODBUS_API int modbus_read_range(modbus_t *ctx, int function, int addr, int nb, void *dest,
+                                 int *failed_offset);
+MODBUS_API int modbus_write_range(modbus_t *ctx, int function, int addr, int nb,
+                                  const void *src, int *failed_offset);
+
 /*
 函数modbus_mapping_new_start_address()与modbus_mapping_new()的
 功能一致，即在内存中申请一段连续的空间，用于分别存储4个寄存器快的数据。
@@ -359,6 +433,29 @@ MODBUS_API modbus_mapping_t* modbus_mapping_new(int nb_bits, int nb_input_bits,
                                                 int nb_registers, int nb_input_registers);
 MODBUS_API void modbus_mapping_free(modbus_mapping_t *mb_mapping);  //释放申请的内存，防止内存泄漏
 
+/*
+modbus_reply()的读应答缓存（功能码0x01~0x04），按(功能码, 地址, 数量)保存
+已编码的数据，命中时只重新填写报文头。nb_entries为0时关闭（默认关闭）。
+开启后，应用程序修改映射表须通过下面的modbus_mapping_set_xxx()函数，
+或在直接修改tab_xxx后调用modbus_mapping_invalidate()，否则会应答旧值。
+缓存保存在库内部，也可用于应用程序自行分配的映射表，此时释放映射表前须以
+nb_entries为0关闭缓存。
+开启、关闭缓存（包括modbus_mapping_free()）不能与使用该映射表的
+modbus_reply()同时进行，须由应用程序保证；没有开启任何缓存时modbus_reply()不加锁。
+*/
+#define MODBUS_MAPPING_DEFAULT_CACHE_ENTRIES 64
+MODBUS_API int modbus_mapping_set_reply_cache(modbus_mapping_t *mb_mapping, int nb_entries);
+MODBUS_API void modbus_mapping_invalidate(modbus_mapping_t *mb_mapping);
+/* 按Modbus地址写入映射表，超出范围时返回-1，errno为EMBXILADD */
+MODBUS_API int modbus_mapping_set_bits(modbus_mapping_t *mb_mapping, int addr, int nb,
+                                       const uint8_t *src);
+MODBUS_API int modbus_mapping_set_input_bits(modbus_mapping_t *mb_mapping, int addr, int nb,
+                                             const uint8_t *src);
+MODBUS_API int modbus_mapping_set_registers(modbus_mapping_t *mb_mapping, int addr, int nb,
+                                            const uint16_t *src);
+MODBUS_API int modbus_mapping_set_input_registers(modbus_mapping_t *mb_mapping, int addr,
+                                                  int nb, const uint16_t *src);
+
 MODBUS_API int modbus_send_raw_request(modbus_t *ctx, uint8_t *raw_req, int raw_req_length);
 
 MODBUS_API int modbus_receive(modbus_t *ctx, uint8_t *req);
@@ -370,6 +467,27 @@ MODBUS_API int modbus_reply(modbus_t *ctx, const uint8_t *req,
 MODBUS_API int modbus_reply_exception(modbus_t *ctx, const uint8_t *req,
                                       unsigned int exception_code);
 
+/*
+非阻塞的组成部分，供事件循环使用（如modbus-coro.hpp）：
+modbus_connect_start()：同modbus_connect()，但TCP连接不等待完成，进行中返回-1且errno为EINPROGRESS，
+  套接字可写后由modbus_connect_finish()取得结果；
+modbus_encode_request()：将PDU（功能码+数据）编码为当前从站的请求报文（TCP取下一个事务号），返回长度；
+modbus_confirmation_length()：由已收到的rsp_length个字节计算应答长度，等于rsp_length时应答完整，
+  否则为至少需要的字节数；
+modbus_check_confirmation()：校验完整的应答，返回值同阻塞调用；协议层错误恢复（清空并等待）由调用者处理。
+modbus_send_bytes()/modbus_receive_bytes()：不等待的发送和接收，无法进行时返回-1且errno为EAGAIN，
+  连接关闭时接收返回-1且errno为ECONNRESET。
+*/
+MODBUS_API int modbus_connect_start(modbus_t *ctx);
+MODBUS_API int modbus_connect_finish(modbus_t *ctx);
+MODBUS_API int modbus_send_bytes(modbus_t *ctx, const uint8_t *buf, int length);
+MODBUS_API int modbus_receive_bytes(modbus_t *ctx, uint8_t *buf, int length);
+MODBUS_API int modbus_encode_request(modbus_t *ctx, const uint8_t *pdu, int pdu_length,
+                                     uint8_t *req);
+MODBUS_API int modbus_confirmation_length(modbus_t *ctx, const uint8_t *rsp, int rsp_length);
+MODBUS_API int modbus_check_confirmation(modbus_t *ctx, const uint8_t *req,
+                                         const uint8_t *rsp, int rsp_length);
+
 /**
  * UTILS FUNCTIONS
  **/
@@ -417,8 +535,57 @@ MODBUS_API void modbus_set_float_dcba(float f, uint16_t *dest);
 MODBUS_API void modbus_set_float_badc(float f, uint16_t *dest);
 MODBUS_API void modbus_set_float_cdab(float f, uint16_t *dest);
 
+/*
+多个寄存器组成的值的字节序，名称与modbus_get_float_abcd()等函数一致：
+DCBA为第一个寄存器在高位的大端序（同MODBUS_GET_INT32_FROM_INT16），
+BADC为寄存器顺序反转，CDAB为寄存器内字节交换，ABCD为两者都反转（小端序）。
+64位的值按相同规则扩展到4个寄存器。
+*/
+typedef enum
+{
+    MODBUS_ORDER_ABCD = 0,
+    MODBUS_ORDER_DCBA,
+    MODBUS_ORDER_BADC,
+    MODBUS_ORDER_CDAB
+} modbus_order_t;
+
+/* 批量转换：从src读取nb个值（每个2或4个寄存器），返回nb，参数错误返回-1 */
+MODBUS_API int modbus_get_float_array(const uint16_t *src, int nb, modbus_order_t order, float *dest);
+MODBUS_API int modbus_get_double_array(const uint16_t *src, int nb, modbus_order_t order, double *dest);
+MODBUS_API int modbus_get_int32_array(const uint16_t *src, int nb, modbus_order_t order, int32_t *dest);
+MODBUS_API int modbus_get_uint32_array(const uint16_t *src, int nb, modbus_order_t order, uint32_t *dest);
+MODBUS_API int modbus_get_int64_array(const uint16_t *src, int nb, modbus_order_t order, int64_t *dest);
+
+/*
+读取nb个值（功能码0x03/0x04），直接从接收缓冲区转换，
+寄存器总数不能超过MODBUS_MAX_READ_REGISTERS，成功返回nb
+*/
+MODBUS_API int modbus_read_registers_as_float(modbus_t *ctx, int addr, int nb,
+                                              modbus_order_t order, float *dest);
+MODBUS_API int modbus_read_registers_as_double(modbus_t *ctx, int addr, int nb,
+                                               modbus_order_t order, double *dest);
+MODBUS_API int modbus_read_registers_as_int32(modbus_t *ctx, int addr, int nb,
+                                              modbus_order_t order, int32_t *dest);
+MODBUS_API int modbus_read_registers_as_uint32(modbus_t *ctx, int addr, int nb,
+                                               modbus_order_t order, uint32_t *dest);
+MODBUS_API int modbus_read_registers_as_int64(modbus_t *ctx, int addr, int nb,
+                                              modbus_order_t order, int64_t *dest);
+MODBUS_API int modbus_read_input_registers_as_float(modbus_t *ctx, int addr, int nb,
+                                                    modbus_order_t order, float *dest);
+MODBUS_API int modbus_read_input_registers_as_double(modbus_t *ctx, int addr, int nb,
+                                                     modbus_order_t order, double *dest);
+MODBUS_API int modbus_read_input_registers_as_int32(modbus_t *ctx, int addr, int nb,
+                                                    modbus_order_t order, int32_t *dest);
+MODBUS_API int modbus_read_input_registers_as_uint32(modbus_t *ctx, int addr, int nb,
+                                                     modbus_order_t order, uint32_t *dest);
+MODBUS_API int modbus_read_input_registers_as_int64(modbus_t *ctx, int addr, int nb,
+                                                    modbus_order_t order, int64_t *dest);
+
 #include "modbus-tcp.h"
 #include "modbus-rtu.h"
+#include "modbus-server.h"
+#include "modbus-rtu-bus.h"
+#include "modbus-gateway.h"
 
 MODBUS_END_DECLS
 
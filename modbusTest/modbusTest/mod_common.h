@@ -177,6 +177,8 @@ typedef struct
 	int port;
 
 	int clientSocket;
+	int serverSocket;
+	int listenBacklog;
 }TcpBackend;      //TCPṹ
 
 int setTcpParam(void * backend, char c, char * value)
@@ -220,17 +222,18 @@ void delTcp(void * backend)
 	free(tcp);
 }
 
+//opens the listening socket only, the connections are accepted by the server loop
 int listenForTcpConnection(void * backend, modbus_t * ctx)
 {
 	TcpBackend * tcp = (TcpBackend *)backend;
-	tcp->clientSocket = modbus_tcp_listen(ctx, 1);
-	if (-1 == tcp->clientSocket)
+	tcp->serverSocket = modbus_tcp_listen(ctx, tcp->listenBacklog);
+	if (-1 == tcp->serverSocket)
 	{
 		printf("Listen return %d (%s)\n",
-			tcp->clientSocket, modbus_strerror(errno));
+			tcp->serverSocket, modbus_strerror(errno));
 		return 0;
 	}
-	modbus_tcp_accept(ctx, &(tcp->clientSocket));
+	printf("Listening on %s:%d\r\n", tcp->ip, tcp->port);
 	return 1;
 }
 
@@ -242,16 +245,23 @@ void closeTcpConnection(void * backend)
 		close(tcp->clientSocket);
 		tcp->clientSocket = -1;
 	}
+	if (tcp->serverSocket != -1)
+	{
+		close(tcp->serverSocket);
+		tcp->serverSocket = -1;
+	}
 }
 
 BackendParams * createTcpBackend()
 {
 	TcpBackend * tcp                = (TcpBackend *)malloc(sizeof(TcpBackend));
 	tcp->clientSocket               = -1;
+	tcp->serverSocket               = -1;
+	tcp->listenBacklog              = 128;
 	tcp->base.setParam              = &setTcpParam;
 	tcp->base.createCtxt            = &createTcpCtx;
 	tcp->base.del                   = &delTcp;
-	tcp->base.listenForConnection   = &listenForRtuConnection;
+	tcp->base.listenForConnection   = &listenForTcpConnection;
 	tcp->base.closeConnection       = &closeTcpConnection;
 
 	tcp->base.type                  = TCP_T;
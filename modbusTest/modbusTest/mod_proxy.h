@@ -0,0 +1,86 @@
+#ifndef MOD_PROXY_H
+#define MOD_PROXY_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "modbus.h"
+#include "modbus-proxy.h"
+#include "mod_common.h"
+#include "mod_server.h"
+
+//connection sharing daemon: the local applications connect to a unix socket,
+//their requests go to the device over one tcp session
+
+static int runProxy(const char * path, ServerConfig * cfg, TcpBackend * tcp, int timeout_ms)
+{
+	modbus_t * local;
+	modbus_t * device;
+	modbus_proxy_t * proxy = 0;
+	int listenSocket;
+	int ok = 0;
+	int i;
+
+	//the local context only carries the server settings
+	local = modbus_new_tcp(0, 0);
+	device = modbus_new_tcp(tcp->ip, tcp->port);
+	if (0 == local || 0 == device)
+	{
+		printf("Context creation failed: %s\n", modbus_strerror(errno));
+		goto out;
+	}
+	modbus_set_debug(local, cfg->debug);
+	modbus_set_debug(device, cfg->debug);
+	modbus_set_response_timeout(device, timeout_ms / 1000, (timeout_ms % 1000) * 1000);
+
+	listenSocket = modbus_proxy_listen(path, cfg->maxConnections);
+	if (-1 == listenSocket)
+	{
+		printf("Listen on %s failed (%s)\n", path, modbus_strerror(errno));
+		goto out;
+	}
+
+	proxy = modbus_proxy_new(local, listenSocket, cfg->engine);
+	if (0 == proxy)
+	{
+		printf("Proxy error (%s)\n", modbus_strerror(errno));
+		close(listenSocket);
+		goto out;
+	}
+	modbus_server_set_max_connections(modbus_proxy_get_server(proxy), cfg->maxConnections);
+	modbus_proxy_add_device(proxy, device);
+
+	//every unit id goes to the device when no list is given
+	if (0 == cfg->unitCount)
+	{
+		for (i = 0; i < 256; i++)
+			modbus_proxy_map_unit(proxy, i, 0, i);
+	}
+	for (i = 0; i < cfg->unitCount; i++)
+		modbus_proxy_map_unit(proxy, cfg->units[i].unit, 0, cfg->units[i].unit);
+
+	printf("Sharing %s:%d on %s\n", tcp->ip, tcp->port, path);
+	ok = 1;
+	while (1)
+	{
+		if (-1 == modbus_proxy_run(proxy, -1))
+		{
+			printf("Proxy error (%s)\n", modbus_strerror(errno));
+			ok = 0;
+			break;
+		}
+	}
+
+	modbus_proxy_free(proxy);
+	close(listenSocket);
+out:
+	if (0 != device)
+		modbus_free(device);
+	if (0 != local)
+		modbus_free(local);
+	return ok;
+}
+
+#endif //MOD_PROXY_H
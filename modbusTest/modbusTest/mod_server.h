@@ -0,0 +1,515 @@
+#ifndef MOD_SERVER_H
+#define MOD_SERVER_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include "modbus.h"
+#include "mod_common.h"
+
+//simulator server: serves one mapping per unit id to many concurrent
+//connections, values can be animated by generators
+
+#define SERVER_MAX_UNITS            247
+#define SERVER_DEFAULT_ELEMENTS     1000
+#define SERVER_DEFAULT_PERIOD_MS    1000
+#define SERVER_DEFAULT_CONNECTIONS  MODBUS_SERVER_DEFAULT_MAX_CONNECTIONS
+
+typedef enum
+{
+	TableCoils,
+	TableDiscreteInputs,
+	TableHoldingRegisters,
+	TableInputRegisters
+}TableType;
+
+typedef enum
+{
+	GenConst,
+	GenRamp,
+	GenRandom
+}GenKind;
+
+typedef struct
+{
+	int unit;           //-1 for every unit served
+	TableType table;
+	int addr;
+	int count;
+	GenKind kind;
+	int min;
+	int max;
+	int step;
+	int value;          //current ramp value
+}Generator;
+
+typedef struct
+{
+	int unit;
+	modbus_mapping_t * mapping;
+}ServedUnit;
+
+typedef struct
+{
+	ServedUnit units[SERVER_MAX_UNITS];
+	int unitCount;
+	int elements;
+	int periodMs;
+	int maxConnections;
+	int engine;         //MODBUS_SERVER_ENGINE_xxx for the tcp connections
+	int debug;
+
+	Generator * generators;
+	int generatorCount;
+	int generatorCapacity;
+}ServerConfig;
+
+void initServer(ServerConfig * cfg)
+{
+	memset(cfg, 0, sizeof(ServerConfig));
+	cfg->elements = SERVER_DEFAULT_ELEMENTS;
+	cfg->periodMs = SERVER_DEFAULT_PERIOD_MS;
+	cfg->maxConnections = SERVER_DEFAULT_CONNECTIONS;
+}
+
+static long long serverNowMs()
+{
+#ifdef _WIN32
+	return (long long)GetTickCount64();
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+#endif
+}
+
+static int addUnit(ServerConfig * cfg, int unit)
+{
+	int i;
+
+	if (unit < 1 || unit > SERVER_MAX_UNITS)
+		return 0;
+	for (i = 0; i < cfg->unitCount; ++i)
+	{
+		if (cfg->units[i].unit == unit)
+			return 1;
+	}
+	cfg->units[cfg->unitCount++].unit = unit;
+	return 1;
+}
+
+//unit list like "1,2,10-20"
+int parseUnits(ServerConfig * cfg, const char * str)
+{
+	char buf[256];
+	char * item;
+
+	strncpy(buf, str, sizeof(buf) - 1);
+	buf[sizeof(buf) - 1] = 0;
+	for (item = strtok(buf, ","); 0 != item; item = strtok(0, ","))
+	{
+		int first, last;
+		int n = sscanf(item, "%d-%d", &first, &last);
+		if (1 == n)
+			last = first;
+		else if (2 != n || last < first)
+		{
+			printf("Unit list item incorrect (%s)\n", item);
+			return 0;
+		}
+		for (; first <= last; ++first)
+		{
+			if (0 == addUnit(cfg, first))
+			{
+				printf("Unit id %d out of range 1..%d\n", first, SERVER_MAX_UNITS);
+				return 0;
+			}
+		}
+	}
+	return 1;
+}
+
+static Generator * newGenerator(ServerConfig * cfg)
+{
+	Generator * gen;
+
+	if (cfg->generatorCount == cfg->generatorCapacity)
+	{
+		int capacity = (0 == cfg->generatorCapacity) ? 16 : 2 * cfg->generatorCapacity;
+		Generator * gens = (Generator *)realloc(cfg->generators, capacity * sizeof(Generator));
+		if (0 == gens)
+			return 0;
+		cfg->generators = gens;
+		cfg->generatorCapacity = capacity;
+	}
+	gen = &cfg->generators[cfg->generatorCount++];
+	memset(gen, 0, sizeof(Generator));
+	return gen;
+}
+
+static int parseTable(const char * str, TableType * table)
+{
+	if (0 == strcmp(str, "coils"))
+		*table = TableCoils;
+	else if (0 == strcmp(str, "inputs"))
+		*table = TableDiscreteInputs;
+	else if (0 == strcmp(str, "holding"))
+		*table = TableHoldingRegisters;
+	else if (0 == strcmp(str, "input-regs"))
+		*table = TableInputRegisters;
+	else
+		return 0;
+	return 1;
+}
+
+//-g option: animates every input register and discrete input of every unit
+int addDefaultGenerators(ServerConfig * cfg, const char * kind)
+{
+	Generator * regs;
+	Generator * bits;
+	GenKind genKind;
+
+	if (0 == strcmp(kind, "random"))
+		genKind = GenRandom;
+	else if (0 == strcmp(kind, "ramp"))
+		genKind = GenRamp;
+	else
+	{
+		printf("Unrecognized generator (%s)\n", kind);
+		return 0;
+	}
+
+	regs = newGenerator(cfg);
+	bits = newGenerator(cfg);
+	if (0 == regs || 0 == bits)
+		return 0;
+
+	regs->unit = -1;
+	regs->table = TableInputRegisters;
+	regs->count = -1;
+	regs->kind = genKind;
+	regs->max = 0xFFFF;
+	regs->step = 1;
+
+	*bits = *regs;
+	bits->table = TableDiscreteInputs;
+	bits->max = 1;
+	return 1;
+}
+
+//script line: <unit|*> <coils|inputs|holding|input-regs> <addr> <count> <kind> [args]
+//with kind: const <value> | ramp <min> <max> <step> | random <min> <max>
+int loadScript(ServerConfig * cfg, const char * fileName)
+{
+	char line[256];
+	int lineNo = 0;
+	FILE * f = fopen(fileName, "r");
+
+	if (0 == f)
+	{
+		printf("Can't open script %s (%s)\n", fileName, strerror(errno));
+		return 0;
+	}
+
+	while (0 != fgets(line, sizeof(line), f))
+	{
+		char unit[16], table[16], kind[16];
+		int addr, count, a = 0, b = 0, c = 1;
+		int unitId = -1;
+		int n;
+		char tail;
+		Generator * gen;
+
+		lineNo++;
+		if (0 >= sscanf(line, " %15s", unit) || '#' == unit[0])
+			continue;
+
+		n = sscanf(line, " %15s %15s %d %d %15s %d %d %d",
+			unit, table, &addr, &count, kind, &a, &b, &c);
+		gen = newGenerator(cfg);
+		if (n < 5 || 0 == gen || 0 == parseTable(table, &gen->table) || addr < 0 || count < 1)
+		{
+			printf("%s:%d: generator line incorrect\n", fileName, lineNo);
+			fclose(f);
+			return 0;
+		}
+		if (0 != strcmp(unit, "*") &&
+			(1 != sscanf(unit, "%d%c", &unitId, &tail) || unitId < 1 || unitId > SERVER_MAX_UNITS))
+		{
+			printf("%s:%d: unit id %s out of range 1..%d\n", fileName, lineNo, unit, SERVER_MAX_UNITS);
+			fclose(f);
+			return 0;
+		}
+		//16 bit values, signed or not; keeps max - min + 1 from overflowing
+		if (a < -0x8000 || a > 0xFFFF || b < -0x8000 || b > 0xFFFF)
+		{
+			printf("%s:%d: value out of range %d..%d\n", fileName, lineNo, -0x8000, 0xFFFF);
+			fclose(f);
+			return 0;
+		}
+
+		gen->unit = unitId;
+		gen->addr = addr;
+		gen->count = count;
+		if (0 == strcmp(kind, "const") && n >= 6)
+		{
+			gen->kind = GenConst;
+			gen->min = gen->max = a;
+		}
+		else if (0 == strcmp(kind, "ramp") && n >= 7 && b >= a && (n < 8 || (c > 0 && c <= 0xFFFF)))
+		{
+			gen->kind = GenRamp;
+			gen->min = a;
+			gen->max = b;
+			gen->step = (n >= 8) ? c : 1;
+		}
+		else if (0 == strcmp(kind, "random") && n >= 7 && b >= a)
+		{
+			gen->kind = GenRandom;
+			gen->min = a;
+			gen->max = b;
+		}
+		else
+		{
+			printf("%s:%d: unknown generator %s, missing or invalid arguments\n",
+				fileName, lineNo, kind);
+			fclose(f);
+			return 0;
+		}
+		gen->value = gen->min;
+	}
+
+	fclose(f);
+	return 1;
+}
+
+int createUnitMappings(ServerConfig * cfg)
+{
+	int i;
+
+	for (i = 0; i < cfg->unitCount; ++i)
+	{
+		cfg->units[i].mapping = modbus_mapping_new(cfg->elements, cfg->elements,
+			cfg->elements, cfg->elements);
+		if (0 == cfg->units[i].mapping)
+		{
+			printf("Mapping alloc error (%s)\n", modbus_strerror(errno));
+			return 0;
+		}
+		//polls mostly read the same blocks, keep their encoded responses
+		modbus_mapping_set_reply_cache(cfg->units[i].mapping, MODBUS_MAPPING_DEFAULT_CACHE_ENTRIES);
+	}
+	return 1;
+}
+
+void freeServer(ServerConfig * cfg)
+{
+	int i;
+
+	for (i = 0; i < cfg->unitCount; ++i)
+	{
+		modbus_mapping_free(cfg->units[i].mapping);
+		cfg->units[i].mapping = 0;
+	}
+	free(cfg->generators);
+	cfg->generators = 0;
+	cfg->generatorCount = cfg->generatorCapacity = 0;
+}
+
+static int generateValue(Generator * gen)
+{
+	int value;
+
+	switch (gen->kind)
+	{
+	case GenRandom:
+		value = gen->min + rand() % (gen->max - gen->min + 1);
+		break;
+	case GenRamp:
+		value = gen->value;
+		break;
+	default:
+		value = gen->min;
+		break;
+	}
+	return value;
+}
+
+static void applyGenerator(Generator * gen, modbus_mapping_t * m)
+{
+	int size;
+	int i;
+	int count;
+
+	switch (gen->table)
+	{
+	case TableCoils:            size = m->nb_bits; break;
+	case TableDiscreteInputs:   size = m->nb_input_bits; break;
+	case TableHoldingRegisters: size = m->nb_registers; break;
+	default:                    size = m->nb_input_registers; break;
+	}
+
+	count = (gen->count < 0) ? size - gen->addr : gen->count;
+	if (gen->addr + count > size)
+		count = size - gen->addr;
+
+	for (i = gen->addr; i < gen->addr + count; ++i)
+	{
+		int value = generateValue(gen);
+		switch (gen->table)
+		{
+		case TableCoils:            m->tab_bits[i] = (0 != value); break;
+		case TableDiscreteInputs:   m->tab_input_bits[i] = (0 != value); break;
+		case TableHoldingRegisters: m->tab_registers[i] = (uint16_t)value; break;
+		default:                    m->tab_input_registers[i] = (uint16_t)value; break;
+		}
+	}
+	modbus_mapping_invalidate(m);
+}
+
+void runGenerators(ServerConfig * cfg)
+{
+	int i, j;
+
+	for (i = 0; i < cfg->generatorCount; ++i)
+	{
+		Generator * gen = &cfg->generators[i];
+
+		for (j = 0; j < cfg->unitCount; ++j)
+		{
+			if (-1 == gen->unit || gen->unit == cfg->units[j].unit)
+				applyGenerator(gen, cfg->units[j].mapping);
+		}
+
+		if (GenRamp == gen->kind)
+		{
+			gen->value += gen->step;
+			if (gen->value > gen->max)
+				gen->value = gen->min;
+		}
+	}
+}
+
+//reply with the mapping of the unit addressed by the query
+static int serveQuery(ServerConfig * cfg, modbus_t * ctx, uint8_t * query, int length)
+{
+	int unit = query[modbus_get_header_length(ctx) - 1];
+	int i;
+
+	for (i = 0; i < cfg->unitCount; ++i)
+	{
+		if (cfg->units[i].unit == unit)
+			return modbus_reply(ctx, query, length, cfg->units[i].mapping);
+	}
+
+	//a single unit served answers to any unit id (eg. 0xFF in tcp)
+	if (1 == cfg->unitCount)
+		return modbus_reply(ctx, query, length, cfg->units[0].mapping);
+
+	return modbus_reply_exception(ctx, query, MODBUS_EXCEPTION_GATEWAY_TARGET);
+}
+
+static int serveTcpQuery(modbus_t * ctx, const uint8_t * query, int length, void * userData)
+{
+	return serveQuery((ServerConfig *)userData, ctx, (uint8_t *)query, length);
+}
+
+//all the connections are served by the library server engine (io_uring, epoll or poll)
+static int serveTcp(ServerConfig * cfg, TcpBackend * tcp, modbus_t * ctx)
+{
+	static const char * engineNames[] = { "auto", "poll", "epoll", "io_uring" };
+	long long nextTick = serverNowMs() + cfg->periodMs;
+	modbus_server_t * server = modbus_server_new(ctx, tcp->serverSocket, cfg->engine);
+
+	if (0 == server)
+	{
+		printf("Server engine error (%s)\n", modbus_strerror(errno));
+		return 0;
+	}
+	modbus_server_set_handler(server, serveTcpQuery, cfg);
+	modbus_server_set_max_connections(server, cfg->maxConnections);
+	printf("Serving with the %s engine\n", engineNames[modbus_server_get_engine(server)]);
+
+	while (1)
+	{
+		long long now = serverNowMs();
+		int timeout = (int)((nextTick > now) ? nextTick - now : 0);
+
+		if (-1 == modbus_server_run(server, (0 < cfg->generatorCount) ? timeout : -1))
+		{
+			printf("Server error (%s)\n", modbus_strerror(errno));
+			break;
+		}
+
+		if (0 < cfg->generatorCount && serverNowMs() >= nextTick)
+		{
+			runGenerators(cfg);
+			nextTick += cfg->periodMs;
+		}
+	}
+
+	modbus_server_free(server);
+	return 0;
+}
+
+static int serveRtu(ServerConfig * cfg, modbus_t * ctx)
+{
+	uint8_t query[MODBUS_RTU_MAX_ADU_LENGTH];
+	long long nextTick = serverNowMs() + cfg->periodMs;
+
+	//the serial line filters on one slave address only
+	modbus_set_slave(ctx, cfg->units[0].unit);
+	if (0 < cfg->generatorCount)
+		modbus_set_indication_timeout(ctx, cfg->periodMs / 1000,
+			(cfg->periodMs % 1000) * 1000);
+
+	while (1)
+	{
+		int rc = modbus_receive(ctx, query);
+		if (rc > 0)
+		{
+			serveQuery(cfg, ctx, query, rc);
+		}
+		else if (-1 == rc && EBADF == errno)
+		{
+			printf("Serial port error (%s)\n", modbus_strerror(errno));
+			break;
+		}
+
+		if (0 < cfg->generatorCount && serverNowMs() >= nextTick)
+		{
+			runGenerators(cfg);
+			nextTick = serverNowMs() + cfg->periodMs;
+		}
+	}
+	return 0;
+}
+
+int runServer(ServerConfig * cfg, BackendParams * backend, modbus_t * ctx)
+{
+	int ok;
+
+	if (RTU_T == backend->type && 1 < cfg->unitCount)
+	{
+		printf("Only unit %d is served on the serial line\n", cfg->units[0].unit);
+	}
+	if (0 == createUnitMappings(cfg))
+		return 0;
+	runGenerators(cfg);
+
+	if (0 == backend->listenForConnection(backend, ctx))
+		return 0;
+
+	if (TCP_T == backend->type)
+		ok = serveTcp(cfg, (TcpBackend *)backend, ctx);
+	else
+		ok = serveRtu(cfg, ctx);
+
+	backend->closeConnection(backend);
+	return ok;
+}
+
+#endif //MOD_SERVER_H
@@ -0,0 +1,370 @@
+#ifndef MOD_TARGETS_H
+#define MOD_TARGETS_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <process.h>
+#else
+#include <pthread.h>
+#include <time.h>
+#endif
+
+#include "modbus.h"
+
+//target list file polling: one line per target, all targets polled concurrently
+//line format: <host> <port> <unit> <f-type> <start-addr> <read-no>
+//empty lines and lines starting with '#' are ignored
+
+#define TARGET_MAX_WORKERS      256
+#define TARGET_DEFAULT_WORKERS  64
+
+typedef enum
+{
+	TargetPending,
+	TargetOk,
+	TargetFailed,
+	TargetSkipped
+}TargetStatus;
+
+typedef struct
+{
+	char host[64];
+	char port[16];
+	int unit;
+	int function;
+	int startAddr;
+	int readNo;
+
+	TargetStatus status;
+	int error;
+	long long elapsedMs;
+	uint8_t * data8;
+	uint16_t * data16;
+}Target;
+
+typedef struct
+{
+	Target * targets;
+	int count;
+	int capacity;
+
+	volatile long next;      //index of the next target to be taken by a worker
+	long long deadlineMs;    //overall deadline (monotonic ms), 0 = none
+	int timeoutMs;           //per target response/connect timeout
+	int debug;
+}TargetList;
+
+static long long targetNowMs()
+{
+#ifdef _WIN32
+	return (long long)GetTickCount64();
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+#endif
+}
+
+static long targetTakeNext(TargetList * list)
+{
+#ifdef _WIN32
+	return InterlockedIncrement(&list->next) - 1;
+#else
+	return __sync_fetch_and_add(&list->next, 1);
+#endif
+}
+
+static int isTargetFunction(int function)
+{
+	return (function >= MODBUS_FC_READ_COILS &&
+		function <= MODBUS_FC_READ_INPUT_REGISTERS);
+}
+
+void freeTargets(TargetList * list)
+{
+	int i;
+	for (i = 0; i < list->count; ++i)
+	{
+		free(list->targets[i].data8);
+		free(list->targets[i].data16);
+	}
+	free(list->targets);
+	list->targets = 0;
+	list->count = list->capacity = 0;
+}
+
+//returns 1 on success, on error prints the offending line and returns 0
+int loadTargets(TargetList * list, const char * fileName)
+{
+	char line[256];
+	int lineNo = 0;
+	FILE * f = fopen(fileName, "r");
+
+	if (0 == f)
+	{
+		printf("Can't open target file %s (%s)\n", fileName, strerror(errno));
+		return 0;
+	}
+
+	memset(list, 0, sizeof(TargetList));
+	while (0 != fgets(line, sizeof(line), f))
+	{
+		char host[64], port[16], unit[16], func[16], start[16], number[16];
+		int okUnit, okFunc, okStart, okNumber;
+		Target * t;
+		int maxNo;
+
+		lineNo++;
+		if (0 >= sscanf(line, " %63s", host) || '#' == host[0])
+		{
+			continue;
+		}
+
+		if (6 != sscanf(line, " %63s %15s %15s %15s %15s %15s",
+			host, port, unit, func, start, number))
+		{
+			printf("%s:%d: expected <host> <port> <unit> <f-type> <start-addr> <read-no>\n",
+				fileName, lineNo);
+			fclose(f);
+			freeTargets(list);
+			return 0;
+		}
+
+		if (list->count == list->capacity)
+		{
+			int capacity = (0 == list->capacity) ? 64 : 2 * list->capacity;
+			Target * targets = (Target *)realloc(list->targets, capacity * sizeof(Target));
+			if (0 == targets)
+			{
+				printf("Target list alloc error!\n");
+				fclose(f);
+				freeTargets(list);
+				return 0;
+			}
+			list->targets = targets;
+			list->capacity = capacity;
+		}
+
+		t = &list->targets[list->count];
+		memset(t, 0, sizeof(Target));
+		strcpy(t->host, host);
+		strcpy(t->port, port);
+		t->unit = getInt(unit, &okUnit);
+		t->function = getInt(func, &okFunc);
+		t->startAddr = getInt(start, &okStart);
+		t->readNo = getInt(number, &okNumber);
+
+		maxNo = (t->function <= MODBUS_FC_READ_DISCRETE_INPUTS) ?
+			MODBUS_MAX_READ_BITS : MODBUS_MAX_READ_REGISTERS;
+		if (0 == okUnit || 0 == okFunc || 0 == okStart || 0 == okNumber ||
+			0 == isTargetFunction(t->function) ||
+			t->startAddr < 0 || t->startAddr > 0xFFFF ||
+			t->readNo < 1 || t->readNo > maxNo)
+		{
+			printf("%s:%d: invalid target (only read functions 0x01-0x04, start 0..65535, 1..%d elements)\n",
+				fileName, lineNo, maxNo);
+			fclose(f);
+			freeTargets(list);
+			return 0;
+		}
+
+		if (t->function <= MODBUS_FC_READ_DISCRETE_INPUTS)
+			t->data8 = (uint8_t *)malloc(t->readNo * sizeof(uint8_t));
+		else
+			t->data16 = (uint16_t *)malloc(t->readNo * sizeof(uint16_t));
+		if (0 == t->data8 && 0 == t->data16)
+		{
+			printf("Target data alloc error!\n");
+			fclose(f);
+			freeTargets(list);
+			return 0;
+		}
+		list->count++;
+	}
+
+	fclose(f);
+	return 1;
+}
+
+static void pollTarget(TargetList * list, Target * t)
+{
+	int ret = -1;
+	long long start = targetNowMs();
+	long long timeoutMs = list->timeoutMs;
+	modbus_t * ctx;
+
+	//the per target timeout never goes beyond the overall deadline
+	if (0 != list->deadlineMs && list->deadlineMs - start < timeoutMs)
+	{
+		timeoutMs = list->deadlineMs - start;
+	}
+	if (timeoutMs <= 0)
+	{
+		t->status = TargetSkipped;
+		return;
+	}
+
+	ctx = modbus_new_tcp_pi(t->host, t->port);
+	if (0 == ctx)
+	{
+		t->status = TargetFailed;
+		t->error = errno;
+		return;
+	}
+	modbus_set_debug(ctx, list->debug);
+	modbus_set_slave(ctx, t->unit);
+	modbus_set_response_timeout(ctx, (uint32_t)(timeoutMs / 1000),
+		(uint32_t)((timeoutMs % 1000) * 1000));
+
+	if (-1 != modbus_connect(ctx))
+	{
+		switch (t->function)
+		{
+		case MODBUS_FC_READ_COILS:
+			ret = modbus_read_bits(ctx, t->startAddr, t->readNo, t->data8);
+			break;
+		case MODBUS_FC_READ_DISCRETE_INPUTS:
+			ret = modbus_read_input_bits(ctx, t->startAddr, t->readNo, t->data8);
+			break;
+		case MODBUS_FC_READ_HOLDING_REGISTERS:
+			ret = modbus_read_registers(ctx, t->startAddr, t->readNo, t->data16);
+			break;
+		case MODBUS_FC_READ_INPUT_REGISTERS:
+			ret = modbus_read_input_registers(ctx, t->startAddr, t->readNo, t->data16);
+			break;
+		}
+	}
+
+	if (ret == t->readNo)
+	{
+		t->status = TargetOk;
+	}
+	else
+	{
+		t->status = TargetFailed;
+		t->error = errno;
+	}
+	t->elapsedMs = targetNowMs() - start;
+
+	modbus_close(ctx);
+	modbus_free(ctx);
+}
+
+#ifdef _WIN32
+static unsigned __stdcall targetWorker(void * arg)
+#else
+static void * targetWorker(void * arg)
+#endif
+{
+	TargetList * list = (TargetList *)arg;
+	long idx;
+
+	while ((idx = targetTakeNext(list)) < list->count)
+	{
+		Target * t = &list->targets[idx];
+		if (0 != list->deadlineMs && targetNowMs() >= list->deadlineMs)
+		{
+			t->status = TargetSkipped;
+			continue;
+		}
+		pollTarget(list, t);
+	}
+
+	return 0;
+}
+
+//polls all targets with a pool of workers, returns the number of targets polled successfully
+int pollTargets(TargetList * list, int workers)
+{
+	int i;
+	int ok = 0;
+#ifdef _WIN32
+	HANDLE threads[TARGET_MAX_WORKERS];
+#else
+	pthread_t threads[TARGET_MAX_WORKERS];
+#endif
+
+	if (workers > list->count)
+		workers = list->count;
+	if (workers > TARGET_MAX_WORKERS)
+		workers = TARGET_MAX_WORKERS;
+	if (workers < 1)
+		workers = 1;
+
+	list->next = 0;
+	for (i = 0; i < workers; ++i)
+	{
+#ifdef _WIN32
+		threads[i] = (HANDLE)_beginthreadex(0, 0, targetWorker, list, 0, 0);
+		if (0 == threads[i])
+			break;
+#else
+		if (0 != pthread_create(&threads[i], 0, targetWorker, list))
+			break;
+#endif
+	}
+
+	//not a single worker could be started: poll from this thread
+	if (0 == i)
+	{
+		targetWorker(list);
+	}
+
+	while (i-- > 0)
+	{
+#ifdef _WIN32
+		WaitForSingleObject(threads[i], INFINITE);
+		CloseHandle(threads[i]);
+#else
+		pthread_join(threads[i], 0);
+#endif
+	}
+
+	for (i = 0; i < list->count; ++i)
+	{
+		if (TargetOk == list->targets[i].status)
+			ok++;
+	}
+	return ok;
+}
+
+//prints all the results in target file order, in one output stream
+void printTargets(const TargetList * list)
+{
+	int i, j;
+
+	for (i = 0; i < list->count; ++i)
+	{
+		const Target * t = &list->targets[i];
+
+		printf("%s:%s unit %d f-type 0x%02x ref %d: ",
+			t->host, t->port, t->unit, t->function, t->startAddr);
+		switch (t->status)
+		{
+		case TargetOk:
+			printf("OK (%lld ms)", t->elapsedMs);
+			for (j = 0; j < t->readNo; ++j)
+			{
+				if (0 != t->data8)
+					printf(" 0x%02x", t->data8[j]);
+				else
+					printf(" 0x%04x", t->data16[j]);
+			}
+			printf("\n");
+			break;
+		case TargetFailed:
+			printf("ERROR %s (%lld ms)\n", modbus_strerror(t->error), t->elapsedMs);
+			break;
+		default:
+			printf("SKIPPED (deadline reached)\n");
+			break;
+		}
+	}
+}
+
+#endif //MOD_TARGETS_H
@@ -0,0 +1,69 @@
+/*
+ * Copyright © 2001-2013 Stéphane Raimbault <stephane.raimbault@gmail.com>
+ *
+ * SPDX-License-Identifier: LGPL-2.1+
+ */
+
+#ifndef MODBUS_GATEWAY_H
+#define MODBUS_GATEWAY_H
+
+#include "modbus.h"
+
+MODBUS_BEGIN_DECLS
+
+/*
+ Modbus TCP到RTU的网关。
+ TCP端由modbus_server_t接收多个连接的请求，按单元号(unit id)转发到对应串口，
+ 每个串口一个请求队列，同一时间只有一个事务在线上；各串口之间互不等待。
+ 应答按原事务号(transaction id)和单元号返回给发起请求的连接，
+ 不同串口、合并或缓存的请求，应答顺序可能与请求顺序不同。
+ 所有函数需在同一线程中调用，Windows下不支持（返回ENOTSUP）。
+ */
+
+#define MODBUS_GATEWAY_MAX_LINES            16
+/* Requests waiting on one serial line, the next ones get a busy exception */
+#define MODBUS_GATEWAY_DEFAULT_QUEUE_LENGTH 64
+
+typedef struct _modbus_gateway modbus_gateway_t;
+
+/*
+ ctx: modbus_new_tcp()/modbus_new_tcp_pi()创建的实例
+ server_socket: modbus_tcp_listen()/modbus_tcp_pi_listen()返回的监听套接字
+ engine: MODBUS_SERVER_ENGINE_xxx
+ */
+MODBUS_API modbus_gateway_t* modbus_gateway_new(modbus_t *ctx, int server_socket, int engine);
+/* 用于设置最大连接数等TCP端参数 */
+MODBUS_API modbus_server_t* modbus_gateway_get_server(modbus_gateway_t *gateway);
+
+/*
+ 添加一个串口，ctx为modbus_new_rtu()创建并已连接的实例，其应答超时用作该线的超时。
+ 返回串口编号（从0开始）
+ */
+MODBUS_API int modbus_gateway_add_line(modbus_gateway_t *gateway, modbus_t *ctx);
+/*
+ 单元号unit的请求转发到串口line上的从站slave，未映射的单元号返回网关路径不可用异常。
+ slave为0时作为广播发送，不回应TCP端（只允许写功能码）。
+ */
+MODBUS_API int modbus_gateway_map_unit(modbus_gateway_t *gateway, int unit, int line, int slave);
+MODBUS_API int modbus_gateway_set_queue_length(modbus_gateway_t *gateway, int length);
+/*
+ 读请求合并：与排队中或进行中的读请求（同一从站、功能码、地址和数量）相同时，
+ 不再单独发送，共用其应答；其后已有对该从站的写请求时不合并。默认开启。
+ */
+MODBUS_API int modbus_gateway_set_coalescing(modbus_gateway_t *gateway, int enable);
+/*
+ 读应答缓存（功能码0x01~0x04）：在最大有效期内直接用缓存的应答回复，0为关闭（默认）。
+ 与缓存范围重叠的写请求使对应缓存失效。
+ */
+MODBUS_API int modbus_gateway_set_cache_age(modbus_gateway_t *gateway,
+                                            uint32_t to_sec, uint32_t to_usec);
+/* 所有串口上排队及进行中的请求数 */
+MODBUS_API int modbus_gateway_get_pending(modbus_gateway_t *gateway);
+
+/* 处理一轮TCP及串口事件，返回收到的TCP请求数，timeout_ms < 0 表示一直等待 */
+MODBUS_API int modbus_gateway_run(modbus_gateway_t *gateway, int timeout_ms);
+MODBUS_API void modbus_gateway_free(modbus_gateway_t *gateway);
+
+MODBUS_END_DECLS
+
+#endif /* MODBUS_GATEWAY_H */
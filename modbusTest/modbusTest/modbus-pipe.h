@@ -0,0 +1,42 @@
+/*
+ * Copyright © 2001-2013 Stéphane Raimbault <stephane.raimbault@gmail.com>
+ *
+ * SPDX-License-Identifier: LGPL-2.1+
+ */
+
+#ifndef MODBUS_PIPE_H
+#define MODBUS_PIPE_H
+
+#include "modbus.h"
+
+MODBUS_BEGIN_DECLS
+
+/*
+ 进程内的内存管道，用于测试及测量协议处理本身的开销。
+ 一对实例（客户端、服务端）经两个单生产者单消费者的无锁字节环通信，收发不经过内核，
+ 报文格式（TCP的MBAP或RTU的CRC）与对应的后端相同，modbus_reply()等函数照常使用。
+ - 两个实例可在两个线程中各自阻塞调用（modbus_read_registers()/modbus_receive()），
+   等待时自旋，不进入内核
+ - 在同一线程中需按顺序调用：客户端发送（modbus_send_raw_request()等），
+   服务端modbus_receive()/modbus_reply()，客户端modbus_receive_confirmation()
+ - 没有文件描述符，不能用于服务端引擎、网关及分步接口
+ 一个实例关闭后，对方读到连接断开（TCP格式为ECONNRESET）。
+ */
+
+#define MODBUS_PIPE_TCP 0
+#define MODBUS_PIPE_RTU 1
+
+/* Bytes buffered in each direction */
+#define MODBUS_PIPE_SIZE 8192
+
+/*
+ 创建一对已连接的实例，framing: MODBUS_PIPE_TCP/MODBUS_PIPE_RTU
+ client、server：得到两端的实例，各自用modbus_free()释放
+ */
+MODBUS_API int modbus_new_pipe(int framing, modbus_t **client, modbus_t **server);
+/* 可读的字节数，同一线程中驱动两端时用于判断对方是否已发送 */
+MODBUS_API int modbus_pipe_get_pending(modbus_t *ctx);
+
+MODBUS_END_DECLS
+
+#endif /* MODBUS_PIPE_H */
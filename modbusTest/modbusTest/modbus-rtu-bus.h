@@ -0,0 +1,79 @@
+/*
+ * Copyright © 2001-2013 Stéphane Raimbault <stephane.raimbault@gmail.com>
+ *
+ * SPDX-License-Identifier: LGPL-2.1+
+ */
+
+#ifndef MODBUS_RTU_BUS_H
+#define MODBUS_RTU_BUS_H
+
+#include "modbus.h"
+
+MODBUS_BEGIN_DECLS
+
+/*
+ RS-485多从站总线主站调度。
+ 一个串口实例，每个从站一个请求队列，按优先级（相同优先级轮询）连续调度，
+ 帧间只保留t3.5最小间隔；广播地址(0)用于所有从站共用的写操作。
+ 所有函数需在同一线程中调用。
+ */
+
+typedef struct _modbus_rtu_bus modbus_rtu_bus_t;
+
+/*
+ 每个请求完成时调用：
+ rsp/rsp_length为完整的应答报文（地址+PDU，不含CRC），出错或广播时rsp为NULL，
+ error为0或errno（超时ETIMEDOUT，异常应答为EMBXxxx）
+ */
+typedef void (*modbus_rtu_bus_callback_t)(modbus_rtu_bus_t *bus, int slave,
+                                          const uint8_t *rsp, int rsp_length,
+                                          int error, void *user_data);
+
+typedef struct {
+    unsigned int transactions;  /* requests completed, broadcasts included */
+    unsigned int broadcasts;
+    unsigned int errors;        /* exception responses and invalid frames */
+    unsigned int timeouts;
+    uint64_t bytes;             /* bytes sent and received on the line */
+    uint64_t frame_us;          /* time the line carried frames (bytes * char time) */
+    uint64_t busy_us;           /* time spent in transactions, waits included */
+    uint64_t elapsed_us;        /* since the creation or the last reset */
+} modbus_rtu_bus_stats_t;
+
+/* Default wait after a broadcast, time for the slaves to process it */
+#define MODBUS_RTU_BUS_TURNAROUND_DELAY  100000
+/* Consecutive timeouts before a slave is considered offline */
+#define MODBUS_RTU_BUS_OFFLINE_TIMEOUTS  3
+/* Time an offline slave is skipped, then one request is tried again */
+#define MODBUS_RTU_BUS_OFFLINE_PERIOD    5000000
+
+/* ctx: modbus_new_rtu()创建并已连接的实例 */
+MODBUS_API modbus_rtu_bus_t* modbus_rtu_bus_new(modbus_t *ctx);
+MODBUS_API void modbus_rtu_bus_free(modbus_rtu_bus_t *bus);
+
+MODBUS_API int modbus_rtu_bus_set_slave_timeout(modbus_rtu_bus_t *bus, int slave,
+                                                uint32_t to_sec, uint32_t to_usec);
+/* 数值越大越优先，默认0 */
+MODBUS_API int modbus_rtu_bus_set_slave_priority(modbus_rtu_bus_t *bus, int slave, int priority);
+MODBUS_API int modbus_rtu_bus_set_turnaround_delay(modbus_rtu_bus_t *bus, int us);
+
+/*
+ 将一个请求加入从站队列，pdu为功能码及数据。
+ slave为MODBUS_BROADCAST_ADDRESS时广播，只允许写功能码（0x05/0x06/0x0F/0x10）。
+ */
+MODBUS_API int modbus_rtu_bus_submit(modbus_rtu_bus_t *bus, int slave,
+                                     const uint8_t *pdu, int pdu_length,
+                                     modbus_rtu_bus_callback_t callback, void *user_data);
+MODBUS_API int modbus_rtu_bus_pending(modbus_rtu_bus_t *bus);
+
+/* 执行一次事务，返回1，无可调度请求返回0，串口错误返回-1 */
+MODBUS_API int modbus_rtu_bus_run_once(modbus_rtu_bus_t *bus);
+/* 连续调度直到没有可调度的请求，返回完成的事务数 */
+MODBUS_API int modbus_rtu_bus_run(modbus_rtu_bus_t *bus);
+
+MODBUS_API int modbus_rtu_bus_get_stats(modbus_rtu_bus_t *bus, modbus_rtu_bus_stats_t *stats,
+                                        int reset);
+
+MODBUS_END_DECLS
+
+#endif /* MODBUS_RTU_BUS_H */
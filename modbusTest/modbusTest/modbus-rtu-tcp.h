@@ -0,0 +1,37 @@
+/*
+ * Copyright © 2001-2013 Stéphane Raimbault <stephane.raimbault@gmail.com>
+ *
+ * SPDX-License-Identifier: LGPL-2.1+
+ */
+
+#ifndef MODBUS_RTU_TCP_H
+#define MODBUS_RTU_TCP_H
+
+#include "modbus.h"
+
+MODBUS_BEGIN_DECLS
+
+/*
+ RTU over TCP：串口服务器透传的RTU报文（地址+PDU+CRC，没有MBAP头）经TCP连接收发。
+ 报文编码、CRC校验及从站地址过滤同RTU后端，帧按功能码计算的长度从字节流中划分，
+ 没有串口的字符间隔及t3.5超时；CRC错误时（MODBUS_ERROR_RECOVERY_PROTOCOL）清空
+ 接收缓存以重新同步。一条连接相当于一条串行线路，同一时间只有一个请求。
+ - 客户端：modbus_set_slave()选择从站，modbus_connect()连接
+ - 服务端：modbus_set_slave()设置本站地址，modbus_rtu_tcp_listen()/modbus_rtu_tcp_accept()，
+   之后同TCP服务端（modbus_receive()/modbus_reply()，或服务端引擎）
+ 没有串口参数，不能用于网关的串行线路及RTU总线调度（返回EINVAL）。
+ */
+
+/*
+ node：地址或主机名，服务端为NULL时监听任意地址
+ service：端口号或服务名，如"4001"
+ */
+MODBUS_API modbus_t* modbus_new_rtu_tcp(const char *node, const char *service);
+/* 监听实例的地址和端口，返回监听的套接字 */
+MODBUS_API int modbus_rtu_tcp_listen(modbus_t *ctx, int nb_connection);
+/* 接受一个连接，同modbus_tcp_pi_accept() */
+MODBUS_API int modbus_rtu_tcp_accept(modbus_t *ctx, int *s);
+
+MODBUS_END_DECLS
+
+#endif /* MODBUS_RTU_TCP_H */
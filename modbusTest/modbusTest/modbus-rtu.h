@@ -47,6 +47,18 @@ MODBUS_API int modbus_rtu_set_custom_rts(modbus_t *ctx, void (*set_rts) (modbus_
 MODBUS_API int modbus_rtu_set_rts_delay(modbus_t *ctx, int us);
 MODBUS_API int modbus_rtu_get_rts_delay(modbus_t *ctx);
 
+/*
+ 报文分帧方式：
+ MODBUS_RTU_FRAME_LENGTH：默认，按功能码逐步计算报文长度
+ MODBUS_RTU_FRAME_SILENCE：按t3.5静默间隔分帧，一帧一次读完，
+     未知功能码或错误帧不会导致失步（Windows下不支持）
+ */
+#define MODBUS_RTU_FRAME_LENGTH   0
+#define MODBUS_RTU_FRAME_SILENCE  1
+
+MODBUS_API int modbus_rtu_set_frame_mode(modbus_t *ctx, int mode);
+MODBUS_API int modbus_rtu_get_frame_mode(modbus_t *ctx);
+
 MODBUS_END_DECLS
 
 #endif /* MODBUS_RTU_H */
@@ -54,6 +54,20 @@ MODBUS_API modbus_t* modbus_new_tcp_pi(const char *node, const char *service);
 MODBUS_API int modbus_tcp_pi_listen(modbus_t *ctx, int nb_connection);
 MODBUS_API int modbus_tcp_pi_accept(modbus_t *ctx, int *s);
 
+/*
+ 以Unix域套接字的方式创建libmodbus实例，报文格式与TCP相同（MBAP），
+ 本机进程间通信时不经过TCP/IP协议栈，没有Nagle算法和端口的问题。
+ 用法与TCP实例相同，服务端引擎、网关等均可使用。Windows下不支持（返回ENOTSUP）。
+ char *path：套接字路径，以'@'开头时为Linux的抽象命名空间（不创建文件）
+ */
+MODBUS_API modbus_t* modbus_new_unix(const char *path);
+/*
+ 监听实例的路径，上次运行遗留的套接字文件（已无服务端监听）先删除，
+ 其他文件或仍在监听的套接字返回EADDRINUSE；退出时的删除由调用者负责
+ */
+MODBUS_API int modbus_unix_listen(modbus_t *ctx, int nb_connection);
+MODBUS_API int modbus_unix_accept(modbus_t *ctx, int *s);
+
 MODBUS_END_DECLS
 
 #endif /* MODBUS_TCP_H */
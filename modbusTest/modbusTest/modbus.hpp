@@ -0,0 +1,470 @@
+/*
+ * Copyright © 2001-2013 Stéphane Raimbault <stephane.raimbault@gmail.com>
+ *
+ * SPDX-License-Identifier: LGPL-2.1+
+ */
+
+#ifndef MODBUS_HPP
+#define MODBUS_HPP
+
+/*
+ C++17/20的头文件封装，只依赖modbus.h，不需要单独编译。
+ - context/mapping/prepared_read：RAII所有者，只能移动，析构时关闭并释放
+ - 读写函数接受span（C++20为std::span，C++17为同接口的modbus::span），不分配内存
+ - 返回result<T>：成功时为值，失败时为std::error_code（modbus::category()，信息同modbus_strerror()）
+ - rtu_read_frame()/tcp_read_frame()：constexpr请求编码，CRC在编译期计算，
+   用于固定的轮询表或自行管理的传输通道
+ */
+
+#include <array>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <system_error>
+#include <type_traits>
+#include <utility>
+
+#if defined(__has_include)
+#  if __has_include(<version>)
+#    include <version>
+#  endif
+#endif
+#if defined(__cpp_lib_span)
+#  include <span>
+#endif
+
+#include "modbus.h"
+
+namespace modbus {
+
+/* Errors */
+
+class error_category_impl : public std::error_category {
+public:
+    const char *name() const noexcept override { return "modbus"; }
+    std::string message(int code) const override { return modbus_strerror(code); }
+};
+
+inline const std::error_category &category() noexcept
+{
+    static const error_category_impl instance;
+    return instance;
+}
+
+inline std::error_code last_error() noexcept
+{
+    return std::error_code(errno, category());
+}
+
+/* Value or error, with the member names of std::expected */
+template <class T>
+class result {
+public:
+    result(T value) noexcept : value_(std::move(value)), error_() {}
+    result(std::error_code error) noexcept : value_(), error_(error) {}
+
+    bool has_value() const noexcept { return !error_; }
+    explicit operator bool() const noexcept { return has_value(); }
+    const T &value() const & noexcept { return value_; }
+    T &value() & noexcept { return value_; }
+    T &&value() && noexcept { return std::move(value_); }
+    const T &operator*() const & noexcept { return value_; }
+    T &operator*() & noexcept { return value_; }
+    const T *operator->() const noexcept { return &value_; }
+    T *operator->() noexcept { return &value_; }
+    std::error_code error() const noexcept { return error_; }
+    T value_or(T other) const noexcept { return has_value() ? value_ : other; }
+
+private:
+    T value_;
+    std::error_code error_;
+};
+
+template <>
+class result<void> {
+public:
+    result() noexcept : error_() {}
+    result(std::error_code error) noexcept : error_(error) {}
+
+    bool has_value() const noexcept { return !error_; }
+    explicit operator bool() const noexcept { return has_value(); }
+    std::error_code error() const noexcept { return error_; }
+
+private:
+    std::error_code error_;
+};
+
+namespace detail {
+
+/* C calls returning -1 and errno on failure */
+inline result<int> check(int rc) noexcept
+{
+    if (rc == -1)
+        return last_error();
+    return rc;
+}
+
+inline result<void> check_void(int rc) noexcept
+{
+    if (rc == -1)
+        return last_error();
+    return result<void>();
+}
+
+} // namespace detail
+
+/* Spans */
+
+#if defined(__cpp_lib_span)
+template <class T>
+using span = std::span<T>;
+#else
+/* Subset of std::span used by the calls below */
+template <class T>
+class span {
+public:
+    constexpr span() noexcept : data_(nullptr), size_(0) {}
+    constexpr span(T *data, std::size_t size) noexcept : data_(data), size_(size) {}
+    template <std::size_t N>
+    constexpr span(T (&array)[N]) noexcept : data_(array), size_(N) {}
+    template <class U, std::size_t N,
+              class = typename std::enable_if<std::is_convertible<U (*)[], T (*)[]>::value>::type>
+    constexpr span(std::array<U, N> &array) noexcept : data_(array.data()), size_(N) {}
+    template <class U, std::size_t N,
+              class = typename std::enable_if<std::is_convertible<const U (*)[], T (*)[]>::value>::type>
+    constexpr span(const std::array<U, N> &array) noexcept : data_(array.data()), size_(N) {}
+    /* Contiguous containers (std::vector, std::string...) */
+    template <class C,
+              class = typename std::enable_if<
+                  !std::is_array<C>::value &&
+                  std::is_convertible<typename std::remove_pointer<decltype(
+                      std::declval<C &>().data())>::type (*)[], T (*)[]>::value>::type>
+    constexpr span(C &container) noexcept : data_(container.data()), size_(container.size()) {}
+    template <class U,
+              class = typename std::enable_if<std::is_convertible<U (*)[], T (*)[]>::value>::type>
+    constexpr span(const span<U> &other) noexcept : data_(other.data()), size_(other.size()) {}
+
+    constexpr T *data() const noexcept { return data_; }
+    constexpr std::size_t size() const noexcept { return size_; }
+    constexpr bool empty() const noexcept { return size_ == 0; }
+    constexpr T &operator[](std::size_t i) const noexcept { return data_[i]; }
+    constexpr T *begin() const noexcept { return data_; }
+    constexpr T *end() const noexcept { return data_ + size_; }
+    constexpr span subspan(std::size_t offset, std::size_t count) const noexcept
+    {
+        return span(data_ + offset, count);
+    }
+
+private:
+    T *data_;
+    std::size_t size_;
+};
+#endif
+
+/* Compile-time request encoders */
+
+constexpr uint16_t crc16(const uint8_t *buffer, std::size_t length) noexcept
+{
+    uint16_t crc = 0xFFFF;
+
+    for (std::size_t i = 0; i < length; i++) {
+        crc ^= buffer[i];
+        for (int bit = 0; bit < 8; bit++) {
+            crc = (crc & 1) ? (uint16_t)((crc >> 1) ^ 0xA001) : (uint16_t)(crc >> 1);
+        }
+    }
+    return crc;
+}
+
+/* RTU read request (slave, function, address, number, CRC low byte first) */
+constexpr std::array<uint8_t, 8> rtu_read_frame(uint8_t slave, uint8_t function,
+                                                uint16_t addr, uint16_t nb) noexcept
+{
+    std::array<uint8_t, 8> frame = {{
+        slave, function,
+        (uint8_t)(addr >> 8), (uint8_t)(addr & 0xFF),
+        (uint8_t)(nb >> 8), (uint8_t)(nb & 0xFF),
+        0, 0
+    }};
+    const uint16_t crc = crc16(frame.data(), 6);
+
+    frame[6] = (uint8_t)(crc & 0xFF);
+    frame[7] = (uint8_t)(crc >> 8);
+    return frame;
+}
+
+/* TCP read request, the transaction ID (bytes 0 and 1) is set before sending */
+constexpr std::array<uint8_t, 12> tcp_read_frame(uint8_t unit, uint8_t function,
+                                                 uint16_t addr, uint16_t nb,
+                                                 uint16_t tid = 0) noexcept
+{
+    return std::array<uint8_t, 12>{{
+        (uint8_t)(tid >> 8), (uint8_t)(tid & 0xFF),
+        0, 0,   /* protocol */
+        0, 6,   /* length */
+        unit, function,
+        (uint8_t)(addr >> 8), (uint8_t)(addr & 0xFF),
+        (uint8_t)(nb >> 8), (uint8_t)(nb & 0xFF)
+    }};
+}
+
+/* Owners */
+
+class mapping {
+public:
+    mapping() noexcept : mapping_(nullptr) {}
+    explicit mapping(modbus_mapping_t *mapping) noexcept : mapping_(mapping) {}
+    mapping(int nb_bits, int nb_input_bits, int nb_registers, int nb_input_registers) noexcept
+        : mapping_(modbus_mapping_new(nb_bits, nb_input_bits, nb_registers, nb_input_registers)) {}
+    mapping(const mapping &) = delete;
+    mapping &operator=(const mapping &) = delete;
+    mapping(mapping &&other) noexcept : mapping_(other.release()) {}
+    mapping &operator=(mapping &&other) noexcept
+    {
+        reset(other.release());
+        return *this;
+    }
+    ~mapping() { reset(); }
+
+    modbus_mapping_t *get() const noexcept { return mapping_; }
+    modbus_mapping_t *operator->() const noexcept { return mapping_; }
+    explicit operator bool() const noexcept { return mapping_ != nullptr; }
+
+    modbus_mapping_t *release() noexcept
+    {
+        modbus_mapping_t *m = mapping_;
+        mapping_ = nullptr;
+        return m;
+    }
+    void reset(modbus_mapping_t *m = nullptr) noexcept
+    {
+        if (mapping_ != nullptr)
+            modbus_mapping_free(mapping_);
+        mapping_ = m;
+    }
+
+private:
+    modbus_mapping_t *mapping_;
+};
+
+class prepared_read {
+public:
+    prepared_read() noexcept : prepared_(nullptr), nb_(0) {}
+    prepared_read(modbus_prepared_t *prepared, int nb) noexcept : prepared_(prepared), nb_(nb) {}
+    prepared_read(const prepared_read &) = delete;
+    prepared_read &operator=(const prepared_read &) = delete;
+    prepared_read(prepared_read &&other) noexcept : prepared_(other.prepared_), nb_(other.nb_)
+    {
+        other.prepared_ = nullptr;
+    }
+    prepared_read &operator=(prepared_read &&other) noexcept
+    {
+        std::swap(prepared_, other.prepared_);
+        std::swap(nb_, other.nb_);
+        return *this;
+    }
+    ~prepared_read() { modbus_prepared_free(prepared_); }
+
+    const modbus_prepared_t *get() const noexcept { return prepared_; }
+    int size() const noexcept { return nb_; }
+    explicit operator bool() const noexcept { return prepared_ != nullptr; }
+
+private:
+    modbus_prepared_t *prepared_;
+    int nb_;
+};
+
+class context {
+public:
+    context() noexcept : ctx_(nullptr) {}
+    explicit context(modbus_t *ctx) noexcept : ctx_(ctx) {}
+    context(const context &) = delete;
+    context &operator=(const context &) = delete;
+    context(context &&other) noexcept : ctx_(other.release()) {}
+    context &operator=(context &&other) noexcept
+    {
+        reset(other.release());
+        return *this;
+    }
+    ~context() { reset(); }
+
+    static result<context> tcp(const char *ip, int port) noexcept
+    {
+        return make(modbus_new_tcp(ip, port));
+    }
+    static result<context> tcp_pi(const char *node, const char *service) noexcept
+    {
+        return make(modbus_new_tcp_pi(node, service));
+    }
+    static result<context> unix_socket(const char *path) noexcept
+    {
+        return make(modbus_new_unix(path));
+    }
+    static result<context> rtu(const char *device, int baud, char parity, int data_bit,
+                               int stop_bit) noexcept
+    {
+        return make(modbus_new_rtu(device, baud, parity, data_bit, stop_bit));
+    }
+
+    modbus_t *get() const noexcept { return ctx_; }
+    explicit operator bool() const noexcept { return ctx_ != nullptr; }
+
+    modbus_t *release() noexcept
+    {
+        modbus_t *ctx = ctx_;
+        ctx_ = nullptr;
+        return ctx;
+    }
+    void reset(modbus_t *ctx = nullptr) noexcept
+    {
+        if (ctx_ != nullptr) {
+            modbus_close(ctx_);
+            modbus_free(ctx_);
+        }
+        ctx_ = ctx;
+    }
+
+    result<void> connect() noexcept { return detail::check_void(modbus_connect(ctx_)); }
+    void close() noexcept { modbus_close(ctx_); }
+    result<void> set_slave(int slave) noexcept
+    {
+        return detail::check_void(modbus_set_slave(ctx_, slave));
+    }
+    result<void> set_response_timeout(uint32_t to_sec, uint32_t to_usec) noexcept
+    {
+        return detail::check_void(modbus_set_response_timeout(ctx_, to_sec, to_usec));
+    }
+    result<void> set_debug(bool enable) noexcept
+    {
+        return detail::check_void(modbus_set_debug(ctx_, enable ? TRUE : FALSE));
+    }
+
+    /* Reads as many values as dest holds, returns the number read */
+    result<int> read_bits(int addr, span<uint8_t> dest) noexcept
+    {
+        return detail::check(modbus_read_bits(ctx_, addr, (int)dest.size(), dest.data()));
+    }
+    result<int> read_input_bits(int addr, span<uint8_t> dest) noexcept
+    {
+        return detail::check(modbus_read_input_bits(ctx_, addr, (int)dest.size(), dest.data()));
+    }
+    result<int> read_registers(int addr, span<uint16_t> dest) noexcept
+    {
+        return detail::check(modbus_read_registers(ctx_, addr, (int)dest.size(), dest.data()));
+    }
+    result<int> read_input_registers(int addr, span<uint16_t> dest) noexcept
+    {
+        return detail::check(modbus_read_input_registers(ctx_, addr, (int)dest.size(),
+                                                         dest.data()));
+    }
+    result<int> read_registers_as(int addr, span<float> dest, modbus_order_t order) noexcept
+    {
+        return detail::check(modbus_read_registers_as_float(ctx_, addr, (int)dest.size(),
+                                                            order, dest.data()));
+    }
+    result<int> read_input_registers_as(int addr, span<float> dest,
+                                        modbus_order_t order) noexcept
+    {
+        return detail::check(modbus_read_input_registers_as_float(ctx_, addr, (int)dest.size(),
+                                                                  order, dest.data()));
+    }
+    /* The view is valid until the next read_view() on this context */
+    result<modbus_view_t> read_view(int function, int addr, int nb) noexcept
+    {
+        modbus_view_t view = modbus_view_t();
+
+        if (modbus_read_view(ctx_, function, addr, nb, &view) == -1)
+            return last_error();
+        return view;
+    }
+
+    result<int> write_bit(int addr, bool status) noexcept
+    {
+        return detail::check(modbus_write_bit(ctx_, addr, status ? ON : OFF));
+    }
+    result<int> write_register(int addr, uint16_t value) noexcept
+    {
+        return detail::check(modbus_write_register(ctx_, addr, value));
+    }
+    result<int> write_bits(int addr, span<const uint8_t> src) noexcept
+    {
+        return detail::check(modbus_write_bits(ctx_, addr, (int)src.size(), src.data()));
+    }
+    result<int> write_registers(int addr, span<const uint16_t> src) noexcept
+    {
+        return detail::check(modbus_write_registers(ctx_, addr, (int)src.size(), src.data()));
+    }
+    result<int> mask_write_register(int addr, uint16_t and_mask, uint16_t or_mask) noexcept
+    {
+        return detail::check(modbus_mask_write_register(ctx_, addr, and_mask, or_mask));
+    }
+
+    /* Whole transfers split at the protocol limits, see modbus_read_range() */
+    result<int> read_range(int function, int addr, span<uint16_t> dest,
+                           int *failed_offset = nullptr) noexcept
+    {
+        return detail::check(modbus_read_range(ctx_, function, addr, (int)dest.size(),
+                                               dest.data(), failed_offset));
+    }
+    result<int> read_range(int function, int addr, span<uint8_t> dest,
+                           int *failed_offset = nullptr) noexcept
+    {
+        return detail::check(modbus_read_range(ctx_, function, addr, (int)dest.size(),
+                                               dest.data(), failed_offset));
+    }
+    result<int> write_range(int addr, span<const uint8_t> src,
+                            int *failed_offset = nullptr) noexcept
+    {
+        return detail::check(modbus_write_range(ctx_, MODBUS_FC_WRITE_MULTIPLE_COILS, addr,
+                                                (int)src.size(), src.data(), failed_offset));
+    }
+    result<int> write_range(int addr, span<const uint16_t> src,
+                            int *failed_offset = nullptr) noexcept
+    {
+        return detail::check(modbus_write_range(ctx_, MODBUS_FC_WRITE_MULTIPLE_REGISTERS, addr,
+                                                (int)src.size(), src.data(), failed_offset));
+    }
+    /* Returns the number of operations done, see modbus_batch() */
+    result<int> batch(span<modbus_batch_op_t> ops) noexcept
+    {
+        return detail::check(modbus_batch(ctx_, ops.data(), (int)ops.size()));
+    }
+
+    /* Request encoded once for repeated polls */
+    result<prepared_read> prepare_read(int function, int addr, int nb) noexcept
+    {
+        modbus_prepared_t *prepared = modbus_prepare_read(ctx_, function, addr, nb);
+
+        if (prepared == nullptr)
+            return last_error();
+        return prepared_read(prepared, nb);
+    }
+    /* dest must hold the number of values prepared */
+    result<int> read(const prepared_read &prepared, span<uint16_t> dest) noexcept
+    {
+        if (dest.size() < (std::size_t)prepared.size())
+            return std::error_code(EINVAL, category());
+        return detail::check(modbus_prepared_read_registers(ctx_, prepared.get(), dest.data()));
+    }
+    result<int> read(const prepared_read &prepared, span<uint8_t> dest) noexcept
+    {
+        if (dest.size() < (std::size_t)prepared.size())
+            return std::error_code(EINVAL, category());
+        return detail::check(modbus_prepared_read_bits(ctx_, prepared.get(), dest.data()));
+    }
+
+private:
+    static result<context> make(modbus_t *ctx) noexcept
+    {
+        if (ctx == nullptr)
+            return last_error();
+        return context(ctx);
+    }
+
+    modbus_t *ctx_;
+};
+
+} // namespace modbus
+
+#endif /* MODBUS_HPP */
@@ -7,6 +7,9 @@
 #include "errno.h"
 #include "getopt.h"
 #include "mod_common.h"
+#include "mod_targets.h"
+#include "mod_server.h"
+#include "mod_proxy.h"
 //ѡ
 const char DebugOpt[]  = "debug";
 const char TcpOptVar[] = "tcp";
@@ -46,6 +49,23 @@ void printerUsage(const char progName[])
 		"\tp{none|even|odd}=even\n");
 	printf("tcp-params:\n"\
 		"\tp<port>=502\n");
+	printf("target list polling (all targets polled concurrently over tcp):\n"\
+		"\t%s [--%s] -f<target-file> [-j<workers>=%d] [-w<deadline-ms>] [-o<timeout-ms>=1000]\n"\
+		"\ttarget-file line: <host> <port> <unit> <f-type 0x01-0x04> <start-addr> <read-no>\n",
+		progName, DebugOpt, TARGET_DEFAULT_WORKERS);
+	printf("server mode (simulator serving one mapping per unit id):\n"\
+		"\t%s [--%s] -S -m{rtu|tcp} [-u<unit-list>=<slave-addr>] [-n<elements>=%d]\n\t"\
+		"[-g{random|ramp}] [-x<script-file>] [-i<period-ms>=%d] [-l<max-connections>=%d]\n\t"\
+		"[-e{auto|poll|epoll|uring}] [{rtu-params|tcp-params}] [serialport|listen-ip]\n",
+		progName, DebugOpt, SERVER_DEFAULT_ELEMENTS, SERVER_DEFAULT_PERIOD_MS,
+		SERVER_DEFAULT_CONNECTIONS);
+	printf("\tunit-list: 1,2,10-20\n"\
+		"\tscript-file line: <unit|*> <coils|inputs|holding|input-regs> <addr> <count> <kind>\n"\
+		"\t\tkind: const <value> | ramp <min> <max> [<step>] | random <min> <max>\n");
+	printf("proxy mode (local applications share one tcp session to the device):\n"\
+		"\t%s [--%s] -P<socket-path> -mtcp [-u<unit-list>] [-o<timeout-ms>=1000]\n\t"\
+		"[-l<max-connections>=%d] [-e{auto|poll|epoll|uring}] [tcp-params] host\n",
+		progName, DebugOpt, SERVER_DEFAULT_CONNECTIONS);
 	printf("Examples (run with default mbServer at port 1502): \n"\
 		"\tWrite data: \t%s --debug -mtcp -t0x10 -r0 -p1502 127.0.0.1 0x01 0x02\n"\
 		"\tRead that data:\t%s --debug -mtcp -t0x03 -r0 -p1502 127.0.0.1 -c3\n",
@@ -66,6 +86,12 @@ int main(int argc, char * * argv)
 	int fType = FuncNone;
 	int timeout_ms = 1000;
 	int hasDevice = 0;
+	const char * targetFile = 0;
+	int workers = TARGET_DEFAULT_WORKERS;
+	int deadline_ms = 0;
+	int serverMode = 0;
+	const char * proxyPath = 0;
+	ServerConfig server;
 
 	int isWriteFunction = 0;
 	enum WriteDataType
@@ -81,6 +107,8 @@ int main(int argc, char * * argv)
 		uint16_t * data16;
 	}data;
 
+	initServer(&server);
+
 	while (1)
 	{
 		int option_intex = 0;
@@ -91,7 +119,7 @@ int main(int argc, char * * argv)
 		};
 
 		//н
-		c = getopt_long(argc, argv, "a:b:d:c:m:r:s:t:p:o:0",
+		c = getopt_long(argc, argv, "a:b:d:c:m:r:s:t:p:o:f:j:w:Su:n:g:x:i:l:e:P:0",
 			long_options, &option_intex);
 		if (c == -1)
 		{
@@ -185,6 +213,120 @@ int main(int argc, char * * argv)
 		}
 		break;
 
+		case 'f':
+			targetFile = optarg;
+			break;
+
+		case 'j':
+		{
+			workers = getInt(optarg, &ok);
+			if (0 == ok || workers < 1 || workers > TARGET_MAX_WORKERS)
+			{
+				printf("Workers (%s) is not integer in 1..%d!\n\n", optarg, TARGET_MAX_WORKERS);
+				printerUsage(argv[0]);
+				exit(EXIT_FAILURE);
+			}
+		}
+		break;
+
+		case 'w':
+		{
+			deadline_ms = getInt(optarg, &ok);
+			if (0 == ok || deadline_ms < 0)
+			{
+				printf("Deadline (%s) is not integer!\n\n", optarg);
+				printerUsage(argv[0]);
+				exit(EXIT_FAILURE);
+			}
+		}
+		break;
+
+		case 'S':
+			serverMode = 1;
+			break;
+
+		case 'P':
+			proxyPath = optarg;
+			break;
+
+		case 'u':
+			if (0 == parseUnits(&server, optarg))
+			{
+				printerUsage(argv[0]);
+				exit(EXIT_FAILURE);
+			}
+			break;
+
+		case 'n':
+		{
+			server.elements = getInt(optarg, &ok);
+			if (0 == ok || server.elements < 1 || server.elements > 0x10000)
+			{
+				printf("#elements per table (%s) is not integer in 1..65536!\n\n", optarg);
+				printerUsage(argv[0]);
+				exit(EXIT_FAILURE);
+			}
+		}
+		break;
+
+		case 'g':
+			if (0 == addDefaultGenerators(&server, optarg))
+			{
+				printerUsage(argv[0]);
+				exit(EXIT_FAILURE);
+			}
+			break;
+
+		case 'x':
+			if (0 == loadScript(&server, optarg))
+			{
+				exit(EXIT_FAILURE);
+			}
+			break;
+
+		case 'i':
+		{
+			server.periodMs = getInt(optarg, &ok);
+			if (0 == ok || server.periodMs < 1)
+			{
+				printf("Generator period (%s) is not integer!\n\n", optarg);
+				printerUsage(argv[0]);
+				exit(EXIT_FAILURE);
+			}
+		}
+		break;
+
+		case 'l':
+		{
+			server.maxConnections = getInt(optarg, &ok);
+			if (0 == ok || server.maxConnections < 1)
+			{
+				printf("Max connections (%s) is not integer!\n\n", optarg);
+				printerUsage(argv[0]);
+				exit(EXIT_FAILURE);
+			}
+		}
+		break;
+
+		case 'e':
+		{
+			if (0 == strcmp(optarg, "auto"))
+				server.engine = MODBUS_SERVER_ENGINE_AUTO;
+			else if (0 == strcmp(optarg, "poll"))
+				server.engine = MODBUS_SERVER_ENGINE_POLL;
+			else if (0 == strcmp(optarg, "epoll"))
+				server.engine = MODBUS_SERVER_ENGINE_EPOLL;
+			else if (0 == strcmp(optarg, "uring"))
+				server.engine = MODBUS_SERVER_ENGINE_IO_URING;
+			else
+			{
+				printf("Unknown server engine (%s)!\n\n", optarg);
+				printerUsage(argv[0]);
+				exit(EXIT_FAILURE);
+			}
+		}
+		break;
+
 		case '0':
 			startReferenceAt0 = 1;
 			break;
@@ -216,6 +358,33 @@ int main(int argc, char * * argv)
 		}
 	}
 	
+	//poll every target of the list, the other options are not used
+	if (0 != targetFile)
+	{
+		TargetList targets;
+		int polled;
+		long long start;
+
+		if (0 == loadTargets(&targets, targetFile))
+		{
+			exit(EXIT_FAILURE);
+		}
+		targets.debug = debug;
+		targets.timeoutMs = timeout_ms;
+		start = targetNowMs();
+		targets.deadlineMs = (0 < deadline_ms) ? start + deadline_ms : 0;
+
+		polled = pollTargets(&targets, workers);
+		printTargets(&targets);
+		printf("Polled %d of %d targets in %lld ms\n",
+			polled, targets.count, targetNowMs() - start);
+
+		freeTargets(&targets);
+		if (0 != backend)
+			backend->del(backend);
+		exit((polled == targets.count) ? EXIT_SUCCESS : EXIT_FAILURE);
+	}
+
 	if (0 == backend)
 	{
 		printf("Help:\n");
@@ -228,6 +397,61 @@ int main(int argc, char * * argv)
 		startAddr--;
 	}
 
+	//run as a simulator until killed
+	if (1 == serverMode)
+	{
+		modbus_t * ctx;
+		int served;
+
+		if (optind < argc)
+		{
+			if (RTU_T == backend->type)
+				strcpy(((RtuBackend *)backend)->devName, argv[optind]);
+			else
+				strcpy(((TcpBackend *)backend)->ip, argv[optind]);
+		}
+		if (0 == server.unitCount)
+			addUnit(&server, slaveAddr);
+		server.debug = debug;
+
+		ctx = backend->createCtxt(backend);
+		if (0 == ctx)
+		{
+			fprintf(stderr, "Context creation failed: %s\n", modbus_strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+		modbus_set_debug(ctx, debug);
+
+		served = runServer(&server, backend, ctx);
+
+		modbus_close(ctx);
+		modbus_free(ctx);
+		freeServer(&server);
+		backend->del(backend);
+		exit(served ? EXIT_SUCCESS : EXIT_FAILURE);
+	}
+
+	//share the device with the local applications until killed
+	if (0 != proxyPath)
+	{
+		int shared;
+
+		if (TCP_T != backend->type || optind >= argc)
+		{
+			printf("Proxy mode needs a tcp device (-mtcp host)\n\n");
+			printerUsage(argv[0]);
+			exit(EXIT_FAILURE);
+		}
+		strcpy(((TcpBackend *)backend)->ip, argv[optind]);
+		server.debug = debug;
+
+		shared = runProxy(proxyPath, &server, (TcpBackend *)backend, timeout_ms);
+
+		freeServer(&server);
+		backend->del(backend);
+		exit(shared ? EXIT_SUCCESS : EXIT_FAILURE);
+	}
+
 	//choose write data type
 	switch (fType)
 	{